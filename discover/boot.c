@@ -22,6 +22,7 @@
 
 #include "device-handler.h"
 #include "boot.h"
+#include "kexec.h"
 #include "paths.h"
 #include "resource.h"
 #include "platform.h"
@@ -35,6 +36,12 @@ enum {
 	BOOT_HOOK_EXIT_UPDATE	= 2,
 };
 
+static struct waitset *boot_waitset;
+
+/* The kexec load action, -s or -l, that last worked. Tried first next time,
+ * so we don't keep running the one this kernel rejects */
+static char kexec_load_action;
+
 static void __attribute__((format(__printf__, 4, 5))) update_status(
 		boot_status_fn fn, void *arg, int type, char *fmt, ...)
 {
@@ -56,55 +63,159 @@ static void __attribute__((format(__printf__, 4, 5))) update_status(
 	talloc_free(status.message);
 }
 
-/**
- * kexec_load - kexec load helper.
+/* Report how far into the boot we are, so we can see where the time goes */
+static void __attribute__((format(__printf__, 2, 3))) boot_phase(
+		struct boot_task *task, const char *fmt, ...)
+{
+	struct timespec now;
+	unsigned long ms;
+	char *phase;
+	va_list ap;
+
+	va_start(ap, fmt);
+	phase = talloc_vasprintf(task, fmt, ap);
+	va_end(ap);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - task->start.tv_sec) * 1000 +
+		(now.tv_nsec - task->start.tv_nsec) / 1000000;
+
+	pb_log("boot: %s at %lu.%03lus\n", phase, ms / 1000, ms % 1000);
+	update_status(task->status_fn, task->status_arg, STATUS_INFO,
+			_("%s (%lu.%03lus)"), phase, ms / 1000, ms % 1000);
+
+	talloc_free(phase);
+}
+
+static enum process_chain_action kexec_load_step_cb(struct process *process,
+		void *data __attribute__((unused)))
+{
+	if (process_exit_ok(process)) {
+		kexec_load_action = process->argv[1][1];
+		return PROCESS_CHAIN_STOP;
+	}
+
+	pb_log_fn("kexec load (%s) failed (rc %d): %.*s\n", process->argv[1],
+			WEXITSTATUS(process->exit_status),
+			process->stdout_len, process->stdout_buf);
+
+	/* try the next load method, if any */
+	return PROCESS_CHAIN_CONTINUE;
+}
+
+static void boot_finish(struct boot_task *task, int rc);
+
+static void kexec_load_finish(struct boot_task *task, int rc)
+{
+	task->kexec_loading = false;
+	task->kexec_file = NULL;
+	validate_boot_files_cleanup(task);
+
+	if (!rc)
+		boot_phase(task, _("kexec load finished"));
+
+	boot_finish(task, rc);
+}
+
+static void cleanup_cancellations(struct boot_task *task,
+		struct load_url_result *cur_result);
+
+static void kexec_unload_cb(void *data, struct process *failed)
+{
+	struct boot_task *task = data;
+
+	task->kexec_unload = NULL;
+
+	if (failed)
+		pb_log_fn("kexec unload failed\n");
+
+	task->kexec_loading = false;
+	cleanup_cancellations(task, NULL);
+}
+
+/* A load that completed after the boot was cancelled mustn't be left for
+ * the next kexec -e to find. The task is freed once it has been unloaded */
+static void kexec_load_cancelled(struct boot_task *task, bool loaded)
+{
+	if (loaded) {
+		pb_log("boot cancelled during kexec load, unloading\n");
+		task->kexec_unload = process_chain_create(task,
+				kexec_unload_cb, task);
+		process_chain_add(task->kexec_unload, NULL,
+				pb_system_apps.kexec, "-u", NULL);
+		process_chain_run(task->kexec_unload);
+		return;
+	}
+
+	task->kexec_loading = false;
+	cleanup_cancellations(task, NULL);
+}
+
+static void kexec_load_cb(void *data, struct process *failed)
+{
+	struct boot_task *task = data;
+	char *err_buf = NULL;
+
+	task->kexec_chain = NULL;
+
+	if (task->cancelled) {
+		kexec_load_cancelled(task, !failed);
+		return;
+	}
+
+	if (failed) {
+		if (failed->stdout_len)
+			err_buf = talloc_strndup(task, failed->stdout_buf,
+					failed->stdout_len);
+		update_status(task->status_fn, task->status_arg,
+				STATUS_ERROR, _("kexec load failed: %s"),
+				err_buf ?: "(no output)");
+	}
+
+	kexec_load_finish(task, failed ? -1 : 0);
+}
+
+/*
+ * Collect the results of checking the boot files. If they were checked
+ * individually as they loaded, only the command line is left, as boot hooks
+ * may have changed it.
  */
-static int kexec_load(struct boot_task *boot_task)
+static int boot_validate(struct boot_task *task)
+{
+	unsigned int i;
+
+	if (!boot_waitset)
+		return validate_boot_files(task);
+
+	for (i = 0; i < BOOT_FILE_COUNT; i++)
+		if (task->checks[i].rc)
+			return task->checks[i].rc;
+
+	return validate_boot_cmdline(task);
+}
+
+/* Load with the kexec binary, trying each load action in turn */
+static void kexec_load_binary(struct boot_task *boot_task)
 {
-	const char *load_args[] = {"-l", "-s"};
 	const struct system_info *sysinfo;
+	struct process_chain *chain;
 	struct process *process;
+	const char *load_args[2];
 	char *s_initrd = NULL;
 	char *s_args = NULL;
 	const char *argv[8];
 	char *s_dtb = NULL;
 	const char **p;
-	char *err_buf;
-	int result;
 	size_t i;
 
 	sysinfo = system_info_get();
 
-	boot_task->local_initrd_override = NULL;
-	boot_task->local_dtb_override = NULL;
-	boot_task->local_image_override = NULL;
-
-	result = validate_boot_files(boot_task);
-	if (result) {
-		const char *msg;
-
-		switch (result) {
-		case KEXEC_LOAD_DECRYPTION_FALURE:
-			msg = _("decryption failed");
-			break;
-		case KEXEC_LOAD_SIGNATURE_FAILURE:
-			msg = _("signature verification failed");
-			break;
-		case KEXEC_LOAD_SIG_SETUP_INVALID:
-			msg = _("invalid signature configuration");
-			break;
-		default:
-			msg = _("unknown verification failure");
-		}
-
-		update_status(boot_task->status_fn, boot_task->status_arg,
-				STATUS_ERROR,
-				_("Boot verification failure: %s"), msg);
-		pb_log_fn("Aborting kexec due to verification failure: %s",
-				msg);
-
-		validate_boot_files_cleanup(boot_task);
-		return result;
+	if (kexec_load_action == 's') {
+		load_args[0] = "-s";
+		load_args[1] = "-l";
+	} else {
+		load_args[0] = "-l";
+		load_args[1] = "-s";
 	}
 
 	const char* local_initrd = (boot_task->local_initrd_override) ?
@@ -145,7 +256,7 @@ static int kexec_load(struct boot_task *boot_task)
 	*p++ = local_image;		/* 7 */
 	*p++ = NULL;			/* 8 */
 
-	err_buf = NULL;
+	chain = process_chain_create(boot_task, kexec_load_cb, boot_task);
 
 	for (i = 0; i < ARRAY_SIZE(load_args); i++) {
 		/* our first argument is the action: -s or -l */
@@ -155,50 +266,140 @@ static int kexec_load(struct boot_task *boot_task)
 		if (sysinfo->stb_os_enforcing && argv[1][1] == 'l')
 			continue;
 
-		process = process_create(boot_task);
-		if (!process) {
-			result = -1;
-			pb_log_fn("failed to create process\n");
+		/* -s needs kexec_file_load, which this kernel doesn't have.
+		 * Still try it if it's all we have, to report the failure */
+		if (argv[1][1] == 's' && !kexec_file_load_available() &&
+				!sysinfo->stb_os_enforcing)
 			continue;
-		}
 
-		process->path = pb_system_apps.kexec;
-		process->argv = argv;
+		process = process_chain_add_argv(chain, kexec_load_step_cb,
+				argv);
 		process->keep_stdout = true;
 		process->add_stderr = true;
+	}
 
-		result = process_run_sync(process);
-		if (result) {
-			pb_log_fn("failed to run process\n");
-			continue;
-		}
+	boot_task->kexec_chain = chain;
+	process_chain_run(chain);
+}
 
-		result = 0;
+#ifdef NATIVE_KEXEC
+static void kexec_file_cb(void *data, int rc)
+{
+	struct boot_task *task = data;
 
-		if (process_exit_ok(process))
-			break;
+	task->kexec_file = NULL;
 
-		result = -1;
+	if (!rc) {
+		kexec_load_action = 's';
+		kexec_load_finish(task, 0);
+		return;
+	}
 
-		if (process->stdout_len)
-			err_buf = talloc_strndup(boot_task, process->stdout_buf,
-					process->stdout_len);
+	pb_log("kexec_file_load failed (%s), trying %s\n", strerror(-rc),
+			pb_system_apps.kexec);
+	kexec_load_binary(task);
+}
 
-		pb_log_fn("kexec load (%s) failed (rc %d): %s\n", argv[1],
-				WEXITSTATUS(process->exit_status),
-				err_buf ?: "");
+/* Use the verified copy if we have one, so the kernel loads exactly what we
+ * checked */
+static int kexec_file_open(const char *path, int fd, bool *opened)
+{
+	*opened = false;
 
-		process_release(process);
-	}
+	if (fd >= 0 || !path)
+		return fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		pb_log_fn("can't open %s: %m\n", path);
+	else
+		*opened = true;
+
+	return fd;
+}
+
+/*
+ * Load through the kexec_file_load syscall, rather than running the kexec
+ * binary. The syscall can't take a device tree, and has to be possible on
+ * this kernel; returns false if the binary is needed instead.
+ */
+static bool kexec_load_native(struct boot_task *task)
+{
+	bool opened_image, opened_initrd;
+	int image_fd, initrd_fd;
+
+	if (task->dry_run || !boot_waitset || task->local_dtb ||
+			!kexec_file_load_available())
+		return false;
+
+	image_fd = kexec_file_open(task->local_image, task->local_image_fd,
+			&opened_image);
+	initrd_fd = kexec_file_open(task->local_initrd, task->local_initrd_fd,
+			&opened_initrd);
+
+	if (image_fd >= 0 && (initrd_fd >= 0 || !task->local_initrd))
+		task->kexec_file = kexec_file_load_start(task, boot_waitset,
+				image_fd, initrd_fd, task->args,
+				kexec_file_cb, task);
+
+	if (opened_image)
+		close(image_fd);
+	if (opened_initrd)
+		close(initrd_fd);
+
+	return task->kexec_file != NULL;
+}
+#else
+static bool kexec_load_native(struct boot_task *task __attribute__((unused)))
+{
+	return false;
+}
+#endif
+
+/**
+ * kexec_load - kexec load helper.
+ *
+ * Starts the kexec load, which completes in kexec_load_finish. Returns
+ * non-zero if the load couldn't be started.
+ */
+static int kexec_load(struct boot_task *boot_task)
+{
+	int result;
+
+	result = boot_validate(boot_task);
+	if (result) {
+		const char *msg;
+
+		switch (result) {
+		case KEXEC_LOAD_DECRYPTION_FALURE:
+			msg = _("decryption failed");
+			break;
+		case KEXEC_LOAD_SIGNATURE_FAILURE:
+			msg = _("signature verification failed");
+			break;
+		case KEXEC_LOAD_SIG_SETUP_INVALID:
+			msg = _("invalid signature configuration");
+			break;
+		default:
+			msg = _("unknown verification failure");
+		}
 
-	if (result)
 		update_status(boot_task->status_fn, boot_task->status_arg,
-				STATUS_ERROR, _("kexec load failed: %s"),
-				err_buf ?: "(no output)");
+				STATUS_ERROR,
+				_("Boot verification failure: %s"), msg);
+		pb_log_fn("Aborting kexec due to verification failure: %s",
+				msg);
 
-	validate_boot_files_cleanup(boot_task);
+		validate_boot_files_cleanup(boot_task);
+		return result;
+	}
 
-	return result;
+	boot_task->kexec_loading = true;
+
+	if (!kexec_load_native(boot_task))
+		kexec_load_binary(boot_task);
+
+	return 0;
 }
 
 /**
@@ -316,25 +517,64 @@ static int hook_cmp(const struct dirent **a, const struct dirent **b)
 	return strcmp((*a)->d_name, (*b)->d_name);
 }
 
+static enum process_chain_action boot_hook_cb(struct process *process,
+		void *data)
+{
+	struct boot_task *task = data;
+	const char *hookname;
+
+	/* if the hook returned with BOOT_HOOK_EXIT_UPDATE, then we process
+	 * stdout to look for updated params */
+	if (WIFEXITED(process->exit_status) &&
+			WEXITSTATUS(process->exit_status)
+				== BOOT_HOOK_EXIT_UPDATE) {
+		hookname = process->path + strlen(boot_hook_dir) + 1;
+		boot_hook_update(task, hookname, process->stdout_buf);
+		boot_hook_setenv(task);
+	}
+
+	/* a failed hook doesn't prevent the boot */
+	return PROCESS_CHAIN_CONTINUE;
+}
+
+static void boot_load(struct boot_task *task);
+static void boot_continue(struct boot_task *task);
+
+static void boot_hooks_cb(void *data,
+		struct process *failed __attribute__((unused)))
+{
+	struct boot_task *task = data;
+
+	task->hooks_done = true;
+	boot_phase(task, _("Boot hooks finished"));
+	boot_continue(task);
+}
+
+/* Run the boot hooks in order, then continue the boot */
 static void run_boot_hooks(struct boot_task *task)
 {
+	struct process_chain *chain;
+	struct process *process;
 	struct dirent **hooks;
 	int i, n;
 
 	n = scandir(boot_hook_dir, &hooks, hook_filter, hook_cmp);
-	if (n < 1)
+	if (n < 1) {
+		task->hooks_done = true;
+		boot_continue(task);
 		return;
+	}
 
 	update_status(task->status_fn, task->status_arg, STATUS_INFO,
 			_("Running boot hooks"));
 
 	boot_hook_setenv(task);
 
+	chain = process_chain_create(task, boot_hooks_cb, task);
+
 	for (i = 0; i < n; i++) {
 		const char *argv[2] = { NULL, NULL };
-		struct process *process;
 		char *path;
-		int rc;
 
 		path = join_paths(task, boot_hook_dir, hooks[i]->d_name);
 
@@ -343,35 +583,18 @@ static void run_boot_hooks(struct boot_task *task)
 			continue;
 		}
 
-		process = process_create(task);
-
 		argv[0] = path;
-		process->path = path;
-		process->argv = argv;
+		process = process_chain_add_argv(chain, boot_hook_cb, argv);
 		process->keep_stdout = true;
 
-		pb_log("running boot hook %s\n", hooks[i]->d_name);
+		pb_log("queueing boot hook %s\n", hooks[i]->d_name);
 
-		rc = process_run_sync(process);
-		if (rc) {
-			pb_log("boot hook exec failed!\n");
-
-		} else if (WIFEXITED(process->exit_status) &&
-			   WEXITSTATUS(process->exit_status)
-				== BOOT_HOOK_EXIT_UPDATE) {
-			/* if the hook returned with BOOT_HOOK_EXIT_UPDATE,
-			 * then we process stdout to look for updated params
-			 */
-			boot_hook_update(task, hooks[i]->d_name,
-					process->stdout_buf);
-			boot_hook_setenv(task);
-		}
-
-		process_release(process);
 		talloc_free(path);
 	}
 
 	free(hooks);
+
+	process_chain_run(chain);
 }
 
 static bool load_pending(struct load_url_result *result)
@@ -444,8 +667,23 @@ static void cleanup_cancellations(struct boot_task *task,
 		}
 	}
 
-	if (!pending)
+	/* stop any kexec load; whatever it had loaded is unloaded once it
+	 * exits */
+	if (task->kexec_chain) {
+		process_chain_stop(task->kexec_chain);
+		pending = true;
+	}
+
+	/* ... and let an unload finish */
+	if (task->kexec_unload)
+		pending = true;
+
+	if (!pending) {
+		/* remove any verified copies; freeing the task cancels any
+		 * checks still in progress */
+		validate_boot_files_cleanup(task);
 		talloc_free(task);
+	}
 }
 
 static bool preboot_check(struct boot_task *task)
@@ -466,28 +704,191 @@ static bool preboot_check(struct boot_task *task)
 	return preboot_check_ret;
 }
 
+static struct boot_resource *find_resource(struct boot_task *task,
+		const char **local_path)
+{
+	struct boot_resource *resource;
+
+	list_for_each_entry(&task->resources, resource, list)
+		if (resource->local_path == local_path)
+			return resource;
+
+	return NULL;
+}
+
+static const char **boot_file_path(struct boot_task *task,
+		enum boot_file_type type, const char ***sig)
+{
+	switch (type) {
+	case BOOT_FILE_IMAGE:
+		*sig = &task->local_image_signature;
+		return &task->local_image;
+	case BOOT_FILE_INITRD:
+		*sig = &task->local_initrd_signature;
+		return &task->local_initrd;
+	default:
+		*sig = &task->local_dtb_signature;
+		return &task->local_dtb;
+	}
+}
+
+/* A file can be checked once it, and any signature, have loaded. Boot hooks
+ * may also add a file that wasn't loaded at all */
+static bool boot_file_ready(struct boot_task *task, enum boot_file_type type)
+{
+	struct boot_resource *signature;
+	const char **file, **sig;
+
+	file = boot_file_path(task, type, &sig);
+	if (!*file)
+		return false;
+
+	signature = find_resource(task, sig);
+	return !signature || !load_pending(signature->result);
+}
+
+static void boot_check_cb(void *data, enum boot_file_type type, int rc)
+{
+	struct boot_task *task = data;
+
+	task->checks[type].done = true;
+	task->checks[type].rc = rc;
+
+	boot_continue(task);
+}
+
+/*
+ * Start checking each file as soon as it's ready. Files checked before the
+ * boot hooks finished are checked again if a hook has since changed them.
+ * Returns true once every file has been checked.
+ */
+static bool boot_start_checks(struct boot_task *task)
+{
+	bool done = true;
+	unsigned int i;
+
+	if (!boot_waitset ||
+			(!task->verify_signature && !task->decrypt_files))
+		return true;
+
+	for (i = 0; i < BOOT_FILE_COUNT; i++) {
+		struct boot_check *check = &task->checks[i];
+		const char **sig;
+
+		if (check->check && task->hooks_done && check->before_hooks &&
+				check->done) {
+			check->before_hooks = false;
+			if (validate_boot_file_stale(check->check)) {
+				pb_log("boot: %s changed by boot hooks, "
+						"checking again\n",
+						*boot_file_path(task, i, &sig));
+				talloc_free(check->check);
+				check->check = NULL;
+			}
+		}
+
+		if (!check->check && boot_file_ready(task, i)) {
+			check->check = validate_boot_file_start(task,
+					boot_waitset, i, boot_check_cb, task);
+			check->before_hooks = !task->hooks_done;
+			check->done = !check->check;
+			check->rc = check->check ? 0 : -1;
+		}
+
+		if (check->check && !check->done)
+			done = false;
+	}
+
+	return done;
+}
+
+/*
+ * Move the boot along as far as it can go. Each file is checked as soon as
+ * it lands; the boot hooks only need the files themselves, so start once
+ * they're all loaded, alongside the signature loads and checks. The kexec
+ * load waits for everything.
+ */
+static void boot_continue(struct boot_task *task)
+{
+	struct boot_resource *resource;
+	bool pending = false, files_pending = false, failed = false;
+	bool checked = false;
+
+	/* local loads complete while boot() is still adding resources, so
+	 * wait until they've all been started */
+	if (!task->loads_started || task->files_ready)
+		return;
+
+	list_for_each_entry(&task->resources, resource, list) {
+		if (load_pending(resource->result)) {
+			pending = true;
+			if (!resource->signature)
+				files_pending = true;
+		} else if (resource->result->status == LOAD_ERROR) {
+			failed = true;
+		}
+	}
+
+	if (!failed) {
+		checked = boot_start_checks(task);
+
+		if (!files_pending && !task->hooks_started) {
+			boot_phase(task, _("Boot files loaded"));
+			task->hooks_started = true;
+			run_boot_hooks(task);
+			return;
+		}
+	}
+
+	if (pending)
+		return;
+
+	if (failed) {
+		task->files_ready = true;
+		validate_boot_files_cleanup(task);
+		boot_finish(task, -1);
+		return;
+	}
+
+	if (!task->hooks_done || !checked)
+		return;
+
+	task->files_ready = true;
+
+	if (boot_waitset && (task->verify_signature || task->decrypt_files))
+		boot_phase(task, _("Boot files checked"));
+
+	boot_load(task);
+}
+
 static void boot_process(struct load_url_result *result, void *data)
 {
 	struct boot_task *task = data;
 	struct boot_resource *resource;
-	int rc = -1;
 
 	if (task->cancelled) {
 		cleanup_cancellations(task, result);
 		return;
 	}
 
-	list_for_each_entry(&task->resources, resource, list)
-		if (load_pending(resource->result))
-			return;
-
+	/* pick up each load as it completes; local files will have already
+	 * loaded when we're first called, with no result */
 	list_for_each_entry(&task->resources, resource, list) {
-		if (check_load(task, resource->name, resource->result))
-			goto no_load;
-		*resource->local_path = resource->result->local;
+		if (resource->loaded || load_pending(resource->result))
+			continue;
+
+		resource->loaded = true;
+		if (!check_load(task, resource->name, resource->result))
+			*resource->local_path = resource->result->local;
 	}
 
-	run_boot_hooks(task);
+	boot_continue(task);
+}
+
+/* Once the boot hooks have run, check and load the kernel */
+static void boot_load(struct boot_task *task)
+{
+	int rc;
 
 	if (!preboot_check(task))
 		return;
@@ -496,8 +897,15 @@ static void boot_process(struct load_url_result *result, void *data)
 			_("Performing kexec load"));
 
 	rc = kexec_load(task);
+	if (rc)
+		boot_finish(task, rc);
+}
+
+/* Clean up our loaded resources, and reboot if the kexec load succeeded */
+static void boot_finish(struct boot_task *task, int rc)
+{
+	struct boot_resource *resource;
 
-no_load:
 	list_for_each_entry(&task->resources, resource, list)
 		cleanup_load(resource->result);
 
@@ -551,6 +959,11 @@ static struct boot_resource *add_boot_resource(struct boot_task *task,
 	res->url = pb_url_copy(res, url);
 	res->local_path = local_path;
 
+	/* anything other than the boot files themselves is a signature */
+	res->signature = local_path != &task->local_image &&
+		local_path != &task->local_initrd &&
+		local_path != &task->local_dtb;
+
 	list_add(&task->resources, &res->list);
 	return res;
 }
@@ -580,6 +993,10 @@ struct boot_task *boot(void *ctx, struct discover_boot_option *opt,
 			_("Booting %s"), boot_desc);
 
 	boot_task = talloc_zero(ctx, struct boot_task);
+	clock_gettime(CLOCK_MONOTONIC, &boot_task->start);
+	boot_task->local_image_fd = -1;
+	boot_task->local_initrd_fd = -1;
+	boot_task->local_dtb_fd = -1;
 	boot_task->dry_run = dry_run;
 	boot_task->status_fn = status_fn;
 	boot_task->status_arg = status_arg;
@@ -701,6 +1118,7 @@ struct boot_task *boot(void *ctx, struct discover_boot_option *opt,
 		return NULL;
 	}
 
+	boot_task->loads_started = true;
 	boot_process(NULL, boot_task);
 
 	return boot_task;
@@ -715,3 +1133,8 @@ void boot_cancel(struct boot_task *task)
 
 	cleanup_cancellations(task, NULL);
 }
+
+void boot_init(struct waitset *set)
+{
+	boot_waitset = set;
+}
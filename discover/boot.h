@@ -1,11 +1,17 @@
 #ifndef _BOOT_H
 #define _BOOT_H
 
+#include <time.h>
+
 #include <types/types.h>
 #include "device-handler.h"
 
 struct boot_option;
 struct boot_command;
+struct boot_file_check;
+struct kexec_file;
+struct process_chain;
+struct waitset;
 
 typedef void (*boot_status_fn)(void *arg, struct status *);
 
@@ -15,6 +21,24 @@ struct boot_task *boot(void *ctx, struct discover_boot_option *opt,
 
 void boot_cancel(struct boot_task *task);
 
+/* Files are checked on worker threads, which report back through @set */
+void boot_init(struct waitset *set);
+
+enum boot_file_type {
+	BOOT_FILE_IMAGE,
+	BOOT_FILE_INITRD,
+	BOOT_FILE_DTB,
+	BOOT_FILE_COUNT,
+};
+
+/* A boot file being verified or decrypted, see boot_start_checks */
+struct boot_check {
+	struct boot_file_check	*check;
+	bool			before_hooks;
+	bool			done;
+	int			rc;
+};
+
 struct boot_task {
 	const char *local_image;
 	const char *local_initrd;
@@ -22,6 +46,9 @@ struct boot_task {
 	char *local_image_override;
 	char *local_initrd_override;
 	char *local_dtb_override;
+	int local_image_fd;
+	int local_initrd_fd;
+	int local_dtb_fd;
 	const char *args;
 	const char *boot_console;
 	boot_status_fn status_fn;
@@ -30,6 +57,16 @@ struct boot_task {
 	bool cancelled;
 	bool verify_signature;
 	bool decrypt_files;
+	bool kexec_loading;
+	struct kexec_file *kexec_file;
+	struct process_chain *kexec_chain;
+	struct process_chain *kexec_unload;
+	bool loads_started;
+	bool hooks_started;
+	bool hooks_done;
+	bool files_ready;
+	struct timespec start;
+	struct boot_check checks[BOOT_FILE_COUNT];
 	const char *local_image_signature;
 	const char *local_initrd_signature;
 	const char *local_dtb_signature;
@@ -42,6 +79,8 @@ struct boot_resource {
 	struct pb_url *url;
 	const char **local_path;
 	const char *name;
+	bool signature;
+	bool loaded;
 
 	struct list_item list;
 };
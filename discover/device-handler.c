@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <mntent.h>
 #include <locale.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
@@ -20,6 +21,7 @@
 #include <url/url.h>
 #include <i18n/i18n.h>
 #include <pb-config/pb-config.h>
+#include <waiter/job.h>
 
 #include <sys/sysmacros.h>
 #include <sys/types.h>
@@ -53,10 +55,10 @@ enum default_priority {
 static int default_rescan_timeout = 5 * 60; /* seconds */
 
 struct progress_info {
-	unsigned int			percentage;
-	unsigned long			size;		/* size in bytes */
+	uint64_t		current;	/* bytes so far */
+	uint64_t		total;		/* bytes expected, 0 if unknown */
 
-	const struct process_info	*procinfo;
+	const void		*id;
 	struct list_item	list;
 };
 
@@ -67,6 +69,42 @@ struct crypt_info {
 	struct list_item	list;
 };
 
+/* Devices are indexed by each of the keys that we look them up by. Devices
+ * sharing a key (eg, multipath devices with the same filesystem UUID) are
+ * kept in their bucket in the order they were added, so a lookup finds the
+ * first-added device, as the linear search through handler->devices did.
+ */
+#define DEVICE_HASH_SIZE	512
+
+enum device_key {
+	DEVICE_KEY_ID,
+	DEVICE_KEY_UUID,
+	DEVICE_KEY_LABEL,
+	DEVICE_KEY_SERIAL,
+	DEVICE_KEY_MAX,
+};
+
+struct device_index_entry {
+	struct discover_device	*dev;
+	char			*key;
+	struct list_item	list;
+};
+
+struct device_index {
+	struct device_index_entry	entries[DEVICE_KEY_MAX];
+};
+
+/* Unresolved boot options are indexed by the device keys that their
+ * resources are waiting for, so that a new device only causes a retry of
+ * the options that may refer to it. */
+#define UNRESOLVED_HASH_SIZE	256
+
+struct unresolved_wait {
+	struct discover_boot_option	*opt;
+	struct resource			*res;
+	struct list_item		list;
+};
+
 struct device_handler {
 	struct discover_server	*server;
 	int			dry_run;
@@ -77,6 +115,7 @@ struct device_handler {
 
 	struct discover_device	**devices;
 	unsigned int		n_devices;
+	struct list		device_index[DEVICE_KEY_MAX][DEVICE_HASH_SIZE];
 
 	struct ramdisk_device	**ramdisks;
 	unsigned int		n_ramdisks;
@@ -92,6 +131,9 @@ struct device_handler {
 	int			default_boot_option_priority;
 
 	struct list		unresolved_boot_options;
+	struct list		unresolved_index[UNRESOLVED_HASH_SIZE];
+	struct list		unresolved_any;
+	unsigned int		unresolved_seq;
 
 	struct boot_task	*pending_boot;
 	bool			pending_boot_is_default;
@@ -104,9 +146,62 @@ struct device_handler {
 	bool			plugin_installing;
 
 	struct list		crypt_devices;
+
+	struct list		discover_jobs;
+	unsigned int		n_mounting;
 };
 
-static int mount_device(struct discover_device *dev);
+/* Discovery of a block device runs as a pipeline: the device is mounted on
+ * a worker thread, so that slow mounts don't hold up the main loop. The
+ * worker also reads the parsers' config files into the page cache, so that
+ * devices' I/O happens in parallel, and parsing doesn't block on the disk.
+ * Parsing and commit then run in the main loop, in parser order, once the
+ * mount completes. At most
+ * MAX_CONCURRENT_MOUNTS devices are mounted at once; the rest wait in
+ * handler->discover_jobs.
+ */
+#define MAX_CONCURRENT_MOUNTS	4
+
+enum discover_job_state {
+	DISCOVER_JOB_NEW,
+	DISCOVER_JOB_QUEUED,
+	DISCOVER_JOB_MOUNTING,
+};
+
+struct discover_job {
+	struct device_handler	*handler;
+	/* NULL once the device has been removed */
+	struct discover_device	*dev;
+	struct discover_context	*ctx;
+	enum discover_job_state	state;
+	struct list_item	list;
+
+	/* mount parameters, kept here so that we can clean up a mount that
+	 * completes after the device has gone */
+	char			*mount_path;
+	const char		*device_path;
+	const char		*fstype;
+	bool			have_snapshot;
+	/* a btrfs root may be in a subvolume; see check_subvols */
+	char			*subvol_path;
+
+	/* the worker running the mount, and its result as an errno value */
+	struct waiter_job	*mount_job;
+	int			mount_err;
+
+	/* time (in ms) that each stage finished */
+	uint64_t		queued;
+	uint64_t		mount_start;
+	uint64_t		mount_end;
+	uint64_t		parse_end;
+};
+
+static void discover_job_free(struct discover_job *job);
+static int discover_job_prepare_mount(struct discover_job *job);
+static void discover_job_start_mount(struct discover_job *job);
+static bool discover_job_retry_mount(struct discover_job *job, int err);
+static void discover_job_unmount(struct discover_job *job, bool mounted);
+static char *check_subvols(struct discover_device *dev);
 static int umount_device(struct discover_device *dev);
 
 static int device_handler_init_sources(struct device_handler *handler);
@@ -187,44 +282,121 @@ struct discover_boot_option *discover_boot_option_create(
 	return opt;
 }
 
-static int device_match_uuid(struct discover_device *dev, const char *uuid)
+static const char *device_key_value(struct discover_device *dev,
+		enum device_key key)
 {
-	return dev->uuid && !strcmp(dev->uuid, uuid);
+	switch (key) {
+	case DEVICE_KEY_ID:
+		return dev->device->id;
+	case DEVICE_KEY_UUID:
+		return dev->uuid;
+	case DEVICE_KEY_LABEL:
+		return dev->label;
+	case DEVICE_KEY_SERIAL:
+		return discover_device_get_param(dev, "ID_SERIAL");
+	default:
+		break;
+	}
+	return NULL;
 }
 
-static int device_match_label(struct discover_device *dev, const char *label)
+static struct list *device_index_bucket(struct device_handler *handler,
+		enum device_key key, const char *str)
 {
-	return dev->label && !strcmp(dev->label, label);
+	return &handler->device_index[key][str_hash(str) %
+		DEVICE_HASH_SIZE];
+}
+
+static int device_index_destructor(void *arg)
+{
+	struct device_index *index = arg;
+	unsigned int i;
+
+	for (i = 0; i < DEVICE_KEY_MAX; i++)
+		if (index->entries[i].key)
+			list_remove(&index->entries[i].list);
+
+	return 0;
+}
+
+static void device_index_set_key(struct device_handler *handler,
+		struct device_index_entry *entry, enum device_key key)
+{
+	struct discover_device *dev = entry->dev;
+	const char *value = device_key_value(dev, key);
+
+	if (entry->key && value && !strcmp(entry->key, value))
+		return;
+
+	if (entry->key) {
+		list_remove(&entry->list);
+		talloc_free(entry->key);
+		entry->key = NULL;
+	}
+
+	if (!value)
+		return;
+
+	entry->key = talloc_strdup(dev->index, value);
+	list_add_tail(device_index_bucket(handler, key, value), &entry->list);
+}
+
+static void device_index_add(struct device_handler *handler,
+		struct discover_device *dev)
+{
+	unsigned int i;
+
+	if (dev->index) {
+		device_handler_reindex_device(handler, dev);
+		return;
+	}
+
+	dev->index = talloc_zero(dev, struct device_index);
+	talloc_set_destructor(dev->index, device_index_destructor);
+
+	for (i = 0; i < DEVICE_KEY_MAX; i++) {
+		dev->index->entries[i].dev = dev;
+		device_index_set_key(handler, &dev->index->entries[i], i);
+	}
 }
 
-static int device_match_id(struct discover_device *dev, const char *id)
+static void device_index_remove(struct discover_device *dev)
 {
-	return !strcmp(dev->device->id, id);
+	talloc_free(dev->index);
+	dev->index = NULL;
 }
 
-static int device_match_serial(struct discover_device *dev, const char *serial)
+/**
+ * device_handler_reindex_device - Update the lookup indexes for a device
+ * that has had its id, UUID, label or serial changed after being added.
+ */
+void device_handler_reindex_device(struct device_handler *handler,
+		struct discover_device *dev)
 {
-	const char *val = discover_device_get_param(dev, "ID_SERIAL");
-	return val && !strcmp(val, serial);
+	unsigned int i;
+
+	if (!dev->index)
+		return;
+
+	for (i = 0; i < DEVICE_KEY_MAX; i++)
+		device_index_set_key(handler, &dev->index->entries[i], i);
 }
 
 static struct discover_device *device_lookup(
 		struct device_handler *device_handler,
-		int (match_fn)(struct discover_device *, const char *),
-		const char *str)
+		enum device_key key, const char *str)
 {
-	struct discover_device *dev;
-	unsigned int i;
+	struct device_index_entry *entry;
+	struct list *bucket;
 
 	if (!str)
 		return NULL;
 
-	for (i = 0; i < device_handler->n_devices; i++) {
-		dev = device_handler->devices[i];
+	bucket = device_index_bucket(device_handler, key, str);
 
-		if (match_fn(dev, str))
-			return dev;
-	}
+	list_for_each_entry(bucket, entry, list)
+		if (!strcmp(entry->key, str))
+			return entry->dev;
 
 	return NULL;
 }
@@ -242,28 +414,28 @@ struct discover_device *device_lookup_by_uuid(
 		struct device_handler *device_handler,
 		const char *uuid)
 {
-	return device_lookup(device_handler, device_match_uuid, uuid);
+	return device_lookup(device_handler, DEVICE_KEY_UUID, uuid);
 }
 
 struct discover_device *device_lookup_by_label(
 		struct device_handler *device_handler,
 		const char *label)
 {
-	return device_lookup(device_handler, device_match_label, label);
+	return device_lookup(device_handler, DEVICE_KEY_LABEL, label);
 }
 
 struct discover_device *device_lookup_by_id(
 		struct device_handler *device_handler,
 		const char *id)
 {
-	return device_lookup(device_handler, device_match_id, id);
+	return device_lookup(device_handler, DEVICE_KEY_ID, id);
 }
 
 struct discover_device *device_lookup_by_serial(
 		struct device_handler *device_handler,
 		const char *serial)
 {
-	return device_lookup(device_handler, device_match_serial, serial);
+	return device_lookup(device_handler, DEVICE_KEY_SERIAL, serial);
 }
 
 void device_handler_destroy(struct device_handler *handler)
@@ -274,8 +446,19 @@ void device_handler_destroy(struct device_handler *handler)
 static int destroy_device(void *arg)
 {
 	struct discover_device *dev = arg;
+	struct discover_job *job;
 	struct process *p;
 
+	/* if the device is still being discovered, any mount in progress is
+	 * cleaned up when it completes */
+	job = dev->discover_job;
+	if (job) {
+		job->dev = NULL;
+		dev->discover_job = NULL;
+		if (job->state != DISCOVER_JOB_MOUNTING)
+			discover_job_free(job);
+	}
+
 	umount_device(dev);
 
 	devmapper_destroy_snapshot(dev);
@@ -395,6 +578,7 @@ struct device_handler *device_handler_init(struct discover_server *server,
 		struct waitset *waitset, int dry_run)
 {
 	struct device_handler *handler;
+	unsigned int i, j;
 	int rc;
 
 	handler = talloc_zero(NULL, struct device_handler);
@@ -403,10 +587,18 @@ struct device_handler *device_handler_init(struct discover_server *server,
 	handler->dry_run = dry_run;
 	handler->autoboot_enabled = config_autoboot_active(config_get());
 
+	for (i = 0; i < DEVICE_KEY_MAX; i++)
+		for (j = 0; j < DEVICE_HASH_SIZE; j++)
+			list_init(&handler->device_index[i][j]);
+
 	list_init(&handler->unresolved_boot_options);
+	for (i = 0; i < UNRESOLVED_HASH_SIZE; i++)
+		list_init(&handler->unresolved_index[i]);
+	list_init(&handler->unresolved_any);
 
 	list_init(&handler->progress);
 	list_init(&handler->crypt_devices);
+	list_init(&handler->discover_jobs);
 
 	/* set up our mount point base */
 	pb_mkdir_recursive(mount_base());
@@ -427,9 +619,19 @@ struct device_handler *device_handler_init(struct discover_server *server,
 	return handler;
 }
 
+static void device_handler_rescan_cb(void *data,
+		struct process *failed __attribute__((unused)))
+{
+	struct device_handler *handler = data;
+
+	device_handler_reinit_sources(handler);
+}
+
 void device_handler_reinit(struct device_handler *handler)
 {
 	struct discover_boot_option *opt, *tmp;
+	struct discover_job *job, *job_tmp;
+	struct process_chain *chain;
 	struct crypt_info *crypt, *c;
 	struct ramdisk_device *ramdisk;
 	struct config *config;
@@ -465,6 +667,18 @@ void device_handler_reinit(struct device_handler *handler)
 		talloc_free(ramdisk);
 	}
 
+	/* and those that are still being discovered. Block devices are only
+	 * added to handler->devices once their discovery commits, so ones
+	 * still queued or mounting aren't freed above; any that are in both
+	 * have had their job detached by destroy_device, so are skipped */
+	list_for_each_entry_safe(&handler->discover_jobs, job, job_tmp, list) {
+		if (!job->dev)
+			continue;
+		ramdisk = job->dev->ramdisk;
+		talloc_free(job->dev);
+		talloc_free(ramdisk);
+	}
+
 	talloc_free(handler->devices);
 	handler->devices = NULL;
 	handler->n_devices = 0;
@@ -496,10 +710,11 @@ void device_handler_reinit(struct device_handler *handler)
 		discover_server_notify_config(handler->server, config);
 	}
 
-	/* Force rediscovery on SCSI devices */
-	process_run_simple(handler, pb_system_apps.scsi_rescan, NULL);
-
-	device_handler_reinit_sources(handler);
+	/* Force rediscovery on SCSI devices, then restart our sources */
+	chain = process_chain_create(handler, device_handler_rescan_cb,
+			handler);
+	process_chain_add(chain, NULL, pb_system_apps.scsi_rescan, NULL);
+	process_chain_run(chain);
 }
 
 void device_handler_remove(struct device_handler *handler,
@@ -544,6 +759,8 @@ void device_handler_remove(struct device_handler *handler,
 	if (device->device->type == DEVICE_TYPE_NETWORK)
 		network_unregister_device(handler->network, device);
 
+	device_index_remove(device);
+
 	handler->n_devices--;
 	memmove(&handler->devices[i], &handler->devices[i + 1],
 		(handler->n_devices - i) * sizeof(handler->devices[0]));
@@ -631,61 +848,65 @@ void device_handler_status_err(struct device_handler *handler,
 	va_end(ap);
 }
 
-void device_handler_status_download(struct device_handler *handler,
-		const struct process_info *procinfo,
-		unsigned int percentage, unsigned int size, char suffix)
+/* Progress updates from the same source are coalesced in the status
+ * backlog, so repeated updates don't push out other messages */
+static void device_handler_status_progress(struct device_handler *handler,
+		const char *source, const char *fmt, ...)
 {
-	struct progress_info *p, *progress = NULL;
-	uint64_t current_converted, current = 0;
-	const char *units = " kMGTP";
-	unsigned long size_bytes;
-	char *update = NULL;
-	double total = 0;
-	unsigned int i;
-	int unit = 0;
+	struct status status;
+	va_list ap;
+
+	va_start(ap, fmt);
+	status.message = talloc_vasprintf(handler, fmt, ap);
+	va_end(ap);
+
+	status.type = STATUS_INFO;
+	status.backlog = false;
+	status.boot_active = false;
+
+	pb_debug("%s: %s\n", __func__, status.message);
+	discover_server_notify_boot_progress(handler->server, &status, source);
+
+	talloc_free(status.message);
+}
+
+static struct progress_info *device_handler_progress_get(
+		struct device_handler *handler, const void *id)
+{
+	struct progress_info *p;
 
 	list_for_each_entry(&handler->progress, p, list)
-		if (p->procinfo == procinfo)
-			progress = p;
-
-	if (!progress) {
-		pb_log("Registering new progress struct\n");
-		progress = talloc_zero(handler, struct progress_info);
-		if (!progress) {
-			pb_log("Failed to allocate room for progress struct\n");
-			return;
-		}
-		progress->procinfo = procinfo;
-		list_add(&handler->progress, &progress->list);
-		handler->n_progress++;
-	}
+		if (p->id == id)
+			return p;
 
-	size_bytes = size;
-	for (i = 0; i < strlen(units); i++) {
-		if (units[i] == suffix)
-			break;
+	pb_log("Registering new progress struct\n");
+	p = talloc_zero(handler, struct progress_info);
+	if (!p) {
+		pb_log("Failed to allocate room for progress struct\n");
+		return NULL;
 	}
+	p->id = id;
+	list_add(&handler->progress, &p->list);
+	handler->n_progress++;
 
-	if (i >= strlen(units)) {
-	    pb_log("Couldn't recognise suffix '%c'\n", suffix);
-	    size_bytes = 0;
-	} else {
-		while (i--)
-			size_bytes <<= 10;
-	}
+	return p;
+}
 
-	progress->percentage = percentage;
-	progress->size = size_bytes;
+static void device_handler_status_download_update(
+		struct device_handler *handler)
+{
+	uint64_t current_converted, current = 0, total = 0;
+	const char *units = " kMGTP";
+	struct progress_info *p;
+	char *update = NULL;
+	int unit = 0;
 
 	/*
-	 * Aggregate the info we have and update status. If a progress struct
-	 * has zero for both percentage and size we assume progress information
-	 * is unavailable and fall back to a generic progress message.
+	 * Aggregate the info we have and update status. If a download doesn't
+	 * know its total size we fall back to a generic progress message.
 	 */
 	list_for_each_entry(&handler->progress, p, list) {
-		uint64_t c;
-		double t;
-		if (!p->percentage || !p->size) {
+		if (!p->total) {
 			update = talloc_asprintf(handler,
 					_("%u downloads in progress..."),
 					handler->n_progress);
@@ -693,11 +914,8 @@ void device_handler_status_download(struct device_handler *handler,
 			break;
 		}
 
-		c = p->size;
-		t = (100 * c) / p->percentage;
-
-		current += c;
-		total += t;
+		current += p->current;
+		total += p->total;
 	}
 
 	if (total) {
@@ -710,40 +928,97 @@ void device_handler_status_download(struct device_handler *handler,
 				_("%u %s downloading: %.0f%% - %" PRIu64 "%cB"),
 				handler->n_progress,
 				ngettext("item", "items", handler->n_progress),
-				(current / total) * 100, current_converted,
-				units[unit]);
+				((double)current / total) * 100,
+				current_converted, units[unit]);
 	}
 
 	if (!update) {
 		pb_log_fn("failed to allocate new status\n");
 	} else {
-		device_handler_status_info(handler, "%s\n", update);
+		device_handler_status_progress(handler, "download", "%s\n",
+				update);
 		talloc_free(update);
 	}
 }
 
+void device_handler_status_download(struct device_handler *handler,
+		const struct process_info *procinfo,
+		unsigned int percentage, unsigned int size, char suffix)
+{
+	const char *units = " kMGTP";
+	struct progress_info *progress;
+	uint64_t size_bytes;
+	unsigned int i;
+
+	progress = device_handler_progress_get(handler, procinfo);
+	if (!progress)
+		return;
+
+	size_bytes = size;
+	for (i = 0; i < strlen(units); i++) {
+		if (units[i] == suffix)
+			break;
+	}
+
+	if (i >= strlen(units)) {
+	    pb_log("Couldn't recognise suffix '%c'\n", suffix);
+	    size_bytes = 0;
+	} else {
+		while (i--)
+			size_bytes <<= 10;
+	}
+
+	/* If we have zero for either percentage or size we assume progress
+	 * information is unavailable */
+	progress->current = size_bytes;
+	progress->total = percentage ? (100 * size_bytes) / percentage : 0;
+
+	device_handler_status_download_update(handler);
+}
+
+void device_handler_status_download_bytes(struct device_handler *handler,
+		const void *id, uint64_t current, uint64_t total)
+{
+	struct progress_info *progress;
+
+	progress = device_handler_progress_get(handler, id);
+	if (!progress)
+		return;
+
+	progress->current = current;
+	progress->total = total;
+
+	device_handler_status_download_update(handler);
+}
+
+static void device_handler_plugin_scan_cb(
+		void *data __attribute__((unused)), struct process *failed)
+{
+	if (failed)
+		pb_log("Error from pb-plugin scan %s\n", failed->argv[2]);
+}
+
 static void device_handler_plugin_scan_device(struct device_handler *handler,
 		struct discover_device *dev)
 {
-	int rc;
+	struct process_chain *chain;
 
 	pb_debug("Scanning %s for plugin files\n", dev->device->id);
 
-	rc = process_run_simple(handler, pb_system_apps.pb_plugin,
-				"scan", dev->mount_path,
-				NULL);
-	if (rc)
-		pb_log("Error from pb-plugin scan %s\n",
-				dev->mount_path);
+	chain = process_chain_create(handler, device_handler_plugin_scan_cb,
+			NULL);
+	process_chain_add(chain, NULL, pb_system_apps.pb_plugin,
+			"scan", dev->mount_path, NULL);
+	process_chain_run(chain);
 }
 
 void device_handler_status_download_remove(struct device_handler *handler,
-		struct process_info *procinfo)
+		const void *id)
 {
 	struct progress_info *p, *tmp;
 
 	list_for_each_entry_safe(&handler->progress, p, tmp, list)
-		if (p->procinfo == procinfo) {
+		if (p->id == id) {
 			list_remove(&p->list);
 			talloc_free(p);
 			handler->n_progress--;
@@ -768,24 +1043,22 @@ static void device_handler_boot_status_cb(void *arg, struct status *status)
 static void countdown_status(struct device_handler *handler,
 		struct discover_boot_option *opt, unsigned int sec)
 {
-	struct status status;
-
-	status.type = STATUS_INFO;
-	status.message = talloc_asprintf(handler,
+	device_handler_status_progress(handler, "autoboot",
 			_("Booting in %d sec: [%s] %s"), sec,
 			opt->device->device->id, opt->option->name);
-	status.backlog = false;
-	status.boot_active = false;
-
-	device_handler_status(handler, &status);
-
-	talloc_free(status.message);
 }
 
+/* Runs either as the countdown waiter's callback, or directly once any
+ * countdown waiter has been removed. The waiter is only kept if we rearm it;
+ * otherwise the waitset frees it once we return */
 static int default_timeout(void *arg)
 {
 	struct device_handler *handler = arg;
 	struct discover_boot_option *opt;
+	struct waiter *waiter;
+
+	waiter = handler->timeout_waiter;
+	handler->timeout_waiter = NULL;
 
 	if (!handler->default_boot_option)
 		return 0;
@@ -800,14 +1073,17 @@ static int default_timeout(void *arg)
 	if (handler->sec_to_boot) {
 		countdown_status(handler, opt, handler->sec_to_boot);
 		handler->sec_to_boot--;
-		handler->timeout_waiter = waiter_register_timeout(
+		if (waiter) {
+			waiter_rearm_timeout(waiter, 1000);
+			handler->timeout_waiter = waiter;
+		} else {
+			handler->timeout_waiter = waiter_register_timeout(
 						handler->waitset, 1000,
 						default_timeout, handler);
+		}
 		return 0;
 	}
 
-	handler->timeout_waiter = NULL;
-
 	pb_log("Timeout expired, booting default option %s\n", opt->option->id);
 
 	platform_pre_boot();
@@ -979,6 +1255,11 @@ static void set_default(struct device_handler *handler,
 	pb_log("handler: boot option %s set as default, timeout %u sec.\n",
 	       opt->option->id, handler->sec_to_boot);
 
+	/* restart the countdown from a fresh waiter */
+	if (handler->timeout_waiter)
+		waiter_remove(handler->timeout_waiter);
+	handler->timeout_waiter = NULL;
+
 	default_timeout(handler);
 }
 
@@ -1080,6 +1361,8 @@ static bool resource_resolve(struct resource *res, const char *name,
 static bool boot_option_resolve(struct discover_boot_option *opt,
 		struct device_handler *handler)
 {
+	opt->n_resolve_attempts++;
+
 	return resource_resolve(opt->boot_image, "boot_image", opt, handler) &&
 		resource_resolve(opt->initrd, "initrd", opt, handler) &&
 		resource_resolve(opt->dtb, "dtb", opt, handler) &&
@@ -1130,20 +1413,138 @@ static void notify_boot_option(struct device_handler *handler,
 	discover_server_notify_boot_option_add(handler->server, opt->option);
 }
 
-static void process_boot_option_queue(struct device_handler *handler)
+static int unresolved_wait_destructor(void *arg)
 {
-	struct discover_boot_option *opt, *tmp;
+	struct unresolved_wait *wait = arg;
 
-	list_for_each_entry_safe(&handler->unresolved_boot_options,
-			opt, tmp, list) {
+	list_remove(&wait->list);
+	return 0;
+}
+
+static void unresolved_wait_add(struct device_handler *handler,
+		struct discover_boot_option *opt, struct resource *res)
+{
+	struct unresolved_wait *wait;
+	struct list *list;
+
+	if (!res || resource_is_resolved(res))
+		return;
+
+	wait = talloc_zero(opt->unresolved_waits, struct unresolved_wait);
+	wait->opt = opt;
+	wait->res = res;
+
+	if (res->device_key)
+		list = &handler->unresolved_index[
+			str_hash(res->device_key) %
+			UNRESOLVED_HASH_SIZE];
+	else
+		list = &handler->unresolved_any;
+
+	list_add_tail(list, &wait->list);
+	talloc_set_destructor(wait, unresolved_wait_destructor);
+}
+
+/* (Re-)index an unresolved option by the devices its remaining unresolved
+ * resources are waiting for */
+static void boot_option_index_unresolved(struct device_handler *handler,
+		struct discover_boot_option *opt)
+{
+	talloc_free(opt->unresolved_waits);
+	opt->unresolved_waits = talloc_new(opt);
+
+	unresolved_wait_add(handler, opt, opt->boot_image);
+	unresolved_wait_add(handler, opt, opt->initrd);
+	unresolved_wait_add(handler, opt, opt->dtb);
+	unresolved_wait_add(handler, opt, opt->args_sig_file);
+	unresolved_wait_add(handler, opt, opt->icon);
+}
+
+static void boot_option_wake(struct discover_boot_option *opt,
+		struct discover_boot_option ***woken, unsigned int *n_woken)
+{
+	if (opt->unresolved_woken)
+		return;
+
+	opt->unresolved_woken = true;
+	*woken = talloc_realloc(NULL, *woken, struct discover_boot_option *,
+			*n_woken + 1);
+	(*woken)[(*n_woken)++] = opt;
+}
+
+static void boot_option_wake_key(struct device_handler *handler,
+		const char *key, unsigned int type,
+		struct discover_boot_option ***woken, unsigned int *n_woken)
+{
+	struct unresolved_wait *wait;
+	struct list *bucket;
+
+	if (!key)
+		return;
+
+	bucket = &handler->unresolved_index[str_hash(key) %
+		UNRESOLVED_HASH_SIZE];
+
+	list_for_each_entry(bucket, wait, list) {
+		if (!(wait->res->device_key_types & type))
+			continue;
+		if (strcmp(wait->res->device_key, key))
+			continue;
+		boot_option_wake(wait->opt, woken, n_woken);
+	}
+}
+
+/* the unresolved queue is newest-first, so retry in the same order */
+static int boot_option_queue_cmp(const void *a, const void *b)
+{
+	const struct discover_boot_option *opt_a, *opt_b;
+
+	opt_a = *(const struct discover_boot_option **)a;
+	opt_b = *(const struct discover_boot_option **)b;
+
+	if (opt_a->unresolved_seq == opt_b->unresolved_seq)
+		return 0;
+	return opt_a->unresolved_seq > opt_b->unresolved_seq ? -1 : 1;
+}
+
+/* Retry resolution of the unresolved options that may refer to a newly
+ * discovered device */
+static void process_boot_option_queue(struct device_handler *handler,
+		struct discover_device *dev)
+{
+	struct discover_boot_option **woken = NULL, *opt;
+	struct unresolved_wait *wait;
+	unsigned int i, n_woken = 0;
+
+	boot_option_wake_key(handler, dev->device->id, RESOURCE_DEVICE_ID,
+			&woken, &n_woken);
+	boot_option_wake_key(handler, dev->uuid, RESOURCE_DEVICE_UUID,
+			&woken, &n_woken);
+	boot_option_wake_key(handler, dev->label, RESOURCE_DEVICE_LABEL,
+			&woken, &n_woken);
+
+	list_for_each_entry(&handler->unresolved_any, wait, list)
+		boot_option_wake(wait->opt, &woken, &n_woken);
+
+	qsort(woken, n_woken, sizeof(*woken), boot_option_queue_cmp);
+
+	for (i = 0; i < n_woken; i++) {
+		opt = woken[i];
+		opt->unresolved_woken = false;
 
 		pb_debug("queue: attempting resolution for %s\n",
 				opt->option->id);
 
-		if (!boot_option_resolve(opt, handler))
+		if (!boot_option_resolve(opt, handler)) {
+			boot_option_index_unresolved(handler, opt);
 			continue;
+		}
+
+		pb_debug("\tresolved after %u attempts\n",
+				opt->n_resolve_attempts);
 
-		pb_debug("\tresolved!\n");
+		talloc_free(opt->unresolved_waits);
+		opt->unresolved_waits = NULL;
 
 		list_remove(&opt->list);
 		list_add_tail(&opt->device->boot_options, &opt->list);
@@ -1151,6 +1552,8 @@ static void process_boot_option_queue(struct device_handler *handler)
 		boot_option_finalise(handler, opt);
 		notify_boot_option(handler, opt);
 	}
+
+	talloc_free(woken);
 }
 
 struct discover_context *device_handler_discover_context_create(
@@ -1177,6 +1580,9 @@ void device_handler_add_device(struct device_handler *handler,
 
 	if (device->device->type == DEVICE_TYPE_NETWORK)
 		network_register_device(handler->network, device);
+
+	/* after network registration, which may set the device's UUID */
+	device_index_add(handler, device);
 }
 
 void device_handler_add_ramdisk(struct device_handler *handler,
@@ -1378,13 +1784,136 @@ void device_handler_add_encrypted_dev(struct device_handler *handler,
 		device_handler_add_device(handler, dev);
 }
 
+static uint64_t discover_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void discover_job_free(struct discover_job *job)
+{
+	if (job->state != DISCOVER_JOB_NEW)
+		list_remove(&job->list);
+
+	if (job->dev)
+		job->dev->discover_job = NULL;
+
+	talloc_unlink(job->handler, job->ctx);
+	talloc_free(job);
+}
+
+/* A mount still running when the handler goes is cleaned up once it
+ * finishes */
+static int discover_job_destroy(void *arg)
+{
+	struct discover_job *job = arg;
+
+	return waiter_job_destroy(job->mount_job);
+}
+
+/* The parse and commit stages, once the device is mounted */
+static void discover_job_parse(struct discover_job *job)
+{
+	struct device_handler *handler = job->handler;
+	struct discover_device *dev = job->dev;
+	uint64_t end;
+
+	/* add this device to our system info */
+	system_info_register_blockdev(dev->device->id, dev->uuid,
+			dev->mount_path);
+
+	/* run the parsers. This will populate the ctx's boot_option list. */
+	iterate_parsers(job->ctx);
+	job->parse_end = discover_time_ms();
+
+	/* add discovered stuff to the handler */
+	device_handler_discover_context_commit(handler, job->ctx);
+
+	process_boot_option_queue(handler, dev);
+
+	/* Check this device for pb-plugins */
+	device_handler_plugin_scan_device(handler, dev);
+
+	end = discover_time_ms();
+	pb_log("%s: discovery took %ums (queued %ums, mount %ums, "
+			"parse %ums, commit %ums)\n", dev->device->id,
+			(unsigned int)(end - job->queued),
+			(unsigned int)(job->mount_start - job->queued),
+			(unsigned int)(job->mount_end - job->mount_start),
+			(unsigned int)(job->parse_end - job->mount_end),
+			(unsigned int)(end - job->parse_end));
+
+	discover_job_free(job);
+}
+
+/* Start mounting queued devices, up to the concurrency limit */
+static void discover_jobs_run(struct device_handler *handler)
+{
+	struct discover_job *job, *tmp;
+
+	list_for_each_entry_safe(&handler->discover_jobs, job, tmp, list) {
+		if (handler->n_mounting >= MAX_CONCURRENT_MOUNTS)
+			break;
+
+		if (job->state != DISCOVER_JOB_QUEUED)
+			continue;
+
+		job->state = DISCOVER_JOB_MOUNTING;
+		job->mount_start = discover_time_ms();
+		handler->n_mounting++;
+
+		discover_job_start_mount(job);
+	}
+}
+
+/* A mount has finished, with err as its errno value */
+static void discover_job_mount_done(struct discover_job *job, int err)
+{
+	struct device_handler *handler = job->handler;
+	struct discover_device *dev = job->dev;
+
+	/* the device has been removed while we were mounting it */
+	if (!dev) {
+		discover_job_unmount(job, !err);
+		handler->n_mounting--;
+		discover_job_free(job);
+		return;
+	}
+
+	/* If mount fails clean up any snapshot and try again */
+	if (err && discover_job_retry_mount(job, err))
+		return;
+
+	handler->n_mounting--;
+	job->mount_end = discover_time_ms();
+
+	if (err) {
+		pb_log("couldn't mount device %s: mount failed: %s\n",
+				job->device_path, strerror(err));
+		discover_job_unmount(job, false);
+		discover_job_free(job);
+		return;
+	}
+
+	dev->mount_path = talloc_steal(dev, job->mount_path);
+	job->mount_path = NULL;
+	dev->mounted = true;
+	dev->mounted_rw = false;
+	dev->unmount = true;
+	dev->root_path = check_subvols(dev);
+
+	discover_job_parse(job);
+}
+
 /* Start discovery on a hotplugged device. The device will be in our devices
  * array, but has only just been initialised by the hotplug source.
  */
 int device_handler_discover(struct device_handler *handler,
 		struct discover_device *dev)
 {
-	struct discover_context *ctx;
+	struct discover_job *job;
 	int rc;
 
 	device_handler_status_dev_info(handler, dev,
@@ -1396,29 +1925,39 @@ int device_handler_discover(struct device_handler *handler,
 		_("Processing new %s device"),
 		device_type_display_name(dev->device->type));
 
-	/* create our context */
-	ctx = device_handler_discover_context_create(handler, dev);
+	if (dev->discover_job) {
+		pb_debug("%s: discovery already in progress\n",
+				dev->device->id);
+		return 0;
+	}
 
-	rc = mount_device(dev);
-	if (rc)
-		goto out;
+	job = talloc_zero(handler, struct discover_job);
+	talloc_set_destructor(job, discover_job_destroy);
+	job->handler = handler;
+	job->dev = dev;
+	job->state = DISCOVER_JOB_NEW;
+	job->queued = job->mount_start = job->mount_end = discover_time_ms();
 
-	/* add this device to our system info */
-	system_info_register_blockdev(dev->device->id, dev->uuid,
-			dev->mount_path);
+	/* create our context */
+	job->ctx = device_handler_discover_context_create(handler, dev);
 
-	/* run the parsers. This will populate the ctx's boot_option list. */
-	iterate_parsers(ctx);
+	rc = discover_job_prepare_mount(job);
+	if (rc < 0) {
+		discover_job_free(job);
+		return 0;
+	}
 
-	/* add discovered stuff to the handler */
-	device_handler_discover_context_commit(handler, ctx);
+	/* already mounted, or nothing to mount */
+	if (rc == 0) {
+		discover_job_parse(job);
+		return 0;
+	}
 
-	process_boot_option_queue(handler);
+	job->state = DISCOVER_JOB_QUEUED;
+	dev->discover_job = job;
+	list_add_tail(&handler->discover_jobs, &job->list);
 
-	/* Check this device for pb-plugins */
-	device_handler_plugin_scan_device(handler, dev);
-out:
-	talloc_unlink(handler, ctx);
+	discover_jobs_run(handler);
 
 	return 0;
 }
@@ -1924,6 +2463,15 @@ void device_handler_install_plugin(struct device_handler *handler,
 
 #ifndef PETITBOOT_TEST
 
+static void boot_option_queue_unresolved(struct device_handler *handler,
+		struct discover_boot_option *opt)
+{
+	opt->unresolved_seq = handler->unresolved_seq++;
+	list_add(&handler->unresolved_boot_options, &opt->list);
+	talloc_steal(handler, opt);
+	boot_option_index_unresolved(handler, opt);
+}
+
 /**
  * context_commit - Commit a temporary discovery context to the handler,
  * and notify the clients about any new options / devices
@@ -1968,9 +2516,7 @@ void device_handler_discover_context_commit(struct device_handler *handler,
 				pb_log("boot option %s is unresolved, "
 						"adding to queue\n",
 						opt->option->id);
-				list_add(&handler->unresolved_boot_options,
-						&opt->list);
-				talloc_steal(handler, opt);
+				boot_option_queue_unresolved(handler, opt);
 			}
 		}
 	}
@@ -2188,10 +2734,12 @@ static int try_mount(const char *device_path, const char *mount_path,
 	return mount(device_path, mount_path, fs, flags, safe_opts);
 }
 
-static int mount_device(struct discover_device *dev)
+/* Returns 1 if the device needs mounting, with the job's mount parameters
+ * set up, 0 if it is already mounted or has no filesystem, or -1 if it
+ * can't be mounted */
+static int discover_job_prepare_mount(struct discover_job *job)
 {
-	const char *fstype, *device_path;
-	int rc;
+	struct discover_device *dev = job->dev;
 
 	if (!dev->device_path)
 		return -1;
@@ -2202,55 +2750,106 @@ static int mount_device(struct discover_device *dev)
 	if (check_existing_mount(dev))
 		return 0;
 
-	fstype = discover_device_get_param(dev, "ID_FS_TYPE");
-	if (!fstype)
+	job->fstype = discover_device_get_param(dev, "ID_FS_TYPE");
+	if (!job->fstype)
 		return 0;
 
-	dev->mount_path = join_paths(dev, mount_base(),
-					dev->device_path);
-
-	if (pb_mkdir_recursive(dev->mount_path)) {
-		pb_log("couldn't create mount directory %s: %s\n",
-				dev->mount_path, strerror(errno));
-		goto err_free;
-	}
+	job->mount_path = join_paths(job, mount_base(), dev->device_path);
+	job->device_path = get_device_path(dev);
+	job->have_snapshot = !!dev->ramdisk;
 
-	device_path = get_device_path(dev);
+	if (!strncmp(job->fstype, "btrfs", strlen("btrfs")))
+		job->subvol_path = join_paths(job, job->mount_path, "@");
 
-	pb_log("mounting device %s read-only\n", dev->device_path);
-	rc = try_mount(device_path, dev->mount_path, fstype,
-		       MS_RDONLY | MS_SILENT, dev->ramdisk);
+	return 1;
+}
 
-	/* If mount fails clean up any snapshot and try again */
-	if (rc && dev->ramdisk) {
-		pb_log("couldn't mount snapshot for %s: mount failed: %s\n",
-				device_path, strerror(errno));
-		pb_log("falling back to actual device\n");
+/* Runs on a worker thread, so only uses the job's mount parameters, and
+ * doesn't allocate from any context the main loop uses */
+static void discover_job_mount_thread(void *arg)
+{
+	struct discover_job *job = arg;
 
-		devmapper_destroy_snapshot(dev);
+	job->mount_err = 0;
 
-		device_path = get_device_path(dev);
-		pb_log("mounting device %s read-only\n", dev->device_path);
-		rc = try_mount(device_path, dev->mount_path, fstype,
-			       MS_RDONLY | MS_SILENT, dev->ramdisk);
+	if (pb_mkdir_recursive(job->mount_path)) {
+		job->mount_err = errno ?: EIO;
+		return;
 	}
 
-	if (!rc) {
-		dev->mounted = true;
-		dev->mounted_rw = false;
-		dev->unmount = true;
-		dev->root_path = check_subvols(dev);
-		return 0;
+	if (try_mount(job->device_path, job->mount_path, job->fstype,
+			MS_RDONLY | MS_SILENT, job->have_snapshot)) {
+		job->mount_err = errno ?: EIO;
+		return;
 	}
 
-	pb_log("couldn't mount device %s: mount failed: %s\n",
-			device_path, strerror(errno));
+	parser_prefetch(job->mount_path);
+	if (job->subvol_path)
+		parser_prefetch(job->subvol_path);
+}
 
-	pb_rmdir_recursive(mount_base(), dev->mount_path);
-err_free:
-	talloc_free(dev->mount_path);
-	dev->mount_path = NULL;
-	return -1;
+/* If mounting the snapshot failed, drop it and mount the real device
+ * instead. Returns true if a new mount has been started */
+static bool discover_job_retry_mount(struct discover_job *job, int err)
+{
+	struct discover_device *dev = job->dev;
+
+	if (!job->have_snapshot)
+		return false;
+
+	pb_log("couldn't mount snapshot for %s: mount failed: %s\n",
+			job->device_path, strerror(err));
+	pb_log("falling back to actual device\n");
+
+	devmapper_destroy_snapshot(dev);
+
+	job->device_path = get_device_path(dev);
+	job->have_snapshot = !!dev->ramdisk;
+	discover_job_start_mount(job);
+	return true;
+}
+
+static void discover_job_unmount(struct discover_job *job, bool mounted)
+{
+	if (mounted)
+		umount(job->mount_path);
+	pb_rmdir_recursive(mount_base(), job->mount_path);
+}
+
+static void discover_job_mount_thread_done(void *arg)
+{
+	struct discover_job *job = arg;
+	struct device_handler *handler = job->handler;
+
+	discover_job_mount_done(job, job->mount_err);
+	discover_jobs_run(handler);
+}
+
+/* the handler was freed while we were mounting */
+static void discover_job_mount_cancelled(void *arg)
+{
+	struct discover_job *job = arg;
+
+	discover_job_unmount(job, !job->mount_err);
+}
+
+static void discover_job_start_mount(struct discover_job *job)
+{
+	pb_log("mounting device %s read-only\n", job->dev->device_path);
+
+	/* a retry replaces the finished mount */
+	talloc_free(job->mount_job);
+	job->mount_job = waiter_job_start(job->handler->waitset, job,
+			discover_job_mount_thread,
+			discover_job_mount_thread_done,
+			discover_job_mount_cancelled);
+	if (job->mount_job)
+		return;
+
+	/* if we can't start the job, fall back to mounting synchronously */
+	pb_log("couldn't start mount job, mounting synchronously\n");
+	discover_job_mount_thread(job);
+	discover_job_mount_done(job, job->mount_err);
 }
 
 static int umount_device(struct discover_device *dev)
@@ -2427,10 +3026,64 @@ static int umount_device(struct discover_device *dev __attribute__((unused)))
 	return 0;
 }
 
-static int __attribute__((unused)) mount_device(
-		struct discover_device *dev __attribute__((unused)))
+/* Devices that a test has marked as unmounted are mounted by a
+ * "worker" that only completes when the test calls
+ * test_discover_mount_done() */
+static int discover_job_prepare_mount(struct discover_job *job)
 {
-	return 0;
+	if (job->dev->mounted)
+		return 0;
+
+	job->mount_path = talloc_strdup(job, job->dev->mount_path);
+	job->device_path = job->dev->device_path;
+	return 1;
+}
+
+static void discover_job_start_mount(
+		struct discover_job *job __attribute__((unused)))
+{
+}
+
+static bool discover_job_retry_mount(
+		struct discover_job *job __attribute__((unused)),
+		int err __attribute__((unused)))
+{
+	return false;
+}
+
+static void discover_job_unmount(
+		struct discover_job *job __attribute__((unused)),
+		bool mounted __attribute__((unused)))
+{
+}
+
+static char *check_subvols(struct discover_device *dev)
+{
+	return dev->mount_path;
+}
+
+/* A non-exported function to allow the test infrastructure to complete
+ * the mount started for dev, or for a device that has since been removed
+ * if dev is NULL, as the mount worker would. Returns -1 if there is no
+ * such mount in progress */
+int __attribute__((unused)) test_discover_mount_done(
+		struct device_handler *handler,
+		struct discover_device *dev, int err);
+int test_discover_mount_done(struct device_handler *handler,
+		struct discover_device *dev, int err)
+{
+	struct discover_job *job;
+
+	list_for_each_entry(&handler->discover_jobs, job, list) {
+		if (job->state != DISCOVER_JOB_MOUNTING || job->dev != dev)
+			continue;
+
+		discover_job_mount_done(job, err);
+		discover_jobs_run(handler);
+		return 0;
+	}
+
+	return -1;
 }
 
 int device_request_write(struct discover_device *dev __attribute__((unused)),
@@ -16,6 +16,8 @@ struct event;
 struct device;
 struct waitset;
 struct config;
+struct parser_file_cache;
+struct device_index;
 
 struct discover_device {
 	struct device		*device;
@@ -43,6 +45,13 @@ struct discover_device {
 	struct list		params;
 
 	struct waiter		*requery_waiter;
+
+	/* set while the device is queued for, or in, the mount stage of
+	 * discovery */
+	struct discover_job	*discover_job;
+
+	/* lookup index entries, while the device is registered */
+	struct device_index	*index;
 };
 
 struct discover_boot_option {
@@ -57,6 +66,13 @@ struct discover_boot_option {
 	struct resource		*dtb;
 	struct resource		*args_sig_file;
 	struct resource		*icon;
+
+	/* while queued as unresolved: the handler's index entries for the
+	 * devices we're waiting for, and our position in the queue */
+	void			*unresolved_waits;
+	unsigned int		unresolved_seq;
+	bool			unresolved_woken;
+	unsigned int		n_resolve_attempts;
 };
 
 
@@ -67,6 +83,7 @@ struct discover_context {
 	struct discover_device	*device;
 	struct list		boot_options;
 	struct pb_url		*conf_url;
+	struct parser_file_cache *file_cache;
 	void			*test_data;
 };
 
@@ -130,8 +147,10 @@ void device_handler_status_dev_err(struct device_handler *handler,
 void device_handler_status_download(struct device_handler *handler,
 		const struct process_info *procinfo,
 		unsigned int percentage, unsigned int size, char suffix);
+void device_handler_status_download_bytes(struct device_handler *handler,
+		const void *id, uint64_t current, uint64_t total);
 void device_handler_status_download_remove(struct device_handler *handler,
-		struct process_info *procinfo);
+		const void *id);
 
 struct discover_context *device_handler_discover_context_create(
 		struct device_handler *handler,
@@ -161,6 +180,8 @@ struct discover_device *device_lookup_by_id(struct device_handler *handler,
 struct discover_device *device_lookup_by_serial(
 		struct device_handler *device_handler,
 		const char *serial);
+void device_handler_reindex_device(struct device_handler *handler,
+		struct discover_device *dev);
 
 void discover_device_set_param(struct discover_device *device,
 		const char *name, const char *value);
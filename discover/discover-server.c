@@ -29,14 +29,53 @@
 #include "platform.h"
 #include "sysinfo.h"
 
+/* Status messages kept for newly-connected clients, as a ring of at most
+ * size entries, starting at head. Entries from a progress source are
+ * coalesced, so only the latest from each is kept. */
+struct status_backlog_entry {
+	struct status	*status;
+	const char	*source;
+};
+
+struct status_backlog {
+	struct status_backlog_entry	*entries;
+	unsigned int			size;
+	unsigned int			head;
+	unsigned int			len;
+	unsigned int			n_dropped;
+	unsigned int			n_coalesced;
+};
+
+#define DEFAULT_STATUS_BACKLOG_SIZE	1024
+
+/* How many of the most recent backlog entries we search for an earlier
+ * update from the same progress source */
+#define STATUS_COALESCE_WINDOW		8
+
 struct discover_server {
 	int socket;
 	struct waitset *waitset;
 	struct waiter *waiter;
 	struct list clients;
-	struct list status;
+	struct status_backlog status;
 	struct device_handler *device_handler;
 	bool restrict_clients;
+	unsigned int client_queue_limit;
+	enum slow_client_policy slow_client_policy;
+};
+
+/* Messages that only carry the latest state, so a slow client only needs
+ * to see the most recent one of each. */
+enum coalesce_slot {
+	COALESCE_STATUS,
+	COALESCE_SYSTEM_INFO,
+	COALESCE_CONFIG,
+	COALESCE_MAX,
+};
+
+/* A coalesced message, waiting for room in the output queue */
+struct pending_message {
+	struct pb_protocol_message	*message;
 };
 
 struct client {
@@ -44,11 +83,31 @@ struct client {
 	struct list_item list;
 	struct waiter *waiter;
 	int fd;
+	struct pb_protocol_reader *reader;
 	bool remote_closed;
 	bool can_modify;
 	struct waiter *auth_waiter;
+
+	/* Outgoing data that the socket hasn't accepted yet: a ring buffer
+	 * of out_len bytes starting at out_head, flushed when the socket is
+	 * writable. */
+	char *out_buf;
+	unsigned int out_size;
+	unsigned int out_head;
+	unsigned int out_len;
+	struct waiter *out_waiter;
+	struct pending_message pending[COALESCE_MAX];
+	unsigned int n_dropped;
+	unsigned int n_coalesced;
+
+	/* capabilities advertised by the client, and the coalesce slots of
+	 * messages we couldn't send before we knew them */
+	uint32_t caps;
+	unsigned int withheld;
 };
 
+#define DEFAULT_CLIENT_QUEUE_LIMIT	(4 * 1024 * 1024)
+
 
 static int server_destructor(void *arg)
 {
@@ -76,6 +135,14 @@ static int client_destructor(void *arg)
 	if (client->auth_waiter)
 		waiter_remove(client->auth_waiter);
 
+	if (client->out_waiter)
+		waiter_remove(client->out_waiter);
+
+	if (client->n_dropped || client->n_coalesced)
+		pb_log("client %p: %u messages dropped, %u coalesced\n",
+				client, client->n_dropped,
+				client->n_coalesced);
+
 	list_remove(&client->list);
 
 	return 0;
@@ -99,18 +166,358 @@ static void print_clients(struct discover_server *server)
 				client->fd);
 }
 
-static int client_write_message(
-		struct discover_server *server __attribute__((unused)),
+static bool send_would_block(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+}
+
+/* Stop talking to a client. We shut the socket down rather than freeing
+ * the client here, as we may be in the middle of iterating the client
+ * list; the read side sees EOF and frees it from the main loop. */
+static void client_disconnect(struct client *client)
+{
+	unsigned int i;
+
+	client->remote_closed = true;
+	shutdown(client->fd, SHUT_RDWR);
+
+	client->out_len = 0;
+	for (i = 0; i < COALESCE_MAX; i++) {
+		talloc_free(client->pending[i].message);
+		client->pending[i].message = NULL;
+	}
+}
+
+static int client_queue_append(struct client *client, const char *buf,
+		unsigned int len)
+{
+	unsigned int tail, n;
+
+	if (client->out_len + len > client->out_size) {
+		unsigned int size = client->out_size ?: 4096;
+		char *out_buf;
+
+		while (size < client->out_len + len)
+			size *= 2;
+
+		/* linearise the existing ring contents into the new buffer */
+		out_buf = talloc_array(client, char, size);
+		if (!out_buf)
+			return -1;
+
+		n = min(client->out_len, client->out_size - client->out_head);
+		if (client->out_len) {
+			memcpy(out_buf, client->out_buf + client->out_head, n);
+			memcpy(out_buf + n, client->out_buf,
+					client->out_len - n);
+		}
+
+		talloc_free(client->out_buf);
+		client->out_buf = out_buf;
+		client->out_size = size;
+		client->out_head = 0;
+	}
+
+	tail = (client->out_head + client->out_len) % client->out_size;
+	n = min(len, client->out_size - tail);
+	memcpy(client->out_buf + tail, buf, n);
+	memcpy(client->out_buf, buf + n, len - n);
+	client->out_len += len;
+
+	return 0;
+}
+
+static int client_queue_flush(struct client *client)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	unsigned int n;
+	ssize_t rc;
+
+	while (client->out_len) {
+		n = min(client->out_len, client->out_size - client->out_head);
+
+		iov[0].iov_base = client->out_buf + client->out_head;
+		iov[0].iov_len = n;
+		iov[1].iov_base = client->out_buf;
+		iov[1].iov_len = client->out_len - n;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+		rc = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (send_would_block(errno))
+				return 0;
+			pb_log_fn("failed: %m\n");
+			return -1;
+		}
+
+		client->out_head = (client->out_head + rc) % client->out_size;
+		client->out_len -= rc;
+	}
+
+	client->out_head = 0;
+	return 0;
+}
+
+/* A message always fits in an empty queue, however large it is */
+static bool client_queue_has_room(struct client *client, unsigned int len)
+{
+	return !client->out_len ||
+		client->out_len + len <= client->server->client_queue_limit;
+}
+
+static int client_send_message(struct discover_server *server,
+		struct client *client, struct pb_protocol_message *message);
+
+static int client_flush(void *arg)
+{
+	struct client *client = arg;
+	struct pending_message *pending;
+	unsigned int i;
+	int rc;
+
+	if (client_queue_flush(client)) {
+		client_disconnect(client);
+		goto out_done;
+	}
+
+	/* queue the latest coalesced messages once we have room */
+	for (i = 0; i < COALESCE_MAX; i++) {
+		pending = &client->pending[i];
+
+		if (!pending->message)
+			continue;
+
+		rc = client_send_message(client->server, client,
+				pending->message);
+		if (rc == 1)
+			continue;
+
+		/* on error, client_disconnect has already freed it */
+		talloc_free(pending->message);
+		pending->message = NULL;
+
+		if (rc)
+			goto out_done;
+	}
+
+	if (client->out_len)
+		return 0;
+
+	for (i = 0; i < COALESCE_MAX; i++)
+		if (client->pending[i].message)
+			return 0;
+
+out_done:
+	client->out_waiter = NULL;
+	return 1;
+}
+
+static int coalesce_slot(enum pb_protocol_action action)
+{
+	switch (action) {
+	case PB_PROTOCOL_ACTION_STATUS:
+		return COALESCE_STATUS;
+	case PB_PROTOCOL_ACTION_SYSTEM_INFO:
+		return COALESCE_SYSTEM_INFO;
+	case PB_PROTOCOL_ACTION_CONFIG:
+		return COALESCE_CONFIG;
+	default:
+		return -1;
+	}
+}
+
+/* Hold message as the pending message for its slot, replacing any older
+ * one. Takes ownership of message. */
+static void client_coalesce_message(struct client *client, int slot,
+		struct pb_protocol_message *message)
+{
+	struct pending_message *pending = &client->pending[slot];
+
+	if (pending->message) {
+		talloc_free(pending->message);
+		client->n_coalesced++;
+	}
+
+	pending->message = message;
+}
+
+/* Send buf to the client, queueing whatever the socket doesn't accept,
+ * regardless of the queue limit. Returns 0 on success, or -1 on error, in
+ * which case the client has been disconnected. */
+static int client_send_data(struct discover_server *server,
+		struct client *client, const char *buf, unsigned int len)
+{
+	unsigned int sent = 0;
+	ssize_t rc;
+
+	/* nothing queued: try sending straight away */
+	if (!client->out_len) {
+		rc = send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0 && !send_would_block(errno)) {
+			pb_log_fn("failed: %m\n");
+			client_disconnect(client);
+			return -1;
+		}
+		if (rc > 0)
+			sent = rc;
+		if (sent == len)
+			return 0;
+	}
+
+	if (client_queue_append(client, buf + sent, len - sent)) {
+		client_disconnect(client);
+		return -1;
+	}
+
+	if (client->out_waiter)
+		return 0;
+
+	client->out_waiter = waiter_register_io(server->waitset, client->fd,
+			WAIT_OUT, client_flush, client);
+	if (!client->out_waiter) {
+		pb_log_fn("can't wait for output on client %d\n", client->fd);
+		client_disconnect(client);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Send buf to the client, queueing whatever the socket doesn't accept.
+ * Returns 0 on success, -1 on error (in which case the client has been
+ * disconnected), or 1 if buf doesn't fit in the client's output queue, in
+ * which case nothing has been sent.
+ *
+ * Data that we have started sending has to be queued in full to keep the
+ * stream framing intact, so the queue limit is only checked up front. */
+static int client_send(struct discover_server *server, struct client *client,
+		const char *buf, unsigned int len)
+{
+	if (!client_queue_has_room(client, len))
+		return 1;
+
+	return client_send_data(server, client, buf, len);
+}
+
+/* Send a message, in host format, to the client, as fragments if it is too
+ * large for a single message. Return values are as for client_send; the
+ * message is only converted to wire format once it has been sent or
+ * queued. The caller must check that the client can receive fragments. */
+static int client_send_message(struct discover_server *server,
+		struct client *client, struct pb_protocol_message *message)
+{
+	char hdr[PB_PROTOCOL_FRAGMENT_HEADER_SIZE];
+	unsigned int len, offset;
+
+	len = pb_protocol_wire_len(message);
+	if (!client_queue_has_room(client, len))
+		return 1;
+
+	if (!pb_protocol_needs_fragments(message)) {
+		pb_protocol_finalise_message(message);
+		return client_send_data(server, client, (char *)message, len);
+	}
+
+	/* send each fragment straight from the message payload, rather than
+	 * building a fragmented copy of the whole message */
+	for (offset = 0; offset < message->payload_len; offset += len) {
+		len = pb_protocol_fragment_header(message, offset, hdr);
+
+		if (client_send_data(server, client, hdr, sizeof(hdr)))
+			return -1;
+		if (client_send_data(server, client,
+					message->payload + offset, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/* Apply the slow client policy to data that doesn't fit in the output
+ * queue, and can't be coalesced */
+static int client_queue_full(struct discover_server *server,
+		struct client *client)
+{
+	switch (server->slow_client_policy) {
+	case SLOW_CLIENT_DROP:
+		client->n_dropped++;
+		pb_debug("client %p: output queue full, dropping message\n",
+				client);
+		return 0;
+	case SLOW_CLIENT_COALESCE:
+		/* messages that reach here can't be dropped without the
+		 * client's view of our state going stale */
+	case SLOW_CLIENT_DISCONNECT:
+	default:
+		pb_log("client %p: output queue full, disconnecting\n",
+				client);
+		client_disconnect(client);
+		return -1;
+	}
+}
+
+static int client_write_message(struct discover_server *server,
 		struct client *client, struct pb_protocol_message *message)
+{
+	int slot, rc;
+
+	if (client->remote_closed) {
+		talloc_free(message);
+		return -1;
+	}
+
+	slot = coalesce_slot(message->action);
+
+	if (pb_protocol_needs_fragments(message) &&
+			!(client->caps & PB_PROTOCOL_CAP_FRAGMENTS)) {
+		pb_log("client %p: can't send %u-byte message (action %d) "
+				"without fragment support\n", client,
+				message->payload_len, message->action);
+		if (slot >= 0)
+			client->withheld |= 1 << slot;
+		talloc_free(message);
+		return -1;
+	}
+
+	/* a newer message replaces one already waiting to be coalesced, so
+	 * that the client never sees the older state last */
+	if (slot >= 0 && client->pending[slot].message) {
+		client_coalesce_message(client, slot, message);
+		return 0;
+	}
+
+	rc = client_send_message(server, client, message);
+
+	if (rc == 1 && slot >= 0 &&
+			server->slow_client_policy == SLOW_CLIENT_COALESCE) {
+		client_coalesce_message(client, slot, message);
+		return 0;
+	}
+
+	talloc_free(message);
+
+	if (rc == 1)
+		rc = client_queue_full(server, client);
+
+	return rc;
+}
+
+static int client_write_batch(struct discover_server *server,
+		struct client *client, struct pb_protocol_batch *batch)
 {
 	int rc;
 
 	if (client->remote_closed)
 		return -1;
 
-	rc = pb_protocol_write_message(client->fd, message);
-	if (rc)
-		client->remote_closed = true;
+	rc = client_send(server, client, batch->buf, batch->len);
+	if (rc == 1)
+		rc = client_queue_full(server, client);
 
 	return rc;
 }
@@ -278,6 +685,148 @@ static int write_authenticate_message(struct discover_server *server,
 	return client_write_message(server, client, message);
 }
 
+static int batch_device_add(struct pb_protocol_batch *batch,
+		const struct device *dev)
+{
+	int len = pb_protocol_device_len(dev);
+	char *payload;
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_DEVICE_ADD, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_device(dev, payload, len);
+	return 0;
+}
+
+static int batch_boot_option_add(struct pb_protocol_batch *batch,
+		const struct boot_option *opt)
+{
+	int len = pb_protocol_boot_option_len(opt);
+	char *payload;
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_BOOT_OPTION_ADD, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_boot_option(opt, payload, len);
+	return 0;
+}
+
+static int batch_plugin_option_add(struct pb_protocol_batch *batch,
+		const struct plugin_option *opt)
+{
+	int len = pb_protocol_plugin_option_len(opt);
+	char *payload;
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_plugin_option(opt, payload, len);
+	return 0;
+}
+
+static int batch_boot_status(struct pb_protocol_batch *batch,
+		const struct status *status)
+{
+	int len = pb_protocol_boot_status_len(status);
+	char *payload;
+
+	payload = pb_protocol_batch_add(batch, PB_PROTOCOL_ACTION_STATUS, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_boot_status(status, payload, len);
+	return 0;
+}
+
+/* The client only tells us its capabilities in reply to ours, in the
+ * initial state, so a system info or config message too large to send
+ * unfragmented is withheld until it does. */
+static bool batch_withhold(struct client *client, int slot, int len)
+{
+	if (len <= PB_PROTOCOL_MAX_PAYLOAD_SIZE)
+		return false;
+
+	client->withheld |= 1 << slot;
+	return true;
+}
+
+static int batch_system_info(struct pb_protocol_batch *batch,
+		struct client *client, const struct system_info *sysinfo)
+{
+	int len = pb_protocol_system_info_len(sysinfo);
+	char *payload;
+
+	if (batch_withhold(client, COALESCE_SYSTEM_INFO, len))
+		return 0;
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_SYSTEM_INFO, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_system_info(sysinfo, payload, len);
+	return 0;
+}
+
+static int batch_config(struct pb_protocol_batch *batch,
+		struct client *client, const struct config *config)
+{
+	int len = pb_protocol_config_len(config);
+	char *payload;
+
+	if (batch_withhold(client, COALESCE_CONFIG, len))
+		return 0;
+
+	payload = pb_protocol_batch_add(batch, PB_PROTOCOL_ACTION_CONFIG, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_config(config, payload, len);
+	return 0;
+}
+
+static int batch_capabilities(struct pb_protocol_batch *batch)
+{
+	int len = pb_protocol_capabilities_len();
+	char *payload;
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_CAPABILITIES, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_capabilities(PB_PROTOCOL_CAPABILITIES,
+			payload, len);
+	return 0;
+}
+
+static int batch_authenticate(struct pb_protocol_batch *batch,
+		struct client *client)
+{
+	struct auth_message auth_msg;
+	char *payload;
+	int len;
+
+	auth_msg.op = AUTH_MSG_RESPONSE;
+	auth_msg.authenticated = client->can_modify;
+
+	len = pb_protocol_authenticate_len(&auth_msg);
+
+	payload = pb_protocol_batch_add(batch,
+			PB_PROTOCOL_ACTION_AUTHENTICATE, len);
+	if (!payload)
+		return -1;
+
+	pb_protocol_serialise_authenticate(&auth_msg, payload, len);
+	return 0;
+}
+
 static int client_auth_timeout(void *arg)
 {
 	struct client *client = arg;
@@ -393,23 +942,49 @@ static int discover_server_handle_auth_message(struct client *client,
 	return rc;
 }
 
-static int discover_server_process_message(void *arg)
+static void discover_server_handle_capabilities(struct client *client,
+		const struct pb_protocol_message *message)
+{
+	struct discover_server *server = client->server;
+	unsigned int withheld;
+
+	if (pb_protocol_deserialise_capabilities(&client->caps, message)) {
+		pb_log("Couldn't parse client's capabilities\n");
+		return;
+	}
+
+	pb_debug("client %p: capabilities 0x%x\n", client, client->caps);
+
+	/* send any state that was too large to include in the initial
+	 * messages, now that we know whether the client can receive it */
+	withheld = client->withheld;
+	client->withheld = 0;
+
+	if (withheld & (1 << COALESCE_SYSTEM_INFO))
+		write_system_info_message(server, client, system_info_get());
+
+	if (withheld & (1 << COALESCE_CONFIG))
+		write_config_message(server, client, config_get());
+}
+
+/* Decoded objects take their strings from the message payload, and the
+ * message is reparented under the object that uses it */
+static void discover_server_handle_message(struct client *client,
+		struct pb_protocol_message *message)
 {
 	struct autoboot_option *autoboot_opt;
-	struct pb_protocol_message *message;
 	struct boot_command *boot_command;
 	struct auth_message *auth_msg;
 	struct status *status;
-	struct client *client = arg;
 	struct config *config;
 	char *url;
-	int rc = 0;
-
-	message = pb_protocol_read_message(client, client->fd);
+	int rc;
 
-	if (!message) {
-		talloc_free(client);
-		return 0;
+	/* any client may tell us its capabilities */
+	if (message->action == PB_PROTOCOL_ACTION_CAPABILITIES) {
+		discover_server_handle_capabilities(client, message);
+		talloc_free(message);
+		return;
 	}
 
 	/*
@@ -421,11 +996,11 @@ static int discover_server_process_message(void *arg)
 		case PB_PROTOCOL_ACTION_BOOT:
 			boot_command = talloc(client, struct boot_command);
 
-			rc = pb_protocol_deserialise_boot_command(boot_command,
-					message);
+			rc = pb_protocol_decode_message(boot_command,
+					message, PB_PROTOCOL_DECODE_VIEW);
 			if (rc) {
 				pb_log("%s: no boot command?", __func__);
-				return 0;
+				return;
 			}
 
 			device_handler_boot(client->server->device_handler,
@@ -436,15 +1011,14 @@ static int discover_server_process_message(void *arg)
 			break;
 		case PB_PROTOCOL_ACTION_AUTHENTICATE:
 			auth_msg = talloc(client, struct auth_message);
-			rc = pb_protocol_deserialise_authenticate(
-					auth_msg, message);
+			rc = pb_protocol_decode_message(auth_msg, message,
+					PB_PROTOCOL_DECODE_VIEW);
 			if (rc) {
 				pb_log("Couldn't parse client's auth request\n");
 				break;
 			}
 
-			rc = discover_server_handle_auth_message(client,
-					auth_msg);
+			discover_server_handle_auth_message(client, auth_msg);
 			talloc_free(auth_msg);
 			break;
 		default:
@@ -460,18 +1034,18 @@ static int discover_server_process_message(void *arg)
 				talloc_free(status);
 			}
 		}
-		return rc;
+		return;
 	}
 
 	switch (message->action) {
 	case PB_PROTOCOL_ACTION_BOOT:
 		boot_command = talloc(client, struct boot_command);
 
-		rc = pb_protocol_deserialise_boot_command(boot_command,
-				message);
+		rc = pb_protocol_decode_message(boot_command, message,
+				PB_PROTOCOL_DECODE_VIEW);
 		if (rc) {
 			pb_log_fn("no boot command?\n");
-			return 0;
+			return;
 		}
 
 		device_handler_boot(client->server->device_handler,
@@ -489,10 +1063,11 @@ static int discover_server_process_message(void *arg)
 	case PB_PROTOCOL_ACTION_CONFIG:
 		config = talloc_zero(client, struct config);
 
-		rc = pb_protocol_deserialise_config(config, message);
+		rc = pb_protocol_decode_message(config, message,
+				PB_PROTOCOL_DECODE_VIEW);
 		if (rc) {
 			pb_log_fn("no config?\n");
-			return 0;
+			return;
 		}
 
 		device_handler_update_config(client->server->device_handler,
@@ -515,11 +1090,11 @@ static int discover_server_process_message(void *arg)
 
 	case PB_PROTOCOL_ACTION_TEMP_AUTOBOOT:
 		autoboot_opt = talloc_zero(client, struct autoboot_option);
-		rc = pb_protocol_deserialise_temp_autoboot(autoboot_opt,
-				message);
+		rc = pb_protocol_decode_message(autoboot_opt, message,
+				PB_PROTOCOL_DECODE_VIEW);
 		if (rc) {
 			pb_log("can't parse temporary autoboot message\n");
-			return 0;
+			return;
 		}
 
 		device_handler_apply_temp_autoboot(
@@ -530,8 +1105,8 @@ static int discover_server_process_message(void *arg)
 	/* For AUTH_MSG_SET */
 	case PB_PROTOCOL_ACTION_AUTHENTICATE:
 		auth_msg = talloc(client, struct auth_message);
-		rc = pb_protocol_deserialise_authenticate(
-				auth_msg, message);
+		rc = pb_protocol_decode_message(auth_msg, message,
+				PB_PROTOCOL_DECODE_VIEW);
 		if (rc) {
 			pb_log("Couldn't parse client's auth request\n");
 			break;
@@ -542,13 +1117,42 @@ static int discover_server_process_message(void *arg)
 		break;
 	default:
 		pb_log_fn("invalid action %d\n", message->action);
+	}
+}
+
+/* Read whatever the client has sent, without blocking on the rest of a
+ * partial or fragmented message; the reader keeps that until it arrives */
+static int discover_server_process_message(void *arg)
+{
+	const struct pb_protocol_message *message;
+	struct pb_protocol_message *copy;
+	struct client *client = arg;
+
+	if (pb_protocol_reader_fill(client->reader)) {
+		talloc_free(client);
 		return 0;
 	}
 
+	while ((message = pb_protocol_reader_next(client->reader))) {
+		/* the reader reuses its buffer, so decode from a copy */
+		copy = talloc_memdup(client, message,
+				sizeof(*message) + message->payload_len);
+		if (!copy)
+			break;
+		discover_server_handle_message(client, copy);
+	}
 
 	return 0;
 }
 
+void discover_server_set_client_queue(struct discover_server *server,
+		unsigned int limit, enum slow_client_policy policy)
+{
+	if (limit)
+		server->client_queue_limit = limit;
+	server->slow_client_policy = policy;
+}
+
 void discover_server_set_auth_mode(struct discover_server *server,
 		bool restrict_clients)
 {
@@ -565,8 +1169,9 @@ void discover_server_set_auth_mode(struct discover_server *server,
 static int discover_server_process_connection(void *arg)
 {
 	struct discover_server *server = arg;
-	struct statuslog_entry *entry;
+	struct status_backlog *backlog = &server->status;
 	int fd, rc, i, n_devices, n_plugins;
+	struct pb_protocol_batch *batch;
 	struct client *client;
 	struct ucred ucred;
 	socklen_t len;
@@ -586,6 +1191,13 @@ static int discover_server_process_connection(void *arg)
 
 	client->fd = fd;
 	client->server = server;
+
+	client->reader = pb_protocol_reader_create(client, client->fd);
+	if (!client->reader) {
+		talloc_free(client);
+		return 0;
+	}
+
 	client->waiter = waiter_register_io(server->waitset, client->fd,
 				WAIT_IN, discover_server_process_message,
 				client);
@@ -609,53 +1221,73 @@ static int discover_server_process_connection(void *arg)
 	} else
 		client->can_modify = true;
 
-	/* send auth status to client */
-	rc = write_authenticate_message(server, client);
-	if (rc)
-		return 0;
-
-	/* send sysinfo to client */
-	rc = write_system_info_message(server, client, system_info_get());
-	if (rc)
+	/* Send our current state to the client. This is built up as a
+	 * single buffer of messages, so we only need one write. */
+	batch = pb_protocol_batch_create(client);
+	if (!batch)
 		return 0;
 
-	/* send config to client */
-	rc = write_config_message(server, client, config_get());
+	/* our capabilities, auth status, sysinfo and config */
+	rc = batch_capabilities(batch);
+	rc = rc ?: batch_authenticate(batch, client);
+	rc = rc ?: batch_system_info(batch, client, system_info_get());
+	rc = rc ?: batch_config(batch, client, config_get());
 	if (rc)
-		return 0;
+		goto out;
 
-	/* send existing devices to client */
+	/* existing devices */
 	n_devices = device_handler_get_device_count(server->device_handler);
 	for (i = 0; i < n_devices; i++) {
 		const struct discover_boot_option *opt;
 		const struct discover_device *device;
 
 		device = device_handler_get_device(server->device_handler, i);
-		rc = write_device_add_message(server, client, device->device);
+		rc = batch_device_add(batch, device->device);
 		if (rc)
-			return 0;
+			goto out;
 
 		list_for_each_entry(&device->boot_options, opt, list) {
-			rc = write_boot_option_add_message(server, client,
-					opt->option);
+			rc = batch_boot_option_add(batch, opt->option);
 			if (rc)
-				return 0;
+				goto out;
 		}
 	}
 
-	/* send status backlog to client */
-	list_for_each_entry(&server->status, entry, list)
-		write_boot_status_message(server, client, entry->status);
+	/* status backlog, noting any entries that we've discarded */
+	pb_debug("status backlog: %u entries, %u dropped, %u coalesced\n",
+			backlog->len, backlog->n_dropped,
+			backlog->n_coalesced);
+
+	if (backlog->n_dropped) {
+		struct status dropped;
+
+		dropped.type = STATUS_INFO;
+		dropped.backlog = true;
+		dropped.boot_active = false;
+		dropped.message = talloc_asprintf(batch,
+				_("(%u earlier status messages not shown)"),
+				backlog->n_dropped);
+		batch_boot_status(batch, &dropped);
+	}
+
+	for (i = 0; i < (int)backlog->len; i++) {
+		unsigned int idx = (backlog->head + i) % backlog->size;
+		batch_boot_status(batch, backlog->entries[idx].status);
+	}
 
-	/* send installed plugins to client */
+	/* installed plugins */
 	n_plugins = device_handler_get_plugin_count(server->device_handler);
 	for (i = 0; i < n_plugins; i++) {
 		const struct plugin_option *plugin;
 
 		plugin = device_handler_get_plugin(server->device_handler, i);
-		write_plugin_option_add_message(server, client, plugin);
+		batch_plugin_option_add(batch, plugin);
 	}
 
+out:
+	client_write_batch(server, client, batch);
+	talloc_free(batch);
+
 	return 0;
 }
 
@@ -688,33 +1320,132 @@ void discover_server_notify_device_remove(struct discover_server *server,
 
 }
 
-void discover_server_notify_boot_status(struct discover_server *server,
-		struct status *status)
+static struct status_backlog_entry *status_backlog_entry(
+		struct status_backlog *backlog, unsigned int i)
 {
-	struct statuslog_entry *entry;
-	struct client *client;
+	return &backlog->entries[(backlog->head + i) % backlog->size];
+}
+
+/* Remove the most recent entry from source, if it is recent enough */
+static void status_backlog_coalesce(struct status_backlog *backlog,
+		const char *source)
+{
+	struct status_backlog_entry *entry = NULL;
+	unsigned int i, n;
 
-	/* Duplicate the status struct to add to the backlog */
-	entry = talloc(server, struct statuslog_entry);
-	if (!entry) {
+	n = min(backlog->len, (unsigned int)STATUS_COALESCE_WINDOW);
+
+	/* search back from the newest entry */
+	for (i = backlog->len; i > backlog->len - n; i--) {
+		entry = status_backlog_entry(backlog, i - 1);
+		if (entry->source && !strcmp(entry->source, source))
+			break;
+		entry = NULL;
+	}
+
+	if (!entry)
+		return;
+
+	talloc_free(entry->status);
+	backlog->n_coalesced++;
+
+	/* move the newer entries down over the removed one */
+	for (; i < backlog->len; i++)
+		*status_backlog_entry(backlog, i - 1) =
+			*status_backlog_entry(backlog, i);
+
+	backlog->len--;
+}
+
+static void status_backlog_add(struct discover_server *server,
+		struct status *status, const char *source)
+{
+	struct status_backlog *backlog = &server->status;
+	struct status_backlog_entry *entry;
+	struct status *copy;
+
+	if (source)
+		status_backlog_coalesce(backlog, source);
+
+	/* drop the oldest entry if we're full */
+	if (backlog->len == backlog->size) {
+		talloc_free(backlog->entries[backlog->head].status);
+		backlog->head = (backlog->head + 1) % backlog->size;
+		backlog->len--;
+		if (!backlog->n_dropped++)
+			pb_debug("status backlog full, dropping old entries\n");
+	}
+
+	copy = talloc(backlog->entries, struct status);
+	if (!copy) {
 		pb_log("Failed to allocated saved status!\n");
-	} else {
-		entry->status = talloc(entry, struct status);
-		if (entry->status) {
-			entry->status->type = status->type;
-			entry->status->message = talloc_strdup(entry->status,
-							       status->message);
-			entry->status->backlog = true;
-			list_add_tail(&server->status, &entry->list);
-		} else {
-			talloc_free(entry);
-		}
+		return;
 	}
 
+	copy->type = status->type;
+	copy->message = talloc_strdup(copy, status->message);
+	copy->backlog = true;
+	copy->boot_active = false;
+
+	entry = status_backlog_entry(backlog, backlog->len++);
+	entry->status = copy;
+	entry->source = source;
+}
+
+static void notify_boot_status(struct discover_server *server,
+		struct status *status, const char *source)
+{
+	struct client *client;
+
+	if (server->status.size)
+		status_backlog_add(server, status, source);
+
 	list_for_each_entry(&server->clients, client, list)
 		write_boot_status_message(server, client, status);
 }
 
+void discover_server_notify_boot_status(struct discover_server *server,
+		struct status *status)
+{
+	notify_boot_status(server, status, NULL);
+}
+
+void discover_server_notify_boot_progress(struct discover_server *server,
+		struct status *status, const char *source)
+{
+	notify_boot_status(server, status, source);
+}
+
+int discover_server_set_status_backlog(struct discover_server *server,
+		unsigned int size)
+{
+	struct status_backlog *backlog = &server->status;
+	struct status_backlog_entry *entries;
+	unsigned int i, n;
+
+	entries = talloc_zero_array(server, struct status_backlog_entry,
+			size ?: 1);
+	if (!entries)
+		return -1;
+
+	/* keep the most recent entries that fit */
+	n = min(backlog->len, size);
+	for (i = 0; i < n; i++) {
+		entries[i] = *status_backlog_entry(backlog,
+				backlog->len - n + i);
+		talloc_steal(entries, entries[i].status);
+	}
+
+	backlog->n_dropped += backlog->len - n;
+	talloc_free(backlog->entries);
+	backlog->entries = entries;
+	backlog->size = size;
+	backlog->head = 0;
+	backlog->len = n;
+
+	return 0;
+}
+
 void discover_server_notify_system_info(struct discover_server *server,
 		const struct system_info *sysinfo)
 {
@@ -768,8 +1499,14 @@ struct discover_server *discover_server_init(struct waitset *waitset)
 
 	server->waiter = NULL;
 	server->waitset = waitset;
+	server->restrict_clients = false;
+	server->client_queue_limit = DEFAULT_CLIENT_QUEUE_LIMIT;
+	server->slow_client_policy = SLOW_CLIENT_COALESCE;
 	list_init(&server->clients);
-	list_init(&server->status);
+	memset(&server->status, 0, sizeof(server->status));
+	if (discover_server_set_status_backlog(server,
+				DEFAULT_STATUS_BACKLOG_SIZE))
+		goto out_err;
 
 	unlink(PB_SOCKET_PATH);
 
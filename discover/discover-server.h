@@ -13,6 +13,17 @@ struct system_info;
 struct device;
 struct config;
 
+/* What to do with messages for a client whose output queue is full */
+enum slow_client_policy {
+	/* discard new messages */
+	SLOW_CLIENT_DROP,
+	/* keep only the latest status, sysinfo and config messages, and
+	 * disconnect if any other message doesn't fit */
+	SLOW_CLIENT_COALESCE,
+	/* disconnect the client */
+	SLOW_CLIENT_DISCONNECT,
+};
+
 struct discover_server *discover_server_init(struct waitset *waitset);
 
 void discover_server_destroy(struct discover_server *server);
@@ -23,6 +34,11 @@ void discover_server_set_device_source(struct discover_server *server,
 void discover_server_set_auth_mode(struct discover_server *server,
 		bool restrict_clients);
 
+/* Limit the amount of output queued for each client (zero keeps the
+ * default limit), and set what happens to clients that exceed it. */
+void discover_server_set_client_queue(struct discover_server *server,
+		unsigned int limit, enum slow_client_policy policy);
+
 void discover_server_notify_device_add(struct discover_server *server,
 		struct device *device);
 void discover_server_notify_boot_option_add(struct discover_server *server,
@@ -31,6 +47,17 @@ void discover_server_notify_device_remove(struct discover_server *server,
 		struct device *device);
 void discover_server_notify_boot_status(struct discover_server *server,
 		struct status *status);
+
+/* Notify clients of a progress update. Only the most recent status from
+ * each source (a static string) is kept in the backlog sent to newly
+ * connected clients. */
+void discover_server_notify_boot_progress(struct discover_server *server,
+		struct status *status, const char *source);
+
+/* Set the maximum number of status messages kept for new clients; older
+ * messages are discarded. A size of zero disables the backlog. */
+int discover_server_set_status_backlog(struct discover_server *server,
+		unsigned int size);
 void discover_server_notify_system_info(struct discover_server *server,
 		const struct system_info *sysinfo);
 void discover_server_notify_config(struct discover_server *server,
@@ -0,0 +1,156 @@
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <file/file.h>
+#include <list/list.h>
+#include <talloc/talloc.h>
+
+#include "device-handler.h"
+#include "file-cache.h"
+
+struct file_cache_entry {
+	struct list_item	list;
+	char			*path;
+
+	bool			have_data;
+	int			read_rc;
+	char			*buf;
+	int			len;
+
+	bool			have_stat;
+	int			stat_rc;
+	struct stat		statbuf;
+};
+
+struct parser_file_cache {
+	struct list		entries;
+	unsigned int		hits;
+	unsigned int		misses;
+};
+
+static struct parser_file_cache *file_cache_get(struct discover_context *ctx)
+{
+	struct parser_file_cache *cache = ctx->file_cache;
+
+	if (!cache) {
+		cache = talloc_zero(ctx, struct parser_file_cache);
+		list_init(&cache->entries);
+		ctx->file_cache = cache;
+	}
+
+	return cache;
+}
+
+static struct file_cache_entry *file_cache_find(
+		struct parser_file_cache *cache, const char *path)
+{
+	struct file_cache_entry *entry;
+
+	list_for_each_entry(&cache->entries, entry, list)
+		if (!strcmp(entry->path, path))
+			return entry;
+
+	return NULL;
+}
+
+static struct file_cache_entry *file_cache_entry(
+		struct discover_context *ctx, const char *path)
+{
+	struct parser_file_cache *cache = file_cache_get(ctx);
+	struct file_cache_entry *entry;
+
+	entry = file_cache_find(cache, path);
+	if (entry)
+		return entry;
+
+	entry = talloc_zero(cache, struct file_cache_entry);
+	entry->path = talloc_strdup(entry, path);
+	list_add(&cache->entries, &entry->list);
+
+	return entry;
+}
+
+static void file_cache_count(struct discover_context *ctx, bool hit)
+{
+	if (hit)
+		ctx->file_cache->hits++;
+	else
+		ctx->file_cache->misses++;
+}
+
+int file_cache_read(struct discover_context *ctx, const char *path,
+		char **buf, int *len)
+{
+	struct file_cache_entry *entry;
+
+	entry = file_cache_entry(ctx, path);
+
+	/* a path we couldn't stat can't be read either */
+	if (!entry->have_data && entry->have_stat && entry->stat_rc) {
+		entry->have_data = true;
+		entry->read_rc = -1;
+		file_cache_count(ctx, true);
+	} else if (!entry->have_data) {
+		entry->read_rc = read_file(entry, entry->path,
+				&entry->buf, &entry->len);
+		entry->have_data = true;
+		file_cache_count(ctx, false);
+	} else {
+		file_cache_count(ctx, true);
+	}
+
+	if (entry->read_rc)
+		return entry->read_rc;
+
+	*buf = talloc_memdup(ctx, entry->buf, entry->len + 1);
+	*len = entry->len;
+
+	return 0;
+}
+
+int file_cache_stat(struct discover_context *ctx, const char *path,
+		struct stat *statbuf)
+{
+	struct file_cache_entry *entry;
+
+	entry = file_cache_entry(ctx, path);
+
+	if (!entry->have_stat) {
+		entry->stat_rc = stat(entry->path, &entry->statbuf) ? -1 : 0;
+		entry->have_stat = true;
+		file_cache_count(ctx, false);
+	} else {
+		file_cache_count(ctx, true);
+	}
+
+	if (entry->stat_rc)
+		return -1;
+
+	*statbuf = entry->statbuf;
+	return 0;
+}
+
+void file_cache_invalidate(struct discover_context *ctx, const char *path)
+{
+	struct file_cache_entry *entry;
+
+	if (!ctx->file_cache)
+		return;
+
+	entry = file_cache_find(ctx->file_cache, path);
+	if (!entry)
+		return;
+
+	list_remove(&entry->list);
+	talloc_free(entry);
+}
+
+void file_cache_get_stats(struct discover_context *ctx,
+		unsigned int *hits, unsigned int *misses)
+{
+	*hits = ctx->file_cache ? ctx->file_cache->hits : 0;
+	*misses = ctx->file_cache ? ctx->file_cache->misses : 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _FILE_CACHE_H
+#define _FILE_CACHE_H
+
+#include <sys/stat.h>
+
+struct discover_context;
+
+/*
+ * Parsers probe many of the same paths, so we keep the results of file
+ * reads and stats (including failures) for the lifetime of the discover
+ * context. Entries are keyed on the full local path.
+ */
+
+/* Read @path at most once per context. Callers get their own copy of the
+ * data, allocated against @ctx, as they may modify it */
+int file_cache_read(struct discover_context *ctx, const char *path,
+		char **buf, int *len);
+
+int file_cache_stat(struct discover_context *ctx, const char *path,
+		struct stat *statbuf);
+
+/* Drop anything we know about @path, once it has been written */
+void file_cache_invalidate(struct discover_context *ctx, const char *path);
+
+void file_cache_get_stats(struct discover_context *ctx,
+		unsigned int *hits, unsigned int *misses);
+
+#endif /* _FILE_CACHE_H */
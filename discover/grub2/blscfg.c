@@ -23,6 +23,11 @@ static const char *const bls_dirs[] = {
 	NULL
 };
 
+const char *const *blscfg_dirs(void)
+{
+	return bls_dirs;
+}
+
 struct bls_state {
 	struct discover_boot_option *opt;
 	struct grub2_script *script;
@@ -74,7 +74,7 @@ struct resource *create_grub2_resource(struct grub2_script *script,
 	if (!file || !file->path)
 		return NULL;
 
-	res = talloc(opt, struct resource);
+	res = talloc_zero(opt, struct resource);
 	root = script_env_get(script, "root");
 
 	if (!file->dev && root && strlen(root))
@@ -92,6 +92,10 @@ struct resource *create_grub2_resource(struct grub2_script *script,
 	} else {
 		res->resolved = false;
 		res->info = talloc_steal(opt, file);
+		/* see grub2_lookup_device() */
+		res->device_key = file->dev;
+		res->device_key_types = RESOURCE_DEVICE_ID |
+			RESOURCE_DEVICE_UUID;
 	}
 
 	return res;
@@ -195,6 +199,8 @@ static struct parser grub2_parser = {
 	.name			= "grub2",
 	.parse			= grub2_parse,
 	.resolve_resource	= resolve_grub2_resource,
+	.prefetch_files		= grub2_conf_files,
+	.prefetch_dirs		= blscfg_dirs,
 };
 
 register_parser(grub2_parser);
@@ -195,6 +195,9 @@ void script_register_function(struct grub2_script *script,
 
 void register_builtins(struct grub2_script *script);
 
+/* BLS entry directories searched by the blscfg builtin, NULL-terminated */
+const char *const *blscfg_dirs(void);
+
 /* resources */
 struct resource *create_grub2_resource(struct grub2_script *script,
 		struct discover_boot_option *opt, const char *path);
@@ -220,6 +220,7 @@ static struct parser kboot_parser = {
 	.name			= "kboot",
 	.parse			= kboot_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.prefetch_files		= kboot_conf_files,
 };
 
 register_parser(kboot_parser);
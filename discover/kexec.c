@@ -0,0 +1,160 @@
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/kexec.h>
+
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/job.h>
+
+#include "kexec.h"
+
+struct kexec_file {
+	int			kernel_fd;
+	int			initrd_fd;
+	char			*cmdline;
+	int			rc;
+	struct waiter_job	*job;
+
+	kexec_file_load_cb	cb;
+	void			*data;
+};
+
+/* cleared once the kernel tells us it has no kexec_file_load */
+static bool available = true;
+
+bool kexec_file_load_available(void)
+{
+#ifdef SYS_kexec_file_load
+	return available;
+#else
+	return false;
+#endif
+}
+
+#ifndef PETITBOOT_TEST
+static int kexec_file_syscall(int kernel_fd, int initrd_fd,
+		const char *cmdline, unsigned long flags)
+{
+#ifdef SYS_kexec_file_load
+	/* the length includes the terminating nul */
+	if (syscall(SYS_kexec_file_load, kernel_fd, initrd_fd,
+				cmdline ? strlen(cmdline) + 1 : 0, cmdline,
+				flags))
+		return -errno;
+
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+#else
+/* tests stand in for the kernel */
+int test_kexec_file_syscall(int kernel_fd, int initrd_fd,
+		const char *cmdline, unsigned long flags);
+#define kexec_file_syscall test_kexec_file_syscall
+#endif
+
+static int kexec_file_load(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+	unsigned long flags = 0;
+
+	if (initrd_fd < 0)
+		flags |= KEXEC_FILE_NO_INITRAMFS;
+
+	return kexec_file_syscall(kernel_fd, initrd_fd, cmdline, flags);
+}
+
+static void kexec_file_thread(void *arg)
+{
+	struct kexec_file *kf = arg;
+
+	kf->rc = kexec_file_load(kf->kernel_fd, kf->initrd_fd, kf->cmdline);
+}
+
+static void kexec_file_done(void *arg)
+{
+	struct kexec_file *kf = arg;
+
+	if (kf->rc == -ENOSYS) {
+		pb_log("kexec: kernel has no kexec_file_load support\n");
+		available = false;
+	}
+
+	/* this may free the load */
+	kf->cb(kf->data, kf->rc);
+}
+
+/* nobody wants this kernel now, so don't leave it for the next kexec -e to
+ * find */
+static void kexec_file_cancelled(void *arg)
+{
+	struct kexec_file *kf = arg;
+
+	if (kf->rc)
+		return;
+
+	pb_log("kexec: load was cancelled, unloading\n");
+	if (kexec_file_syscall(-1, -1, NULL, KEXEC_FILE_UNLOAD))
+		pb_log("kexec: unload failed\n");
+}
+
+static int kexec_file_destroy(void *arg)
+{
+	struct kexec_file *kf = arg;
+
+	if (waiter_job_destroy(kf->job))
+		return -1;
+
+	if (kf->kernel_fd >= 0)
+		close(kf->kernel_fd);
+	if (kf->initrd_fd >= 0)
+		close(kf->initrd_fd);
+
+	return 0;
+}
+
+struct kexec_file *kexec_file_load_start(void *ctx, struct waitset *set,
+		int kernel_fd, int initrd_fd, const char *cmdline,
+		kexec_file_load_cb cb, void *data)
+{
+	struct kexec_file *kf;
+
+	if (!kexec_file_load_available())
+		return NULL;
+
+	kf = talloc_zero(ctx, struct kexec_file);
+	kf->kernel_fd = kf->initrd_fd = -1;
+	kf->cb = cb;
+	kf->data = data;
+	talloc_set_destructor(kf, kexec_file_destroy);
+
+	/* the caller may close its fds before the worker gets to them */
+	kf->kernel_fd = fcntl(kernel_fd, F_DUPFD_CLOEXEC, 0);
+	if (initrd_fd >= 0)
+		kf->initrd_fd = fcntl(initrd_fd, F_DUPFD_CLOEXEC, 0);
+
+	if (kf->kernel_fd < 0 || (initrd_fd >= 0 && kf->initrd_fd < 0)) {
+		pb_log_fn("unable to duplicate fds: %m\n");
+		goto err;
+	}
+
+	kf->cmdline = talloc_strdup(kf, cmdline ?: "");
+
+	kf->job = waiter_job_start(set, kf, kexec_file_thread,
+			kexec_file_done, kexec_file_cancelled);
+	if (!kf->job)
+		goto err;
+
+	return kf;
+
+err:
+	talloc_free(kf);
+	return NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef _KEXEC_H
+#define _KEXEC_H
+
+#include <stdbool.h>
+
+struct waitset;
+struct kexec_file;
+
+/* Called with zero on success, or a negative errno */
+typedef void (*kexec_file_load_cb)(void *data, int rc);
+
+/*
+ * Load a kernel through the kexec_file_load syscall, on a worker thread. The
+ * fds are duplicated, so stay owned by the caller; @initrd_fd may be -1.
+ * Returns NULL if the load can't be started, otherwise @cb is always called,
+ * from @set. Freeing the returned load before then drops the callback, and
+ * unloads the kernel if the load still succeeds.
+ */
+struct kexec_file *kexec_file_load_start(void *ctx, struct waitset *set,
+		int kernel_fd, int initrd_fd, const char *cmdline,
+		kexec_file_load_cb cb, void *data);
+
+/* False once the running kernel has shown it doesn't have kexec_file_load.
+ * That won't change until we're running a different kernel, so neither the
+ * syscall nor kexec -s are worth trying again */
+bool kexec_file_load_available(void);
+
+#endif /* _KEXEC_H */
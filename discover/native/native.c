@@ -50,6 +50,7 @@ static struct parser native_parser = {
 	.name			= "native",
 	.parse			= native_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.prefetch_files		= native_conf_files,
 };
 
 register_parser(native_parser);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -8,6 +9,7 @@
 #include <linux/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <arpa/inet.h>
 #include <i18n/i18n.h>
 
 #include <log/log.h>
@@ -16,19 +18,28 @@
 #include <types/types.h>
 #include <talloc/talloc.h>
 #include <waiter/waiter.h>
-#include <process/process.h>
-#include <system/system.h>
+#include <rtnl/rtnl.h>
+#include <dhcp/dhcp.h>
+#include <dhcp/dhcp6.h>
 
 #include "network.h"
 #include "sysinfo.h"
 #include "platform.h"
 #include "device-handler.h"
+#include "user-event.h"
+#include "event.h"
 #include "paths.h"
 
 #define HWADDR_SIZE	6
-#define PIDFILE_BASE	(LOCAL_STATE_DIR "/petitboot/")
 #define INITIAL_BUFSIZE	4096
 
+/* datagrams received per recvmmsg() call, and the number of calls made
+ * before returning to the main loop */
+#define NETLINK_BATCH		16
+#define NETLINK_MAX_ROUNDS	16
+
+#define IFACE_HASH_SIZE	64
+
 #define for_each_nlmsg(buf, nlmsg, len) \
 	for (nlmsg = (struct nlmsghdr *)buf; \
 		NLMSG_OK(nlmsg, len) && nlmsg->nlmsg_type != NLMSG_DONE; \
@@ -40,6 +51,7 @@
 
 
 struct interface {
+	struct network	*network;
 	int	ifindex;
 	char	name[IFNAMSIZ];
 	uint8_t	hwaddr[HWADDR_SIZE];
@@ -52,16 +64,32 @@ struct interface {
 	} state;
 
 	struct list_item list;
-	struct process *udhcpc_process;
-	struct process *udhcpc6_process;
+	struct list_item ifindex_list;
+	struct list_item hwaddr_list;
+
+	/* link state from netlink, waiting for configure_interface() */
+	struct list_item pending_list;
+	bool pending;
+	bool pending_up;
+	bool pending_link;
+
+	struct dhcp_client *dhcp_client;
+	char *dhcp_address;
+	struct dhcp6_client *dhcp6_client;
+	char *dhcp6_address;
 	struct discover_device *dev;
 	bool ready;
 };
 
 struct network {
 	struct list		interfaces;
+	struct list		ifindex_hash[IFACE_HASH_SIZE];
+	struct list		hwaddr_hash[IFACE_HASH_SIZE];
+	struct list		pending;
 	struct device_handler	*handler;
+	struct waitset		*waitset;
 	struct waiter		*waiter;
+	struct rtnl		*rtnl;
 	int			netlink_sd;
 	void			*netlink_buf;
 	unsigned int		netlink_buf_size;
@@ -108,18 +136,47 @@ static const struct interface_config *find_config_by_hwaddr(
 	return NULL;
 }
 
+static unsigned int ifindex_hash(int ifindex)
+{
+	return (unsigned int)ifindex % IFACE_HASH_SIZE;
+}
+
+static unsigned int hwaddr_hash(const uint8_t *hwaddr)
+{
+	unsigned int i, hash = 2166136261u;
+
+	for (i = 0; i < HWADDR_SIZE; i++)
+		hash = (hash ^ hwaddr[i]) * 16777619u;
+
+	return hash % IFACE_HASH_SIZE;
+}
+
 static struct interface *find_interface_by_ifindex(struct network *network,
 		int ifindex)
 {
+	struct list *bucket = &network->ifindex_hash[ifindex_hash(ifindex)];
 	struct interface *interface;
 
-	list_for_each_entry(&network->interfaces, interface, list)
+	list_for_each_entry(bucket, interface, ifindex_list)
 		if (interface->ifindex == ifindex)
 			return interface;
 
 	return NULL;
 }
 
+static struct interface *find_interface_by_hwaddr(struct network *network,
+		const uint8_t *hwaddr)
+{
+	struct list *bucket = &network->hwaddr_hash[hwaddr_hash(hwaddr)];
+	struct interface *interface;
+
+	list_for_each_entry(bucket, interface, hwaddr_list)
+		if (!memcmp(interface->hwaddr, hwaddr, HWADDR_SIZE))
+			return interface;
+
+	return NULL;
+}
+
 static struct interface *find_interface_by_name(struct network *network,
 		const char *name)
 {
@@ -132,23 +189,24 @@ static struct interface *find_interface_by_name(struct network *network,
 	return NULL;
 }
 
+/* device uuids are the interface's MAC address, as from
+ * mac_bytes_to_string() */
 static struct interface *find_interface_by_uuid(struct network *network,
 		const char *uuid)
 {
-	struct interface *interface;
-	char *mac;
+	uint8_t hwaddr[HWADDR_SIZE];
+	int n;
 
-	list_for_each_entry(&network->interfaces, interface, list) {
-		mac = mac_bytes_to_string(interface, interface->hwaddr,
-					sizeof(interface->hwaddr));
-		if (!strcmp(mac, uuid)) {
-			talloc_free(mac);
-			return interface;
-		}
-		talloc_free(mac);
-	}
+	if (!uuid || strlen(uuid) != HWADDR_SIZE * 3 - 1)
+		return NULL;
 
-	return NULL;
+	if (sscanf(uuid, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n",
+			&hwaddr[0], &hwaddr[1], &hwaddr[2], &hwaddr[3],
+			&hwaddr[4], &hwaddr[5], &n) != HWADDR_SIZE ||
+			uuid[n] != '\0')
+		return NULL;
+
+	return find_interface_by_hwaddr(network, hwaddr);
 }
 
 uint8_t *find_mac_by_name(void *ctx, struct network *network,
@@ -188,7 +246,7 @@ static int network_init_netlink(struct network *network)
 
 	network->netlink_buf_size = INITIAL_BUFSIZE;
 	network->netlink_buf = talloc_array(network, char,
-				network->netlink_buf_size);
+				NETLINK_BATCH * network->netlink_buf_size);
 
 	return 0;
 }
@@ -230,12 +288,43 @@ static void create_interface_dev(struct network *network,
 	talloc_free(uuid);
 }
 
+static void add_interface(struct network *network,
+		struct interface *interface)
+{
+	list_add(&network->interfaces, &interface->list);
+	list_add(&network->ifindex_hash[ifindex_hash(interface->ifindex)],
+			&interface->ifindex_list);
+	list_add(&network->hwaddr_hash[hwaddr_hash(interface->hwaddr)],
+			&interface->hwaddr_list);
+}
+
+static void interface_set_hwaddr(struct network *network,
+		struct interface *interface, const uint8_t *hwaddr)
+{
+	/* any lease we hold belongs to the old address */
+	if (memcmp(interface->hwaddr, hwaddr, HWADDR_SIZE)) {
+		talloc_free(interface->dhcp_client);
+		interface->dhcp_client = NULL;
+		talloc_free(interface->dhcp6_client);
+		interface->dhcp6_client = NULL;
+	}
+
+	list_remove(&interface->hwaddr_list);
+	memcpy(interface->hwaddr, hwaddr, sizeof(interface->hwaddr));
+	list_add(&network->hwaddr_hash[hwaddr_hash(interface->hwaddr)],
+			&interface->hwaddr_list);
+}
+
 static void remove_interface(struct network *network,
 		struct interface *interface)
 {
 	if (interface->dev)
 		device_handler_remove(network->handler, interface->dev);
 	list_remove(&interface->list);
+	list_remove(&interface->ifindex_list);
+	list_remove(&interface->hwaddr_list);
+	if (interface->pending)
+		list_remove(&interface->pending_list);
 	talloc_free(interface);
 }
 
@@ -268,207 +357,581 @@ void network_unregister_device(struct network *network,
 	iface->dev = NULL;
 }
 
-static int interface_change(struct interface *interface, bool up)
+static void interface_stop_dhcp(struct interface *interface)
+{
+	if (interface->dhcp_client)
+		dhcp_client_stop(interface->dhcp_client);
+
+	if (interface->dhcp6_client)
+		dhcp6_client_stop(interface->dhcp6_client);
+}
+
+static int interface_flush_cb(int error, void *data)
+{
+	struct interface *interface = data;
+
+	if (error)
+		pb_log("failed to flush addresses from interface %s: %s\n",
+			interface->name, strerror(-error));
+
+	return 0;
+}
+
+/* Add the requests to bring an interface up or down to @batch, returning
+ * the link state change */
+static struct rtnl_request *interface_change_add(struct rtnl_batch *batch,
+		struct interface *interface, bool up)
+{
+	if (!up)
+		rtnl_batch_addr_flush(batch, interface_flush_cb,
+				interface->ifindex);
+
+	return rtnl_batch_link_set(batch, NULL, interface->ifindex, up);
+}
+
+static void interface_up_cb(void *data, struct rtnl_request *failed)
+{
+	struct interface *interface = data;
+
+	if (failed)
+		pb_log("failed to bring interface %s up: %s\n",
+				interface->name,
+				strerror(-rtnl_request_error(failed)));
+}
+
+static void interface_up(struct network *network, struct interface *interface)
+{
+	struct rtnl_batch *batch;
+
+	batch = rtnl_batch_create(interface, network->rtnl, interface_up_cb,
+			interface);
+	interface_change_add(batch, interface, true);
+	rtnl_batch_run(batch);
+}
+
+/* Called on shutdown, once the main loop has finished, so this waits for
+ * the kernel to apply the changes */
+static void interface_down_sync(struct network *network,
+		struct interface *interface)
 {
-	const char *statestr = up ? "up" : "down";
+	struct rtnl_batch *batch;
 	int rc;
 
-	if (!up && interface->udhcpc_process) {
-		/* we don't care about the callback from here */
-		interface->udhcpc_process->exit_cb = NULL;
-		interface->udhcpc_process->data = NULL;
-		process_stop_async(interface->udhcpc_process);
-		process_release(interface->udhcpc_process);
-	}
-	if (!up && interface->udhcpc6_process) {
-		/* we don't care about the callback from here */
-		interface->udhcpc6_process->exit_cb = NULL;
-		interface->udhcpc6_process->data = NULL;
-		process_stop_async(interface->udhcpc6_process);
-		process_release(interface->udhcpc6_process);
-	}
-
-	if (!up) {
-		rc = process_run_simple(interface, pb_system_apps.ip,
-				"address", "flush", "dev", interface->name,
-				NULL);
-		if (rc)
-			pb_log("failed to flush addresses from interface %s\n",
+	interface_stop_dhcp(interface);
+
+	batch = rtnl_batch_create(interface, network->rtnl, NULL, NULL);
+	interface_change_add(batch, interface, false);
+
+	rc = rtnl_batch_run_sync(batch);
+	if (rc)
+		pb_log("failed to bring interface %s down\n",
 				interface->name);
-	}
+}
+
+static void network_add_dns_servers(struct network *network,
+		const char **servers, unsigned int n_servers)
+{
+	unsigned int i;
+	int rc, len;
+	bool modified;
+	char *buf;
+
+	if (network->dry_run || !n_servers)
+		return;
+
+	rc = read_file(network, "/etc/resolv.conf", &buf, &len);
 
-	rc = process_run_simple(interface, pb_system_apps.ip,
-			"link", "set", interface->name, statestr, NULL);
 	if (rc) {
-		pb_log("failed to bring interface %s %s\n", interface->name,
-				statestr);
-		return -1;
+		buf = talloc_strdup(network, "");
+		len = 0;
 	}
-	return 0;
+
+	modified = false;
+
+	for (i = 0; i < n_servers; i++) {
+		int dns_conf_len;
+		char *dns_conf;
+
+		dns_conf = talloc_asprintf(network, "nameserver %s\n",
+				servers[i]);
+
+		if (strstr(buf, dns_conf)) {
+			talloc_free(dns_conf);
+			continue;
+		}
+
+		dns_conf_len = strlen(dns_conf);
+		buf = talloc_realloc(network, buf, char, len + dns_conf_len + 1);
+		memcpy(buf + len, dns_conf, dns_conf_len);
+		len += dns_conf_len;
+		buf[len] = '\0';
+		modified = true;
+
+		talloc_free(dns_conf);
+	}
+
+	if (modified) {
+		rc = replace_file("/etc/resolv.conf", buf, len);
+		if (rc)
+			pb_log("error replacing resolv.conf: %s\n",
+					strerror(errno));
+	}
+
+	talloc_free(buf);
+}
+
+static void network_init_dns(struct network *network)
+{
+	const struct config *config;
+
+	config = config_get();
+	if (!config)
+		return;
+
+	network_add_dns_servers(network, config->network.dns_servers,
+			config->network.n_dns_servers);
 }
 
-static int interface_up(struct interface *interface)
+struct dhcp_config {
+	struct network		*network;
+	struct interface	*interface;
+	struct event		*event;
+	struct event		*add_event;
+	char			*address;
+	struct rtnl_request	*address_request;
+	struct rtnl_request	*route_request;
+};
+
+static int dhcp_config_exists_cb(int error,
+		void *data __attribute__((unused)))
 {
-	return interface_change(interface, true);
+	/* we may be re-applying the same lease */
+	return error == -EEXIST ? 0 : error;
 }
 
-static int interface_down(struct interface *interface)
+static int dhcp_config_del_cb(int error,
+		void *data __attribute__((unused)))
 {
-	return interface_change(interface, false);
+	/* the old address may have gone with the link */
+	return error == -EADDRNOTAVAIL ? 0 : error;
 }
 
-static void udhcpc_process_exit(struct process *process)
+/* Remove the address from a previous lease, if it's no longer in use.
+ * @current is the interface's DHCPv4 or DHCPv6 address */
+static void dhcp_config_del_address(struct rtnl_batch *batch,
+		struct interface *interface, char **current,
+		const char *address)
 {
-	struct interface *interface = process->data;
+	if (!*current)
+		return;
 
-	if (process == interface->udhcpc_process) {
-		pb_debug("udhcpc client [pid %d] for interface %s exited, rc %d\n",
-				process->pid, interface->name, process->exit_status);
-		interface->udhcpc_process = NULL;
-	} else {
-		pb_debug("udhcpc6 client [pid %d] for interface %s exited, rc %d\n",
-				process->pid, interface->name, process->exit_status);
-		interface->udhcpc6_process = NULL;
-	}
+	if (!address || strcmp(address, *current))
+		rtnl_batch_addr_del(batch, dhcp_config_del_cb,
+				interface->ifindex, *current);
 
-	process_release(process);
+	talloc_free(*current);
+	*current = NULL;
 }
 
-static void configure_interface_dhcp(struct network *network,
-		struct interface *interface)
+static char *dhcp_addr_string(void *ctx, struct in_addr addr)
 {
-	const struct platform *platform;
-	char pidfile[256], idv4[10], idv6[10];
-	struct process *p_v4, *p_v6;
-	int rc;
-	const char *argv_ipv4[] = {
-		pb_system_apps.udhcpc,
-		"-R",
-		"-f",
-		"-O", "pxeconffile",
-		"-O", "pxepathprefix",
-		"-O", "reboottime",
-		"-p", pidfile,
-		"-i", interface->name,
-		"-x", idv4, /* [13,14] - dhcp client identifier */
-		NULL,
-	};
-
-	const char *argv_ipv6[] = {
-		pb_system_apps.udhcpc6,
-		"-R",
-		"-f",
-		"-O", "bootfile_url",
-		"-O", "bootfile_param",
-		"-O", "pxeconffile",
-		"-O", "pxepathprefix",
-		"-p", pidfile,
-		"-i", interface->name,
-		"-x", idv6, /* [15,16] - dhcp client identifier */
-		NULL,
-	};
+	char buf[INET_ADDRSTRLEN];
 
-	device_handler_status_dev_info(network->handler, interface->dev,
-			_("Configuring with DHCP"));
+	return talloc_strdup(ctx, inet_ntop(AF_INET, &addr, buf, sizeof(buf)));
+}
 
-	snprintf(pidfile, sizeof(pidfile), "%s/udhcpc-%s.pid",
-			PIDFILE_BASE, interface->name);
+static struct event *dhcp_lease_event(struct dhcp_config *dc,
+		enum event_action action, const struct dhcp_lease *lease)
+{
+	struct interface *interface = dc->interface;
+	struct event *event;
+
+	event = talloc_zero(dc, struct event);
+	event->type = EVENT_TYPE_USER;
+	event->action = action;
+	event->device = talloc_strdup(event, interface->name);
+
+	event_set_param(event, "mac", mac_bytes_to_string(event,
+				interface->hwaddr, sizeof(interface->hwaddr)));
+	event_set_param(event, "siaddr", dhcp_addr_string(event,
+				lease->siaddr));
+	if (lease->bootfile)
+		event_set_param(event, "bootfile", lease->bootfile);
+
+	return event;
+}
 
-	platform = platform_get();
-	if (platform && platform->dhcp_arch_id != 0xffff) {
-		snprintf(idv6, sizeof(idv6), "0x3d:%04x",
-				platform->dhcp_arch_id);
-		snprintf(idv4, sizeof(idv4), "0x5d:%04x",
-				platform->dhcp_arch_id);
-	} else {
-		argv_ipv4[13] = argv_ipv6[15] =  NULL;
+/* Build the events that pb-udhcpc would have sent for this lease: the
+ * dhcp event for the parsers, and an add event for any explicit boot file */
+static void dhcp_config_events(struct dhcp_config *dc,
+		const struct dhcp_lease *lease)
+{
+	struct event *event;
+
+	event = dhcp_lease_event(dc, EVENT_ACTION_DHCP, lease);
+	event_set_param(event, "ip", dhcp_addr_string(event, lease->address));
+	event_set_param(event, "serverid", dhcp_addr_string(event,
+				lease->server_id));
+	if (lease->tftp_server)
+		event_set_param(event, "tftp", lease->tftp_server);
+	if (lease->pxeconffile)
+		event_set_param(event, "pxeconffile", lease->pxeconffile);
+	if (lease->pxepathprefix)
+		event_set_param(event, "pxepathprefix", lease->pxepathprefix);
+	if (lease->have_reboottime)
+		event_set_param(event, "reboottime", talloc_asprintf(event,
+					"%u", lease->reboottime));
+	dc->event = event;
+
+	if (!lease->bootfile)
+		return;
+
+	event = dhcp_lease_event(dc, EVENT_ACTION_ADD, lease);
+	event_set_param(event, "name", talloc_asprintf(event,
+				"netboot %s (%s)", dc->interface->name,
+				lease->bootfile));
+	if (lease->rootpath)
+		event_set_param(event, "rootpath", lease->rootpath);
+	dc->add_event = event;
+}
+
+static void dhcp_config_cb(void *data, struct rtnl_request *failed)
+{
+	struct dhcp_config *dc = data;
+	struct interface *interface = dc->interface;
+	struct network *network = dc->network;
+	struct discover_device *dev;
+
+	if (failed && failed == dc->route_request) {
+		pb_log("failed to add default route on interface %s: %s\n",
+				interface->name,
+				strerror(-rtnl_request_error(failed)));
+	} else if (failed) {
+		pb_log("failed to add address %s to interface %s: %s\n",
+				dc->address, interface->name,
+				strerror(-rtnl_request_error(failed)));
+		goto out;
 	}
 
-	p_v4 = process_create(interface);
-	p_v4->path = pb_system_apps.udhcpc;
-	p_v4->argv = argv_ipv4;
-	p_v4->exit_cb = udhcpc_process_exit;
-	p_v4->data = interface;
+	system_info_set_interface_address(sizeof(interface->hwaddr),
+			interface->hwaddr, dc->address);
 
-	pb_log("Running DHCPv4 client\n");
-	rc = process_run_async(p_v4);
-	if (rc)
-		process_release(p_v4);
-	else
-		interface->udhcpc_process = p_v4;
+	dev = discover_device_create(network->handler,
+			event_get_param(dc->event, "mac"), interface->name);
 
-	pb_log("Running DHCPv6 client\n");
-	p_v6 = process_create(interface);
-	p_v6->path = pb_system_apps.udhcpc6;
-	p_v6->argv = argv_ipv6;
-	p_v6->exit_cb = udhcpc_process_exit;
-	p_v6->data = interface;
+	device_handler_dhcp(network->handler, dev, dc->event);
+	talloc_free(dc->event);
 
-	rc = process_run_async(p_v6);
-	if (rc)
-		process_release(p_v6);
-	else
-		interface->udhcpc6_process = p_v6;
+	if (dc->add_event) {
+		user_event_add_option(network->handler, dc->add_event);
+		talloc_free(dc->add_event);
+	}
 
-	return;
+out:
+	talloc_free(dc);
 }
 
-static void configure_interface_static(struct network *network,
-		struct interface *interface,
-		const struct interface_config *config)
+static void dhcp_lease_bound(struct network *network,
+		struct interface *interface, const struct dhcp_lease *lease)
+{
+	const char **dns_servers;
+	struct rtnl_batch *batch;
+	struct dhcp_config *dc;
+	unsigned int i;
+
+	pb_log("network: DHCP lease on %s, address %s/%u\n", interface->name,
+			inet_ntoa(lease->address), lease->prefixlen);
+
+	dc = talloc_zero(interface, struct dhcp_config);
+	dc->network = network;
+	dc->interface = interface;
+	dc->address = talloc_asprintf(dc, "%s/%u",
+			inet_ntoa(lease->address), lease->prefixlen);
+
+	dhcp_config_events(dc, lease);
+
+	batch = rtnl_batch_create(dc, network->rtnl, dhcp_config_cb, dc);
+	dhcp_config_del_address(batch, interface, &interface->dhcp_address,
+			dc->address);
+	interface->dhcp_address = talloc_strdup(interface, dc->address);
+
+	dc->address_request = rtnl_batch_addr_add(batch, dhcp_config_exists_cb,
+			interface->ifindex, dc->address);
+	if (lease->have_router)
+		dc->route_request = rtnl_batch_route_add_default(batch,
+				dhcp_config_exists_cb, interface->ifindex,
+				inet_ntoa(lease->router));
+	rtnl_batch_run(batch);
+
+	dns_servers = talloc_array(dc, const char *, lease->n_dns_servers);
+	for (i = 0; i < lease->n_dns_servers; i++)
+		dns_servers[i] = dhcp_addr_string(dns_servers,
+				lease->dns_servers[i]);
+	network_add_dns_servers(network, dns_servers, lease->n_dns_servers);
+	talloc_free(dns_servers);
+}
+
+/* @address is the interface's DHCPv4 or DHCPv6 address */
+static void dhcp_lease_expired(struct network *network,
+		struct interface *interface, char **address)
+{
+	struct rtnl_batch *batch;
+	struct discover_device *dev;
+	char *mac;
+
+	pb_log("network: DHCP lease on %s lost\n", interface->name);
+
+	batch = rtnl_batch_create(interface, network->rtnl, NULL, NULL);
+	dhcp_config_del_address(batch, interface, address, NULL);
+	rtnl_batch_run(batch);
+
+	/* the boot options from this lease are no longer reachable */
+	mac = mac_bytes_to_string(interface, interface->hwaddr,
+			sizeof(interface->hwaddr));
+	dev = device_lookup_by_uuid(network->handler, mac);
+	if (dev)
+		device_handler_remove(network->handler, dev);
+	talloc_free(mac);
+}
+
+static void interface_dhcp_lease_cb(void *data, enum dhcp_event event,
+		const struct dhcp_lease *lease)
+{
+	struct interface *interface = data;
+	struct network *network = interface->network;
+
+	switch (event) {
+	case DHCP_EVENT_BOUND:
+		dhcp_lease_bound(network, interface, lease);
+		break;
+	case DHCP_EVENT_RENEWED:
+		pb_debug("network: DHCP lease on %s renewed\n",
+				interface->name);
+		break;
+	case DHCP_EVENT_EXPIRED:
+		dhcp_lease_expired(network, interface,
+				&interface->dhcp_address);
+		break;
+	}
+}
+
+static char *dhcp6_addr_string(void *ctx, const struct in6_addr *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	return talloc_strdup(ctx, inet_ntop(AF_INET6, addr, buf, sizeof(buf)));
+}
+
+/* As for DHCPv4, but with the parameters udhcpc6 passed to pb-udhcpc.
+ * DHCPv6 leases are single addresses; the on-link prefix and the default
+ * route come from router advertisements */
+static void dhcp6_lease_bound(struct network *network,
+		struct interface *interface, const struct dhcp6_lease *lease)
+{
+	const char **dns_servers;
+	struct rtnl_batch *batch;
+	struct dhcp_config *dc;
+	struct event *event;
+	unsigned int i;
+	char *address;
+
+	dc = talloc_zero(interface, struct dhcp_config);
+	dc->network = network;
+	dc->interface = interface;
+
+	address = dhcp6_addr_string(dc, &lease->address);
+	dc->address = talloc_asprintf(dc, "%s/128", address);
+
+	pb_log("network: DHCPv6 lease on %s, address %s\n", interface->name,
+			dc->address);
+
+	event = talloc_zero(dc, struct event);
+	event->type = EVENT_TYPE_USER;
+	event->action = EVENT_ACTION_DHCP;
+	event->device = talloc_strdup(event, interface->name);
+	event_set_param(event, "mac", mac_bytes_to_string(event,
+				interface->hwaddr, sizeof(interface->hwaddr)));
+	event_set_param(event, "ipv6", address);
+	if (lease->bootfile_url)
+		event_set_param(event, "bootfile_url", lease->bootfile_url);
+	if (lease->bootfile_param)
+		event_set_param(event, "bootfile_param",
+				lease->bootfile_param);
+	dc->event = event;
+
+	batch = rtnl_batch_create(dc, network->rtnl, dhcp_config_cb, dc);
+	dhcp_config_del_address(batch, interface, &interface->dhcp6_address,
+			dc->address);
+	interface->dhcp6_address = talloc_strdup(interface, dc->address);
+
+	dc->address_request = rtnl_batch_addr_add(batch, dhcp_config_exists_cb,
+			interface->ifindex, dc->address);
+	rtnl_batch_run(batch);
+
+	dns_servers = talloc_array(dc, const char *, lease->n_dns_servers);
+	for (i = 0; i < lease->n_dns_servers; i++)
+		dns_servers[i] = dhcp6_addr_string(dns_servers,
+				&lease->dns_servers[i]);
+	network_add_dns_servers(network, dns_servers, lease->n_dns_servers);
+	talloc_free(dns_servers);
+}
+
+static void interface_dhcp6_lease_cb(void *data, enum dhcp_event event,
+		const struct dhcp6_lease *lease)
+{
+	struct interface *interface = data;
+	struct network *network = interface->network;
+
+	switch (event) {
+	case DHCP_EVENT_BOUND:
+		dhcp6_lease_bound(network, interface, lease);
+		break;
+	case DHCP_EVENT_RENEWED:
+		pb_debug("network: DHCPv6 lease on %s renewed\n",
+				interface->name);
+		break;
+	case DHCP_EVENT_EXPIRED:
+		dhcp_lease_expired(network, interface,
+				&interface->dhcp6_address);
+		break;
+	}
+}
+
+static void configure_interface_dhcp(struct network *network,
+		struct interface *interface)
 {
+	const struct platform *platform;
+	uint16_t arch_id = DHCP_ARCH_ID_NONE;
 	int rc;
 
 	device_handler_status_dev_info(network->handler, interface->dev,
-			_("Configuring with static address (ip: %s)"),
-			config->static_config.address);
+			_("Configuring with DHCP"));
 
-	rc = process_run_simple(interface, pb_system_apps.ip,
-			"address", "add", config->static_config.address,
-			"dev", interface->name, NULL);
+	platform = platform_get();
+	if (platform)
+		arch_id = platform->dhcp_arch_id;
 
+	if (!interface->dhcp_client)
+		interface->dhcp_client = dhcp_client_create(interface,
+				network->waitset, interface->ifindex,
+				interface->hwaddr, arch_id,
+				interface_dhcp_lease_cb, interface);
 
-	if (rc) {
-		pb_log("failed to add address %s to interface %s\n",
-				config->static_config.address,
+	if (network->dry_run) {
+		pb_log("network: dry run, not starting DHCPv4 client on %s\n",
 				interface->name);
-		return;
+	} else if (interface->dhcp_client) {
+		pb_log("Running DHCPv4 client\n");
+		rc = dhcp_client_start(interface->dhcp_client);
+		if (rc)
+			pb_log("network: can't start DHCPv4 client on %s\n",
+					interface->name);
 	}
 
-	system_info_set_interface_address(sizeof(interface->hwaddr),
-				interface->hwaddr,
-				config->static_config.address);
+	if (!interface->dhcp6_client)
+		interface->dhcp6_client = dhcp6_client_create(interface,
+				network->waitset, interface->ifindex,
+				interface->hwaddr, arch_id,
+				interface_dhcp6_lease_cb, interface);
 
-	/* we need the interface up before we can route through it */
-	rc = interface_up(interface);
-	if (rc)
-		return;
+	if (network->dry_run) {
+		pb_log("network: dry run, not starting DHCPv6 client on %s\n",
+				interface->name);
+	} else if (interface->dhcp6_client) {
+		pb_log("Running DHCPv6 client\n");
+		rc = dhcp6_client_start(interface->dhcp6_client);
+		if (rc)
+			pb_log("network: can't start DHCPv6 client on %s\n",
+					interface->name);
+	}
+}
 
-	if (config->static_config.gateway)
-		rc = process_run_simple(interface, pb_system_apps.ip,
-				"route", "add", "default",
-				"via", config->static_config.gateway,
-				NULL);
+struct static_config {
+	struct network		*network;
+	struct interface	*interface;
+	char			*address;
+	char			*gateway;
+	char			*url;
+	struct rtnl_request	*address_request;
+	struct rtnl_request	*link_request;
+	struct rtnl_request	*route_request;
+};
 
-	if (rc) {
-		pb_log("failed to add default route %s on interface %s\n",
-				config->static_config.gateway,
-				interface->name);
+static void static_config_cb(void *data, struct rtnl_request *failed)
+{
+	struct static_config *sc = data;
+	struct interface *interface = sc->interface;
+	struct network *network = sc->network;
+
+	if (!rtnl_request_error(sc->address_request))
+		system_info_set_interface_address(sizeof(interface->hwaddr),
+				interface->hwaddr, sc->address);
+
+	if (failed && failed == sc->route_request) {
+		pb_log("failed to add default route %s on interface %s: %s\n",
+				sc->gateway, interface->name,
+				strerror(-rtnl_request_error(failed)));
+	} else if (failed) {
+		if (failed == sc->address_request)
+			pb_log("failed to add address %s to interface %s: %s\n",
+					sc->address, interface->name,
+					strerror(-rtnl_request_error(failed)));
+		else if (failed == sc->link_request)
+			pb_log("failed to bring interface %s up: %s\n",
+					interface->name,
+					strerror(-rtnl_request_error(failed)));
+		goto out;
 	}
 
-	if (config->static_config.url) {
-		pb_log("config URL %s\n", config->static_config.url);
-		device_handler_process_url(network->handler,
-				config->static_config.url,
+	if (sc->url) {
+		pb_log("config URL %s\n", sc->url);
+		device_handler_process_url(network->handler, sc->url,
 				mac_bytes_to_string(interface->dev,
 						interface->hwaddr,
 						sizeof(interface->hwaddr)),
-				config->static_config.address);
+				sc->address);
 		device_handler_start_requery_timeout(network->handler,
 				interface->dev, -1);
 	}
 
-	return;
+out:
+	/* Nothing left to do for static interfaces */
+	pending_network_jobs_start();
+	talloc_free(sc);
+}
+
+/* The address, link and route changes go to the kernel as a single batch;
+ * the route needs the interface up, which the kernel's in-order processing
+ * of the batch guarantees */
+static void configure_interface_static(struct network *network,
+		struct interface *interface,
+		const struct interface_config *config)
+{
+	struct rtnl_batch *batch;
+	struct static_config *sc;
+
+	device_handler_status_dev_info(network->handler, interface->dev,
+			_("Configuring with static address (ip: %s)"),
+			config->static_config.address);
+
+	sc = talloc_zero(interface, struct static_config);
+	sc->network = network;
+	sc->interface = interface;
+	sc->address = talloc_strdup(sc, config->static_config.address);
+	sc->gateway = talloc_strdup(sc, config->static_config.gateway);
+	sc->url = talloc_strdup(sc, config->static_config.url);
+
+	batch = rtnl_batch_create(sc, network->rtnl, static_config_cb, sc);
+
+	sc->address_request = rtnl_batch_addr_add(batch, NULL,
+			interface->ifindex, sc->address);
+	sc->link_request = interface_change_add(batch, interface, true);
+
+	if (sc->gateway)
+		sc->route_request = rtnl_batch_route_add_default(batch, NULL,
+				interface->ifindex, sc->gateway);
+
+	rtnl_batch_run(batch);
 }
 
 static void configure_interface(struct network *network,
@@ -495,7 +958,7 @@ static void configure_interface(struct network *network,
 	/* always up the lookback, no other handling required */
 	if (!strcmp(interface->name, "lo")) {
 		if (interface->state == IFSTATE_NEW)
-			interface_up(interface);
+			interface_up(network, interface);
 		interface->state = IFSTATE_CONFIGURED;
 		return;
 	}
@@ -519,7 +982,7 @@ static void configure_interface(struct network *network,
 	/* new interface? bring up to the point so we can detect a link */
 	if (interface->state == IFSTATE_NEW) {
 		if (!up) {
-			interface_up(interface);
+			interface_up(network, interface);
 			pb_log("network: bringing up interface %s\n",
 					interface->name);
 			return;
@@ -540,8 +1003,6 @@ static void configure_interface(struct network *network,
 
 	} else if (config->method == CONFIG_METHOD_STATIC) {
 		configure_interface_static(network, interface, config);
-		/* Nothing left to do for static interfaces */
-		pending_network_jobs_start();
 	}
 
 	interface->state = IFSTATE_CONFIGURED;
@@ -557,18 +1018,7 @@ void network_requery_device(struct network *network,
 	if (!interface)
 		return;
 
-	if (interface->udhcpc_process) {
-		interface->udhcpc_process->exit_cb = NULL;
-		interface->udhcpc_process->data = NULL;
-		process_stop_async(interface->udhcpc_process);
-		process_release(interface->udhcpc_process);
-	}
-	if (interface->udhcpc6_process) {
-		interface->udhcpc6_process->exit_cb = NULL;
-		interface->udhcpc6_process->data = NULL;
-		process_stop_async(interface->udhcpc6_process);
-		process_release(interface->udhcpc6_process);
-	}
+	interface_stop_dhcp(interface);
 
 	config = find_config_by_hwaddr(interface->hwaddr);
 
@@ -599,7 +1049,7 @@ void network_requery_device(struct network *network,
 static int network_handle_nlmsg(struct network *network, struct nlmsghdr *nlmsg)
 {
 	bool have_ifaddr, have_ifname;
-	struct interface *interface, *tmp;
+	struct interface *interface;
 	struct ifinfomsg *info;
 	struct rtattr *attr;
 	unsigned int mtu;
@@ -661,21 +1111,20 @@ static int network_handle_nlmsg(struct network *network, struct nlmsghdr *nlmsg)
 	interface = find_interface_by_ifindex(network, info->ifi_index);
 	if (!interface) {
 		interface = talloc_zero(network, struct interface);
+		interface->network = network;
 		interface->ifindex = info->ifi_index;
 		interface->state = IFSTATE_NEW;
 		memcpy(interface->hwaddr, ifaddr, sizeof(interface->hwaddr));
 		strncpy(interface->name, ifname, sizeof(interface->name));
 
-		list_for_each_entry(&network->interfaces, tmp, list)
-			if (memcmp(interface->hwaddr, tmp->hwaddr,
-				   sizeof(interface->hwaddr)) == 0) {
-				pb_log("%s: %s has duplicate MAC address, ignoring\n",
-				       __func__, interface->name);
-				talloc_free(interface);
-				return -1;
-			}
+		if (find_interface_by_hwaddr(network, interface->hwaddr)) {
+			pb_log("%s: %s has duplicate MAC address, ignoring\n",
+			       __func__, interface->name);
+			talloc_free(interface);
+			return -1;
+		}
 
-		list_add(&network->interfaces, &interface->list);
+		add_interface(network, interface);
 		create_interface_dev(network, interface);
 	} else {
 		/* The interface can be marked as ready before the MAC address is set. */
@@ -683,7 +1132,7 @@ static int network_handle_nlmsg(struct network *network, struct nlmsghdr *nlmsg)
 			   sizeof(interface->hwaddr)) != 0) {
 			pb_log("%s: %s has changed MAC address\n",
 			       __func__, interface->name);
-			memcpy(interface->hwaddr, ifaddr, sizeof(interface->hwaddr));
+			interface_set_hwaddr(network, interface, ifaddr);
 		}
 	}
 
@@ -711,18 +1160,36 @@ static int network_handle_nlmsg(struct network *network, struct nlmsghdr *nlmsg)
 		return 0;
 	}
 
-	configure_interface(network, interface,
-			info->ifi_flags & IFF_UP,
-			info->ifi_flags & IFF_LOWER_UP);
+	/* only the latest state matters, so defer configuration until
+	 * we've seen everything that's queued for us */
+	interface->pending_up = info->ifi_flags & IFF_UP;
+	interface->pending_link = info->ifi_flags & IFF_LOWER_UP;
+	if (!interface->pending) {
+		interface->pending = true;
+		list_add_tail(&network->pending, &interface->pending_list);
+	}
 
 	return 0;
 }
 
+static void network_configure_pending(struct network *network)
+{
+	struct interface *interface, *tmp;
+
+	list_for_each_entry_safe(&network->pending, interface, tmp,
+			pending_list) {
+		list_remove(&interface->pending_list);
+		interface->pending = false;
+		configure_interface(network, interface,
+				interface->pending_up, interface->pending_link);
+	}
+}
+
 void network_mark_interface_ready(struct device_handler *handler,
 		int ifindex, const char *ifname, uint8_t *mac, int hwsize)
 {
 	struct network *network = device_handler_get_network(handler);
-	struct interface *interface, *tmp = NULL;
+	struct interface *interface;
 	char *macstr;
 
 	if (!network) {
@@ -741,21 +1208,20 @@ void network_mark_interface_ready(struct device_handler *handler,
 		pb_debug("Creating ready interface %d - %s\n",
 				ifindex, ifname);
 		interface = talloc_zero(network, struct interface);
+		interface->network = network;
 		interface->ifindex = ifindex;
 		interface->state = IFSTATE_NEW;
 		memcpy(interface->hwaddr, mac, HWADDR_SIZE);
 		strncpy(interface->name, ifname, sizeof(interface->name) - 1);
 
-		list_for_each_entry(&network->interfaces, tmp, list)
-			if (memcmp(interface->hwaddr, tmp->hwaddr,
-				   sizeof(interface->hwaddr)) == 0) {
-				pb_log("%s: %s has duplicate MAC address, ignoring\n",
-				       __func__, interface->name);
-				talloc_free(interface);
-				return;
-			}
+		if (find_interface_by_hwaddr(network, interface->hwaddr)) {
+			pb_log("%s: %s has duplicate MAC address, ignoring\n",
+			       __func__, interface->name);
+			talloc_free(interface);
+			return;
+		}
 
-		list_add(&network->interfaces, &interface->list);
+		add_interface(network, interface);
 		create_interface_dev(network, interface);
 	}
 
@@ -784,122 +1250,108 @@ void network_mark_interface_ready(struct device_handler *handler,
 	configure_interface(network, interface, false, false);
 }
 
+/* Drain the netlink socket, NETLINK_BATCH datagrams at a time, then
+ * configure each interface that changed state once */
 static int network_netlink_process(void *arg)
 {
+	struct mmsghdr msgs[NETLINK_BATCH];
+	struct iovec iovs[NETLINK_BATCH];
 	struct network *network = arg;
+	unsigned int round, len, n_msgs;
+	bool resync, truncated;
 	struct nlmsghdr *nlmsg;
-	struct msghdr msg;
-	struct iovec iov;
-	unsigned int len;
-	int rc, flags;
-
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	int i, n;
+
+	resync = truncated = false;
+	n_msgs = 0;
+
+	for (round = 0; round < NETLINK_MAX_ROUNDS; round++) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < NETLINK_BATCH; i++) {
+			iovs[i].iov_base = (char *)network->netlink_buf +
+				i * network->netlink_buf_size;
+			iovs[i].iov_len = network->netlink_buf_size;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-	flags = MSG_PEEK;
+		n = recvmmsg(network->netlink_sd, msgs, NETLINK_BATCH,
+				MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ENOBUFS) {
+				/* the kernel has dropped events for us */
+				pb_log("network: netlink overrun, "
+						"resynchronising\n");
+				resync = true;
+				continue;
+			}
+			pb_log("network: netlink recv failed: %s\n",
+					strerror(errno));
+			break;
+		}
 
-retry:
-	iov.iov_len = network->netlink_buf_size;
-	iov.iov_base = network->netlink_buf;
+		for (i = 0; i < n; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				truncated = true;
+				continue;
+			}
 
-	rc = recvmsg(network->netlink_sd, &msg, flags);
+			len = msgs[i].msg_len;
+			for_each_nlmsg(iovs[i].iov_base, nlmsg, len) {
+				network_handle_nlmsg(network, nlmsg);
+				n_msgs++;
+			}
+		}
 
-	if (rc < 0) {
-		perror("netlink recv header");
-		return -1;
+		if (n < NETLINK_BATCH)
+			break;
 	}
 
-	len = rc;
-
-	/* if the netlink message was larger than our buffer, realloc
-	 * before reading again */
-	if (len > network->netlink_buf_size || msg.msg_flags & MSG_TRUNC) {
+	/* a message was larger than our buffers, and has been lost; grow
+	 * the buffers and query the links again */
+	if (truncated) {
 		network->netlink_buf_size *= 2;
 		network->netlink_buf = talloc_realloc(network,
-					network->netlink_buf,
-					char *,
+					network->netlink_buf, char,
+					NETLINK_BATCH *
 					network->netlink_buf_size);
-		goto retry;
-	}
-
-	/* otherwise, we're good to read the entire message without PEEK */
-	if (flags == MSG_PEEK) {
-		flags = 0;
-		goto retry;
-	}
-
-	for_each_nlmsg(network->netlink_buf, nlmsg, len)
-		network_handle_nlmsg(network, nlmsg);
-
-	return 0;
-}
-
-static void network_init_dns(struct network *network)
-{
-	const struct config *config;
-	unsigned int i;
-	int rc, len;
-	bool modified;
-	char *buf;
-
-	if (network->dry_run)
-		return;
-
-	config = config_get();
-	if (!config || !config->network.n_dns_servers)
-		return;
-
-	rc = read_file(network, "/etc/resolv.conf", &buf, &len);
-
-	if (rc) {
-		buf = talloc_strdup(network, "");
-		len = 0;
+		pb_debug("network: netlink message truncated, "
+				"increasing buffer size to %u\n",
+				network->netlink_buf_size);
+		resync = true;
 	}
 
-	modified = false;
-
-	for (i = 0; i < config->network.n_dns_servers; i++) {
-		int dns_conf_len;
-		char *dns_conf;
-
-		dns_conf = talloc_asprintf(network, "nameserver %s\n",
-				config->network.dns_servers[i]);
-
-		if (strstr(buf, dns_conf)) {
-			talloc_free(dns_conf);
-			continue;
-		}
-
-		dns_conf_len = strlen(dns_conf);
-		buf = talloc_realloc(network, buf, char, len + dns_conf_len + 1);
-		memcpy(buf + len, dns_conf, dns_conf_len);
-		len += dns_conf_len;
-		buf[len] = '\0';
-		modified = true;
+	if (n_msgs > 1)
+		pb_debug("network: processed %u netlink messages\n", n_msgs);
 
-		talloc_free(dns_conf);
-	}
+	network_configure_pending(network);
 
-	if (modified) {
-		rc = replace_file("/etc/resolv.conf", buf, len);
-		if (rc)
-			pb_log("error replacing resolv.conf: %s\n",
-					strerror(errno));
-	}
+	if (resync)
+		network_send_link_query(network);
 
-	talloc_free(buf);
+	return 0;
 }
 
 struct network *network_init(struct device_handler *handler,
 		struct waitset *waitset, bool dry_run)
 {
 	struct network *network;
+	unsigned int i;
 	int rc;
 
-	network = talloc(handler, struct network);
+	network = talloc_zero(handler, struct network);
 	list_init(&network->interfaces);
+	list_init(&network->pending);
+	for (i = 0; i < IFACE_HASH_SIZE; i++) {
+		list_init(&network->ifindex_hash[i]);
+		list_init(&network->hwaddr_hash[i]);
+	}
 	network->handler = handler;
+	network->waitset = waitset;
 	network->dry_run = dry_run;
 	network->manual_config = config_get()->network.n_interfaces != 0;
 
@@ -915,6 +1367,10 @@ struct network *network_init(struct device_handler *handler,
 	if (!network->waiter)
 		goto err;
 
+	network->rtnl = rtnl_init(network, waitset, dry_run);
+	if (!network->rtnl)
+		goto err;
+
 	rc = network_send_link_query(network);
 	if (rc)
 		goto err;
@@ -938,7 +1394,7 @@ int network_shutdown(struct network *network)
 			continue;
 		if (!strcmp(interface->name, "lo"))
 			continue;
-		interface_down(interface);
+		interface_down_sync(network, interface);
 	}
 
 	close(network->netlink_sd);
@@ -1,6 +1,8 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "types/types.h"
 #include <file/file.h>
@@ -8,6 +10,7 @@
 #include <talloc/talloc.h>
 
 #include "device-handler.h"
+#include "file-cache.h"
 #include "parser.h"
 #include "parser-utils.h"
 #include "paths.h"
@@ -39,9 +42,7 @@ int parser_request_file(struct discover_context *ctx,
 		return -1;
 
 	path = local_path(ctx, dev, filename);
-
-	rc = read_file(ctx, path, buf, len);
-
+	rc = file_cache_read(ctx, path, buf, len);
 	talloc_free(path);
 
 	return rc;
@@ -51,23 +52,15 @@ int parser_stat_path(struct discover_context *ctx,
 		struct discover_device *dev, const char *path,
 		struct stat *statbuf)
 {
-	int rc = -1;
 	char *full_path;
+	int rc;
 
 	/* we only support local files at present */
 	if (!dev->mount_path)
 		return -1;
 
 	full_path = local_path(ctx, dev, path);
-
-	rc = stat(full_path, statbuf);
-	if (rc) {
-		rc = -1;
-		goto out;
-	}
-
-	rc = 0;
-out:
+	rc = file_cache_stat(ctx, full_path, statbuf);
 	talloc_free(full_path);
 
 	return rc;
@@ -125,6 +118,9 @@ int parser_replace_file(struct discover_context *ctx,
 
 	rc = replace_file(path, buf, len);
 
+	/* drop any cached results for the old file */
+	file_cache_invalidate(ctx, path);
+
 	talloc_free(path);
 
 	device_release_write(dev, release);
@@ -176,6 +172,7 @@ int parser_scandir(struct discover_context *ctx, const char *dirname,
 
 void iterate_parsers(struct discover_context *ctx)
 {
+	unsigned int hits, misses;
 	struct p_item* i;
 
 	pb_log("trying parsers for %s\n", ctx->device->device->id);
@@ -186,6 +183,50 @@ void iterate_parsers(struct discover_context *ctx)
 		i->parser->parse(ctx);
 	}
 	ctx->parser = NULL;
+
+	file_cache_get_stats(ctx, &hits, &misses);
+	pb_debug("%s: file cache: %u hits, %u misses\n",
+			ctx->device->device->id, hits, misses);
+}
+
+/* Parsing stays on the main loop: parsers share talloc contexts, the
+ * handler's device and boot option state and (for grub2) the script
+ * interpreter, none of which are thread-safe. What they wait on is the
+ * device, so we overlap that instead: each device's config files are read
+ * on its mount worker, with all of the reads in flight together, and
+ * devices mounting concurrently read in parallel. This runs on that worker
+ * thread, so only allocates from its own context */
+void parser_prefetch(const char *root)
+{
+	const char *const *filename, *const *dirs;
+	struct file_prefetch *prefetch;
+	struct p_item *i;
+	unsigned int n;
+	char *path;
+
+	prefetch = file_prefetch_create(NULL);
+
+	list_for_each_entry(&parsers, i, list) {
+		for (filename = i->parser->prefetch_files;
+				filename && *filename; filename++) {
+			path = join_paths(prefetch, root, *filename);
+			file_prefetch_add(prefetch, path);
+			talloc_free(path);
+		}
+
+		dirs = i->parser->prefetch_dirs ?
+			i->parser->prefetch_dirs() : NULL;
+
+		for (filename = dirs; filename && *filename; filename++) {
+			path = join_paths(prefetch, root, *filename);
+			file_prefetch_add_dir(prefetch, path);
+			talloc_free(path);
+		}
+	}
+
+	n = file_prefetch_wait(prefetch);
+
+	pb_debug("%s: prefetched %u files from %s\n", __func__, n, root);
 }
 
 static void *parsers_ctx;
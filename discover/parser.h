@@ -35,6 +35,13 @@ struct parser {
 	bool			(*resolve_resource)(
 						struct device_handler *handler,
 						struct resource *res);
+
+	/* Config files, and directories of them (relative to the device
+	 * root), that the parser may read; these are read ahead before
+	 * parsing so that the parser doesn't wait on the device. Either may
+	 * be NULL. */
+	const char *const	*prefetch_files;
+	const char *const	*(*prefetch_dirs)(void);
 };
 
 enum generic_icon_type {
@@ -56,6 +63,11 @@ struct parser_found_file {
 void parser_init(void);
 
 void iterate_parsers(struct discover_context *ctx);
+
+/* Read the config files of all parsers under @root into the page cache.
+ * This blocks until all I/O is complete, so should be run outside of the
+ * main loop, once the device is mounted. */
+void parser_prefetch(const char *root);
 int parse_user_event(struct discover_context *ctx, struct event *event);
 
 /* File IO functions for parsers; these should be the only interface that
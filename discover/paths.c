@@ -3,6 +3,7 @@
 #endif
 
 #include <assert.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <string.h>
 #include <stdio.h>
@@ -14,6 +15,8 @@
 #include <talloc/talloc.h>
 #include <system/system.h>
 #include <process/process.h>
+#include <download/cache.h>
+#include <download/download.h>
 #include <url/url.h>
 #include <log/log.h>
 #include "i18n/i18n.h"
@@ -26,6 +29,8 @@
 
 
 struct list	pending_network_jobs;
+static struct waitset *load_waitset;
+static struct download_cache *load_cache;
 
 struct network_job {
 	struct load_task	*task;
@@ -41,6 +46,14 @@ struct load_task {
 	bool			async;
 	load_url_complete	async_cb;
 	void			*async_data;
+	/* waiting for the TFTP client type check, so the download process
+	 * hasn't been started yet */
+	bool			tftp_check;
+	/* in-process download, instead of the process */
+	struct download		*download;
+	int			fd;
+	/* for download status, if the caller isn't handling the output */
+	struct device_handler	*handler;
 };
 
 const char *mount_base(void)
@@ -68,6 +81,16 @@ char *join_paths(void *alloc_ctx, const char *a, const char *b)
 	return full_path;
 }
 
+void load_url_init(struct waitset *set)
+{
+	load_waitset = set;
+}
+
+void load_url_set_cache(struct download_cache *cache)
+{
+	load_cache = cache;
+}
+
 #ifndef PETITBOOT_TEST
 
 #ifdef WITH_BUSYBOX
@@ -76,20 +99,25 @@ static inline bool have_busybox(void) { return true; }
 static inline bool have_busybox(void) { return false; }
 #endif
 
-static char *local_name(void *ctx)
+/* Create a new local file. If @fd is not NULL, it is set to a writable fd
+ * for the file, otherwise the file is closed */
+static char *local_name(void *ctx, int *fd)
 {
 	char *ret, tmp[] = "/tmp/pb-XXXXXX";
 	mode_t oldmask;
-	int fd;
+	int tmp_fd;
 
 	oldmask = umask(0644);
-	fd = mkstemp(tmp);
+	tmp_fd = mkstemp(tmp);
 	umask(oldmask);
 
-	if (fd < 0)
+	if (tmp_fd < 0)
 		return NULL;
 
-	close(fd);
+	if (fd)
+		*fd = tmp_fd;
+	else
+		close(tmp_fd);
 
 	ret = talloc_strdup(ctx, tmp);
 
@@ -210,7 +238,7 @@ static void load_process_to_local_file(struct load_task *task,
 {
 	int rc;
 
-	task->result->local = local_name(task->result);
+	task->result->local = local_name(task->result, NULL);
 	if (!task->result->local) {
 		task->result->status = LOAD_ERROR;
 		return;
@@ -261,7 +289,7 @@ static void load_nfs(struct load_task *task)
 	};
 
 	task->result->status = LOAD_ERROR;
-	mountpoint = local_name(task->result);
+	mountpoint = local_name(task->result, NULL);
 	if (!mountpoint)
 		return;
 	task->result->cleanup_local = true;
@@ -316,6 +344,29 @@ static void load_sftp(struct load_task *task)
 	load_process_to_local_file(task, argv, 2);
 }
 
+static enum tftp_type tftp_type_from_output(struct process *process)
+{
+	if (!process->stdout_buf || process->stdout_len == 0) {
+		pb_log("Can't check TFTP client type!\n");
+		return TFTP_TYPE_BROKEN;
+	}
+
+	if (memmem(process->stdout_buf, process->stdout_len,
+				"tftp-hpa", strlen("tftp-hpa"))) {
+		pb_debug("Found TFTP client type: tftp-hpa\n");
+		return TFTP_TYPE_HPA;
+	}
+
+	if (memmem(process->stdout_buf, process->stdout_len,
+				"BusyBox", strlen("BusyBox"))) {
+		pb_debug("Found TFTP client type: BusyBox tftp\n");
+		return TFTP_TYPE_BUSYBOX;
+	}
+
+	pb_log("Unknown TFTP client type!\n");
+	return TFTP_TYPE_BROKEN;
+}
+
 static enum tftp_type check_tftp_type(void *ctx)
 {
 	const char *argv[] = { pb_system_apps.tftp, "-V", NULL };
@@ -330,29 +381,76 @@ static enum tftp_type check_tftp_type(void *ctx)
 	process->add_stderr = true;
 	rc = process_run_sync(process);
 
-	if (rc || !process->stdout_buf || process->stdout_len == 0) {
+	if (rc) {
 		pb_log("Can't check TFTP client type!\n");
 		type = TFTP_TYPE_BROKEN;
-
-	} else if (memmem(process->stdout_buf, process->stdout_len,
-				"tftp-hpa", strlen("tftp-hpa"))) {
-		pb_debug("Found TFTP client type: tftp-hpa\n");
-		type = TFTP_TYPE_HPA;
-
-	} else if (memmem(process->stdout_buf, process->stdout_len,
-				"BusyBox", strlen("BusyBox"))) {
-		pb_debug("Found TFTP client type: BusyBox tftp\n");
-		type = TFTP_TYPE_BUSYBOX;
-
 	} else {
-		pb_log("Unknown TFTP client type!\n");
-		type = TFTP_TYPE_BROKEN;
+		type = tftp_type_from_output(process);
 	}
 
 	process_release(process);
 	return type;
 }
 
+static void load_tftp(struct load_task *task);
+
+static enum process_chain_action tftp_check_step_cb(struct process *process,
+		void *data __attribute__((unused)))
+{
+	/* another load may have checked the type while we were running */
+	if (tftp_type == TFTP_TYPE_UNKNOWN)
+		tftp_type = tftp_type_from_output(process);
+
+	/* the client's exit status doesn't matter, only its output */
+	return PROCESS_CHAIN_STOP;
+}
+
+static void tftp_check_cb(void *data,
+		struct process *failed __attribute__((unused)))
+{
+	struct load_task *task = data;
+	struct load_url_result *result = task->result;
+	load_url_complete cb;
+	void *cb_data;
+
+	task->tftp_check = false;
+
+	if (result->status != LOAD_CANCELLED) {
+		load_tftp(task);
+		if (result->status == LOAD_ASYNC)
+			return;
+		load_url_result_cleanup_local(result);
+	}
+
+	/* we failed (or were cancelled) before starting the download, so
+	 * complete the load here */
+	cb = task->async_cb;
+	cb_data = task->async_data;
+
+	process_release(task->process);
+	talloc_free(task);
+	result->task = NULL;
+
+	cb(result, cb_data);
+}
+
+/* Check the TFTP client type without blocking, then continue the load */
+static void load_tftp_check_async(struct load_task *task)
+{
+	struct process_chain *chain;
+	struct process *process;
+
+	chain = process_chain_create(task, tftp_check_cb, task);
+	process = process_chain_add(chain, tftp_check_step_cb,
+			pb_system_apps.tftp, "-V", NULL);
+	process->keep_stdout = true;
+	process->add_stderr = true;
+
+	task->tftp_check = true;
+	task->result->status = LOAD_ASYNC;
+	process_chain_run(chain);
+}
+
 static void load_tftp(struct load_task *task)
 {
 	const char *port = "69";
@@ -363,8 +461,13 @@ static void load_tftp(struct load_task *task)
 	if (task->url->port)
 		port = task->url->port;
 
-	if (tftp_type == TFTP_TYPE_UNKNOWN)
+	if (tftp_type == TFTP_TYPE_UNKNOWN) {
+		if (task->async) {
+			load_tftp_check_async(task);
+			return;
+		}
 		tftp_type = check_tftp_type(task);
+	}
 
 	if (tftp_type == TFTP_TYPE_BUSYBOX) {
 		argv[1] = "-g";
@@ -438,6 +541,152 @@ static void load_wget(struct load_task *task, int flags)
 	load_process_to_local_file(task, argv, 2);
 }
 
+#ifdef NATIVE_DOWNLOAD
+static void load_download_progress(void *data,
+		const struct download_info *info)
+{
+	struct load_task *task = data;
+
+	device_handler_status_download_bytes(task->handler, task,
+			info->size, info->total);
+}
+
+static void load_download_complete(void *data, int rc,
+		const struct download_info *info);
+
+/* The server says our cached copy is current, but we couldn't use it, and
+ * the cache has dropped it. Fetch the file again, without the validators */
+static int load_download_restart(struct load_task *task)
+{
+	download_progress_cb progress_cb = NULL;
+
+	pb_log("%s: cached copy of %s unusable, downloading again\n",
+			__func__, task->url->full);
+
+	task->fd = open(task->result->local,
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (task->fd < 0)
+		return -1;
+
+	if (task->handler)
+		progress_cb = load_download_progress;
+
+	/* we're called from the old download's completion callback */
+	talloc_free(task->download);
+	task->download = download_start(task, load_waitset, task->url,
+			task->fd, load_download_complete, progress_cb, task);
+	if (!task->download) {
+		close(task->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void load_download_complete(void *data, int rc,
+		const struct download_info *info)
+{
+	struct load_task *task = data;
+	struct load_url_result *result;
+	load_url_complete cb;
+	void *cb_data;
+
+	result = task->result;
+	cb = task->async_cb;
+	cb_data = task->async_data;
+
+	close(task->fd);
+
+	if (result->status == LOAD_CANCELLED) {
+		load_url_result_cleanup_local(result);
+	} else if (rc) {
+		result->status = LOAD_ERROR;
+		load_url_result_cleanup_local(result);
+	} else if (info->not_modified) {
+		if (!download_cache_use(load_cache, task->url, result->local)) {
+			result->status = LOAD_OK;
+		} else if (!load_download_restart(task)) {
+			return;
+		} else {
+			result->status = LOAD_ERROR;
+			load_url_result_cleanup_local(result);
+		}
+	} else {
+		if (load_cache)
+			download_cache_add(load_cache, task->url,
+					result->local, info);
+		result->status = LOAD_OK;
+	}
+
+	if (task->handler) {
+		device_handler_status_download_remove(task->handler, task);
+		if (result->status == LOAD_OK && info->not_modified)
+			device_handler_status_info(task->handler,
+					_("Using cached copy of %s"),
+					task->url->file);
+		else if (result->status == LOAD_OK)
+			device_handler_status_info(task->handler,
+					_("Download complete: %s"),
+					task->url->file);
+	}
+
+	/* as with load_url_process_exit, the callback may free our parent */
+	process_release(task->process);
+	talloc_free(task);
+	result->task = NULL;
+
+	cb(result, cb_data);
+}
+
+/* Load http and tftp URLs in-process, streaming to the local file. Returns
+ * false if the download engine can't take this load, in which case the
+ * caller falls back to a helper process */
+static bool load_download(struct load_task *task)
+{
+	struct load_url_result *result = task->result;
+	download_progress_cb progress_cb = NULL;
+	const struct download_info *cached = NULL;
+
+	if (!task->async || !load_waitset)
+		return false;
+
+	/* leave proxied loads to wget */
+	if (task->url->scheme == pb_url_http && getenv("http_proxy"))
+		return false;
+
+	result->local = local_name(result, &task->fd);
+	if (!result->local) {
+		result->status = LOAD_ERROR;
+		return true;
+	}
+
+	if (task->handler)
+		progress_cb = load_download_progress;
+
+	if (load_cache)
+		cached = download_cache_lookup(load_cache, task->url);
+
+	task->download = download_start_cached(task, load_waitset, task->url,
+			task->fd, cached, load_download_complete, progress_cb,
+			task);
+	if (!task->download) {
+		close(task->fd);
+		unlink(result->local);
+		result->local = NULL;
+		return false;
+	}
+
+	result->cleanup_local = true;
+	result->status = LOAD_ASYNC;
+	return true;
+}
+#else
+static bool load_download(struct load_task *task __attribute__((unused)))
+{
+	return false;
+}
+#endif
+
 /* Although we don't need to load anything for a local path (we just return
  * the path from the file:// URL), the other load helpers will error-out on
  * non-existant files. So, do the same here with an access() check on the local
@@ -466,9 +715,12 @@ static void load_url_async_start_pending(struct load_task *task, int flags)
 
 	switch (task->url->scheme) {
 	case pb_url_ftp:
-	case pb_url_http:
 		load_wget(task, flags);
 		break;
+	case pb_url_http:
+		if (!load_download(task))
+			load_wget(task, flags);
+		break;
 	case pb_url_https:
 		flags |= wget_no_check_certificate;
 		load_wget(task, flags);
@@ -480,7 +732,8 @@ static void load_url_async_start_pending(struct load_task *task, int flags)
 		load_sftp(task);
 		break;
 	case pb_url_tftp:
-		load_tftp(task);
+		if (!load_download(task))
+			load_tftp(task);
 		break;
 	default:
 		/* Shouldn't be a need via this path but.. */
@@ -580,6 +833,8 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 		task->process->data = task;
 		task->process->stdout_cb = stdout_cb;
 		task->process->stdout_data = stdout_data;
+		if (!stdout_cb)
+			task->handler = stdout_data;
 	}
 
 	if (!stdout_cb && stdout_data && have_busybox())
@@ -605,9 +860,12 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 
 	switch (url->scheme) {
 	case pb_url_ftp:
-	case pb_url_http:
 		load_wget(task, flags);
 		break;
+	case pb_url_http:
+		if (!load_download(task))
+			load_wget(task, flags);
+		break;
 	case pb_url_https:
 		flags |= wget_no_check_certificate;
 		load_wget(task, flags);
@@ -619,7 +877,8 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 		load_sftp(task);
 		break;
 	case pb_url_tftp:
-		load_tftp(task);
+		if (!load_download(task))
+			load_tftp(task);
 		break;
 	default:
 		load_local(task);
@@ -661,6 +920,17 @@ void load_url_async_cancel(struct load_url_result *res)
 	assert(task->process);
 
 	res->status = LOAD_CANCELLED;
+
+	/* tftp_check_cb will complete the load */
+	if (task->tftp_check)
+		return;
+
+	/* load_download_complete will complete the load */
+	if (task->download) {
+		download_cancel(task->download);
+		return;
+	}
+
 	process_stop_async(task->process);
 }
 
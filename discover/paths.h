@@ -43,6 +43,15 @@ struct load_url_result {
  */
 typedef void (*load_url_complete)(struct load_url_result *result, void *data);
 
+/* Set the waitset for in-process downloads; without this, all remote loads
+ * use helper processes */
+void load_url_init(struct waitset *set);
+
+/* Keep in-process downloads in @cache, and reuse them where the server says
+ * they're unchanged. Loads through helper processes aren't cached */
+struct download_cache;
+void load_url_set_cache(struct download_cache *cache);
+
 /* Start transfers that were waiting for network connectivity */
 void pending_network_jobs_start(void);
 void pending_network_jobs_cancel(void);
@@ -12,15 +12,25 @@
 
 #include <waiter/waiter.h>
 #include <log/log.h>
+#include <download/cache.h>
 #include <process/process.h>
 #include <talloc/talloc.h>
 #include <i18n/i18n.h>
 
+#include "boot.h"
 #include "discover-server.h"
 #include "device-handler.h"
+#include "paths.h"
 #include "sysinfo.h"
 #include "platform.h"
 
+/* log any event handler that holds up the main loop for longer than this */
+#define LOOP_WATCHDOG_MS	500
+
+/* on the same tmpfs as the downloads themselves, so cached files can be
+ * hard linked rather than copied */
+#define DOWNLOAD_CACHE_DIR	"/tmp/pb-cache"
+
 static void print_version(void)
 {
 	printf("pb-discover (" PACKAGE_NAME ") " PACKAGE_VERSION "\n");
@@ -30,8 +40,12 @@ static void print_usage(void)
 {
 	print_version();
 	printf(
-"Usage: pb-discover [-a, --no-autoboot] [-h, --help] [-l, --log log-file]\n"
-"                   [-n, --dry-run] [-v, --verbose] [-V, --version]\n");
+"Usage: pb-discover [-a, --no-autoboot] [-b, --status-backlog entries]\n"
+"                   [-c, --download-cache MiB] [-t, --cache-tftp]\n"
+"                   [-h, --help] [-l, --log log-file]\n"
+"                   [-n, --dry-run] [-q, --client-queue bytes]\n"
+"                   [-s, --slow-client drop|coalesce|disconnect]\n"
+"                   [-v, --verbose] [-V, --version]\n");
 }
 
 /**
@@ -46,9 +60,14 @@ enum opt_value {opt_undef = 0, opt_yes, opt_no};
 
 struct opts {
 	enum opt_value no_autoboot;
+	int status_backlog;
+	unsigned int download_cache;
+	enum opt_value cache_tftp;
 	enum opt_value show_help;
 	const char *log_file;
 	enum opt_value dry_run;
+	unsigned int client_queue;
+	enum slow_client_policy slow_client;
 	enum opt_value show_version;
 	enum opt_value verbose;
 };
@@ -61,20 +80,30 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 {
 	static const struct option long_options[] = {
 		{"no-autoboot",    no_argument,       NULL, 'a'},
+		{"status-backlog", required_argument, NULL, 'b'},
+		{"download-cache", required_argument, NULL, 'c'},
 		{"help",           no_argument,       NULL, 'h'},
 		{"log",            required_argument, NULL, 'l'},
 		{"dry-run",        no_argument,       NULL, 'n'},
+		{"client-queue",   required_argument, NULL, 'q'},
+		{"slow-client",    required_argument, NULL, 's'},
+		{"cache-tftp",     no_argument,       NULL, 't'},
 		{"verbose",        no_argument,       NULL, 'v'},
 		{"version",        no_argument,       NULL, 'V'},
 		{ NULL, 0, NULL, 0},
 	};
-	static const char short_options[] = "ahl:nvV";
+	static const char short_options[] = "ab:c:hl:nq:s:tvV";
 	static const struct opts default_values = {
 		.no_autoboot = opt_no,
+		.status_backlog = -1,
+		.cache_tftp = opt_no,
 		.log_file = "/var/log/petitboot/pb-discover.log",
 		.dry_run = opt_no,
+		.client_queue = 0,
+		.slow_client = SLOW_CLIENT_COALESCE,
 		.verbose = opt_no,
 	};
+	char *end;
 
 	*opts = default_values;
 
@@ -89,6 +118,20 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		case 'a':
 			opts->no_autoboot = opt_yes;
 			break;
+		case 'b':
+			opts->status_backlog = strtol(optarg, &end, 0);
+			if (*end || opts->status_backlog < 0) {
+				opts->show_help = opt_yes;
+				return -1;
+			}
+			break;
+		case 'c':
+			opts->download_cache = strtoul(optarg, &end, 0);
+			if (*end) {
+				opts->show_help = opt_yes;
+				return -1;
+			}
+			break;
 		case 'h':
 			opts->show_help = opt_yes;
 			break;
@@ -98,6 +141,28 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		case 'n':
 			opts->dry_run = opt_yes;
 			break;
+		case 'q':
+			opts->client_queue = strtoul(optarg, &end, 0);
+			if (*end || !opts->client_queue) {
+				opts->show_help = opt_yes;
+				return -1;
+			}
+			break;
+		case 's':
+			if (!strcmp(optarg, "drop"))
+				opts->slow_client = SLOW_CLIENT_DROP;
+			else if (!strcmp(optarg, "coalesce"))
+				opts->slow_client = SLOW_CLIENT_COALESCE;
+			else if (!strcmp(optarg, "disconnect"))
+				opts->slow_client = SLOW_CLIENT_DISCONNECT;
+			else {
+				opts->show_help = opt_yes;
+				return -1;
+			}
+			break;
+		case 't':
+			opts->cache_tftp = opt_yes;
+			break;
 		case 'v':
 			opts->verbose = opt_yes;
 			break;
@@ -124,6 +189,7 @@ int main(int argc, char *argv[])
 {
 	struct device_handler *handler;
 	struct discover_server *server;
+	struct download_cache *cache;
 	struct waitset *waitset;
 	struct procset *procset;
 	struct opts opts;
@@ -170,15 +236,35 @@ int main(int argc, char *argv[])
 	signal(SIGINT, sigint_handler);
 
 	waitset = waitset_create(NULL);
+	waitset_set_watchdog(waitset, LOOP_WATCHDOG_MS);
 
 	server = discover_server_init(waitset);
 	if (!server)
 		return EXIT_FAILURE;
 
+	discover_server_set_client_queue(server, opts.client_queue,
+			opts.slow_client);
+
+	if (opts.status_backlog >= 0)
+		discover_server_set_status_backlog(server,
+				opts.status_backlog);
+
 	procset = process_init(server, waitset, opts.dry_run == opt_yes);
 	if (!procset)
 		return EXIT_FAILURE;
 
+	load_url_init(waitset);
+
+	if (opts.download_cache) {
+		cache = download_cache_init(server, DOWNLOAD_CACHE_DIR,
+				(uint64_t)opts.download_cache << 20,
+				opts.cache_tftp == opt_yes);
+		if (cache)
+			load_url_set_cache(cache);
+	}
+
+	boot_init(waitset);
+
 	platform_init(NULL);
 	if (opts.no_autoboot == opt_yes)
 		config_set_autoboot(false);
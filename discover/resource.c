@@ -24,17 +24,43 @@ struct devpath_resource_info {
 	char	*dev, *path;
 };
 
+/* Split a device string into the device property to match, and the value
+ * to match it against */
+static const char *parse_device_string_key(const char *devstr,
+		unsigned int *type)
+{
+	if (is_prefix_ignorecase(devstr, "uuid=")) {
+		*type = RESOURCE_DEVICE_UUID;
+		return devstr + strlen("uuid=");
+	}
+
+	if (is_prefix_ignorecase(devstr, "label=")) {
+		*type = RESOURCE_DEVICE_LABEL;
+		return devstr + strlen("label=");
+	}
+
+	if (!strncmp(devstr, "/dev/", strlen("/dev/")))
+		devstr += strlen("/dev/");
+
+	*type = RESOURCE_DEVICE_ID;
+	return devstr;
+}
+
 static struct discover_device *parse_device_string(
 		struct device_handler *handler, const char *devstr)
 {
-	if (is_prefix_ignorecase(devstr, "uuid="))
-		return device_lookup_by_uuid(handler, devstr + strlen("uuid"));
+	unsigned int type;
+	const char *key;
+
+	key = parse_device_string_key(devstr, &type);
+
+	if (type == RESOURCE_DEVICE_UUID)
+		return device_lookup_by_uuid(handler, key);
 
-	if (is_prefix_ignorecase(devstr, "label="))
-		return device_lookup_by_label(handler,
-					devstr + strlen("label="));
+	if (type == RESOURCE_DEVICE_LABEL)
+		return device_lookup_by_label(handler, key);
 
-	return device_lookup_by_name(handler, devstr);
+	return device_lookup_by_id(handler, key);
 }
 
 void resolve_resource_against_device(struct resource *res,
@@ -43,6 +69,7 @@ void resolve_resource_against_device(struct resource *res,
 	char *resolved_path = join_paths(res, dev->mount_path, path);
 	res->url = pb_url_parse(res, resolved_path);
 	res->resolved = true;
+	res->device_key = NULL;
 }
 
 struct resource *create_devpath_resource(struct discover_boot_option *opt,
@@ -54,7 +81,7 @@ struct resource *create_devpath_resource(struct discover_boot_option *opt,
 	struct resource *res;
 	struct pb_url *url;
 
-	res = talloc(opt, struct resource);
+	res = talloc_zero(opt, struct resource);
 
 	pos = strchr(devpath, ':');
 
@@ -95,6 +122,8 @@ struct resource *create_devpath_resource(struct discover_boot_option *opt,
 
 	res->resolved = false;
 	res->info = info;
+	res->device_key = parse_device_string_key(devstr,
+			&res->device_key_types);
 
 	return res;
 }
@@ -123,7 +152,7 @@ struct resource *create_url_resource(struct discover_boot_option *opt,
 {
 	struct resource *res;
 
-	res = talloc(opt, struct resource);
+	res = talloc_zero(opt, struct resource);
 	talloc_steal(res, url);
 	res->url = url;
 	res->resolved = true;
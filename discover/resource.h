@@ -20,8 +20,20 @@ struct resource {
 		struct pb_url	*url;
 		void		*info;
 	};
+
+	/* For unresolved resources: the device that the resource is waiting
+	 * for, if the parser knows it, and which of the device's properties
+	 * (RESOURCE_DEVICE_*) the key may match. Options are only retried when
+	 * a matching device appears; resources without a device_key are
+	 * retried whenever any device appears. */
+	const char	*device_key;
+	unsigned int	device_key_types;
 };
 
+#define RESOURCE_DEVICE_ID	0x1
+#define RESOURCE_DEVICE_UUID	0x2
+#define RESOURCE_DEVICE_LABEL	0x4
+
 void resolve_resource_against_device(struct resource *res,
 	struct discover_device *dev, const char *path);
 
@@ -496,6 +496,7 @@ static struct parser syslinux_parser = {
 	.name			= "syslinux",
 	.parse			= syslinux_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.prefetch_files		= syslinux_conf_files,
 };
 
 register_parser(syslinux_parser);
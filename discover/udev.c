@@ -13,14 +13,17 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 
 #include <log/log.h>
+#include <list/list.h>
 #include <types/types.h>
 #include <talloc/talloc.h>
 #include <waiter/waiter.h>
 #include <system/system.h>
 #include <process/process.h>
 #include <i18n/i18n.h>
+#include <util/util.h>
 
 #include "event.h"
 #include "udev.h"
@@ -35,15 +38,89 @@
  * we'll do the same here */
 static const int monitor_bufsize = 128 * 1024 * 1024;
 
+/* Monitor events are held for a short window before being processed, so
+ * that add/change/remove sequences for one device can be coalesced. The
+ * queue is then processed in batches, so a burst of new devices doesn't
+ * hold up the rest of the main loop. */
+#define UDEV_COALESCE_MS	50
+#define UDEV_RECEIVE_BATCH	256
+#define UDEV_PROCESS_BATCH	16
+#define UDEV_HASH_SIZE		64
+
+/* LVM physical volumes tend to arrive together, so we wait for the burst
+ * to settle before scanning, up to a limit */
+#define LVM_SCAN_DELAY_MS	500
+#define LVM_SCAN_MAX_DELAY_MS	3000
+
+enum udev_action {
+	UDEV_ACTION_ADD,
+	UDEV_ACTION_CHANGE,
+	UDEV_ACTION_REMOVE,
+};
+
+/* removals go first, so stale devices don't conflict with their
+ * replacements; network devices next, as configuring them is cheap and
+ * starts DHCP early */
+enum udev_priority {
+	UDEV_PRIORITY_REMOVE,
+	UDEV_PRIORITY_NET,
+	UDEV_PRIORITY_BLOCK,
+	UDEV_PRIORITY_MAX,
+};
+
+struct udev_event {
+	struct udev_device	*dev;
+	const char		*devpath;
+	enum udev_action	action;
+	/* a remove was coalesced into a later add or change */
+	bool			remove_first;
+	enum udev_priority	priority;
+	struct list_item	queue_list;
+	struct list_item	hash_list;
+};
+
 struct pb_udev {
 	struct udev *udev;
 	struct udev_monitor *monitor;
 	struct device_handler *handler;
+	struct waitset *waitset;
+	struct waiter *queue_waiter;
+	struct list queue[UDEV_PRIORITY_MAX];
+	struct list hash[UDEV_HASH_SIZE];
+	unsigned int n_received;
+	unsigned int n_coalesced;
+	unsigned int n_processed;
+
+	struct waiter *lvm_waiter;
+	uint64_t lvm_request_time;
+	uint64_t lvm_start_time;
+	unsigned int lvm_n_members;
+	unsigned int lvm_n_scanning;
+	bool lvm_running;
+	bool lvm_rescan;
 };
 
 static int udev_destructor(void *p)
 {
 	struct pb_udev *udev = p;
+	struct udev_event *event, *tmp;
+	unsigned int i;
+
+	if (udev->queue_waiter) {
+		waiter_remove(udev->queue_waiter);
+		udev->queue_waiter = NULL;
+	}
+
+	if (udev->lvm_waiter) {
+		waiter_remove(udev->lvm_waiter);
+		udev->lvm_waiter = NULL;
+	}
+
+	/* queued devices hold references to the udev context */
+	for (i = 0; i < UDEV_PRIORITY_MAX; i++)
+		list_for_each_entry_safe(&udev->queue[i], event, tmp,
+				queue_list)
+			talloc_free(event);
 
 	if (udev->monitor) {
 		udev_monitor_unref(udev->monitor);
@@ -73,20 +150,106 @@ static void udev_setup_device_params(struct udev_device *udev,
 				udev_list_entry_get_value(entry));
 }
 
+static uint64_t udev_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /*
  * Search for LVM logical volumes. If any exist they should be recognised
  * by udev as normal.
  * Normally this is handled in an init script, but on some platforms
  * disks are slow enough to come up that we need to check again.
+ *
+ * A single scan covers all of the physical volumes present, so we run one
+ * scan per burst of LVM2_member devices rather than one per device. The
+ * activated logical volumes then arrive through the udev monitor.
  */
-static void lvm_vg_search(struct device_handler *handler)
+static void lvm_vg_search_schedule(struct pb_udev *udev);
+
+static enum process_chain_action lvm_vgscan_cb(struct process *process,
+		void *data __attribute__((unused)))
 {
-	if (process_run_simple(handler, pb_system_apps.vgscan, "-qq", NULL))
+	if (!process_exit_ok(process))
 		pb_log_fn("Failed to execute vgscan\n");
 
-	if (process_run_simple(handler, pb_system_apps.vgchange, "-ay", "-qq",
-				NULL))
+	/* activate whatever we can find anyway */
+	return PROCESS_CHAIN_CONTINUE;
+}
+
+static void lvm_vg_search_cb(void *data, struct process *failed)
+{
+	struct pb_udev *udev = data;
+	unsigned int elapsed;
+
+	if (failed)
 		pb_log_fn("Failed to execute vgchange\n");
+
+	elapsed = udev_time_ms() - udev->lvm_start_time;
+	udev->lvm_running = false;
+
+	pb_log("udev: LVM scan for %u physical volume(s) took %u ms\n",
+			udev->lvm_n_scanning, elapsed);
+	device_handler_status_info(udev->handler,
+			_("LVM scan complete (%u ms)"), elapsed);
+
+	/* more volumes appeared while we were scanning */
+	if (udev->lvm_rescan) {
+		udev->lvm_rescan = false;
+		lvm_vg_search_schedule(udev);
+	}
+}
+
+static int lvm_vg_search_start(void *arg)
+{
+	struct pb_udev *udev = arg;
+	struct process_chain *chain;
+
+	udev->lvm_waiter = NULL;
+	udev->lvm_running = true;
+	udev->lvm_start_time = udev_time_ms();
+	udev->lvm_n_scanning = udev->lvm_n_members;
+	udev->lvm_n_members = 0;
+
+	device_handler_status_info(udev->handler,
+			_("Scanning for LVM volume groups"));
+
+	chain = process_chain_create(udev, lvm_vg_search_cb, udev);
+	process_chain_add(chain, lvm_vgscan_cb, pb_system_apps.vgscan,
+			"-qq", NULL);
+	process_chain_add(chain, NULL, pb_system_apps.vgchange,
+			"-ay", "-qq", NULL);
+	process_chain_run(chain);
+
+	return 0;
+}
+
+static void lvm_vg_search_schedule(struct pb_udev *udev)
+{
+	uint64_t now = udev_time_ms();
+
+	if (!udev->lvm_waiter) {
+		udev->lvm_request_time = now;
+		udev->lvm_waiter = waiter_register_timeout(udev->waitset,
+				LVM_SCAN_DELAY_MS, lvm_vg_search_start, udev);
+
+	} else if (now - udev->lvm_request_time + LVM_SCAN_DELAY_MS <
+			LVM_SCAN_MAX_DELAY_MS) {
+		waiter_rearm_timeout(udev->lvm_waiter, LVM_SCAN_DELAY_MS);
+	}
+}
+
+static void lvm_vg_search(struct pb_udev *udev)
+{
+	udev->lvm_n_members++;
+
+	if (udev->lvm_running)
+		udev->lvm_rescan = true;
+	else
+		lvm_vg_search_schedule(udev);
 }
 
 static int udev_handle_block_add(struct pb_udev *udev, struct udev_device *dev,
@@ -174,7 +337,7 @@ static int udev_handle_block_add(struct pb_udev *udev, struct udev_device *dev,
 
 	/* Search for LVM logical volumes if we see an LVM member */
 	if (strncmp(type, "LVM2_member", strlen("LVM2_member")) == 0) {
-		lvm_vg_search(udev->handler);
+		lvm_vg_search(udev);
 		return 0;
 	}
 
@@ -593,31 +756,237 @@ out_err:
 	return -1;
 }
 
+static const char *udev_action_name(enum udev_action action)
+{
+	switch (action) {
+	case UDEV_ACTION_ADD:
+		return "add";
+	case UDEV_ACTION_CHANGE:
+		return "change";
+	case UDEV_ACTION_REMOVE:
+		return "remove";
+	}
+	return NULL;
+}
+
+static unsigned int udev_devpath_hash(const char *devpath)
+{
+	return str_hash(devpath) % UDEV_HASH_SIZE;
+}
+
+static int udev_event_destructor(void *p)
+{
+	struct udev_event *event = p;
+
+	udev_device_unref(event->dev);
+	return 0;
+}
+
+static struct udev_event *udev_event_lookup(struct pb_udev *udev,
+		const char *devpath)
+{
+	struct list *bucket = &udev->hash[udev_devpath_hash(devpath)];
+	struct udev_event *event;
+
+	list_for_each_entry(bucket, event, hash_list)
+		if (!strcmp(event->devpath, devpath))
+			return event;
+
+	return NULL;
+}
+
+static void udev_event_set_priority(struct pb_udev *udev,
+		struct udev_event *event)
+{
+	const char *subsys = udev_device_get_subsystem(event->dev);
+	enum udev_priority priority;
+
+	if (event->action == UDEV_ACTION_REMOVE || event->remove_first)
+		priority = UDEV_PRIORITY_REMOVE;
+	else if (subsys && !strcmp(subsys, "net"))
+		priority = UDEV_PRIORITY_NET;
+	else
+		priority = UDEV_PRIORITY_BLOCK;
+
+	if (event->queue_list.next && priority == event->priority)
+		return;
+
+	if (event->queue_list.next)
+		list_remove(&event->queue_list);
+	event->priority = priority;
+	list_add_tail(&udev->queue[priority], &event->queue_list);
+}
+
+/* Merge a new event for a device into the one already queued. We keep the
+ * newest udev_device, as its properties describe the current state of the
+ * device. */
+static void udev_event_coalesce(struct udev_event *event,
+		struct udev_device *dev, enum udev_action action)
+{
+	pb_debug("udev: coalescing %s into pending %s for %s\n",
+			udev_action_name(action),
+			udev_action_name(event->action), event->devpath);
+
+	switch (action) {
+	case UDEV_ACTION_REMOVE:
+		/* whatever happened before, the device is now gone */
+		event->action = UDEV_ACTION_REMOVE;
+		event->remove_first = false;
+		break;
+	case UDEV_ACTION_ADD:
+		if (event->action == UDEV_ACTION_REMOVE)
+			event->remove_first = true;
+		event->action = UDEV_ACTION_ADD;
+		break;
+	case UDEV_ACTION_CHANGE:
+		if (event->action == UDEV_ACTION_REMOVE) {
+			event->remove_first = true;
+			event->action = UDEV_ACTION_CHANGE;
+		}
+		/* a pending eject request takes effect regardless of any
+		 * media change that follows it */
+		if (event->action == UDEV_ACTION_CHANGE &&
+				udev_device_get_property_value(event->dev,
+					"DISK_EJECT_REQUEST")) {
+			udev_device_unref(dev);
+			return;
+		}
+		break;
+	}
+
+	udev_device_unref(event->dev);
+	event->dev = dev;
+	event->devpath = udev_device_get_devpath(dev);
+}
+
+static int udev_process_queue(void *arg);
+
+static void udev_queue_device(struct pb_udev *udev, struct udev_device *dev)
+{
+	enum udev_action action;
+	struct udev_event *event;
+	const char *name, *devpath;
+
+	name = udev_device_get_action(dev);
+	devpath = udev_device_get_devpath(dev);
+
+	if (!name || !devpath) {
+		pb_log("udev_device_get_action failed\n");
+		udev_device_unref(dev);
+		return;
+	}
+
+	if (!strcmp(name, "add"))
+		action = UDEV_ACTION_ADD;
+	else if (!strcmp(name, "change"))
+		action = UDEV_ACTION_CHANGE;
+	else if (!strcmp(name, "remove"))
+		action = UDEV_ACTION_REMOVE;
+	else {
+		pb_debug("udev: ignoring action %s for %s\n", name, devpath);
+		udev_device_unref(dev);
+		return;
+	}
+
+	event = udev_event_lookup(udev, devpath);
+	if (event) {
+		udev->n_coalesced++;
+		udev_event_coalesce(event, dev, action);
+	} else {
+		event = talloc_zero(udev, struct udev_event);
+		event->dev = dev;
+		event->devpath = devpath;
+		event->action = action;
+		talloc_set_destructor(event, udev_event_destructor);
+		list_add_tail(&udev->hash[udev_devpath_hash(devpath)],
+				&event->hash_list);
+	}
+
+	udev_event_set_priority(udev, event);
+
+	if (!udev->queue_waiter)
+		udev->queue_waiter = waiter_register_timeout(udev->waitset,
+				UDEV_COALESCE_MS, udev_process_queue, udev);
+}
+
+static struct udev_event *udev_queue_next(struct pb_udev *udev)
+{
+	struct udev_event *event;
+	unsigned int i;
+
+	for (i = 0; i < UDEV_PRIORITY_MAX; i++) {
+		event = list_entry(udev->queue[i].head.next,
+				struct udev_event, queue_list, &udev->queue[i]);
+		if (event)
+			return event;
+	}
+
+	return NULL;
+}
+
+static int udev_process_queue(void *arg)
+{
+	struct pb_udev *udev = arg;
+	struct udev_event *event;
+	unsigned int i;
+
+	for (i = 0; i < UDEV_PROCESS_BATCH; i++) {
+		event = udev_queue_next(udev);
+		if (!event)
+			break;
+
+		/* dequeue first, so later events for this device aren't
+		 * coalesced into one we've already handled */
+		list_remove(&event->queue_list);
+		list_remove(&event->hash_list);
+
+		if (event->remove_first)
+			udev_handle_dev_action(event->dev, "remove");
+		udev_handle_dev_action(event->dev,
+				udev_action_name(event->action));
+
+		udev->n_processed++;
+		talloc_free(event);
+	}
+
+	if (udev_queue_next(udev)) {
+		/* leave the rest for the next main loop iteration */
+		waiter_rearm_timeout(udev->queue_waiter, 0);
+		return 0;
+	}
+
+	udev->queue_waiter = NULL;
+	pb_debug("udev: queue empty; %u events received, %u coalesced, "
+			"%u processed\n", udev->n_received,
+			udev->n_coalesced, udev->n_processed);
+	return 0;
+}
+
 /*
- * udev_process - waiter callback for monitor netlink.
+ * udev_process - waiter callback for monitor netlink. We drain the monitor
+ * here, and leave the events to be processed from the queue.
  */
 
 static int udev_process(void *arg)
 {
-	struct udev_monitor *monitor = arg;
+	struct pb_udev *udev = arg;
 	struct udev_device *dev;
-	const char *action;
+	unsigned int i;
 
-	dev = udev_monitor_receive_device(monitor);
-	if (!dev) {
-		pb_log("udev_monitor_receive_device failed\n");
-		return -1;
-	}
+	for (i = 0; i < UDEV_RECEIVE_BATCH; i++) {
+		dev = udev_monitor_receive_device(udev->monitor);
+		if (!dev)
+			break;
 
-	action = udev_device_get_action(dev);
+		udev->n_received++;
+		udev_queue_device(udev, dev);
+	}
 
-	if (!action) {
-		pb_log("udev_device_get_action failed\n");
-	} else {
-		udev_handle_dev_action(dev, action);
+	if (!i) {
+		pb_log("udev_monitor_receive_device failed\n");
+		return -1;
 	}
 
-	udev_device_unref(dev);
 	return 0;
 }
 
@@ -635,11 +1004,18 @@ struct pb_udev *udev_init(struct device_handler *handler,
 		struct waitset *waitset)
 {
 	struct pb_udev *udev;
+	unsigned int i;
 	int result;
 
 	udev = talloc_zero(handler, struct pb_udev);
 	talloc_set_destructor(udev, udev_destructor);
 	udev->handler = handler;
+	udev->waitset = waitset;
+
+	for (i = 0; i < UDEV_PRIORITY_MAX; i++)
+		list_init(&udev->queue[i]);
+	for (i = 0; i < UDEV_HASH_SIZE; i++)
+		list_init(&udev->hash[i]);
 
 	udev->udev = udev_new();
 
@@ -663,7 +1039,7 @@ struct pb_udev *udev_init(struct device_handler *handler,
 		goto fail;
 
 	waiter_register_io(waitset, udev_monitor_get_fd(udev->monitor), WAIT_IN,
-		udev_process, udev->monitor);
+		udev_process, udev);
 
 	pb_debug("%s: waiting on udev\n", __func__);
 
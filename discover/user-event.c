@@ -423,9 +423,9 @@ static int user_event_dhcp(struct user_event *uev, struct event *event)
 	return 0;
 }
 
-static int user_event_add(struct user_event *uev, struct event *event)
+int user_event_add_option(struct device_handler *handler,
+		struct event *event)
 {
-	struct device_handler *handler = uev->handler;
 	struct discover_context *ctx;
 	struct discover_device *dev;
 	int rc;
@@ -434,6 +434,7 @@ static int user_event_add(struct user_event *uev, struct event *event)
 	dev = discover_device_create(handler, event_get_param(event, "mac"),
 					event->device);
 	dev->device->id = talloc_strdup(dev, event->device);
+	device_handler_reindex_device(handler, dev);
 	ctx = device_handler_discover_context_create(handler, dev);
 
 	rc = parse_user_event(ctx, event);
@@ -449,6 +450,11 @@ static int user_event_add(struct user_event *uev, struct event *event)
 	return 0;
 }
 
+static int user_event_add(struct user_event *uev, struct event *event)
+{
+	return user_event_add_option(uev->handler, event);
+}
+
 static int user_event_remove(struct user_event *uev, struct event *event)
 {
 	struct device_handler *handler = uev->handler;
@@ -564,7 +570,7 @@ static int process_uninstalled_plugin(struct user_event *uev,
 		path += strlen(device->mount_path) + 1;
 	}
 
-	res = talloc(file_opt, struct resource);
+	res = talloc_zero(file_opt, struct resource);
 	resolve_resource_against_device(res, device, path);
 	file_opt->boot_image = res;
 
@@ -33,6 +33,8 @@ struct pb_url *user_event_parse_conf_url(struct discover_context *ctx,
 		struct event *event, bool *complete_url);
 char **user_event_parse_conf_filenames(
 		struct discover_context *ctx, struct event *event);
+int user_event_add_option(struct device_handler *handler,
+		struct event *event);
 struct user_event *user_event_init(struct device_handler *handler,
 		struct waitset *waitset);
 
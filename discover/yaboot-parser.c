@@ -400,6 +400,7 @@ static struct parser yaboot_parser = {
 	.name			= "yaboot",
 	.parse			= yaboot_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.prefetch_files		= yaboot_conf_files,
 };
 
 register_parser(yaboot_parser);
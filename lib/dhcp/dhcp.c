@@ -0,0 +1,967 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "dhcp.h"
+
+#define DHCP_SERVER_PORT	67
+#define DHCP_CLIENT_PORT	68
+#define DHCP_MAGIC_COOKIE	0x63825363
+#define DHCP_OPTIONS_LEN	308
+#define DHCP_FLAG_BROADCAST	0x8000
+
+#define BOOTREQUEST		1
+#define BOOTREPLY		2
+
+enum {
+	DHCPDISCOVER = 1,
+	DHCPOFFER,
+	DHCPREQUEST,
+	DHCPDECLINE,
+	DHCPACK,
+	DHCPNAK,
+	DHCPRELEASE,
+};
+
+enum {
+	OPT_PAD			= 0,
+	OPT_SUBNET_MASK		= 1,
+	OPT_ROUTER		= 3,
+	OPT_DNS_SERVER		= 6,
+	OPT_HOSTNAME		= 12,
+	OPT_DOMAIN		= 15,
+	OPT_ROOTPATH		= 17,
+	OPT_BROADCAST		= 28,
+	OPT_REQUESTED_IP	= 50,
+	OPT_LEASE_TIME		= 51,
+	OPT_OVERLOAD		= 52,
+	OPT_MESSAGE_TYPE	= 53,
+	OPT_SERVER_ID		= 54,
+	OPT_PARAM_REQUEST	= 55,
+	OPT_MAX_SIZE		= 57,
+	OPT_RENEWAL_TIME	= 58,
+	OPT_REBINDING_TIME	= 59,
+	OPT_TFTP_SERVER		= 66,
+	OPT_BOOTFILE		= 67,
+	OPT_CLIENT_ARCH		= 93,
+	OPT_PXECONFFILE		= 209,
+	OPT_PXEPATHPREFIX	= 210,
+	OPT_REBOOTTIME		= 211,
+	OPT_END			= 255,
+};
+
+/* timeouts, in milliseconds */
+#define DISCOVER_TIMEOUT_MIN	2000
+#define DISCOVER_TIMEOUT_MAX	16000
+#define REQUEST_TIMEOUT		2000
+#define REQUEST_RETRIES		3
+#define RENEW_TIMEOUT_MIN	1000
+#define RENEW_TIMEOUT_MAX	60000
+/* the longest we sleep before re-checking the lease deadlines */
+#define TIMER_MAX		3600000
+
+struct dhcp_packet {
+	uint8_t		op;
+	uint8_t		htype;
+	uint8_t		hlen;
+	uint8_t		hops;
+	uint32_t	xid;
+	uint16_t	secs;
+	uint16_t	flags;
+	uint32_t	ciaddr;
+	uint32_t	yiaddr;
+	uint32_t	siaddr;
+	uint32_t	giaddr;
+	uint8_t		chaddr[16];
+	uint8_t		sname[64];
+	uint8_t		file[128];
+	uint32_t	cookie;
+	uint8_t		options[DHCP_OPTIONS_LEN];
+} __attribute__((packed));
+
+struct dhcp_frame {
+	struct iphdr		ip;
+	struct udphdr		udp;
+	struct dhcp_packet	dhcp;
+} __attribute__((packed));
+
+enum dhcp_state {
+	DHCP_STATE_STOPPED,
+	DHCP_STATE_SELECTING,
+	DHCP_STATE_REQUESTING,
+	DHCP_STATE_REBOOTING,
+	DHCP_STATE_BOUND,
+	DHCP_STATE_RENEWING,
+	DHCP_STATE_REBINDING,
+};
+
+struct dhcp_client {
+	struct waitset		*waitset;
+	int			ifindex;
+	uint8_t			hwaddr[ETH_ALEN];
+	uint16_t		arch_id;
+	dhcp_lease_cb		cb;
+	void			*data;
+
+	int			fd;
+	struct waiter		*io_waiter;
+	struct waiter		*timer;
+
+	enum dhcp_state		state;
+	uint32_t		xid;
+	uint32_t		seed;
+	unsigned int		timeout;
+	unsigned int		retries;
+	uint64_t		start_time;
+
+	/* the offer we're requesting */
+	struct in_addr		requested;
+	struct in_addr		server_id;
+
+	/* the current lease, or the last one we had */
+	struct dhcp_lease	*lease;
+	uint64_t		t1, t2, expiry;
+};
+
+/* the options parsed from a server's reply */
+struct dhcp_options {
+	int		type;
+	const uint8_t	*opts[256];
+	uint8_t		lens[256];
+};
+
+static const uint8_t param_request_list[] = {
+	OPT_SUBNET_MASK, OPT_ROUTER, OPT_DNS_SERVER, OPT_HOSTNAME,
+	OPT_DOMAIN, OPT_ROOTPATH, OPT_BROADCAST, OPT_TFTP_SERVER,
+	OPT_BOOTFILE, OPT_PXECONFFILE, OPT_PXEPATHPREFIX, OPT_REBOOTTIME,
+};
+
+static void dhcp_client_discover(struct dhcp_client *client);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t dhcp_random(struct dhcp_client *client)
+{
+	/* xorshift; we just need xids that differ between clients and
+	 * restarts, not cryptographic randomness */
+	client->seed ^= client->seed << 13;
+	client->seed ^= client->seed >> 17;
+	client->seed ^= client->seed << 5;
+	return client->seed;
+}
+
+static uint16_t ip_checksum(const void *buf, unsigned int len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+
+	for (; len > 1; len -= 2, p += 2)
+		sum += (p[0] << 8) | p[1];
+	if (len)
+		sum += p[0] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum & 0xffff);
+}
+
+static uint8_t *dhcp_add_option(uint8_t *opt, int code, const void *data,
+		unsigned int len)
+{
+	*opt++ = code;
+	*opt++ = len;
+	memcpy(opt, data, len);
+	return opt + len;
+}
+
+/* Start a request packet of the given message type */
+static uint8_t *dhcp_init_packet(struct dhcp_client *client,
+		struct dhcp_packet *packet, int type)
+{
+	uint16_t max_size = htons(sizeof(struct dhcp_frame));
+	uint8_t *opt, msg_type = type;
+	uint64_t secs;
+
+	memset(packet, 0, sizeof(*packet));
+	packet->op = BOOTREQUEST;
+	packet->htype = 1;
+	packet->hlen = ETH_ALEN;
+	packet->xid = client->xid;
+	packet->cookie = htonl(DHCP_MAGIC_COOKIE);
+	memcpy(packet->chaddr, client->hwaddr, ETH_ALEN);
+
+	secs = (now_ms() - client->start_time) / 1000;
+	packet->secs = htons(secs > 0xffff ? 0xffff : secs);
+
+	opt = packet->options;
+	opt = dhcp_add_option(opt, OPT_MESSAGE_TYPE, &msg_type, 1);
+
+	if (type == DHCPRELEASE)
+		return opt;
+
+	opt = dhcp_add_option(opt, OPT_MAX_SIZE, &max_size, sizeof(max_size));
+	opt = dhcp_add_option(opt, OPT_PARAM_REQUEST, param_request_list,
+			sizeof(param_request_list));
+
+	if (client->arch_id != DHCP_ARCH_ID_NONE) {
+		uint16_t arch = htons(client->arch_id);
+		opt = dhcp_add_option(opt, OPT_CLIENT_ARCH, &arch, sizeof(arch));
+	}
+
+	return opt;
+}
+
+/* Send a packet, broadcast at the link layer. We use the packet socket even
+ * once we have an address, as the caller may not have configured it yet. */
+static int dhcp_send(struct dhcp_client *client, struct dhcp_packet *packet,
+		uint8_t *end, struct in_addr src, struct in_addr dst)
+{
+	struct {
+		uint32_t	saddr;
+		uint32_t	daddr;
+		uint8_t		zero;
+		uint8_t		protocol;
+		uint16_t	len;
+	} __attribute__((packed)) pseudo;
+	struct dhcp_frame frame;
+	struct sockaddr_ll addr;
+	unsigned int len;
+	uint32_t sum;
+	int rc;
+
+	*end++ = OPT_END;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.dhcp = *packet;
+	len = offsetof(struct dhcp_frame, dhcp) +
+		offsetof(struct dhcp_packet, options) +
+		(end - packet->options);
+	/* pad to the minimum BOOTP message size, as some servers expect */
+	if (len < sizeof(frame))
+		len = sizeof(frame);
+
+	frame.udp.source = htons(DHCP_CLIENT_PORT);
+	frame.udp.dest = htons(DHCP_SERVER_PORT);
+	frame.udp.len = htons(len - offsetof(struct dhcp_frame, udp));
+
+	pseudo.saddr = src.s_addr;
+	pseudo.daddr = dst.s_addr;
+	pseudo.zero = 0;
+	pseudo.protocol = IPPROTO_UDP;
+	pseudo.len = frame.udp.len;
+
+	sum = ntohs(~ip_checksum(&pseudo, sizeof(pseudo), 0) & 0xffff);
+	frame.udp.check = ip_checksum(&frame.udp,
+			len - offsetof(struct dhcp_frame, udp), sum);
+	if (!frame.udp.check)
+		frame.udp.check = 0xffff;
+
+	frame.ip.version = 4;
+	frame.ip.ihl = sizeof(frame.ip) / 4;
+	frame.ip.tot_len = htons(len);
+	frame.ip.ttl = IPDEFTTL;
+	frame.ip.protocol = IPPROTO_UDP;
+	frame.ip.saddr = src.s_addr;
+	frame.ip.daddr = dst.s_addr;
+	frame.ip.check = ip_checksum(&frame.ip, sizeof(frame.ip), 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_IP);
+	addr.sll_ifindex = client->ifindex;
+	addr.sll_halen = ETH_ALEN;
+	memset(addr.sll_addr, 0xff, ETH_ALEN);
+
+	rc = sendto(client->fd, &frame, len, 0,
+			(struct sockaddr *)&addr, sizeof(addr));
+	if (rc < 0) {
+		pb_log("dhcp: send failed on interface %d: %s\n",
+				client->ifindex, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dhcp_timer_cb(void *arg);
+
+static void dhcp_set_timer(struct dhcp_client *client, uint64_t delay)
+{
+	if (delay > TIMER_MAX)
+		delay = TIMER_MAX;
+
+	if (client->timer)
+		waiter_rearm_timeout(client->timer, delay);
+	else
+		client->timer = waiter_register_timeout(client->waitset,
+				delay, dhcp_timer_cb, client);
+}
+
+static void dhcp_cancel_timer(struct dhcp_client *client)
+{
+	if (client->timer) {
+		waiter_remove(client->timer);
+		client->timer = NULL;
+	}
+}
+
+/* a random factor of +/- 1s, as suggested by RFC2131 */
+static unsigned int dhcp_jitter(struct dhcp_client *client,
+		unsigned int timeout)
+{
+	return timeout - 1000 + dhcp_random(client) % 2000;
+}
+
+static void dhcp_send_discover(struct dhcp_client *client)
+{
+	struct dhcp_packet packet;
+	struct in_addr any, bcast;
+	uint8_t *opt;
+
+	any.s_addr = INADDR_ANY;
+	bcast.s_addr = INADDR_BROADCAST;
+
+	opt = dhcp_init_packet(client, &packet, DHCPDISCOVER);
+	packet.flags = htons(DHCP_FLAG_BROADCAST);
+
+	pb_debug("dhcp: sending discover on interface %d\n", client->ifindex);
+	dhcp_send(client, &packet, opt, any, bcast);
+}
+
+/* Send a request: for an offer (SELECTING), a cached lease (REBOOTING), or
+ * to extend our current lease (RENEWING, REBINDING) */
+static void dhcp_send_request(struct dhcp_client *client)
+{
+	struct dhcp_packet packet;
+	struct in_addr src, dst;
+	uint8_t *opt;
+
+	opt = dhcp_init_packet(client, &packet, DHCPREQUEST);
+	src.s_addr = INADDR_ANY;
+	dst.s_addr = INADDR_BROADCAST;
+
+	switch (client->state) {
+	case DHCP_STATE_REQUESTING:
+		opt = dhcp_add_option(opt, OPT_SERVER_ID,
+				&client->server_id, 4);
+		/* fall through */
+	case DHCP_STATE_REBOOTING:
+		opt = dhcp_add_option(opt, OPT_REQUESTED_IP,
+				&client->requested, 4);
+		packet.flags = htons(DHCP_FLAG_BROADCAST);
+		break;
+	case DHCP_STATE_RENEWING:
+	case DHCP_STATE_REBINDING:
+		packet.ciaddr = client->lease->address.s_addr;
+		src = client->lease->address;
+		break;
+	default:
+		return;
+	}
+
+	pb_debug("dhcp: sending request for %s on interface %d\n",
+			inet_ntoa(client->state == DHCP_STATE_RENEWING ||
+				client->state == DHCP_STATE_REBINDING ?
+				client->lease->address : client->requested),
+			client->ifindex);
+	dhcp_send(client, &packet, opt, src, dst);
+}
+
+static void dhcp_send_release(struct dhcp_client *client)
+{
+	struct dhcp_packet packet;
+	struct in_addr dst;
+	uint8_t *opt;
+
+	opt = dhcp_init_packet(client, &packet, DHCPRELEASE);
+	opt = dhcp_add_option(opt, OPT_SERVER_ID,
+			&client->lease->server_id, 4);
+	packet.ciaddr = client->lease->address.s_addr;
+
+	dst.s_addr = INADDR_BROADCAST;
+	dhcp_send(client, &packet, opt, client->lease->address, dst);
+}
+
+static void dhcp_parse_option_area(struct dhcp_options *options,
+		const uint8_t *buf, unsigned int len)
+{
+	unsigned int i = 0;
+
+	uint8_t code, optlen;
+
+	while (i < len) {
+		code = buf[i++];
+
+		if (code == OPT_PAD)
+			continue;
+		if (code == OPT_END || i >= len)
+			break;
+
+		optlen = buf[i++];
+		if (i + optlen > len)
+			break;
+
+		/* we don't concatenate long options (RFC3396); the first
+		 * instance wins */
+		if (!options->opts[code]) {
+			options->opts[code] = buf + i;
+			options->lens[code] = optlen;
+		}
+		i += optlen;
+	}
+}
+
+static int dhcp_parse_options(struct dhcp_options *options,
+		const struct dhcp_packet *packet, unsigned int options_len)
+{
+	memset(options, 0, sizeof(*options));
+
+	dhcp_parse_option_area(options, packet->options, options_len);
+
+	if (options->opts[OPT_OVERLOAD] && options->lens[OPT_OVERLOAD] == 1) {
+		uint8_t overload = options->opts[OPT_OVERLOAD][0];
+
+		if (overload & 1)
+			dhcp_parse_option_area(options, packet->file,
+					sizeof(packet->file));
+		if (overload & 2)
+			dhcp_parse_option_area(options, packet->sname,
+					sizeof(packet->sname));
+	}
+
+	if (!options->opts[OPT_MESSAGE_TYPE] ||
+			options->lens[OPT_MESSAGE_TYPE] != 1)
+		return -1;
+
+	options->type = options->opts[OPT_MESSAGE_TYPE][0];
+	return 0;
+}
+
+static bool dhcp_get_addr(const struct dhcp_options *options, int code,
+		struct in_addr *addr)
+{
+	if (!options->opts[code] || options->lens[code] < 4)
+		return false;
+
+	memcpy(addr, options->opts[code], 4);
+	return true;
+}
+
+static bool dhcp_get_u32(const struct dhcp_options *options, int code,
+		uint32_t *val)
+{
+	if (!options->opts[code] || options->lens[code] != 4)
+		return false;
+
+	memcpy(val, options->opts[code], 4);
+	*val = ntohl(*val);
+	return true;
+}
+
+static char *dhcp_get_string(void *ctx, const struct dhcp_options *options,
+		int code)
+{
+	if (!options->opts[code] || !options->lens[code])
+		return NULL;
+
+	return talloc_strndup(ctx, (const char *)options->opts[code],
+			options->lens[code]);
+}
+
+static struct dhcp_lease *dhcp_parse_lease(struct dhcp_client *client,
+		const struct dhcp_packet *packet,
+		const struct dhcp_options *options)
+{
+	struct dhcp_lease *lease;
+	struct in_addr mask;
+	unsigned int i;
+
+	lease = talloc_zero(client, struct dhcp_lease);
+	lease->address.s_addr = packet->yiaddr;
+	lease->siaddr.s_addr = packet->siaddr;
+	dhcp_get_addr(options, OPT_SERVER_ID, &lease->server_id);
+
+	if (dhcp_get_addr(options, OPT_SUBNET_MASK, &mask))
+		lease->prefixlen = __builtin_popcount(mask.s_addr);
+	else
+		lease->prefixlen = 24;
+
+	lease->have_router = dhcp_get_addr(options, OPT_ROUTER,
+			&lease->router);
+
+	if (options->opts[OPT_DNS_SERVER]) {
+		lease->n_dns_servers = options->lens[OPT_DNS_SERVER] / 4;
+		lease->dns_servers = talloc_array(lease, struct in_addr,
+				lease->n_dns_servers);
+		for (i = 0; i < lease->n_dns_servers; i++)
+			memcpy(&lease->dns_servers[i],
+				options->opts[OPT_DNS_SERVER] + i * 4, 4);
+	}
+
+	if (!dhcp_get_u32(options, OPT_LEASE_TIME, &lease->lease_time))
+		lease->lease_time = 0xffffffff;
+
+	lease->have_reboottime = dhcp_get_u32(options, OPT_REBOOTTIME,
+			&lease->reboottime);
+
+	lease->hostname = dhcp_get_string(lease, options, OPT_HOSTNAME);
+	lease->domain = dhcp_get_string(lease, options, OPT_DOMAIN);
+	lease->rootpath = dhcp_get_string(lease, options, OPT_ROOTPATH);
+	lease->tftp_server = dhcp_get_string(lease, options, OPT_TFTP_SERVER);
+	lease->pxeconffile = dhcp_get_string(lease, options, OPT_PXECONFFILE);
+	lease->pxepathprefix = dhcp_get_string(lease, options,
+			OPT_PXEPATHPREFIX);
+
+	/* the bootfile option takes precedence over the header field,
+	 * unless the field has been overloaded with options */
+	lease->bootfile = dhcp_get_string(lease, options, OPT_BOOTFILE);
+	if (!lease->bootfile && packet->file[0] &&
+			!(options->opts[OPT_OVERLOAD] &&
+				options->opts[OPT_OVERLOAD][0] & 1))
+		lease->bootfile = talloc_strndup(lease,
+				(const char *)packet->file,
+				sizeof(packet->file));
+
+	return lease;
+}
+
+static void dhcp_lease_set_deadlines(struct dhcp_client *client,
+		const struct dhcp_options *options)
+{
+	uint32_t lease_time = client->lease->lease_time, t1, t2;
+	uint64_t now = now_ms();
+
+	if (lease_time == 0xffffffff) {
+		client->t1 = client->t2 = client->expiry = UINT64_MAX;
+		return;
+	}
+
+	if (!dhcp_get_u32(options, OPT_RENEWAL_TIME, &t1) || t1 > lease_time)
+		t1 = lease_time / 2;
+	if (!dhcp_get_u32(options, OPT_REBINDING_TIME, &t2) ||
+			t2 > lease_time || t2 < t1)
+		t2 = (uint64_t)lease_time * 7 / 8;
+
+	client->t1 = now + (uint64_t)t1 * 1000;
+	client->t2 = now + (uint64_t)t2 * 1000;
+	client->expiry = now + (uint64_t)lease_time * 1000;
+}
+
+/* Wait for the next deadline in the BOUND state, or retransmit a renewal
+ * in the RENEWING and REBINDING states */
+static void dhcp_set_lease_timer(struct dhcp_client *client)
+{
+	uint64_t now = now_ms(), deadline, timeout;
+
+	if (client->state == DHCP_STATE_BOUND) {
+		if (client->t1 == UINT64_MAX) {
+			dhcp_cancel_timer(client);
+			return;
+		}
+		dhcp_set_timer(client, client->t1 > now ? client->t1 - now : 0);
+		return;
+	}
+
+	/* RFC2131: retransmit at half the remaining time to the next
+	 * state, down to a minimum */
+	deadline = client->state == DHCP_STATE_RENEWING ?
+		client->t2 : client->expiry;
+	timeout = deadline > now ? (deadline - now) / 2 : 0;
+	if (timeout < RENEW_TIMEOUT_MIN)
+		timeout = RENEW_TIMEOUT_MIN;
+	if (timeout > RENEW_TIMEOUT_MAX)
+		timeout = RENEW_TIMEOUT_MAX;
+	if (deadline > now && timeout > deadline - now)
+		timeout = deadline - now;
+
+	dhcp_set_timer(client, timeout);
+}
+
+static void dhcp_lease_expired(struct dhcp_client *client)
+{
+	struct dhcp_lease *lease = client->lease;
+
+	pb_log("dhcp: lease for %s on interface %d lost\n",
+			inet_ntoa(lease->address), client->ifindex);
+
+	client->lease = NULL;
+	client->cb(client->data, DHCP_EVENT_EXPIRED, lease);
+	talloc_free(lease);
+}
+
+static void dhcp_handle_ack(struct dhcp_client *client,
+		const struct dhcp_packet *packet,
+		const struct dhcp_options *options)
+{
+	struct dhcp_lease *lease, *old = client->lease;
+	enum dhcp_event event;
+
+	lease = dhcp_parse_lease(client, packet, options);
+	if (!lease->server_id.s_addr && old)
+		lease->server_id = old->server_id;
+
+	/* a renewal that changes our address is a new lease */
+	if ((client->state == DHCP_STATE_RENEWING ||
+				client->state == DHCP_STATE_REBINDING) &&
+			old->address.s_addr == lease->address.s_addr)
+		event = DHCP_EVENT_RENEWED;
+	else
+		event = DHCP_EVENT_BOUND;
+
+	client->lease = lease;
+	client->state = DHCP_STATE_BOUND;
+	dhcp_lease_set_deadlines(client, options);
+	dhcp_set_lease_timer(client);
+
+	pb_log("dhcp: %s %s/%u on interface %d, lease %us\n",
+			event == DHCP_EVENT_BOUND ? "bound" : "renewed",
+			inet_ntoa(lease->address), lease->prefixlen,
+			client->ifindex, lease->lease_time);
+
+	client->cb(client->data, event, lease);
+	talloc_free(old);
+}
+
+static void dhcp_handle_packet(struct dhcp_client *client,
+		const struct dhcp_packet *packet, unsigned int options_len)
+{
+	struct dhcp_options options;
+	struct in_addr server_id;
+
+	if (packet->op != BOOTREPLY || packet->xid != client->xid ||
+			packet->cookie != htonl(DHCP_MAGIC_COOKIE) ||
+			memcmp(packet->chaddr, client->hwaddr, ETH_ALEN))
+		return;
+
+	if (dhcp_parse_options(&options, packet, options_len))
+		return;
+
+	switch (client->state) {
+	case DHCP_STATE_SELECTING:
+		if (options.type != DHCPOFFER || !packet->yiaddr)
+			return;
+		if (!dhcp_get_addr(&options, OPT_SERVER_ID, &server_id))
+			return;
+
+		/* take the first offer */
+		client->requested.s_addr = packet->yiaddr;
+		client->server_id = server_id;
+		client->state = DHCP_STATE_REQUESTING;
+		client->retries = 0;
+		dhcp_send_request(client);
+		dhcp_set_timer(client, REQUEST_TIMEOUT);
+		break;
+
+	case DHCP_STATE_REQUESTING:
+	case DHCP_STATE_REBOOTING:
+	case DHCP_STATE_RENEWING:
+	case DHCP_STATE_REBINDING:
+		if (options.type == DHCPACK && packet->yiaddr) {
+			dhcp_handle_ack(client, packet, &options);
+
+		} else if (options.type == DHCPNAK) {
+			pb_debug("dhcp: request refused on interface %d\n",
+					client->ifindex);
+			if (client->state == DHCP_STATE_RENEWING ||
+					client->state == DHCP_STATE_REBINDING)
+				dhcp_lease_expired(client);
+			/* forget the cached lease too */
+			talloc_free(client->lease);
+			client->lease = NULL;
+			dhcp_client_discover(client);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int dhcp_process(void *arg)
+{
+	struct dhcp_client *client = arg;
+	unsigned int ihl, len, tot_len;
+	struct dhcp_frame frame;
+	const uint8_t *buf;
+	int rc;
+
+	rc = recv(client->fd, &frame, sizeof(frame), MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			pb_log("dhcp: recv failed on interface %d: %s\n",
+					client->ifindex, strerror(errno));
+		return 0;
+	}
+
+	len = rc;
+	buf = (const uint8_t *)&frame;
+
+	/* the socket filter has checked this is UDP to the client port,
+	 * but not the lengths */
+	if (len < sizeof(struct iphdr))
+		return 0;
+
+	ihl = frame.ip.ihl * 4;
+	tot_len = ntohs(frame.ip.tot_len);
+	if (ihl < sizeof(struct iphdr) || tot_len < ihl || tot_len > len)
+		return 0;
+	len = tot_len;
+
+	/* move the UDP header up to its usual place if the IP header has
+	 * options */
+	if (ihl != sizeof(struct iphdr)) {
+		memmove(&frame.udp, buf + ihl, len - ihl);
+		len -= ihl - sizeof(struct iphdr);
+	}
+
+	if (len < offsetof(struct dhcp_frame, dhcp.options))
+		return 0;
+
+	dhcp_handle_packet(client, &frame.dhcp,
+			len - offsetof(struct dhcp_frame, dhcp.options));
+
+	return 0;
+}
+
+static int dhcp_open_socket(struct dhcp_client *client)
+{
+	/* accept unfragmented UDP datagrams to the client port; with a
+	 * SOCK_DGRAM packet socket, the data starts at the IP header */
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DHCP_CLIENT_PORT, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+	struct sockaddr_ll addr;
+	int fd, rc;
+
+	fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_IP));
+	if (fd < 0) {
+		pb_log("dhcp: can't create packet socket: %s\n",
+				strerror(errno));
+		return -1;
+	}
+
+	rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	if (rc) {
+		pb_log("dhcp: can't attach socket filter: %s\n",
+				strerror(errno));
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_IP);
+	addr.sll_ifindex = client->ifindex;
+
+	rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (rc) {
+		pb_log("dhcp: can't bind to interface %d: %s\n",
+				client->ifindex, strerror(errno));
+		goto err;
+	}
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static void dhcp_client_discover(struct dhcp_client *client)
+{
+	client->state = DHCP_STATE_SELECTING;
+	client->xid = dhcp_random(client);
+	client->timeout = DISCOVER_TIMEOUT_MIN;
+	dhcp_send_discover(client);
+	dhcp_set_timer(client, dhcp_jitter(client, client->timeout));
+}
+
+static int dhcp_timer_cb(void *arg)
+{
+	struct dhcp_client *client = arg;
+	uint64_t now = now_ms();
+
+	client->timer = NULL;
+
+	switch (client->state) {
+	case DHCP_STATE_SELECTING:
+		if (client->timeout < DISCOVER_TIMEOUT_MAX)
+			client->timeout *= 2;
+		dhcp_send_discover(client);
+		dhcp_set_timer(client, dhcp_jitter(client, client->timeout));
+		break;
+
+	case DHCP_STATE_REQUESTING:
+	case DHCP_STATE_REBOOTING:
+		if (++client->retries >= REQUEST_RETRIES) {
+			/* no answer for our cached lease, or the offer; start
+			 * again from the beginning */
+			dhcp_client_discover(client);
+			break;
+		}
+		dhcp_send_request(client);
+		dhcp_set_timer(client, REQUEST_TIMEOUT);
+		break;
+
+	case DHCP_STATE_BOUND:
+	case DHCP_STATE_RENEWING:
+	case DHCP_STATE_REBINDING:
+		if (now >= client->expiry) {
+			dhcp_lease_expired(client);
+			dhcp_client_discover(client);
+			break;
+		}
+
+		if (now >= client->t2)
+			client->state = DHCP_STATE_REBINDING;
+		else if (now >= client->t1)
+			client->state = DHCP_STATE_RENEWING;
+
+		if (client->state != DHCP_STATE_BOUND)
+			dhcp_send_request(client);
+		dhcp_set_lease_timer(client);
+		break;
+
+	case DHCP_STATE_STOPPED:
+		break;
+	}
+
+	return 0;
+}
+
+/* Stop the state machine and close the socket, keeping any lease */
+static void dhcp_client_reset(struct dhcp_client *client)
+{
+	client->state = DHCP_STATE_STOPPED;
+	dhcp_cancel_timer(client);
+
+	if (client->io_waiter) {
+		waiter_remove(client->io_waiter);
+		client->io_waiter = NULL;
+	}
+
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+	}
+}
+
+int dhcp_client_start(struct dhcp_client *client)
+{
+	dhcp_client_reset(client);
+
+	client->fd = dhcp_open_socket(client);
+	if (client->fd < 0)
+		return -1;
+
+	client->io_waiter = waiter_register_io(client->waitset, client->fd,
+			WAIT_IN, dhcp_process, client);
+	client->start_time = now_ms();
+
+	if (client->lease) {
+		/* try to re-use our previous address */
+		client->state = DHCP_STATE_REBOOTING;
+		client->xid = dhcp_random(client);
+		client->requested = client->lease->address;
+		client->retries = 0;
+		dhcp_send_request(client);
+		dhcp_set_timer(client, REQUEST_TIMEOUT);
+	} else {
+		dhcp_client_discover(client);
+	}
+
+	return 0;
+}
+
+void dhcp_client_stop(struct dhcp_client *client)
+{
+	if (client->state == DHCP_STATE_BOUND ||
+			client->state == DHCP_STATE_RENEWING ||
+			client->state == DHCP_STATE_REBINDING)
+		dhcp_send_release(client);
+
+	dhcp_client_reset(client);
+}
+
+static int dhcp_client_destroy(void *arg)
+{
+	struct dhcp_client *client = arg;
+
+	dhcp_client_stop(client);
+	return 0;
+}
+
+struct dhcp_client *dhcp_client_create(void *ctx, struct waitset *set,
+		int ifindex, const uint8_t *hwaddr, uint16_t arch_id,
+		dhcp_lease_cb cb, void *data)
+{
+	struct dhcp_client *client;
+	unsigned int i;
+
+	client = talloc_zero(ctx, struct dhcp_client);
+	client->waitset = set;
+	client->ifindex = ifindex;
+	client->arch_id = arch_id;
+	client->cb = cb;
+	client->data = data;
+	client->fd = -1;
+	client->state = DHCP_STATE_STOPPED;
+	memcpy(client->hwaddr, hwaddr, ETH_ALEN);
+
+	client->seed = now_ms() ^ ifindex;
+	for (i = 0; i < ETH_ALEN; i++)
+		client->seed = (client->seed << 5) ^ (client->seed >> 27) ^
+			hwaddr[i];
+	if (!client->seed)
+		client->seed = 1;
+
+	talloc_set_destructor(client, dhcp_client_destroy);
+
+	return client;
+}
@@ -0,0 +1,73 @@
+#ifndef _DHCP_H
+#define _DHCP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* A DHCPv4 client, run from the waitset.
+ *
+ * Each client uses a packet socket on its interface, so clients for any
+ * number of interfaces can run in parallel without a process per
+ * interface. The client only acquires and maintains the lease; applying
+ * the address and routes is up to the caller's lease callback.
+ *
+ * The last lease acquired is remembered, and a restarted client first asks
+ * to re-use that address (the INIT-REBOOT state) rather than going through
+ * a full discovery.
+ */
+
+struct waitset;
+struct dhcp_client;
+
+#define DHCP_ARCH_ID_NONE	0xffff
+
+struct dhcp_lease {
+	struct in_addr	address;
+	unsigned int	prefixlen;
+	struct in_addr	router;
+	struct in_addr	server_id;
+	struct in_addr	siaddr;
+	struct in_addr	*dns_servers;
+	unsigned int	n_dns_servers;
+	uint32_t	lease_time;
+
+	/* string options, or NULL if the server didn't provide them */
+	char		*hostname;
+	char		*domain;
+	char		*rootpath;
+	char		*tftp_server;
+	char		*bootfile;
+	char		*pxeconffile;
+	char		*pxepathprefix;
+
+	bool		have_router;
+	bool		have_reboottime;
+	uint32_t	reboottime;
+};
+
+enum dhcp_event {
+	/* a new lease has been acquired */
+	DHCP_EVENT_BOUND,
+	/* the existing lease has been extended */
+	DHCP_EVENT_RENEWED,
+	/* the lease has expired or been refused; lease is the old lease */
+	DHCP_EVENT_EXPIRED,
+};
+
+typedef void (*dhcp_lease_cb)(void *data, enum dhcp_event event,
+		const struct dhcp_lease *lease);
+
+/* @arch_id is sent as the client system architecture option (93), unless
+ * it is DHCP_ARCH_ID_NONE */
+struct dhcp_client *dhcp_client_create(void *ctx, struct waitset *set,
+		int ifindex, const uint8_t *hwaddr, uint16_t arch_id,
+		dhcp_lease_cb cb, void *data);
+
+/* Start acquiring a lease. Starting a running client restarts it */
+int dhcp_client_start(struct dhcp_client *client);
+
+/* Stop the client, releasing any current lease */
+void dhcp_client_stop(struct dhcp_client *client);
+
+#endif /* _DHCP_H */
@@ -0,0 +1,984 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "dhcp6.h"
+
+#define DHCP6_CLIENT_PORT	546
+#define DHCP6_SERVER_PORT	547
+#define DHCP6_MSG_SIZE		1500
+/* a DUID is at most 128 bytes, plus its type */
+#define DUID_MAX_LEN		130
+
+enum {
+	DHCP6_SOLICIT = 1,
+	DHCP6_ADVERTISE,
+	DHCP6_REQUEST,
+	DHCP6_CONFIRM,
+	DHCP6_RENEW,
+	DHCP6_REBIND,
+	DHCP6_REPLY,
+	DHCP6_RELEASE,
+};
+
+enum {
+	OPT_CLIENTID		= 1,
+	OPT_SERVERID		= 2,
+	OPT_IA_NA		= 3,
+	OPT_IAADDR		= 5,
+	OPT_ORO			= 6,
+	OPT_ELAPSED_TIME	= 8,
+	OPT_STATUS_CODE		= 13,
+	OPT_DNS_SERVERS		= 23,
+	OPT_BOOTFILE_URL	= 59,
+	OPT_BOOTFILE_PARAM	= 60,
+	OPT_CLIENT_ARCH		= 61,
+};
+
+enum {
+	STATUS_SUCCESS		= 0,
+	STATUS_NOADDRSAVAIL	= 2,
+	STATUS_NOBINDING	= 3,
+	STATUS_NOTONLINK	= 4,
+};
+
+/* timeouts, in milliseconds, from RFC8415. We cap the solicit timeout well
+ * below SOL_MAX_RT, as we're waiting on the lease to boot */
+#define SOL_TIMEOUT		1000
+#define SOL_MAX_RT		120000
+#define REQ_TIMEOUT		1000
+#define REQ_MAX_RT		30000
+#define REQ_MAX_RC		10
+#define REN_TIMEOUT		10000
+#define REN_MAX_RT		600000
+/* the longest we sleep before re-checking the lease deadlines */
+#define TIMER_MAX		3600000
+
+static const struct in6_addr all_servers = {
+	{ { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0, 0x02 } }
+};
+
+enum dhcp6_state {
+	DHCP6_STATE_STOPPED,
+	DHCP6_STATE_SOLICITING,
+	DHCP6_STATE_REQUESTING,
+	DHCP6_STATE_BOUND,
+	DHCP6_STATE_RENEWING,
+	DHCP6_STATE_REBINDING,
+};
+
+struct dhcp6_client {
+	struct waitset		*waitset;
+	int			ifindex;
+	uint16_t		arch_id;
+	dhcp6_lease_cb		cb;
+	void			*data;
+
+	/* DUID-LL: type, hardware type and address */
+	uint8_t			duid[4 + 6];
+	uint32_t		iaid;
+
+	int			fd;
+	struct waiter		*io_waiter;
+	struct waiter		*timer;
+
+	enum dhcp6_state	state;
+	uint32_t		xid;
+	uint32_t		seed;
+	unsigned int		timeout;
+	unsigned int		retries;
+	/* the start of the current exchange, for the elapsed time option */
+	uint64_t		start_time;
+
+	/* the server we're requesting from, or that gave us our lease */
+	uint8_t			server_id[DUID_MAX_LEN];
+	unsigned int		server_id_len;
+	struct in6_addr		requested;
+
+	/* the current lease, or the last one we had */
+	struct dhcp6_lease	*lease;
+	uint64_t		t1, t2, expiry;
+};
+
+/* the parts of a server's message we act on */
+struct dhcp6_reply {
+	int			type;
+	const uint8_t		*opts;
+	unsigned int		opts_len;
+	const uint8_t		*server_id;
+	unsigned int		server_id_len;
+	/* the message's status, or that of our IA */
+	int			status;
+	bool			have_address;
+	struct in6_addr		address;
+	uint32_t		t1, t2;
+	uint32_t		preferred_lifetime;
+	uint32_t		valid_lifetime;
+};
+
+static const uint16_t option_request_list[] = {
+	OPT_DNS_SERVERS, OPT_BOOTFILE_URL, OPT_BOOTFILE_PARAM,
+};
+
+static void dhcp6_client_solicit(struct dhcp6_client *client);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t dhcp6_random(struct dhcp6_client *client)
+{
+	/* xorshift, as for the DHCPv4 xids */
+	client->seed ^= client->seed << 13;
+	client->seed ^= client->seed >> 17;
+	client->seed ^= client->seed << 5;
+	return client->seed;
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static const char *addr_str(const struct in6_addr *addr, char *buf)
+{
+	return inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN);
+}
+
+static uint8_t *dhcp6_add_option(uint8_t *opt, int code, const void *data,
+		unsigned int len)
+{
+	opt[0] = code >> 8;
+	opt[1] = code;
+	opt[2] = len >> 8;
+	opt[3] = len;
+	if (len)
+		memcpy(opt + 4, data, len);
+	return opt + 4 + len;
+}
+
+/* Add our IA_NA, optionally with the address we'd like */
+static uint8_t *dhcp6_add_ia_na(struct dhcp6_client *client, uint8_t *opt,
+		const struct in6_addr *address)
+{
+	uint8_t ia[12 + 4 + 24], iaaddr[24];
+	uint32_t iaid = htonl(client->iaid);
+	unsigned int len = 12;
+
+	/* we leave T1 and T2 to the server */
+	memset(ia, 0, sizeof(ia));
+	memcpy(ia, &iaid, sizeof(iaid));
+
+	if (address) {
+		memset(iaaddr, 0, sizeof(iaaddr));
+		memcpy(iaaddr, address, sizeof(*address));
+		dhcp6_add_option(ia + len, OPT_IAADDR, iaaddr, sizeof(iaaddr));
+		len += 4 + sizeof(iaaddr);
+	}
+
+	return dhcp6_add_option(opt, OPT_IA_NA, ia, len);
+}
+
+/* Start a new exchange, with a new transaction ID */
+static void dhcp6_new_exchange(struct dhcp6_client *client)
+{
+	client->xid = dhcp6_random(client) & 0xffffff;
+	client->start_time = now_ms();
+}
+
+/* Start a message of the given type, in the current exchange */
+static uint8_t *dhcp6_init_message(struct dhcp6_client *client, uint8_t *buf,
+		int type)
+{
+	uint16_t oro[sizeof(option_request_list) /
+		sizeof(option_request_list[0])];
+	uint16_t elapsed;
+	uint64_t time;
+	unsigned int i;
+	uint8_t *opt;
+
+	buf[0] = type;
+	buf[1] = client->xid >> 16;
+	buf[2] = client->xid >> 8;
+	buf[3] = client->xid;
+	opt = buf + 4;
+
+	opt = dhcp6_add_option(opt, OPT_CLIENTID, client->duid,
+			sizeof(client->duid));
+
+	/* in hundredths of a second */
+	time = (now_ms() - client->start_time) / 10;
+	elapsed = htons(time > 0xffff ? 0xffff : time);
+	opt = dhcp6_add_option(opt, OPT_ELAPSED_TIME, &elapsed,
+			sizeof(elapsed));
+
+	if (type == DHCP6_RELEASE)
+		return opt;
+
+	for (i = 0; i < sizeof(oro) / sizeof(oro[0]); i++)
+		oro[i] = htons(option_request_list[i]);
+	opt = dhcp6_add_option(opt, OPT_ORO, oro, sizeof(oro));
+
+	if (client->arch_id != DHCP_ARCH_ID_NONE) {
+		uint16_t arch = htons(client->arch_id);
+		opt = dhcp6_add_option(opt, OPT_CLIENT_ARCH, &arch,
+				sizeof(arch));
+	}
+
+	return opt;
+}
+
+/* Send a message to all servers on the link. We don't take up the server
+ * unicast option, so this is used for every message type */
+static int dhcp6_send(struct dhcp6_client *client, uint8_t *buf,
+		uint8_t *end)
+{
+	struct sockaddr_in6 addr;
+	int rc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(DHCP6_SERVER_PORT);
+	addr.sin6_addr = all_servers;
+	addr.sin6_scope_id = client->ifindex;
+
+	rc = sendto(client->fd, buf, end - buf, 0,
+			(struct sockaddr *)&addr, sizeof(addr));
+	if (rc < 0) {
+		/* this fails until the link-local address has passed DAD;
+		 * our retransmissions cover that */
+		pb_debug("dhcp6: send failed on interface %d: %s\n",
+				client->ifindex, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dhcp6_timer_cb(void *arg);
+
+static void dhcp6_set_timer(struct dhcp6_client *client, uint64_t delay)
+{
+	if (delay > TIMER_MAX)
+		delay = TIMER_MAX;
+
+	if (client->timer)
+		waiter_rearm_timeout(client->timer, delay);
+	else
+		client->timer = waiter_register_timeout(client->waitset,
+				delay, dhcp6_timer_cb, client);
+}
+
+static void dhcp6_cancel_timer(struct dhcp6_client *client)
+{
+	if (client->timer) {
+		waiter_remove(client->timer);
+		client->timer = NULL;
+	}
+}
+
+/* a random factor of +/- 10%, as RFC8415 asks for */
+static unsigned int dhcp6_jitter(struct dhcp6_client *client,
+		unsigned int timeout)
+{
+	return timeout - timeout / 10 +
+		dhcp6_random(client) % (timeout / 5 + 1);
+}
+
+static void dhcp6_backoff(struct dhcp6_client *client, unsigned int max)
+{
+	client->timeout *= 2;
+	if (client->timeout > max)
+		client->timeout = max;
+}
+
+static void dhcp6_send_solicit(struct dhcp6_client *client)
+{
+	uint8_t buf[DHCP6_MSG_SIZE], *opt;
+
+	opt = dhcp6_init_message(client, buf, DHCP6_SOLICIT);
+	opt = dhcp6_add_ia_na(client, opt,
+			client->lease ? &client->lease->address : NULL);
+
+	pb_debug("dhcp6: sending solicit on interface %d\n", client->ifindex);
+	dhcp6_send(client, buf, opt);
+}
+
+/* Send a request for an advertised address (REQUESTING), or to extend our
+ * current lease (RENEWING, REBINDING) */
+static void dhcp6_send_request(struct dhcp6_client *client)
+{
+	uint8_t buf[DHCP6_MSG_SIZE], *opt;
+	const struct in6_addr *address;
+	char addrbuf[INET6_ADDRSTRLEN];
+	int type;
+
+	switch (client->state) {
+	case DHCP6_STATE_REQUESTING:
+		type = DHCP6_REQUEST;
+		address = &client->requested;
+		break;
+	case DHCP6_STATE_RENEWING:
+		type = DHCP6_RENEW;
+		address = &client->lease->address;
+		break;
+	case DHCP6_STATE_REBINDING:
+		type = DHCP6_REBIND;
+		address = &client->lease->address;
+		break;
+	default:
+		return;
+	}
+
+	opt = dhcp6_init_message(client, buf, type);
+	/* a rebind goes to any server */
+	if (type != DHCP6_REBIND)
+		opt = dhcp6_add_option(opt, OPT_SERVERID, client->server_id,
+				client->server_id_len);
+	opt = dhcp6_add_ia_na(client, opt, address);
+
+	pb_debug("dhcp6: sending %s for %s on interface %d\n",
+			type == DHCP6_REQUEST ? "request" :
+			type == DHCP6_RENEW ? "renew" : "rebind",
+			addr_str(address, addrbuf), client->ifindex);
+	dhcp6_send(client, buf, opt);
+}
+
+static void dhcp6_send_release(struct dhcp6_client *client)
+{
+	uint8_t buf[DHCP6_MSG_SIZE], *opt;
+
+	dhcp6_new_exchange(client);
+	opt = dhcp6_init_message(client, buf, DHCP6_RELEASE);
+	opt = dhcp6_add_option(opt, OPT_SERVERID, client->server_id,
+			client->server_id_len);
+	opt = dhcp6_add_ia_na(client, opt, &client->lease->address);
+
+	dhcp6_send(client, buf, opt);
+}
+
+static const uint8_t *dhcp6_find_option(const uint8_t *buf, unsigned int len,
+		int code, unsigned int *optlen)
+{
+	unsigned int i = 0, c, l;
+
+	while (i + 4 <= len) {
+		c = get_u16(buf + i);
+		l = get_u16(buf + i + 2);
+		i += 4;
+
+		if (i + l > len)
+			break;
+
+		if (c == (unsigned int)code) {
+			*optlen = l;
+			return buf + i;
+		}
+		i += l;
+	}
+
+	return NULL;
+}
+
+/* The status code in an option area; no status option means success */
+static int dhcp6_status(const uint8_t *buf, unsigned int len)
+{
+	const uint8_t *opt;
+	unsigned int optlen;
+
+	opt = dhcp6_find_option(buf, len, OPT_STATUS_CODE, &optlen);
+	if (!opt || optlen < 2)
+		return STATUS_SUCCESS;
+
+	return get_u16(opt);
+}
+
+/* Find the address offered in our IA, or the reason there isn't one */
+static void dhcp6_parse_ia_na(struct dhcp6_client *client,
+		struct dhcp6_reply *reply)
+{
+	const uint8_t *ia, *iaaddr;
+	unsigned int ialen, len;
+
+	/* a server leaves out the IA if it has no addresses for us */
+	reply->status = STATUS_NOADDRSAVAIL;
+
+	ia = dhcp6_find_option(reply->opts, reply->opts_len, OPT_IA_NA,
+			&ialen);
+	if (!ia || ialen < 12 || get_u32(ia) != client->iaid)
+		return;
+
+	reply->t1 = get_u32(ia + 4);
+	reply->t2 = get_u32(ia + 8);
+
+	reply->status = dhcp6_status(ia + 12, ialen - 12);
+	if (reply->status != STATUS_SUCCESS)
+		return;
+
+	iaaddr = dhcp6_find_option(ia + 12, ialen - 12, OPT_IAADDR, &len);
+	if (!iaaddr || len < 24) {
+		reply->status = STATUS_NOADDRSAVAIL;
+		return;
+	}
+
+	reply->status = dhcp6_status(iaaddr + 24, len - 24);
+	if (reply->status != STATUS_SUCCESS)
+		return;
+
+	memcpy(&reply->address, iaaddr, sizeof(reply->address));
+	reply->preferred_lifetime = get_u32(iaaddr + 16);
+	reply->valid_lifetime = get_u32(iaaddr + 20);
+
+	/* an address with no lifetime is being taken away from us */
+	if (!reply->valid_lifetime ||
+			reply->preferred_lifetime > reply->valid_lifetime) {
+		reply->status = STATUS_NOADDRSAVAIL;
+		return;
+	}
+
+	reply->have_address = true;
+}
+
+static int dhcp6_parse_reply(struct dhcp6_client *client,
+		struct dhcp6_reply *reply, const uint8_t *buf, unsigned int len)
+{
+	const uint8_t *client_id;
+	unsigned int optlen;
+
+	memset(reply, 0, sizeof(*reply));
+
+	if (len < 4)
+		return -1;
+
+	if ((uint32_t)(buf[1] << 16 | buf[2] << 8 | buf[3]) != client->xid)
+		return -1;
+
+	reply->type = buf[0];
+	reply->opts = buf + 4;
+	reply->opts_len = len - 4;
+
+	client_id = dhcp6_find_option(reply->opts, reply->opts_len,
+			OPT_CLIENTID, &optlen);
+	if (!client_id || optlen != sizeof(client->duid) ||
+			memcmp(client_id, client->duid, optlen))
+		return -1;
+
+	reply->server_id = dhcp6_find_option(reply->opts, reply->opts_len,
+			OPT_SERVERID, &reply->server_id_len);
+	if (!reply->server_id || !reply->server_id_len ||
+			reply->server_id_len > DUID_MAX_LEN)
+		return -1;
+
+	reply->status = dhcp6_status(reply->opts, reply->opts_len);
+	if (reply->status == STATUS_SUCCESS)
+		dhcp6_parse_ia_na(client, reply);
+
+	return 0;
+}
+
+static char *dhcp6_get_string(void *ctx, const struct dhcp6_reply *reply,
+		int code)
+{
+	const uint8_t *opt;
+	unsigned int len;
+
+	opt = dhcp6_find_option(reply->opts, reply->opts_len, code, &len);
+	if (!opt || !len)
+		return NULL;
+
+	return talloc_strndup(ctx, (const char *)opt, len);
+}
+
+/* The bootfile parameters are a list of length-prefixed strings */
+static char *dhcp6_get_bootfile_param(void *ctx,
+		const struct dhcp6_reply *reply)
+{
+	unsigned int i, len, l;
+	const uint8_t *opt;
+	char *param = NULL;
+
+	opt = dhcp6_find_option(reply->opts, reply->opts_len,
+			OPT_BOOTFILE_PARAM, &len);
+	if (!opt)
+		return NULL;
+
+	for (i = 0; i + 2 <= len; i += l) {
+		l = get_u16(opt + i);
+		i += 2;
+		if (i + l > len)
+			break;
+
+		if (param)
+			param = talloc_asprintf_append(param, " %.*s", l,
+					(const char *)opt + i);
+		else
+			param = talloc_asprintf(ctx, "%.*s", l,
+					(const char *)opt + i);
+	}
+
+	return param;
+}
+
+static struct dhcp6_lease *dhcp6_parse_lease(struct dhcp6_client *client,
+		const struct dhcp6_reply *reply)
+{
+	struct dhcp6_lease *lease;
+	const uint8_t *opt;
+	unsigned int i, len;
+
+	lease = talloc_zero(client, struct dhcp6_lease);
+	lease->address = reply->address;
+	lease->preferred_lifetime = reply->preferred_lifetime;
+	lease->valid_lifetime = reply->valid_lifetime;
+
+	opt = dhcp6_find_option(reply->opts, reply->opts_len,
+			OPT_DNS_SERVERS, &len);
+	if (opt) {
+		lease->n_dns_servers = len / sizeof(struct in6_addr);
+		lease->dns_servers = talloc_array(lease, struct in6_addr,
+				lease->n_dns_servers);
+		for (i = 0; i < lease->n_dns_servers; i++)
+			memcpy(&lease->dns_servers[i],
+				opt + i * sizeof(struct in6_addr),
+				sizeof(struct in6_addr));
+	}
+
+	lease->bootfile_url = dhcp6_get_string(lease, reply, OPT_BOOTFILE_URL);
+	lease->bootfile_param = dhcp6_get_bootfile_param(lease, reply);
+
+	return lease;
+}
+
+static void dhcp6_lease_set_deadlines(struct dhcp6_client *client,
+		const struct dhcp6_reply *reply)
+{
+	uint32_t valid = client->lease->valid_lifetime;
+	uint32_t preferred = client->lease->preferred_lifetime;
+	uint64_t now = now_ms();
+	uint32_t t1, t2;
+
+	if (valid == 0xffffffff) {
+		client->t1 = client->t2 = client->expiry = UINT64_MAX;
+		return;
+	}
+
+	/* RFC8415: if the server leaves T1 and T2 to us, use 0.5 and 0.8
+	 * times the preferred lifetime */
+	t1 = reply->t1;
+	t2 = reply->t2;
+	if (!t1 || t1 > valid)
+		t1 = preferred / 2;
+	if (!t2 || t2 > valid)
+		t2 = (uint64_t)preferred * 4 / 5;
+	if (t2 < t1)
+		t2 = t1;
+
+	client->t1 = now + (uint64_t)t1 * 1000;
+	client->t2 = now + (uint64_t)t2 * 1000;
+	client->expiry = now + (uint64_t)valid * 1000;
+}
+
+/* Wait for the next deadline in the BOUND state, or retransmit a renew or
+ * rebind, without running past the point at which we give up on it */
+static void dhcp6_set_lease_timer(struct dhcp6_client *client)
+{
+	uint64_t now = now_ms(), deadline, timeout;
+
+	if (client->state == DHCP6_STATE_BOUND) {
+		if (client->t1 == UINT64_MAX) {
+			dhcp6_cancel_timer(client);
+			return;
+		}
+		dhcp6_set_timer(client,
+				client->t1 > now ? client->t1 - now : 0);
+		return;
+	}
+
+	deadline = client->state == DHCP6_STATE_RENEWING ?
+		client->t2 : client->expiry;
+	timeout = dhcp6_jitter(client, client->timeout);
+	if (deadline <= now)
+		timeout = 0;
+	else if (timeout > deadline - now)
+		timeout = deadline - now;
+
+	dhcp6_set_timer(client, timeout);
+}
+
+static void dhcp6_lease_expired(struct dhcp6_client *client)
+{
+	struct dhcp6_lease *lease = client->lease;
+	char addrbuf[INET6_ADDRSTRLEN];
+
+	pb_log("dhcp6: lease for %s on interface %d lost\n",
+			addr_str(&lease->address, addrbuf), client->ifindex);
+
+	client->lease = NULL;
+	client->cb(client->data, DHCP_EVENT_EXPIRED, lease);
+	talloc_free(lease);
+}
+
+static void dhcp6_set_server_id(struct dhcp6_client *client,
+		const struct dhcp6_reply *reply)
+{
+	memcpy(client->server_id, reply->server_id, reply->server_id_len);
+	client->server_id_len = reply->server_id_len;
+}
+
+static void dhcp6_handle_bound(struct dhcp6_client *client,
+		const struct dhcp6_reply *reply)
+{
+	struct dhcp6_lease *lease, *old = client->lease;
+	char addrbuf[INET6_ADDRSTRLEN];
+	enum dhcp_event event;
+
+	lease = dhcp6_parse_lease(client, reply);
+
+	/* a renewal that changes our address is a new lease */
+	if ((client->state == DHCP6_STATE_RENEWING ||
+				client->state == DHCP6_STATE_REBINDING) &&
+			IN6_ARE_ADDR_EQUAL(&old->address, &lease->address))
+		event = DHCP_EVENT_RENEWED;
+	else
+		event = DHCP_EVENT_BOUND;
+
+	/* a rebind may have been answered by a different server */
+	dhcp6_set_server_id(client, reply);
+
+	client->lease = lease;
+	client->state = DHCP6_STATE_BOUND;
+	dhcp6_lease_set_deadlines(client, reply);
+	dhcp6_set_lease_timer(client);
+
+	pb_log("dhcp6: %s %s on interface %d, lease %us\n",
+			event == DHCP_EVENT_BOUND ? "bound" : "renewed",
+			addr_str(&lease->address, addrbuf), client->ifindex,
+			lease->valid_lifetime);
+
+	client->cb(client->data, event, lease);
+	talloc_free(old);
+}
+
+static void dhcp6_client_request(struct dhcp6_client *client)
+{
+	client->state = DHCP6_STATE_REQUESTING;
+	client->timeout = REQ_TIMEOUT;
+	client->retries = 0;
+	dhcp6_new_exchange(client);
+	dhcp6_send_request(client);
+	dhcp6_set_timer(client, dhcp6_jitter(client, client->timeout));
+}
+
+static void dhcp6_handle_message(struct dhcp6_client *client,
+		const uint8_t *buf, unsigned int len)
+{
+	struct dhcp6_reply reply;
+
+	if (dhcp6_parse_reply(client, &reply, buf, len))
+		return;
+
+	switch (client->state) {
+	case DHCP6_STATE_SOLICITING:
+		if (reply.type != DHCP6_ADVERTISE || !reply.have_address)
+			return;
+
+		/* take the first advertise */
+		dhcp6_set_server_id(client, &reply);
+		client->requested = reply.address;
+		dhcp6_client_request(client);
+		break;
+
+	case DHCP6_STATE_REQUESTING:
+	case DHCP6_STATE_RENEWING:
+	case DHCP6_STATE_REBINDING:
+		if (reply.type != DHCP6_REPLY)
+			return;
+
+		if (reply.have_address) {
+			dhcp6_handle_bound(client, &reply);
+
+		} else if (reply.status == STATUS_NOADDRSAVAIL ||
+				reply.status == STATUS_NOBINDING ||
+				reply.status == STATUS_NOTONLINK) {
+			pb_debug("dhcp6: request refused on interface %d, "
+					"status %d\n", client->ifindex,
+					reply.status);
+			if (client->state == DHCP6_STATE_RENEWING ||
+					client->state == DHCP6_STATE_REBINDING)
+				dhcp6_lease_expired(client);
+			/* don't ask for the old address again */
+			talloc_free(client->lease);
+			client->lease = NULL;
+			dhcp6_client_solicit(client);
+		}
+		/* other failures are transient; keep retransmitting */
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int dhcp6_process(void *arg)
+{
+	struct dhcp6_client *client = arg;
+	uint8_t buf[DHCP6_MSG_SIZE];
+	int rc;
+
+	rc = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			pb_log("dhcp6: recv failed on interface %d: %s\n",
+					client->ifindex, strerror(errno));
+		return 0;
+	}
+
+	dhcp6_handle_message(client, buf, rc);
+
+	return 0;
+}
+
+static int dhcp6_open_socket(struct dhcp6_client *client)
+{
+	struct sockaddr_in6 addr;
+	char ifname[IF_NAMESIZE];
+	int fd, rc, one = 1;
+
+	if (!if_indextoname(client->ifindex, ifname)) {
+		pb_log("dhcp6: no interface %d: %s\n", client->ifindex,
+				strerror(errno));
+		return -1;
+	}
+
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0) {
+		pb_log("dhcp6: can't create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the clients for each interface share the client port */
+	rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (!rc)
+		rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one,
+				sizeof(one));
+	if (!rc)
+		rc = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+				strlen(ifname));
+	if (!rc)
+		rc = setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+				&client->ifindex, sizeof(client->ifindex));
+	if (rc) {
+		pb_log("dhcp6: can't set socket options for %s: %s\n",
+				ifname, strerror(errno));
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(DHCP6_CLIENT_PORT);
+	addr.sin6_addr = in6addr_any;
+
+	rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (rc) {
+		pb_log("dhcp6: can't bind to %s: %s\n", ifname,
+				strerror(errno));
+		goto err;
+	}
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static void dhcp6_client_solicit(struct dhcp6_client *client)
+{
+	client->state = DHCP6_STATE_SOLICITING;
+	client->timeout = SOL_TIMEOUT;
+	dhcp6_new_exchange(client);
+	dhcp6_send_solicit(client);
+	dhcp6_set_timer(client, dhcp6_jitter(client, client->timeout));
+}
+
+static int dhcp6_timer_cb(void *arg)
+{
+	struct dhcp6_client *client = arg;
+	uint64_t now = now_ms();
+
+	client->timer = NULL;
+
+	switch (client->state) {
+	case DHCP6_STATE_SOLICITING:
+		dhcp6_backoff(client, SOL_MAX_RT);
+		dhcp6_send_solicit(client);
+		dhcp6_set_timer(client, dhcp6_jitter(client, client->timeout));
+		break;
+
+	case DHCP6_STATE_REQUESTING:
+		if (++client->retries >= REQ_MAX_RC) {
+			/* the server has gone away; start again */
+			dhcp6_client_solicit(client);
+			break;
+		}
+		dhcp6_backoff(client, REQ_MAX_RT);
+		dhcp6_send_request(client);
+		dhcp6_set_timer(client, dhcp6_jitter(client, client->timeout));
+		break;
+
+	case DHCP6_STATE_BOUND:
+	case DHCP6_STATE_RENEWING:
+	case DHCP6_STATE_REBINDING:
+		if (now >= client->expiry) {
+			dhcp6_lease_expired(client);
+			dhcp6_client_solicit(client);
+			break;
+		}
+
+		/* moving to RENEWING or REBINDING starts a new exchange;
+		 * otherwise, this is a retransmission */
+		if (now >= client->t2 &&
+				client->state != DHCP6_STATE_REBINDING) {
+			client->state = DHCP6_STATE_REBINDING;
+			client->timeout = REN_TIMEOUT;
+			dhcp6_new_exchange(client);
+		} else if (now >= client->t1 &&
+				client->state == DHCP6_STATE_BOUND) {
+			client->state = DHCP6_STATE_RENEWING;
+			client->timeout = REN_TIMEOUT;
+			dhcp6_new_exchange(client);
+		} else if (client->state != DHCP6_STATE_BOUND) {
+			dhcp6_backoff(client, REN_MAX_RT);
+		}
+
+		if (client->state != DHCP6_STATE_BOUND)
+			dhcp6_send_request(client);
+		dhcp6_set_lease_timer(client);
+		break;
+
+	case DHCP6_STATE_STOPPED:
+		break;
+	}
+
+	return 0;
+}
+
+/* Stop the state machine and close the socket, keeping any lease */
+static void dhcp6_client_reset(struct dhcp6_client *client)
+{
+	client->state = DHCP6_STATE_STOPPED;
+	dhcp6_cancel_timer(client);
+
+	if (client->io_waiter) {
+		waiter_remove(client->io_waiter);
+		client->io_waiter = NULL;
+	}
+
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+	}
+}
+
+int dhcp6_client_start(struct dhcp6_client *client)
+{
+	dhcp6_client_reset(client);
+
+	client->fd = dhcp6_open_socket(client);
+	if (client->fd < 0)
+		return -1;
+
+	client->io_waiter = waiter_register_io(client->waitset, client->fd,
+			WAIT_IN, dhcp6_process, client);
+
+	/* any previous lease is sent as a hint */
+	dhcp6_client_solicit(client);
+
+	return 0;
+}
+
+void dhcp6_client_stop(struct dhcp6_client *client)
+{
+	if (client->state == DHCP6_STATE_BOUND ||
+			client->state == DHCP6_STATE_RENEWING ||
+			client->state == DHCP6_STATE_REBINDING)
+		dhcp6_send_release(client);
+
+	dhcp6_client_reset(client);
+}
+
+static int dhcp6_client_destroy(void *arg)
+{
+	struct dhcp6_client *client = arg;
+
+	dhcp6_client_stop(client);
+	return 0;
+}
+
+struct dhcp6_client *dhcp6_client_create(void *ctx, struct waitset *set,
+		int ifindex, const uint8_t *hwaddr, uint16_t arch_id,
+		dhcp6_lease_cb cb, void *data)
+{
+	struct dhcp6_client *client;
+	unsigned int i;
+
+	client = talloc_zero(ctx, struct dhcp6_client);
+	client->waitset = set;
+	client->ifindex = ifindex;
+	client->arch_id = arch_id;
+	client->cb = cb;
+	client->data = data;
+	client->fd = -1;
+	client->state = DHCP6_STATE_STOPPED;
+
+	/* DUID-LL, with the Ethernet hardware type */
+	client->duid[1] = 3;
+	client->duid[3] = 1;
+	memcpy(client->duid + 4, hwaddr, 6);
+	client->iaid = get_u32(hwaddr + 2);
+
+	client->seed = now_ms() ^ ifindex;
+	for (i = 0; i < 6; i++)
+		client->seed = (client->seed << 5) ^ (client->seed >> 27) ^
+			hwaddr[i];
+	if (!client->seed)
+		client->seed = 1;
+
+	talloc_set_destructor(client, dhcp6_client_destroy);
+
+	return client;
+}
@@ -0,0 +1,52 @@
+#ifndef _DHCP6_H
+#define _DHCP6_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "dhcp.h"
+
+/* A DHCPv6 client, run from the waitset.
+ *
+ * This is the stateful counterpart of the DHCPv4 client: it acquires a
+ * single non-temporary address (IA_NA) and the boot options, and keeps the
+ * lease renewed. As with DHCPv4, applying the address is left to the lease
+ * callback. Routes come from router advertisements, not DHCPv6.
+ *
+ * The client identifies itself with a link-layer DUID built from the
+ * interface's hardware address. A restarted client asks for its previous
+ * address again, as a hint in its solicit.
+ */
+
+struct waitset;
+struct dhcp6_client;
+
+struct dhcp6_lease {
+	struct in6_addr	address;
+	struct in6_addr	*dns_servers;
+	unsigned int	n_dns_servers;
+	uint32_t	preferred_lifetime;
+	uint32_t	valid_lifetime;
+
+	/* boot options, or NULL if the server didn't provide them. The
+	 * bootfile parameters are joined with spaces */
+	char		*bootfile_url;
+	char		*bootfile_param;
+};
+
+typedef void (*dhcp6_lease_cb)(void *data, enum dhcp_event event,
+		const struct dhcp6_lease *lease);
+
+/* @arch_id is sent as the client system architecture option (61), unless
+ * it is DHCP_ARCH_ID_NONE */
+struct dhcp6_client *dhcp6_client_create(void *ctx, struct waitset *set,
+		int ifindex, const uint8_t *hwaddr, uint16_t arch_id,
+		dhcp6_lease_cb cb, void *data);
+
+/* Start acquiring a lease. Starting a running client restarts it */
+int dhcp6_client_start(struct dhcp6_client *client);
+
+/* Stop the client, releasing any current lease */
+void dhcp6_client_stop(struct dhcp6_client *client);
+
+#endif /* _DHCP6_H */
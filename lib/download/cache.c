@@ -0,0 +1,293 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <list/list.h>
+#include <log/log.h>
+#include <talloc/talloc.h>
+
+#include "cache.h"
+
+struct cache_entry {
+	char			*url;
+	/* our link to the file, in the cache directory */
+	char			*path;
+	struct download_info	info;
+	/* to spot changes made through another link */
+	off_t			size;
+	struct timespec		mtime;
+	struct list_item	list;
+};
+
+struct download_cache {
+	char				*dir;
+	uint64_t			max_size;
+	/* trust the size of TFTP files */
+	bool				tftp;
+	unsigned int			serial;
+	/* most recently used first */
+	struct list			entries;
+	struct download_cache_stats	stats;
+};
+
+static void cache_clear_dir(const char *dir)
+{
+	struct dirent *dirent;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((dirent = readdir(d)))
+		if (dirent->d_type == DT_REG || dirent->d_type == DT_UNKNOWN)
+			unlinkat(dirfd(d), dirent->d_name, 0);
+
+	closedir(d);
+}
+
+struct download_cache *download_cache_init(void *ctx, const char *dir,
+		uint64_t max_size, bool tftp)
+{
+	struct download_cache *cache;
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		pb_log("download-cache: can't create %s: %m\n", dir);
+		return NULL;
+	}
+
+	cache_clear_dir(dir);
+
+	cache = talloc_zero(ctx, struct download_cache);
+	cache->dir = talloc_strdup(cache, dir);
+	cache->max_size = max_size;
+	cache->tftp = tftp;
+	list_init(&cache->entries);
+
+	pb_log("download-cache: caching up to %llu MB in %s%s\n",
+			(unsigned long long)max_size >> 20, dir,
+			tftp ? ", including TFTP files" : "");
+
+	return cache;
+}
+
+static struct cache_entry *cache_find(struct download_cache *cache,
+		const struct pb_url *url)
+{
+	struct cache_entry *entry;
+
+	list_for_each_entry(&cache->entries, entry, list)
+		if (!strcmp(entry->url, url->full))
+			return entry;
+
+	return NULL;
+}
+
+static void cache_drop(struct download_cache *cache, struct cache_entry *entry)
+{
+	unlink(entry->path);
+	list_remove(&entry->list);
+	cache->stats.n_entries--;
+	cache->stats.size -= entry->size;
+	talloc_free(entry);
+}
+
+/* Link @src to @dst, or copy it if they're on different filesystems */
+static int cache_link(const char *src, const char *dst)
+{
+	int rc, src_fd, dst_fd;
+	struct stat statbuf;
+	ssize_t len;
+
+	unlink(dst);
+	if (!link(src, dst))
+		return 0;
+
+	if (errno != EXDEV)
+		return -1;
+
+	src_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (src_fd < 0)
+		return -1;
+
+	dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (dst_fd < 0) {
+		close(src_fd);
+		return -1;
+	}
+
+	rc = fstat(src_fd, &statbuf);
+	while (!rc && statbuf.st_size) {
+		len = sendfile(dst_fd, src_fd, NULL, statbuf.st_size);
+		if (len <= 0) {
+			rc = -1;
+			break;
+		}
+		statbuf.st_size -= len;
+	}
+
+	close(src_fd);
+	close(dst_fd);
+
+	if (rc)
+		unlink(dst);
+
+	return rc;
+}
+
+const struct download_info *download_cache_lookup(
+		struct download_cache *cache, const struct pb_url *url)
+{
+	struct cache_entry *entry;
+	struct stat statbuf;
+
+	entry = cache_find(cache, url);
+	if (!entry)
+		return NULL;
+
+	/* a boot hook may have changed the file in place */
+	if (stat(entry->path, &statbuf) ||
+			statbuf.st_size != entry->size ||
+			statbuf.st_mtim.tv_sec != entry->mtime.tv_sec ||
+			statbuf.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+		pb_log("download-cache: %s has changed, dropping\n",
+				url->full);
+		cache_drop(cache, entry);
+		return NULL;
+	}
+
+	return &entry->info;
+}
+
+int download_cache_use(struct download_cache *cache, const struct pb_url *url,
+		const char *path)
+{
+	struct cache_entry *entry;
+
+	entry = cache_find(cache, url);
+	if (!entry)
+		return -1;
+
+	if (cache_link(entry->path, path)) {
+		pb_log("download-cache: can't use %s for %s: %m\n",
+				entry->path, url->full);
+		cache_drop(cache, entry);
+		return -1;
+	}
+
+	list_remove(&entry->list);
+	list_add(&cache->entries, &entry->list);
+
+	cache->stats.hits++;
+	cache->stats.saved += entry->size;
+
+	pb_log("download-cache: hit for %s (%u hits, %u misses, "
+			"%llu MB saved)\n", url->full,
+			cache->stats.hits, cache->stats.misses,
+			(unsigned long long)cache->stats.saved >> 20);
+
+	return 0;
+}
+
+static bool cache_validators(struct download_cache *cache,
+		const struct pb_url *url, const struct download_info *info)
+{
+	/* TFTP only gives us a size, and a rebuilt kernel or edited config
+	 * file may well keep that, so TFTP files are fetched again unless
+	 * we've been told to trust it */
+	if (url->scheme == pb_url_tftp)
+		return cache->tftp && info->total;
+
+	return info->etag || info->last_modified;
+}
+
+static void cache_evict(struct download_cache *cache)
+{
+	struct cache_entry *entry;
+
+	while (cache->stats.size > cache->max_size) {
+		entry = list_entry(cache->entries.head.prev,
+				struct cache_entry, list, &cache->entries);
+		if (!entry)
+			break;
+
+		pb_debug("download-cache: evicting %s\n", entry->url);
+		cache_drop(cache, entry);
+		cache->stats.evictions++;
+	}
+}
+
+void download_cache_add(struct download_cache *cache, const struct pb_url *url,
+		const char *path, const struct download_info *info)
+{
+	struct cache_entry *entry;
+	struct stat statbuf;
+
+	cache->stats.misses++;
+
+	/* whatever we had is out of date now */
+	entry = cache_find(cache, url);
+	if (entry)
+		cache_drop(cache, entry);
+
+	if (!cache_validators(cache, url, info))
+		return;
+
+	if (stat(path, &statbuf) || (uint64_t)statbuf.st_size >
+			cache->max_size)
+		return;
+
+	entry = talloc_zero(cache, struct cache_entry);
+	entry->url = talloc_strdup(entry, url->full);
+	entry->path = talloc_asprintf(entry, "%s/%u", cache->dir,
+			++cache->serial);
+	entry->info.total = info->total;
+	if (info->etag)
+		entry->info.etag = talloc_strdup(entry, info->etag);
+	if (info->last_modified)
+		entry->info.last_modified = talloc_strdup(entry,
+				info->last_modified);
+
+	if (cache_link(path, entry->path) || stat(entry->path, &statbuf)) {
+		pb_log("download-cache: can't add %s: %m\n", url->full);
+		unlink(entry->path);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->size = statbuf.st_size;
+	entry->mtime = statbuf.st_mtim;
+
+	list_add(&cache->entries, &entry->list);
+	cache->stats.n_entries++;
+	cache->stats.size += entry->size;
+
+	cache_evict(cache);
+}
+
+void download_cache_get_stats(struct download_cache *cache,
+		struct download_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
@@ -0,0 +1,61 @@
+#ifndef _DOWNLOAD_CACHE_H
+#define _DOWNLOAD_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <download/download.h>
+#include <url/url.h>
+
+/* Keeps downloaded files so that loading the same URL again only has to ask
+ * the server whether the file has changed.
+ *
+ * Files are kept as hard links in the cache directory, which should be on
+ * the same tmpfs as the downloads, so neither adding nor using an entry
+ * copies any data. The least recently used files are dropped to keep the
+ * total under a size budget.
+ */
+
+struct download_cache;
+
+struct download_cache_stats {
+	/* loads served from the cache, and those transferred */
+	unsigned int	hits;
+	unsigned int	misses;
+	unsigned int	evictions;
+	/* bytes that hits didn't have to transfer */
+	uint64_t	saved;
+	/* current contents */
+	unsigned int	n_entries;
+	uint64_t	size;
+};
+
+/* Create a cache of up to @max_size bytes in @dir, removing anything left
+ * there by an earlier instance. With @tftp, TFTP files are kept too, and
+ * are reused while the server reports the same size for them. Returns NULL
+ * if @dir can't be used */
+struct download_cache *download_cache_init(void *ctx, const char *dir,
+		uint64_t max_size, bool tftp);
+
+/* The validators for our copy of @url, to pass to download_start_cached,
+ * or NULL if we don't have one. Copies that have been modified since they
+ * were added are dropped */
+const struct download_info *download_cache_lookup(
+		struct download_cache *cache, const struct pb_url *url);
+
+/* The server says our copy of @url is current: replace @path with it.
+ * Returns non-zero, and drops the entry, if the copy can't be used */
+int download_cache_use(struct download_cache *cache, const struct pb_url *url,
+		const char *path);
+
+/* Keep the file at @path, just downloaded from @url. Files without a
+ * validator the download engine can check later (an ETag or Last-Modified
+ * time for HTTP, the size for TFTP) aren't kept, nor are TFTP files unless
+ * the cache was created to keep them */
+void download_cache_add(struct download_cache *cache, const struct pb_url *url,
+		const char *path, const struct download_info *info);
+
+void download_cache_get_stats(struct download_cache *cache,
+		struct download_cache_stats *stats);
+
+#endif /* _DOWNLOAD_CACHE_H */
@@ -0,0 +1,1349 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/job.h>
+#include <waiter/waiter.h>
+
+#include "download.h"
+
+#define DOWNLOAD_BUF_SIZE	65536
+#define PROGRESS_INTERVAL_MS	250
+
+#define HTTP_TIMEOUT_MS		30000
+#define HTTP_MAX_HEADER		16384
+#define HTTP_MAX_REDIRECTS	5
+
+/* the largest block that fits in a standard ethernet frame */
+#define TFTP_BLKSIZE		1468
+#define TFTP_BLKSIZE_DEFAULT	512
+#define TFTP_WINDOWSIZE		16
+#define TFTP_TIMEOUT_MS		1000
+#define TFTP_RETRIES		5
+#define TFTP_MAX_RRQ		512
+/* leaves space in the request for the mode and options */
+#define TFTP_MAX_PATH		(TFTP_MAX_RRQ - 64)
+
+enum {
+	TFTP_RRQ	= 1,
+	TFTP_DATA	= 3,
+	TFTP_ACK	= 4,
+	TFTP_ERROR	= 5,
+	TFTP_OACK	= 6,
+};
+
+enum {
+	TFTP_ERR_UNDEFINED	= 0,
+	TFTP_ERR_NOT_FOUND	= 1,
+	TFTP_ERR_ACCESS		= 2,
+	TFTP_ERR_DISK_FULL	= 3,
+	TFTP_ERR_OPTIONS	= 8,
+};
+
+enum http_state {
+	HTTP_CONNECTING,
+	HTTP_SENDING,
+	HTTP_HEADERS,
+	HTTP_BODY,
+	HTTP_CHUNK_SIZE,
+	HTTP_CHUNK_DATA,
+	HTTP_CHUNK_END,
+	HTTP_TRAILER,
+};
+
+enum tftp_state {
+	/* waiting for the first reply to our read request */
+	TFTP_REQUESTING,
+	TFTP_TRANSFER,
+};
+
+struct download;
+
+/* Continues the download once its host has been resolved */
+typedef int (*download_resolved_cb)(struct download *download);
+
+/* A host name lookup, run on a worker thread as getaddrinfo() blocks. This
+ * is separate from the download, which may be freed while the worker runs */
+struct download_resolve {
+	struct download		*download;
+	struct waiter_job	*job;
+	download_resolved_cb	resolved_cb;
+	char			*host;
+	char			*port;
+	struct addrinfo		hints;
+	struct addrinfo		*addrs;
+	int			rc;
+};
+
+struct download {
+	struct waitset		*set;
+	enum pb_url_scheme	scheme;
+	char			*url;
+	char			*host;
+	char			*port;
+	char			*path;
+	int			out_fd;
+	download_complete_cb	complete_cb;
+	download_progress_cb	progress_cb;
+	void			*data;
+	struct download_info	info;
+	/* validators of the copy the caller already has, if any */
+	struct download_info	cached;
+	uint64_t		start_time;
+	uint64_t		progress_time;
+	bool			done;
+
+	int			fd;
+	struct waiter		*io_waiter;
+	struct waiter		*timer;
+	struct download_resolve	*resolve;
+	struct addrinfo		*addrs;
+	struct addrinfo		*addr;
+	uint8_t			*buf;
+
+	struct {
+		enum http_state	state;
+		char		*request;
+		size_t		request_len;
+		size_t		sent;
+		size_t		header_len;
+		bool		chunked;
+		bool		have_length;
+		uint64_t	remaining;
+		unsigned int	n_redirects;
+		char		line[64];
+		unsigned int	line_len;
+	} http;
+
+	struct {
+		enum tftp_state	state;
+		uint8_t		rrq[TFTP_MAX_RRQ];
+		unsigned int	rrq_len;
+		bool		options;
+		unsigned int	blksize;
+		unsigned int	windowsize;
+		/* the last block received in order */
+		uint16_t	block;
+		unsigned int	n_window;
+		unsigned int	retries;
+		bool		acked_dup;
+	} tftp;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void download_set_io(struct download *download, int events,
+		waiter_cb cb)
+{
+	if (download->io_waiter)
+		waiter_remove(download->io_waiter);
+	download->io_waiter = waiter_register_io(download->set, download->fd,
+			events, cb, download);
+}
+
+static void download_set_timer(struct download *download, int delay,
+		waiter_cb cb)
+{
+	if (download->timer)
+		waiter_rearm_timeout(download->timer, delay);
+	else
+		download->timer = waiter_register_timeout(download->set,
+				delay, cb, download);
+}
+
+/* Close the connection, keeping the download state */
+static void download_close(struct download *download)
+{
+	if (download->io_waiter) {
+		waiter_remove(download->io_waiter);
+		download->io_waiter = NULL;
+	}
+
+	if (download->timer) {
+		waiter_remove(download->timer);
+		download->timer = NULL;
+	}
+
+	if (download->fd >= 0) {
+		close(download->fd);
+		download->fd = -1;
+	}
+
+	/* a lookup that is still running is freed once it finishes */
+	if (download->resolve) {
+		talloc_free(download->resolve);
+		download->resolve = NULL;
+	}
+
+	if (download->addrs) {
+		freeaddrinfo(download->addrs);
+		download->addrs = download->addr = NULL;
+	}
+}
+
+static void download_finish(struct download *download, int rc)
+{
+	download_close(download);
+	download->done = true;
+
+	if (rc)
+		pb_log("download: %s failed: %s\n", download->url,
+				strerror(-rc));
+	else if (download->info.not_modified)
+		pb_debug("download: %s not modified\n", download->url);
+	else
+		pb_debug("download: %s complete, %llu bytes in %llums\n",
+				download->url,
+				(unsigned long long)download->info.size,
+				(unsigned long long)
+					(now_ms() - download->start_time));
+
+	/* this may free the download */
+	download->complete_cb(download->data, rc, &download->info);
+}
+
+static void download_progress(struct download *download)
+{
+	uint64_t now;
+
+	if (!download->progress_cb)
+		return;
+
+	now = now_ms();
+	if (now - download->progress_time < PROGRESS_INTERVAL_MS)
+		return;
+
+	download->progress_time = now;
+	download->progress_cb(download->data, &download->info);
+}
+
+static int download_write(struct download *download, const uint8_t *buf,
+		size_t len)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = write(download->out_fd, buf, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+		download->info.size += rc;
+	}
+
+	download_progress(download);
+	return 0;
+}
+
+static int download_set_addrs(struct download *download, int rc,
+		struct addrinfo *addrs)
+{
+	if (rc) {
+		pb_log("download: can't resolve %s: %s\n", download->host,
+				gai_strerror(rc));
+		return -EHOSTUNREACH;
+	}
+
+	download->addrs = download->addr = addrs;
+	return 0;
+}
+
+static void download_resolve_thread(void *arg)
+{
+	struct download_resolve *resolve = arg;
+
+	resolve->rc = getaddrinfo(resolve->host, resolve->port,
+			&resolve->hints, &resolve->addrs);
+	if (resolve->rc)
+		resolve->addrs = NULL;
+}
+
+static void download_resolve_done(void *arg)
+{
+	struct download_resolve *resolve = arg;
+	struct download *download = resolve->download;
+	download_resolved_cb resolved_cb = resolve->resolved_cb;
+	int rc;
+
+	rc = download_set_addrs(download, resolve->rc, resolve->addrs);
+	resolve->addrs = NULL;
+	download->resolve = NULL;
+	talloc_free(resolve);
+
+	if (!rc)
+		rc = resolved_cb(download);
+	if (rc)
+		download_finish(download, rc);
+}
+
+static int download_resolve_destroy(void *arg)
+{
+	struct download_resolve *resolve = arg;
+
+	if (waiter_job_destroy(resolve->job))
+		return -1;
+
+	if (resolve->addrs)
+		freeaddrinfo(resolve->addrs);
+	return 0;
+}
+
+/* Resolve the download's host, then continue with @resolved_cb. Numeric
+ * addresses, as we usually get from DHCP, are resolved here; host names are
+ * looked up on a worker thread, so that a slow DNS server doesn't hold up
+ * the event loop. Errors from the lookup finish the download. */
+static int download_resolve(struct download *download, int socktype,
+		const char *default_port, download_resolved_cb resolved_cb)
+{
+	const char *port = download->port ?: default_port;
+	struct download_resolve *resolve;
+	struct addrinfo hints, *addrs;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	rc = getaddrinfo(download->host, port, &hints, &addrs);
+	if (rc != EAI_NONAME) {
+		rc = download_set_addrs(download, rc, addrs);
+		if (rc)
+			return rc;
+		return resolved_cb(download);
+	}
+
+	resolve = talloc_zero(download, struct download_resolve);
+	resolve->download = download;
+	resolve->resolved_cb = resolved_cb;
+	resolve->host = talloc_strdup(resolve, download->host);
+	resolve->port = talloc_strdup(resolve, port);
+	resolve->hints = hints;
+	resolve->hints.ai_flags = 0;
+	talloc_set_destructor(resolve, download_resolve_destroy);
+
+	resolve->job = waiter_job_start(download->set, resolve,
+			download_resolve_thread, download_resolve_done, NULL);
+	if (!resolve->job) {
+		talloc_free(resolve);
+		return -ENOMEM;
+	}
+
+	download->resolve = resolve;
+	return 0;
+}
+
+static int http_process(void *arg);
+static int http_start(struct download *download);
+
+static int http_timeout(void *arg)
+{
+	struct download *download = arg;
+
+	download->timer = NULL;
+	download_finish(download, -ETIMEDOUT);
+	return 0;
+}
+
+/* Start connecting to the current address, or the next one that we can
+ * create a socket for */
+static int http_connect(struct download *download)
+{
+	struct addrinfo *addr;
+	int fd, rc = -EHOSTUNREACH;
+
+	for (; download->addr; download->addr = download->addr->ai_next) {
+		addr = download->addr;
+
+		fd = socket(addr->ai_family,
+				SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			rc = -errno;
+			continue;
+		}
+
+		if (connect(fd, addr->ai_addr, addr->ai_addrlen) &&
+				errno != EINPROGRESS) {
+			rc = -errno;
+			close(fd);
+			continue;
+		}
+
+		download->fd = fd;
+		download->http.state = HTTP_CONNECTING;
+		download_set_io(download, WAIT_OUT, http_process);
+		return 0;
+	}
+
+	return rc;
+}
+
+static int http_redirect(struct download *download, const char *location)
+{
+	struct pb_url *url;
+	char *path;
+
+	if (++download->http.n_redirects > HTTP_MAX_REDIRECTS) {
+		pb_log("download: %s: too many redirects\n", download->url);
+		return -ELOOP;
+	}
+
+	pb_debug("download: %s redirected to %s\n", download->url, location);
+
+	if (location[0] == '/') {
+		path = talloc_strdup(download, location);
+		talloc_free(download->path);
+		download->path = path;
+	} else {
+		url = pb_url_parse(download, location);
+		if (!url || url->scheme != pb_url_http) {
+			pb_log("download: %s: can't follow redirect to %s\n",
+					download->url, location);
+			talloc_free(url);
+			return -EPROTONOSUPPORT;
+		}
+		talloc_free(download->host);
+		talloc_free(download->port);
+		talloc_free(download->path);
+		download->host = talloc_steal(download, url->host);
+		download->port = talloc_steal(download, url->port);
+		download->path = talloc_steal(download, url->path);
+		talloc_free(url);
+	}
+
+	download_close(download);
+
+	talloc_free(download->info.etag);
+	talloc_free(download->info.last_modified);
+	download->info.etag = download->info.last_modified = NULL;
+	download->info.total = 0;
+
+	return http_start(download);
+}
+
+/* Parse the status line and headers. Returns a negative errno on failure,
+ * 1 if we have been redirected, or 0 to continue with the body */
+static int http_parse_headers(struct download *download, char *headers)
+{
+	char *line, *next, *name, *value, *end, *location = NULL;
+	unsigned long long length = 0;
+	int status;
+
+	next = strstr(headers, "\r\n");
+	*next = '\0';
+
+	if (sscanf(headers, "HTTP/%*u.%*u %d", &status) != 1) {
+		pb_log("download: %s: invalid HTTP response\n",
+				download->url);
+		return -EPROTO;
+	}
+
+	for (line = next + 2; *line; line = next + 2) {
+		next = strstr(line, "\r\n");
+		*next = '\0';
+
+		value = strchr(line, ':');
+		if (!value)
+			continue;
+		name = line;
+		*value++ = '\0';
+
+		value += strspn(value, " \t");
+		for (end = value + strlen(value); end > value &&
+				(end[-1] == ' ' || end[-1] == '\t'); end--)
+			;
+		*end = '\0';
+
+		if (!strcasecmp(name, "Content-Length")) {
+			length = strtoull(value, &end, 10);
+			download->http.have_length = end != value;
+		} else if (!strcasecmp(name, "Transfer-Encoding")) {
+			download->http.chunked = !!strcasestr(value, "chunked");
+		} else if (!strcasecmp(name, "Location")) {
+			location = value;
+		} else if (!strcasecmp(name, "ETag")) {
+			download->info.etag = talloc_strdup(download, value);
+		} else if (!strcasecmp(name, "Last-Modified")) {
+			download->info.last_modified =
+				talloc_strdup(download, value);
+		}
+	}
+
+	switch (status) {
+	case 200:
+		break;
+	case 304:
+		if (!download->cached.etag && !download->cached.last_modified)
+			goto err;
+		/* the server may not repeat the validators */
+		if (!download->info.etag && download->cached.etag)
+			download->info.etag = talloc_strdup(download,
+					download->cached.etag);
+		if (!download->info.last_modified &&
+				download->cached.last_modified)
+			download->info.last_modified = talloc_strdup(download,
+					download->cached.last_modified);
+		download->info.total = download->cached.total;
+		download->info.not_modified = true;
+		return 0;
+	case 301:
+	case 302:
+	case 303:
+	case 307:
+	case 308:
+		if (location) {
+			status = http_redirect(download, location);
+			return status ?: 1;
+		}
+		/* fall through */
+	default:
+	err:
+		pb_log("download: %s: HTTP error %d\n", download->url, status);
+		return status == 404 ? -ENOENT : -EIO;
+	}
+
+	if (download->http.chunked) {
+		download->http.have_length = false;
+		download->http.state = HTTP_CHUNK_SIZE;
+		download->http.line_len = 0;
+	} else {
+		download->http.state = HTTP_BODY;
+		download->http.remaining = length;
+		if (download->http.have_length)
+			download->info.total = length;
+	}
+
+	return 0;
+}
+
+/* Collect a CRLF-terminated line into the line buffer. Returns the number
+ * of bytes consumed, and sets @complete once the end of line is reached.
+ * Overlong lines (eg, chunk extensions) are truncated */
+static size_t http_read_line(struct download *download, const uint8_t *buf,
+		size_t len, bool *complete)
+{
+	unsigned int max = sizeof(download->http.line) - 1;
+	const uint8_t *nl;
+	size_t n, copy;
+
+	nl = memchr(buf, '\n', len);
+	n = nl ? (size_t)(nl - buf) + 1 : len;
+
+	copy = nl ? n - 1 : n;
+	if (copy > max - download->http.line_len)
+		copy = max - download->http.line_len;
+	memcpy(download->http.line + download->http.line_len, buf, copy);
+	download->http.line_len += copy;
+
+	*complete = nl != NULL;
+	if (*complete) {
+		if (download->http.line_len &&
+			download->http.line[download->http.line_len - 1] == '\r')
+			download->http.line_len--;
+		download->http.line[download->http.line_len] = '\0';
+	}
+
+	return n;
+}
+
+/* Handle body data. Returns a negative errno on failure, 1 once the body is
+ * complete, or 0 if there's more to come */
+static int http_body(struct download *download, const uint8_t *buf,
+		size_t len)
+{
+	unsigned long long size;
+	bool complete;
+	size_t n;
+	char *end;
+	int rc;
+
+	if (download->http.state == HTTP_BODY) {
+		if (download->http.have_length &&
+				len > download->http.remaining)
+			len = download->http.remaining;
+
+		rc = download_write(download, buf, len);
+		if (rc)
+			return rc;
+
+		download->http.remaining -= len;
+		return download->http.have_length &&
+			!download->http.remaining;
+	}
+
+	while (len) {
+		switch (download->http.state) {
+		case HTTP_CHUNK_SIZE:
+			n = http_read_line(download, buf, len, &complete);
+			if (!complete)
+				break;
+
+			size = strtoull(download->http.line, &end, 16);
+			if (end == download->http.line) {
+				pb_log("download: %s: invalid chunk header\n",
+						download->url);
+				return -EPROTO;
+			}
+			download->http.line_len = 0;
+			download->http.remaining = size;
+			download->http.state = size ?
+				HTTP_CHUNK_DATA : HTTP_TRAILER;
+			break;
+
+		case HTTP_CHUNK_DATA:
+			n = len;
+			if (n > download->http.remaining)
+				n = download->http.remaining;
+
+			rc = download_write(download, buf, n);
+			if (rc)
+				return rc;
+
+			download->http.remaining -= n;
+			if (!download->http.remaining)
+				download->http.state = HTTP_CHUNK_END;
+			break;
+
+		case HTTP_CHUNK_END:
+			n = http_read_line(download, buf, len, &complete);
+			if (complete) {
+				download->http.line_len = 0;
+				download->http.state = HTTP_CHUNK_SIZE;
+			}
+			break;
+
+		case HTTP_TRAILER:
+			n = http_read_line(download, buf, len, &complete);
+			if (!complete)
+				break;
+			if (!download->http.line_len)
+				return 1;
+			download->http.line_len = 0;
+			break;
+
+		default:
+			return -EPROTO;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Handle received data; returns as for http_body */
+static int http_input(struct download *download, size_t len)
+{
+	uint8_t *buf = download->buf;
+	size_t header_len;
+	char *end;
+	int rc;
+
+	if (download->http.state != HTTP_HEADERS)
+		return http_body(download, buf, len);
+
+	download->http.header_len += len;
+	header_len = download->http.header_len;
+
+	end = memmem(buf, header_len, "\r\n\r\n", 4);
+	if (!end) {
+		if (header_len >= HTTP_MAX_HEADER) {
+			pb_log("download: %s: HTTP header too long\n",
+					download->url);
+			return -EPROTO;
+		}
+		return 0;
+	}
+
+	/* terminate the headers after the last CRLF */
+	end[2] = '\0';
+	rc = http_parse_headers(download, (char *)buf);
+	if (rc < 0)
+		return rc;
+
+	/* redirected; the old connection is closed */
+	if (rc == 1)
+		return 0;
+
+	/* a 304 has no body */
+	if (download->info.not_modified)
+		return 1;
+
+	len = header_len - ((uint8_t *)end + 4 - buf);
+	return http_body(download, (uint8_t *)end + 4, len);
+}
+
+static int http_process(void *arg)
+{
+	struct download *download = arg;
+	socklen_t optlen;
+	ssize_t len;
+	int rc, err;
+
+	download_set_timer(download, HTTP_TIMEOUT_MS, http_timeout);
+
+	switch (download->http.state) {
+	case HTTP_CONNECTING:
+		optlen = sizeof(err);
+		rc = getsockopt(download->fd, SOL_SOCKET, SO_ERROR,
+				&err, &optlen);
+		if (rc)
+			err = errno;
+
+		if (err) {
+			pb_debug("download: connection to %s failed: %s\n",
+					download->host, strerror(err));
+			close(download->fd);
+			download->fd = -1;
+			download->addr = download->addr->ai_next;
+			if (http_connect(download))
+				download_finish(download, -err);
+			return 0;
+		}
+
+		download->http.state = HTTP_SENDING;
+		/* fall through */
+
+	case HTTP_SENDING:
+		len = send(download->fd,
+				download->http.request + download->http.sent,
+				download->http.request_len - download->http.sent,
+				MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				download_finish(download, -errno);
+			return 0;
+		}
+
+		download->http.sent += len;
+		if (download->http.sent < download->http.request_len)
+			return 0;
+
+		download->http.state = HTTP_HEADERS;
+		download_set_io(download, WAIT_IN, http_process);
+		return 0;
+
+	case HTTP_HEADERS:
+		len = recv(download->fd,
+				download->buf + download->http.header_len,
+				HTTP_MAX_HEADER - download->http.header_len, 0);
+		break;
+
+	default:
+		len = recv(download->fd, download->buf, DOWNLOAD_BUF_SIZE, 0);
+		break;
+	}
+
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			download_finish(download, -errno);
+		return 0;
+	}
+
+	if (len == 0) {
+		/* without a length or chunking, the body ends at EOF */
+		if (download->http.state == HTTP_BODY &&
+				!download->http.have_length) {
+			download_finish(download, 0);
+		} else {
+			pb_log("download: %s: connection closed early\n",
+					download->url);
+			download_finish(download, -EIO);
+		}
+		return 0;
+	}
+
+	rc = http_input(download, len);
+	if (rc)
+		download_finish(download, rc < 0 ? rc : 0);
+
+	return 0;
+}
+
+static int http_start(struct download *download)
+{
+	const char *host = download->host, *path = download->path;
+	bool ipv6 = strchr(host, ':') != NULL;
+
+	talloc_free(download->http.request);
+	download->http.request = talloc_asprintf(download,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s%s%s%s%s\r\n"
+			"User-Agent: petitboot\r\n"
+			"Accept: */*\r\n"
+			"Accept-Encoding: identity\r\n"
+			"Connection: close\r\n",
+			path && *path ? path : "/",
+			ipv6 ? "[" : "", host, ipv6 ? "]" : "",
+			download->port ? ":" : "", download->port ?: "");
+
+	if (download->cached.etag)
+		download->http.request = talloc_asprintf_append(
+				download->http.request,
+				"If-None-Match: %s\r\n",
+				download->cached.etag);
+	if (download->cached.last_modified)
+		download->http.request = talloc_asprintf_append(
+				download->http.request,
+				"If-Modified-Since: %s\r\n",
+				download->cached.last_modified);
+	download->http.request = talloc_asprintf_append(download->http.request,
+			"\r\n");
+
+	download->http.request_len = strlen(download->http.request);
+	download->http.sent = 0;
+	download->http.header_len = 0;
+	download->http.chunked = false;
+	download->http.have_length = false;
+
+	/* the timeout covers the host lookup too */
+	download_set_timer(download, HTTP_TIMEOUT_MS, http_timeout);
+
+	return download_resolve(download, SOCK_STREAM, "80", http_connect);
+}
+
+static uint8_t *tftp_put16(uint8_t *p, uint16_t val)
+{
+	*p++ = val >> 8;
+	*p++ = val & 0xff;
+	return p;
+}
+
+static uint16_t tftp_get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static int tftp_send(struct download *download, const uint8_t *pkt,
+		size_t len)
+{
+	ssize_t rc;
+
+	if (download->tftp.state == TFTP_REQUESTING)
+		rc = sendto(download->fd, pkt, len, 0,
+				download->addr->ai_addr,
+				download->addr->ai_addrlen);
+	else
+		rc = send(download->fd, pkt, len, 0);
+
+	if (rc < 0) {
+		pb_debug("download: TFTP send to %s failed: %s\n",
+				download->host, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void tftp_send_ack(struct download *download)
+{
+	uint8_t pkt[4];
+
+	tftp_put16(tftp_put16(pkt, TFTP_ACK), download->tftp.block);
+	tftp_send(download, pkt, sizeof(pkt));
+}
+
+/* Tell the server we're giving up, so it stops retransmitting */
+static void tftp_send_error(struct download *download, uint16_t code,
+		const char *msg)
+{
+	uint8_t pkt[64], *p;
+
+	if (download->fd < 0 || download->tftp.state != TFTP_TRANSFER)
+		return;
+
+	p = tftp_put16(tftp_put16(pkt, TFTP_ERROR), code);
+	strcpy((char *)p, msg);
+	tftp_send(download, pkt, p - pkt + strlen(msg) + 1);
+}
+
+static uint8_t *tftp_put_string(uint8_t *p, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	memcpy(p, str, len);
+	return p + len;
+}
+
+static int tftp_build_rrq(struct download *download)
+{
+	uint8_t *p = download->tftp.rrq;
+	char val[16];
+
+	if (strlen(download->path) > TFTP_MAX_PATH) {
+		pb_log("download: %s: path too long for TFTP\n",
+				download->url);
+		return -ENAMETOOLONG;
+	}
+
+	p = tftp_put16(p, TFTP_RRQ);
+	p = tftp_put_string(p, download->path);
+	p = tftp_put_string(p, "octet");
+
+	if (download->tftp.options) {
+		p = tftp_put_string(p, "tsize");
+		p = tftp_put_string(p, "0");
+		snprintf(val, sizeof(val), "%d", TFTP_BLKSIZE);
+		p = tftp_put_string(p, "blksize");
+		p = tftp_put_string(p, val);
+		snprintf(val, sizeof(val), "%d", TFTP_WINDOWSIZE);
+		p = tftp_put_string(p, "windowsize");
+		p = tftp_put_string(p, val);
+	}
+
+	download->tftp.rrq_len = p - download->tftp.rrq;
+	return 0;
+}
+
+static int tftp_timeout(void *arg);
+
+static int tftp_request(struct download *download)
+{
+	struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+	int rc;
+
+	rc = tftp_build_rrq(download);
+	if (rc)
+		return rc;
+
+	/* drop any association with a previous server TID */
+	if (download->tftp.state != TFTP_REQUESTING)
+		connect(download->fd, &unspec, sizeof(unspec));
+
+	download->tftp.state = TFTP_REQUESTING;
+	download->tftp.block = 0;
+	download->tftp.retries = 0;
+	download->tftp.blksize = TFTP_BLKSIZE_DEFAULT;
+	download->tftp.windowsize = 1;
+
+	download_set_timer(download, TFTP_TIMEOUT_MS, tftp_timeout);
+
+	/* a failed send is retried on timeout */
+	tftp_send(download, download->tftp.rrq, download->tftp.rrq_len);
+	return 0;
+}
+
+static int tftp_timeout(void *arg)
+{
+	struct download *download = arg;
+
+	download->timer = NULL;
+
+	if (++download->tftp.retries > TFTP_RETRIES) {
+		download_finish(download, -ETIMEDOUT);
+		return 0;
+	}
+
+	pb_debug("download: %s: TFTP timeout, retrying\n", download->url);
+
+	if (download->tftp.state == TFTP_REQUESTING)
+		tftp_send(download, download->tftp.rrq,
+				download->tftp.rrq_len);
+	else
+		tftp_send_ack(download);
+
+	download->tftp.n_window = 0;
+	download->tftp.acked_dup = false;
+	download_set_timer(download, TFTP_TIMEOUT_MS, tftp_timeout);
+	return 0;
+}
+
+static int tftp_parse_oack(struct download *download, const char *buf,
+		size_t len)
+{
+	const char *end = buf + len, *name, *value;
+	unsigned long long val;
+	char *p;
+
+	while (buf < end) {
+		name = buf;
+		value = name + strnlen(name, end - name) + 1;
+		if (value >= end)
+			return -EPROTO;
+		buf = value + strnlen(value, end - value) + 1;
+		if (buf > end)
+			return -EPROTO;
+
+		val = strtoull(value, &p, 10);
+		if (p == value)
+			return -EPROTO;
+
+		if (!strcasecmp(name, "blksize")) {
+			if (val < 8 || val > TFTP_BLKSIZE)
+				return -EPROTO;
+			download->tftp.blksize = val;
+		} else if (!strcasecmp(name, "windowsize")) {
+			if (val < 1 || val > TFTP_WINDOWSIZE)
+				return -EPROTO;
+			download->tftp.windowsize = val;
+		} else if (!strcasecmp(name, "tsize")) {
+			download->info.total = val;
+		}
+	}
+
+	return 0;
+}
+
+static void tftp_data(struct download *download, uint16_t block,
+		const uint8_t *buf, size_t len)
+{
+	int rc;
+
+	if (len > download->tftp.blksize) {
+		pb_log("download: %s: oversized TFTP block\n", download->url);
+		download_finish(download, -EPROTO);
+		return;
+	}
+
+	if (block != (uint16_t)(download->tftp.block + 1)) {
+		/* a gap or a retransmission: acknowledge the last block we
+		 * have, once, so the server restarts the window from there */
+		if (!download->tftp.acked_dup) {
+			tftp_send_ack(download);
+			download->tftp.acked_dup = true;
+			download->tftp.n_window = 0;
+		}
+		return;
+	}
+
+	rc = download_write(download, buf, len);
+	if (rc) {
+		tftp_send_error(download, TFTP_ERR_DISK_FULL, "write failed");
+		download_finish(download, rc);
+		return;
+	}
+
+	download->tftp.block = block;
+	download->tftp.retries = 0;
+	download->tftp.acked_dup = false;
+
+	if (len < download->tftp.blksize) {
+		tftp_send_ack(download);
+		download_finish(download, 0);
+		return;
+	}
+
+	if (++download->tftp.n_window >= download->tftp.windowsize) {
+		tftp_send_ack(download);
+		download->tftp.n_window = 0;
+	}
+
+	download_set_timer(download, TFTP_TIMEOUT_MS, tftp_timeout);
+}
+
+static int tftp_error(struct download *download, const uint8_t *buf,
+		size_t len)
+{
+	uint16_t code = tftp_get16(buf);
+	int msglen = strnlen((const char *)buf + 2, len - 2);
+
+	/* some servers refuse any options they don't understand, rather
+	 * than ignoring them */
+	if (code == TFTP_ERR_OPTIONS && download->tftp.options &&
+			download->tftp.block == 0) {
+		pb_debug("download: %s: TFTP server refused options, "
+				"retrying without\n", download->url);
+		download->tftp.options = false;
+		return tftp_request(download);
+	}
+
+	pb_log("download: %s: TFTP error %d: %.*s\n", download->url,
+			code, msglen, buf + 2);
+
+	switch (code) {
+	case TFTP_ERR_NOT_FOUND:
+		return -ENOENT;
+	case TFTP_ERR_ACCESS:
+		return -EACCES;
+	default:
+		return -EIO;
+	}
+}
+
+static bool tftp_same_host(const struct sockaddr *a,
+		const struct sockaddr *b)
+{
+	const struct sockaddr_in6 *a6, *b6;
+	const struct sockaddr_in *a4, *b4;
+
+	if (a->sa_family != b->sa_family)
+		return false;
+
+	if (a->sa_family == AF_INET) {
+		a4 = (const struct sockaddr_in *)a;
+		b4 = (const struct sockaddr_in *)b;
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+
+	a6 = (const struct sockaddr_in6 *)a;
+	b6 = (const struct sockaddr_in6 *)b;
+	return !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+			sizeof(a6->sin6_addr));
+}
+
+static int tftp_process(void *arg)
+{
+	struct download *download = arg;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	uint16_t opcode;
+	ssize_t len;
+	int rc;
+
+	from_len = sizeof(from);
+	len = recvfrom(download->fd, download->buf, DOWNLOAD_BUF_SIZE, 0,
+			(struct sockaddr *)&from, &from_len);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			download_finish(download, -errno);
+		return 0;
+	}
+
+	if (len < 4)
+		return 0;
+
+	opcode = tftp_get16(download->buf);
+
+	if (download->tftp.state == TFTP_REQUESTING) {
+		if (!tftp_same_host((struct sockaddr *)&from,
+					download->addr->ai_addr))
+			return 0;
+
+		if (opcode == TFTP_ERROR) {
+			rc = tftp_error(download, download->buf + 2, len - 2);
+			if (rc)
+				download_finish(download, rc);
+			return 0;
+		}
+
+		if (opcode != TFTP_OACK && opcode != TFTP_DATA)
+			return 0;
+
+		/* the server replies from a new port for the rest of the
+		 * transfer; only accept packets from there */
+		if (connect(download->fd, (struct sockaddr *)&from,
+					from_len)) {
+			download_finish(download, -errno);
+			return 0;
+		}
+		download->tftp.state = TFTP_TRANSFER;
+		download->tftp.retries = 0;
+
+		if (opcode == TFTP_OACK) {
+			rc = tftp_parse_oack(download,
+					(char *)download->buf + 2, len - 2);
+			if (rc) {
+				pb_log("download: %s: invalid TFTP option "
+						"ack\n", download->url);
+				tftp_send_error(download, TFTP_ERR_OPTIONS,
+						"invalid options");
+				download_finish(download, rc);
+				return 0;
+			}
+			/* only the size is known; the caller has chosen to
+			 * trust that */
+			if (download->cached.total &&
+					download->info.total ==
+						download->cached.total) {
+				download->info.not_modified = true;
+				tftp_send_error(download, TFTP_ERR_UNDEFINED,
+						"not modified");
+				download_finish(download, 0);
+				return 0;
+			}
+			tftp_send_ack(download);
+			download_set_timer(download, TFTP_TIMEOUT_MS,
+					tftp_timeout);
+			return 0;
+		}
+	}
+
+	switch (opcode) {
+	case TFTP_DATA:
+		tftp_data(download, tftp_get16(download->buf + 2),
+				download->buf + 4, len - 4);
+		break;
+	case TFTP_OACK:
+		/* our ack of the options was lost */
+		if (download->tftp.block == 0)
+			tftp_send_ack(download);
+		break;
+	case TFTP_ERROR:
+		rc = tftp_error(download, download->buf + 2, len - 2);
+		if (rc)
+			download_finish(download, rc);
+		break;
+	}
+
+	return 0;
+}
+
+static int tftp_resolved(struct download *download)
+{
+	int rc;
+
+	download->fd = socket(download->addr->ai_family,
+			SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (download->fd < 0) {
+		pb_log("download: can't create TFTP socket: %s\n",
+				strerror(errno));
+		return -errno;
+	}
+
+	download->tftp.options = true;
+	download->tftp.state = TFTP_REQUESTING;
+
+	rc = tftp_request(download);
+	if (rc)
+		return rc;
+
+	download_set_io(download, WAIT_IN, tftp_process);
+	return 0;
+}
+
+static int tftp_start(struct download *download)
+{
+	return download_resolve(download, SOCK_DGRAM, "69", tftp_resolved);
+}
+
+bool download_supported(const struct pb_url *url)
+{
+	return url->scheme == pb_url_http || url->scheme == pb_url_tftp;
+}
+
+static int download_cancelled(void *arg)
+{
+	struct download *download = arg;
+
+	download->timer = NULL;
+
+	/* this may free the download */
+	download->complete_cb(download->data, -ECANCELED, &download->info);
+	return 0;
+}
+
+void download_cancel(struct download *download)
+{
+	if (download->done)
+		return;
+
+	/* nothing has been sent while we're still looking up the host */
+	if (download->scheme == pb_url_tftp && download->fd >= 0)
+		tftp_send_error(download, TFTP_ERR_UNDEFINED, "cancelled");
+
+	download_close(download);
+	download->done = true;
+
+	pb_debug("download: %s cancelled\n", download->url);
+
+	/* complete from the waitset, as the caller may be iterating over
+	 * its downloads */
+	download->timer = waiter_register_timeout(download->set, 0,
+			download_cancelled, download);
+}
+
+static int download_destroy(void *arg)
+{
+	download_close(arg);
+	return 0;
+}
+
+struct download *download_start(void *ctx, struct waitset *set,
+		const struct pb_url *url, int fd,
+		download_complete_cb complete_cb,
+		download_progress_cb progress_cb, void *data)
+{
+	return download_start_cached(ctx, set, url, fd, NULL, complete_cb,
+			progress_cb, data);
+}
+
+struct download *download_start_cached(void *ctx, struct waitset *set,
+		const struct pb_url *url, int fd,
+		const struct download_info *cached,
+		download_complete_cb complete_cb,
+		download_progress_cb progress_cb, void *data)
+{
+	struct download *download;
+	int rc;
+
+	if (!download_supported(url) || !url->host)
+		return NULL;
+
+	download = talloc_zero(ctx, struct download);
+	download->set = set;
+	download->scheme = url->scheme;
+	download->url = talloc_strdup(download, url->full);
+	download->host = talloc_strdup(download, url->host);
+	download->port = url->port ? talloc_strdup(download, url->port) : NULL;
+	download->path = talloc_strdup(download, url->path);
+	download->out_fd = fd;
+	download->complete_cb = complete_cb;
+	download->progress_cb = progress_cb;
+	download->data = data;
+	download->fd = -1;
+	download->buf = talloc_array(download, uint8_t, DOWNLOAD_BUF_SIZE);
+	download->start_time = download->progress_time = now_ms();
+
+	if (cached) {
+		download->cached.total = cached->total;
+		if (cached->etag)
+			download->cached.etag = talloc_strdup(download,
+					cached->etag);
+		if (cached->last_modified)
+			download->cached.last_modified = talloc_strdup(
+					download, cached->last_modified);
+	}
+
+	talloc_set_destructor(download, download_destroy);
+
+	if (download->scheme == pb_url_http)
+		rc = http_start(download);
+	else
+		rc = tftp_start(download);
+
+	if (rc) {
+		talloc_free(download);
+		return NULL;
+	}
+
+	pb_debug("download: started %s\n", download->url);
+
+	return download;
+}
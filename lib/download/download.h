@@ -0,0 +1,71 @@
+#ifndef _DOWNLOAD_H
+#define _DOWNLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <url/url.h>
+
+/* An in-process HTTP and TFTP client, run from the waitset.
+ *
+ * Each download streams the file into a caller-supplied fd as the data
+ * arrives, so any number of transfers can run in parallel without a helper
+ * process per file. TFTP transfers negotiate larger blocks (RFC 2348), a
+ * window of blocks per acknowledgement (RFC 7440) and the transfer size
+ * (RFC 2349) where the server supports them.
+ */
+
+struct waitset;
+struct download;
+
+struct download_info {
+	/* bytes written to the fd so far */
+	uint64_t	size;
+	/* the size the server reported for the file, or zero if unknown */
+	uint64_t	total;
+	/* HTTP cache validators, or NULL if the server didn't send them */
+	char		*etag;
+	char		*last_modified;
+	/* the file matched the validators passed to download_start_cached,
+	 * so nothing was transferred */
+	bool		not_modified;
+};
+
+/* Called with a negative errno on failure, or -ECANCELED for a cancelled
+ * download. The download may be freed from its completion callback */
+typedef void (*download_complete_cb)(void *data, int rc,
+		const struct download_info *info);
+
+typedef void (*download_progress_cb)(void *data,
+		const struct download_info *info);
+
+/* Whether the engine can handle @url's scheme */
+bool download_supported(const struct pb_url *url);
+
+/* Start downloading @url into @fd, which stays owned by the caller. Host
+ * names are looked up on a worker thread, and a failed lookup is reported
+ * through @complete_cb. Returns NULL if the download can't be started;
+ * otherwise @complete_cb is always called, from the waitset. @progress_cb
+ * is optional */
+struct download *download_start(void *ctx, struct waitset *set,
+		const struct pb_url *url, int fd,
+		download_complete_cb complete_cb,
+		download_progress_cb progress_cb, void *data);
+
+/* As download_start, but skip the transfer if the file still matches
+ * @cached, the info from an earlier download. HTTP servers are asked with
+ * If-None-Match and If-Modified-Since. TFTP has no validators, so a TFTP
+ * file matches if the server reports the same size as @cached->total; only
+ * pass a TFTP file's info if that is good enough. If the file matches,
+ * nothing is written to @fd and @complete_cb sees info->not_modified */
+struct download *download_start_cached(void *ctx, struct waitset *set,
+		const struct pb_url *url, int fd,
+		const struct download_info *cached,
+		download_complete_cb complete_cb,
+		download_progress_cb progress_cb, void *data);
+
+/* Abort a download. The completion callback is still called, from the
+ * waitset, with -ECANCELED */
+void download_cancel(struct download *download);
+
+#endif /* _DOWNLOAD_H */
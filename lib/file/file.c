@@ -16,10 +16,15 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -212,3 +217,146 @@ int replace_file(const char *filename, char *buf, int len)
 	close(fd);
 	return rc;
 }
+
+int copy_file_memfd(const char *source_file, int *fdp)
+{
+	unsigned char buffer[FILE_XFER_BUFFER_SIZE];
+	int source_fd, fd;
+	ssize_t rc, wc;
+
+	source_fd = open(source_file, O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0) {
+		pb_log("%s: unable to open source file '%s': %m\n",
+			__func__, source_file);
+		return -1;
+	}
+
+	fd = memfd_create("petitboot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		pb_log_fn("unable to create memory file, %m\n");
+		close(source_fd);
+		return -1;
+	}
+
+	/* let the kernel do the copy where it can */
+	do {
+		rc = sendfile(fd, source_fd, NULL, 1 << 30);
+	} while (rc > 0 || (rc < 0 && errno == EINTR));
+
+	if (rc < 0 && (errno == EINVAL || errno == ENOSYS)) {
+		/* sendfile can't read from this file, copy it by hand.
+		 * Nothing has been written yet, so start from the top */
+		for (;;) {
+			rc = read(source_fd, buffer, sizeof(buffer));
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				break;
+			wc = write_fd(fd, (char *)buffer, rc);
+			if (wc) {
+				rc = wc;
+				break;
+			}
+		}
+	}
+
+	close(source_fd);
+
+	if (rc < 0) {
+		pb_log("%s: failed to copy '%s': %m\n", __func__, source_file);
+		close(fd);
+		return -1;
+	}
+
+	*fdp = fd;
+	return 0;
+}
+
+int seal_file(int fd)
+{
+	int rc;
+
+	rc = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			F_SEAL_WRITE | F_SEAL_SEAL);
+	if (rc)
+		pb_log_fn("unable to seal file: %m\n");
+
+	return rc;
+}
+
+struct file_prefetch {
+	int		*fds;
+	unsigned int	n_fds;
+};
+
+struct file_prefetch *file_prefetch_create(void *ctx)
+{
+	return talloc_zero(ctx, struct file_prefetch);
+}
+
+/* Open the file and ask the kernel to start reading it; we collect the data
+ * in file_prefetch_wait, so that reads for all files are in flight
+ * together */
+void file_prefetch_add(struct file_prefetch *prefetch, const char *path)
+{
+	struct stat statbuf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode) ||
+			statbuf.st_size > max_file_size) {
+		close(fd);
+		return;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	prefetch->fds = talloc_realloc(prefetch, prefetch->fds, int,
+			prefetch->n_fds + 1);
+	prefetch->fds[prefetch->n_fds++] = fd;
+}
+
+void file_prefetch_add_dir(struct file_prefetch *prefetch, const char *path)
+{
+	struct dirent *dirent;
+	char *file_path;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_type != DT_REG && dirent->d_type != DT_UNKNOWN)
+			continue;
+
+		file_path = talloc_asprintf(prefetch, "%s/%s", path,
+				dirent->d_name);
+		file_prefetch_add(prefetch, file_path);
+		talloc_free(file_path);
+	}
+
+	closedir(dir);
+}
+
+unsigned int file_prefetch_wait(struct file_prefetch *prefetch)
+{
+	unsigned int i, n_fds;
+	char buf[4096];
+	ssize_t rc;
+
+	for (i = 0; i < prefetch->n_fds; i++) {
+		do {
+			rc = read(prefetch->fds[i], buf, sizeof(buf));
+		} while (rc > 0 || (rc < 0 && errno == EINTR));
+		close(prefetch->fds[i]);
+	}
+
+	n_fds = prefetch->n_fds;
+	talloc_free(prefetch);
+
+	return n_fds;
+}
@@ -23,5 +23,22 @@ int copy_file_secure_dest(void *ctx,
 int read_file(void *ctx, const char *filename, char **bufp, int *lenp);
 int replace_file(const char *filename, char *buf, int len);
 
+/* Copy @source_file into a new anonymous memory file, returned in @fdp. Once
+ * sealed, the contents can't be changed by anyone holding the fd */
+int copy_file_memfd(const char *source_file, int *fdp);
+int seal_file(int fd);
+
+/* Read a set of small files, such as config files, into the page cache, with
+ * the reads for all of them in flight together. Files that are missing, not
+ * regular files, or larger than read_file would read are skipped. */
+struct file_prefetch;
+struct file_prefetch *file_prefetch_create(void *ctx);
+void file_prefetch_add(struct file_prefetch *prefetch, const char *path);
+/* Add each regular file directly within the directory @path */
+void file_prefetch_add_dir(struct file_prefetch *prefetch, const char *path);
+/* Wait for the reads to complete, and free @prefetch. Returns the number of
+ * files read */
+unsigned int file_prefetch_wait(struct file_prefetch *prefetch);
+
 #endif /* FILE_H */
 
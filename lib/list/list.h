@@ -1,6 +1,8 @@
 #ifndef _LIST_H
 #define _LIST_H
 
+#include <stdbool.h>
+
 #include <util/util.h>
 
 struct list_item {
@@ -58,6 +60,10 @@ static inline void list_add(struct list *list, struct list_item *item)
 {
 	list_insert_after(&list->head, item);
 }
+static inline bool list_empty(const struct list *list)
+{
+	return list->head.next == &list->head;
+}
 static inline void list_add_tail(struct list *list, struct list_item *item)
 {
 	list_insert_before(&list->head, item);
@@ -12,13 +12,14 @@ static bool debug;
 static void __log_timestamp(void)
 {
 	char hms[20] = {'\0'};
+	struct tm tm;
 	time_t t;
 
 	if (!logf)
 		return;
 
 	t = time(NULL);
-	strftime(hms, sizeof(hms), "%T", localtime(&t));
+	strftime(hms, sizeof(hms), "%T", localtime_r(&t, &tm));
 	fprintf(logf, "[%s] ", hms);
 }
 
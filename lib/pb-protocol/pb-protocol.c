@@ -4,11 +4,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <asm/byteorder.h>
 
 #include <talloc/talloc.h>
 #include <list/list.h>
 #include <log/log.h>
+#include <util/util.h>
 
 #include "pb-protocol.h"
 
@@ -52,6 +54,19 @@
  *   4-byte len, boot_args
  *   4-byte len, args_sig_file
  *
+ * action = 0x11: capabilities
+ *  payload:
+ *   4-byte capability flags
+ *
+ * action = 0x12: fragment
+ *  payload:
+ *   4-byte action of the complete message
+ *   4-byte payload len of the complete message
+ *   fragment data
+ *
+ *  The fragments of a message are sent consecutively, with no other
+ *  messages in between. The message is complete once the fragment data
+ *  adds up to its payload len.
  */
 
 void pb_protocol_dump_device(const struct device *dev, const char *text,
@@ -114,18 +129,35 @@ int pb_protocol_serialise_string(char *pos, const char *str)
 	return len + sizeof(uint32_t);
 }
 
+/* State for a single decode: where strings are placed, depending on the
+ * decode mode. For PB_PROTOCOL_DECODE_ARENA, strings are packed into a
+ * single arena allocation; a string and its terminator never need more space
+ * than the string and its length prefix occupy in the payload, so an arena
+ * of payload_len bytes is always sufficient.
+ */
+struct pb_protocol_decoder {
+	enum pb_protocol_decode_mode	mode;
+	char				*arena;
+};
+
 /* Read a string from a buffer, allocating the new string as necessary.
  *
+ * In PB_PROTOCOL_DECODE_VIEW mode, the string is instead moved down over
+ * its own length prefix and nul-terminated in place, so the caller's buffer
+ * must be writable, and can only be decoded once.
+ *
+ * @param[in] dec	The decoder state
  * @param[in] ctx	The talloc context to base the allocation on
  * @param[in,out] pos	Where to start reading
  * @param[in,out] len	The amount of data remaining in the buffer
  * @param[out] str	Pointer to resuling string
  * @return		zero on success, non-zero on failure
  */
-static int read_string(void *ctx, const char **pos, unsigned int *len,
-	char **str)
+static int read_string(struct pb_protocol_decoder *dec, void *ctx,
+	const char **pos, unsigned int *len, char **str)
 {
 	uint32_t str_len, read_len;
+	char *dest;
 
 	if (*len < sizeof(uint32_t))
 		return -1;
@@ -136,10 +168,25 @@ static int read_string(void *ctx, const char **pos, unsigned int *len,
 	if (read_len + str_len > *len)
 		return -1;
 
-	if (str_len == 0)
+	if (str_len == 0) {
 		*str = NULL;
-	else
+
+	} else if (dec->mode == PB_PROTOCOL_DECODE_VIEW) {
+		dest = (char *)*pos;
+		memmove(dest, dest + read_len, str_len);
+		dest[str_len] = '\0';
+		*str = dest;
+
+	} else if (dec->mode == PB_PROTOCOL_DECODE_ARENA) {
+		dest = dec->arena;
+		memcpy(dest, *pos + read_len, str_len);
+		dest[str_len] = '\0';
+		dec->arena += str_len + 1;
+		*str = dest;
+
+	} else {
 		*str = talloc_strndup(ctx, *pos + read_len, str_len);
+	}
 
 	read_len += str_len;
 
@@ -165,6 +212,7 @@ static int read_u32(const char **pos, unsigned int *len, unsigned int *p)
 char *pb_protocol_deserialise_string(void *ctx,
 		const struct pb_protocol_message *message)
 {
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
 	const char *buf;
 	char *str;
 	unsigned int len;
@@ -172,7 +220,7 @@ char *pb_protocol_deserialise_string(void *ctx,
 	len = message->payload_len;
 	buf = message->payload;
 
-	if (read_string(ctx, &buf, &len, &str))
+	if (read_string(&dec, ctx, &buf, &len, &str))
 		return NULL;
 
 	return str;
@@ -413,6 +461,11 @@ int pb_protocol_authenticate_len(struct auth_message *msg)
 	}
 }
 
+int pb_protocol_capabilities_len(void)
+{
+	return 4;
+}
+
 int pb_protocol_serialise_device(const struct device *dev,
 		char *buf, int buf_len)
 {
@@ -781,29 +834,112 @@ int pb_protocol_serialise_authenticate(struct auth_message *msg,
 	return (pos <= buf + buf_len) ? 0 : -1;
 }
 
-int pb_protocol_write_message(int fd, struct pb_protocol_message *message)
+int pb_protocol_serialise_capabilities(uint32_t caps, char *buf, int buf_len)
 {
-	int total_len, rc;
-	char *pos;
+	if (buf_len < (int)sizeof(uint32_t))
+		return -1;
+
+	*(uint32_t *)buf = __cpu_to_be32(caps);
+	return 0;
+}
+
+int pb_protocol_finalise_message(struct pb_protocol_message *message)
+{
+	int total_len;
 
 	total_len = sizeof(*message) + message->payload_len;
 
 	message->payload_len = __cpu_to_be32(message->payload_len);
 	message->action = __cpu_to_be32(message->action);
 
-	for (pos = (void *)message; total_len;) {
-		rc = write(fd, pos, total_len);
+	return total_len;
+}
+
+bool pb_protocol_needs_fragments(const struct pb_protocol_message *message)
+{
+	return message->payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+}
+
+unsigned int pb_protocol_wire_len(const struct pb_protocol_message *message)
+{
+	unsigned int n;
+
+	if (!pb_protocol_needs_fragments(message))
+		return sizeof(*message) + message->payload_len;
+
+	n = (message->payload_len + PB_PROTOCOL_FRAGMENT_DATA_SIZE - 1) /
+		PB_PROTOCOL_FRAGMENT_DATA_SIZE;
+
+	return n * PB_PROTOCOL_FRAGMENT_HEADER_SIZE + message->payload_len;
+}
+
+unsigned int pb_protocol_fragment_header(
+		const struct pb_protocol_message *message,
+		unsigned int offset, char *hdr)
+{
+	uint32_t *words = (uint32_t *)hdr;
+	unsigned int len;
+
+	len = min(message->payload_len - offset,
+			(unsigned int)PB_PROTOCOL_FRAGMENT_DATA_SIZE);
+
+	words[0] = __cpu_to_be32(PB_PROTOCOL_ACTION_FRAGMENT);
+	words[1] = __cpu_to_be32(2 * sizeof(uint32_t) + len);
+	words[2] = __cpu_to_be32(message->action);
+	words[3] = __cpu_to_be32(message->payload_len);
+
+	return len;
+}
+
+static int write_all(int fd, const char *pos, unsigned int len)
+{
+	int rc;
+
+	while (len) {
+		rc = write(fd, pos, len);
 
 		if (rc <= 0)
-			break;
+			return -1;
 
-		total_len -= rc;
+		len -= rc;
 		pos += rc;
 	}
 
+	return 0;
+}
+
+/* Write message as a series of fragments, straight from its payload */
+static int write_fragments(int fd, const struct pb_protocol_message *message)
+{
+	char hdr[PB_PROTOCOL_FRAGMENT_HEADER_SIZE];
+	unsigned int offset, len;
+
+	for (offset = 0; offset < message->payload_len; offset += len) {
+		len = pb_protocol_fragment_header(message, offset, hdr);
+
+		if (write_all(fd, hdr, sizeof(hdr)))
+			return -1;
+		if (write_all(fd, message->payload + offset, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+int pb_protocol_write_message(int fd, struct pb_protocol_message *message)
+{
+	int total_len, rc;
+
+	if (pb_protocol_needs_fragments(message)) {
+		rc = write_fragments(fd, message);
+	} else {
+		total_len = pb_protocol_finalise_message(message);
+		rc = write_all(fd, (char *)message, total_len);
+	}
+
 	talloc_free(message);
 
-	if (!total_len)
+	if (!rc)
 		return 0;
 
 	pb_log_fn("failed: %s\n", strerror(errno));
@@ -815,9 +951,9 @@ struct pb_protocol_message *pb_protocol_create_message(void *ctx,
 {
 	struct pb_protocol_message *message;
 
-	if (payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+	if (payload_len > PB_PROTOCOL_MAX_MESSAGE_SIZE) {
 		pb_log_fn("payload too big %u/%u\n", payload_len,
-			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+			PB_PROTOCOL_MAX_MESSAGE_SIZE);
 		return NULL;
 	}
 
@@ -831,7 +967,247 @@ struct pb_protocol_message *pb_protocol_create_message(void *ctx,
 
 }
 
-struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd)
+struct pb_protocol_batch *pb_protocol_batch_create(void *ctx)
+{
+	return talloc_zero(ctx, struct pb_protocol_batch);
+}
+
+char *pb_protocol_batch_add(struct pb_protocol_batch *batch,
+		enum pb_protocol_action action, int payload_len)
+{
+	struct pb_protocol_message *message;
+	unsigned int total_len;
+
+	if (payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+		pb_log_fn("payload too big %u/%u\n", payload_len,
+			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+		return NULL;
+	}
+
+	total_len = sizeof(*message) + payload_len;
+
+	if (batch->len + total_len > batch->size) {
+		unsigned int size = batch->size ?: 4096;
+		char *buf;
+
+		while (size < batch->len + total_len)
+			size *= 2;
+
+		buf = talloc_realloc(batch, batch->buf, char, size);
+		if (!buf)
+			return NULL;
+
+		batch->buf = buf;
+		batch->size = size;
+	}
+
+	message = (struct pb_protocol_message *)(batch->buf + batch->len);
+	message->action = __cpu_to_be32(action);
+	message->payload_len = __cpu_to_be32(payload_len);
+	batch->len += total_len;
+
+	return message->payload;
+}
+
+/* A fragmented message being reassembled, with len bytes of its payload
+ * received so far */
+struct pb_protocol_assembly {
+	struct pb_protocol_message	*message;
+	unsigned int			len;
+};
+
+/* Add fragment to the message being reassembled in assembly, starting a new
+ * message if there isn't one in progress. Returns 1 once the message is
+ * complete, 0 if more fragments are needed, or -1 if fragment is invalid,
+ * in which case any partial message is discarded. */
+static int assembly_add_fragment(void *ctx,
+		struct pb_protocol_assembly *assembly,
+		const struct pb_protocol_message *fragment)
+{
+	struct pb_protocol_message *message = assembly->message;
+	uint32_t action, payload_len;
+	unsigned int len;
+
+	if (fragment->payload_len < 2 * sizeof(uint32_t))
+		goto err;
+
+	action = __be32_to_cpu(*(uint32_t *)fragment->payload);
+	payload_len = __be32_to_cpu(*(uint32_t *)(fragment->payload + 4));
+	len = fragment->payload_len - 2 * sizeof(uint32_t);
+
+	if (!message) {
+		if (payload_len > PB_PROTOCOL_MAX_MESSAGE_SIZE) {
+			pb_log_fn("payload too big %u/%u\n", payload_len,
+				PB_PROTOCOL_MAX_MESSAGE_SIZE);
+			goto err;
+		}
+
+		message = talloc_size(ctx, sizeof(*message) + payload_len);
+		if (!message)
+			goto err;
+
+		message->action = action;
+		message->payload_len = payload_len;
+		assembly->message = message;
+		assembly->len = 0;
+
+	} else if (action != message->action ||
+			payload_len != message->payload_len) {
+		pb_log_fn("fragment doesn't match message in progress\n");
+		goto err;
+	}
+
+	if (!len || len > message->payload_len - assembly->len) {
+		pb_log_fn("invalid fragment length %u\n", len);
+		goto err;
+	}
+
+	memcpy(message->payload + assembly->len,
+			fragment->payload + 2 * sizeof(uint32_t), len);
+	assembly->len += len;
+
+	return assembly->len == message->payload_len ? 1 : 0;
+
+err:
+	talloc_free(assembly->message);
+	assembly->message = NULL;
+	return -1;
+}
+
+struct pb_protocol_reader {
+	int		fd;
+	char		*buf;
+	unsigned int	size;
+	unsigned int	start;
+	unsigned int	end;
+
+	struct pb_protocol_assembly	assembly;
+	/* the last reassembled message returned */
+	struct pb_protocol_message	*assembled;
+};
+
+struct pb_protocol_reader *pb_protocol_reader_create(void *ctx, int fd)
+{
+	struct pb_protocol_reader *reader;
+
+	reader = talloc_zero(ctx, struct pb_protocol_reader);
+	if (!reader)
+		return NULL;
+
+	reader->fd = fd;
+	reader->size = 16 * 1024;
+	reader->buf = talloc_array(reader, char, reader->size);
+	if (!reader->buf) {
+		talloc_free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+int pb_protocol_reader_fill(struct pb_protocol_reader *reader)
+{
+	struct pb_protocol_message m;
+	unsigned int len, need;
+	int rc;
+
+	talloc_free(reader->assembled);
+	reader->assembled = NULL;
+
+	/* move any partial message to the start of the buffer */
+	len = reader->end - reader->start;
+	if (reader->start) {
+		memmove(reader->buf, reader->buf + reader->start, len);
+		reader->start = 0;
+		reader->end = len;
+	}
+
+	/* make sure there is room for the whole of a partial message */
+	if (len >= sizeof(m)) {
+		memcpy(&m, reader->buf, sizeof(m));
+		m.payload_len = __be32_to_cpu(m.payload_len);
+
+		if (m.payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+			pb_log_fn("payload too big %u/%u\n", m.payload_len,
+				PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+			return -1;
+		}
+
+		need = sizeof(m) + m.payload_len;
+		if (need > reader->size) {
+			char *buf = talloc_realloc(reader, reader->buf,
+					char, need);
+			if (!buf)
+				return -1;
+			reader->buf = buf;
+			reader->size = need;
+		}
+	}
+
+	rc = read(reader->fd, reader->buf + reader->end,
+			reader->size - reader->end);
+
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		pb_log_fn("failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* EOF */
+	if (rc == 0)
+		return -1;
+
+	reader->end += rc;
+	return 0;
+}
+
+const struct pb_protocol_message *pb_protocol_reader_next(
+		struct pb_protocol_reader *reader)
+{
+	struct pb_protocol_message *message;
+	unsigned int len, payload_len;
+	int rc;
+
+	talloc_free(reader->assembled);
+	reader->assembled = NULL;
+
+	for (;;) {
+		len = reader->end - reader->start;
+		if (len < sizeof(*message))
+			return NULL;
+
+		message = (struct pb_protocol_message *)
+			(reader->buf + reader->start);
+		payload_len = __be32_to_cpu(message->payload_len);
+
+		if (payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE ||
+				len < sizeof(*message) + payload_len)
+			return NULL;
+
+		message->action = __be32_to_cpu(message->action);
+		message->payload_len = payload_len;
+		reader->start += sizeof(*message) + payload_len;
+
+		if (message->action != PB_PROTOCOL_ACTION_FRAGMENT) {
+			if (reader->assembly.message) {
+				pb_log_fn("incomplete fragmented message\n");
+				talloc_free(reader->assembly.message);
+				reader->assembly.message = NULL;
+			}
+			return message;
+		}
+
+		rc = assembly_add_fragment(reader, &reader->assembly, message);
+		if (rc == 1) {
+			reader->assembled = reader->assembly.message;
+			reader->assembly.message = NULL;
+			return reader->assembled;
+		}
+	}
+}
+
+static struct pb_protocol_message *read_wire_message(void *ctx, int fd)
 {
 	struct pb_protocol_message *message, m;
 	int rc;
@@ -871,8 +1247,47 @@ struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd)
 	return message;
 }
 
+struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd)
+{
+	struct pb_protocol_assembly assembly;
+	struct pb_protocol_message *message;
+	int rc;
 
-int pb_protocol_deserialise_device(struct device *dev,
+	message = read_wire_message(ctx, fd);
+	if (!message || message->action != PB_PROTOCOL_ACTION_FRAGMENT)
+		return message;
+
+	/* fragments are sent consecutively, so read until we have them all */
+	memset(&assembly, 0, sizeof(assembly));
+
+	for (;;) {
+		if (message->action != PB_PROTOCOL_ACTION_FRAGMENT) {
+			pb_log_fn("incomplete fragmented message\n");
+			rc = -1;
+		} else {
+			rc = assembly_add_fragment(ctx, &assembly, message);
+		}
+
+		talloc_free(message);
+
+		if (rc == 1)
+			return assembly.message;
+		if (rc < 0) {
+			talloc_free(assembly.message);
+			return NULL;
+		}
+
+		message = read_wire_message(ctx, fd);
+		if (!message) {
+			talloc_free(assembly.message);
+			return NULL;
+		}
+	}
+}
+
+
+static int deserialise_device(struct pb_protocol_decoder *dec,
+		struct device *dev,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len;
@@ -882,7 +1297,7 @@ int pb_protocol_deserialise_device(struct device *dev,
 	len = message->payload_len;
 	pos = message->payload;
 
-	if (read_string(dev, &pos, &len, &dev->id))
+	if (read_string(dec, dev, &pos, &len, &dev->id))
 		goto out;
 
 	if (len < sizeof(enum device_type))
@@ -891,13 +1306,13 @@ int pb_protocol_deserialise_device(struct device *dev,
 	pos += sizeof(enum device_type);
 	len -= sizeof(enum device_type);
 
-	if (read_string(dev, &pos, &len, &dev->name))
+	if (read_string(dec, dev, &pos, &len, &dev->name))
 		goto out;
 
-	if (read_string(dev, &pos, &len, &dev->description))
+	if (read_string(dec, dev, &pos, &len, &dev->description))
 		goto out;
 
-	if (read_string(dev, &pos, &len, &dev->icon_file))
+	if (read_string(dec, dev, &pos, &len, &dev->icon_file))
 		goto out;
 
 	rc = 0;
@@ -906,7 +1321,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_boot_option(struct boot_option *opt,
+static int deserialise_boot_option(struct pb_protocol_decoder *dec,
+		struct boot_option *opt,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len;
@@ -916,34 +1332,34 @@ int pb_protocol_deserialise_boot_option(struct boot_option *opt,
 	len = message->payload_len;
 	pos = message->payload;
 
-	if (read_string(opt, &pos, &len, &opt->device_id))
+	if (read_string(dec, opt, &pos, &len, &opt->device_id))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->id))
+	if (read_string(dec, opt, &pos, &len, &opt->id))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->name))
+	if (read_string(dec, opt, &pos, &len, &opt->name))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->description))
+	if (read_string(dec, opt, &pos, &len, &opt->description))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->icon_file))
+	if (read_string(dec, opt, &pos, &len, &opt->icon_file))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->boot_image_file))
+	if (read_string(dec, opt, &pos, &len, &opt->boot_image_file))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->initrd_file))
+	if (read_string(dec, opt, &pos, &len, &opt->initrd_file))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->dtb_file))
+	if (read_string(dec, opt, &pos, &len, &opt->dtb_file))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->boot_args))
+	if (read_string(dec, opt, &pos, &len, &opt->boot_args))
 		goto out;
 
-	if (read_string(opt, &pos, &len, &opt->args_sig_file))
+	if (read_string(dec, opt, &pos, &len, &opt->args_sig_file))
 		goto out;
 
 	if (len < sizeof(bool))
@@ -964,7 +1380,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_boot_command(struct boot_command *cmd,
+static int deserialise_boot_command(struct pb_protocol_decoder *dec,
+		struct boot_command *cmd,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len;
@@ -974,25 +1391,25 @@ int pb_protocol_deserialise_boot_command(struct boot_command *cmd,
 	len = message->payload_len;
 	pos = message->payload;
 
-	if (read_string(cmd, &pos, &len, &cmd->option_id))
+	if (read_string(dec, cmd, &pos, &len, &cmd->option_id))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->boot_image_file))
+	if (read_string(dec, cmd, &pos, &len, &cmd->boot_image_file))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->initrd_file))
+	if (read_string(dec, cmd, &pos, &len, &cmd->initrd_file))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->dtb_file))
+	if (read_string(dec, cmd, &pos, &len, &cmd->dtb_file))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->boot_args))
+	if (read_string(dec, cmd, &pos, &len, &cmd->boot_args))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->args_sig_file))
+	if (read_string(dec, cmd, &pos, &len, &cmd->args_sig_file))
 		goto out;
 
-	if (read_string(cmd, &pos, &len, &cmd->console))
+	if (read_string(dec, cmd, &pos, &len, &cmd->console))
 		goto out;
 
 	rc = 0;
@@ -1001,7 +1418,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_boot_status(struct status *status,
+static int deserialise_boot_status(struct pb_protocol_decoder *dec,
+		struct status *status,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len;
@@ -1029,7 +1447,7 @@ int pb_protocol_deserialise_boot_status(struct status *status,
 	len -= sizeof(uint32_t);
 
 	/* message string */
-	if (read_string(status, &pos, &len, &status->message))
+	if (read_string(dec, status, &pos, &len, &status->message))
 		goto out;
 
 	/* backlog */
@@ -1046,22 +1464,22 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
+static int deserialise_system_info(struct pb_protocol_decoder *dec,
+		struct system_info *sysinfo,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len, i;
 	const char *pos;
 	int rc = -1;
-	char *tmp;
 
 	len = message->payload_len;
 	pos = message->payload;
 
 	/* type and identifier strings */
-	if (read_string(sysinfo, &pos, &len, &sysinfo->type))
+	if (read_string(dec, sysinfo, &pos, &len, &sysinfo->type))
 		goto out;
 
-	if (read_string(sysinfo, &pos, &len, &sysinfo->identifier))
+	if (read_string(dec, sysinfo, &pos, &len, &sysinfo->identifier))
 		goto out;
 
 	/* Platform version strings for openpower platforms */
@@ -1070,9 +1488,9 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 	sysinfo->platform_primary = talloc_array(sysinfo, char *,
 						sysinfo->n_primary);
 	for (i = 0; i < sysinfo->n_primary; i++) {
-		if (read_string(sysinfo, &pos, &len, &tmp))
+		if (read_string(dec, sysinfo, &pos, &len,
+					&sysinfo->platform_primary[i]))
 			goto out;
-		sysinfo->platform_primary[i] = talloc_strdup(sysinfo, tmp);
 	}
 
 	if (read_u32(&pos, &len, &sysinfo->n_other))
@@ -1080,9 +1498,9 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 	sysinfo->platform_other = talloc_array(sysinfo, char *,
 						sysinfo->n_other);
 	for (i = 0; i < sysinfo->n_other; i++) {
-		if (read_string(sysinfo, &pos, &len, &tmp))
+		if (read_string(dec, sysinfo, &pos, &len,
+					&sysinfo->platform_other[i]))
 			goto out;
-		sysinfo->platform_other[i] = talloc_strdup(sysinfo, tmp);
 	}
 
 	/* BMC version strings for openpower platforms */
@@ -1091,9 +1509,9 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 	sysinfo->bmc_current = talloc_array(sysinfo, char *,
 						sysinfo->n_bmc_current);
 	for (i = 0; i < sysinfo->n_bmc_current; i++) {
-		if (read_string(sysinfo, &pos, &len, &tmp))
+		if (read_string(dec, sysinfo, &pos, &len,
+					&sysinfo->bmc_current[i]))
 			goto out;
-		sysinfo->bmc_current[i] = talloc_strdup(sysinfo, tmp);
 	}
 
 	if (read_u32(&pos, &len, &sysinfo->n_bmc_golden))
@@ -1101,9 +1519,9 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 	sysinfo->bmc_golden = talloc_array(sysinfo, char *,
 						sysinfo->n_bmc_golden);
 	for (i = 0; i < sysinfo->n_bmc_golden; i++) {
-		if (read_string(sysinfo, &pos, &len, &tmp))
+		if (read_string(dec, sysinfo, &pos, &len,
+					&sysinfo->bmc_golden[i]))
 			goto out;
-		sysinfo->bmc_golden[i] = talloc_strdup(sysinfo, tmp);
 	}
 
 	/* number of interfaces */
@@ -1128,15 +1546,15 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 		pos += if_info->hwaddr_size;
 		len -= if_info->hwaddr_size;
 
-		if (read_string(if_info, &pos, &len, &if_info->name))
+		if (read_string(dec, if_info, &pos, &len, &if_info->name))
 			goto out;
 
 		if_info->link = *(bool *)pos;
 		pos += sizeof(if_info->link);
 
-		if (read_string(if_info, &pos, &len, &if_info->address))
+		if (read_string(dec, if_info, &pos, &len, &if_info->address))
 			goto out;
-		if (read_string(if_info, &pos, &len, &if_info->address_v6))
+		if (read_string(dec, if_info, &pos, &len, &if_info->address_v6))
 			goto out;
 
 		sysinfo->interfaces[i] = if_info;
@@ -1153,13 +1571,13 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 		struct blockdev_info *bd_info = talloc(sysinfo,
 							struct blockdev_info);
 
-		if (read_string(bd_info, &pos, &len, &bd_info->name))
+		if (read_string(dec, bd_info, &pos, &len, &bd_info->name))
 			goto out;
 
-		if (read_string(bd_info, &pos, &len, &bd_info->uuid))
+		if (read_string(dec, bd_info, &pos, &len, &bd_info->uuid))
 			goto out;
 
-		if (read_string(bd_info, &pos, &len, &bd_info->mountpoint))
+		if (read_string(dec, bd_info, &pos, &len, &bd_info->mountpoint))
 			goto out;
 
 		sysinfo->blockdevs[i] = bd_info;
@@ -1188,8 +1606,9 @@ out:
 	return rc;
 }
 
-static int pb_protocol_deserialise_config_interface(const char **buf,
-		unsigned int *len, struct interface_config *iface)
+static int deserialise_config_interface(struct pb_protocol_decoder *dec,
+		const char **buf, unsigned int *len,
+		struct interface_config *iface)
 {
 	unsigned int tmp;
 
@@ -1211,13 +1630,16 @@ static int pb_protocol_deserialise_config_interface(const char **buf,
 		return -1;
 
 	if (iface->method == CONFIG_METHOD_STATIC) {
-		if (read_string(iface, buf, len, &iface->static_config.address))
+		if (read_string(dec, iface, buf, len,
+					&iface->static_config.address))
 			return -1;
 
-		if (read_string(iface, buf, len, &iface->static_config.gateway))
+		if (read_string(dec, iface, buf, len,
+					&iface->static_config.gateway))
 			return -1;
 
-		if (read_string(iface, buf, len, &iface->static_config.url))
+		if (read_string(dec, iface, buf, len,
+					&iface->static_config.url))
 			return -1;
 	}
 
@@ -1228,7 +1650,8 @@ static int pb_protocol_deserialise_config_interface(const char **buf,
 	return 0;
 }
 
-int pb_protocol_deserialise_config(struct config *config,
+static int deserialise_config(struct pb_protocol_decoder *dec,
+		struct config *config,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len, i, tmp;
@@ -1260,7 +1683,7 @@ int pb_protocol_deserialise_config(struct config *config,
 		struct interface_config *iface = talloc_zero(
 				config->network.interfaces,
 				struct interface_config);
-		if (pb_protocol_deserialise_config_interface(&pos, &len, iface))
+		if (deserialise_config_interface(dec, &pos, &len, iface))
 			goto out;
 		config->network.interfaces[i] = iface;
 	}
@@ -1271,15 +1694,16 @@ int pb_protocol_deserialise_config(struct config *config,
 			config->network.n_dns_servers);
 
 	for (i = 0; i < config->network.n_dns_servers; i++) {
-		if (read_string(config->network.dns_servers, &pos, &len, &str))
+		if (read_string(dec, config->network.dns_servers,
+					&pos, &len, &str))
 			goto out;
 		config->network.dns_servers[i] = str;
 	}
 
-	if (read_string(config, &pos, &len, &str))
+	if (read_string(dec, config, &pos, &len, &str))
 		goto out;
 	config->http_proxy = str;
-	if (read_string(config, &pos, &len, &str))
+	if (read_string(dec, config, &pos, &len, &str))
 		goto out;
 	config->https_proxy = str;
 
@@ -1297,7 +1721,7 @@ int pb_protocol_deserialise_config(struct config *config,
 				goto out;
 			config->autoboot_opts[i].type = tmp;
 		} else {
-			if (read_string(config, &pos, &len, &str))
+			if (read_string(dec, config, &pos, &len, &str))
 				goto out;
 			config->autoboot_opts[i].uuid = str;
 		}
@@ -1321,12 +1745,12 @@ int pb_protocol_deserialise_config(struct config *config,
 
 	config->consoles = talloc_array(config, char *, config->n_consoles);
 	for (i = 0; i < config->n_consoles; i++) {
-		if (read_string(config->consoles, &pos, &len, &str))
+		if (read_string(dec, config->consoles, &pos, &len, &str))
 			goto out;
 		config->consoles[i] = str;
 	}
 
-	if (read_string(config, &pos, &len, &str))
+	if (read_string(dec, config, &pos, &len, &str))
 		goto out;
 
 	config->boot_console = str;
@@ -1335,7 +1759,7 @@ int pb_protocol_deserialise_config(struct config *config,
 		goto out;
 	config->manual_console = !!tmp;
 
-	if (read_string(config, &pos, &len, &str))
+	if (read_string(dec, config, &pos, &len, &str))
 		goto out;
 
 	config->lang = str;
@@ -1350,7 +1774,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_plugin_option(struct plugin_option *opt,
+static int deserialise_plugin_option(struct pb_protocol_decoder *dec,
+		struct plugin_option *opt,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len, i, tmp;
@@ -1361,31 +1786,31 @@ int pb_protocol_deserialise_plugin_option(struct plugin_option *opt,
 	len = message->payload_len;
 	pos = message->payload;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->id = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->name = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->vendor = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->vendor_id = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->version = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->date = str;
 
-	if (read_string(opt, &pos, &len, &str))
+	if (read_string(dec, opt, &pos, &len, &str))
 		goto out;
 	opt->plugin_file = str;
 
@@ -1398,9 +1823,8 @@ int pb_protocol_deserialise_plugin_option(struct plugin_option *opt,
 		goto out;
 
 	for (i = 0; i < opt->n_executables; i++) {
-		if (read_string(opt, &pos, &len, &str))
+		if (read_string(dec, opt, &pos, &len, &opt->executables[i]))
 			goto out;
-		opt->executables[i] = talloc_strdup(opt, str);
 	}
 
 	rc = 0;
@@ -1408,7 +1832,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_temp_autoboot(struct autoboot_option *opt,
+static int deserialise_temp_autoboot(struct pb_protocol_decoder *dec,
+		struct autoboot_option *opt,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len, tmp;
@@ -1429,7 +1854,7 @@ int pb_protocol_deserialise_temp_autoboot(struct autoboot_option *opt,
 		opt->type = tmp;
 
 	} else if (opt->boot_type == BOOT_DEVICE_UUID) {
-		if (read_string(opt, &pos, &len, &str))
+		if (read_string(dec, opt, &pos, &len, &str))
 			goto out;
 		opt->uuid = str;
 
@@ -1443,7 +1868,8 @@ out:
 	return rc;
 }
 
-int pb_protocol_deserialise_authenticate(struct auth_message *msg,
+static int deserialise_authenticate(struct pb_protocol_decoder *dec,
+		struct auth_message *msg,
 		const struct pb_protocol_message *message)
 {
 	unsigned int len;
@@ -1457,7 +1883,7 @@ int pb_protocol_deserialise_authenticate(struct auth_message *msg,
 
 	switch (msg->op) {
 	case AUTH_MSG_REQUEST:
-		if (read_string(msg, &pos, &len, &msg->password))
+		if (read_string(dec, msg, &pos, &len, &msg->password))
 			return -1;
 		break;
 	case AUTH_MSG_RESPONSE:
@@ -1465,16 +1891,18 @@ int pb_protocol_deserialise_authenticate(struct auth_message *msg,
 		pos += sizeof(bool);
 		break;
 	case AUTH_MSG_SET:
-		if (read_string(msg, &pos, &len, &msg->set_password.password))
+		if (read_string(dec, msg, &pos, &len,
+					&msg->set_password.password))
 			return -1;
-		if (read_string(msg, &pos, &len,
+		if (read_string(dec, msg, &pos, &len,
 					&msg->set_password.new_password))
 			return -1;
 		break;
 	case AUTH_MSG_DECRYPT:
-		if (read_string(msg, &pos, &len, &msg->decrypt_dev.password))
+		if (read_string(dec, msg, &pos, &len,
+					&msg->decrypt_dev.password))
 			return -1;
-		if (read_string(msg, &pos, &len,
+		if (read_string(dec, msg, &pos, &len,
 					&msg->decrypt_dev.device_id))
 			return -1;
 		break;
@@ -1485,3 +1913,139 @@ int pb_protocol_deserialise_authenticate(struct auth_message *msg,
 
 	return 0;
 }
+
+int pb_protocol_deserialise_device(struct device *dev,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_device(&dec, dev, message);
+}
+
+int pb_protocol_deserialise_boot_option(struct boot_option *opt,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_boot_option(&dec, opt, message);
+}
+
+int pb_protocol_deserialise_boot_command(struct boot_command *cmd,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_boot_command(&dec, cmd, message);
+}
+
+int pb_protocol_deserialise_boot_status(struct status *status,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_boot_status(&dec, status, message);
+}
+
+int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_system_info(&dec, sysinfo, message);
+}
+
+int pb_protocol_deserialise_config(struct config *config,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_config(&dec, config, message);
+}
+
+int pb_protocol_deserialise_plugin_option(struct plugin_option *opt,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_plugin_option(&dec, opt, message);
+}
+
+int pb_protocol_deserialise_temp_autoboot(struct autoboot_option *opt,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_temp_autoboot(&dec, opt, message);
+}
+
+int pb_protocol_deserialise_authenticate(struct auth_message *msg,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_decoder dec = { .mode = PB_PROTOCOL_DECODE_COPY };
+
+	return deserialise_authenticate(&dec, msg, message);
+}
+
+int pb_protocol_decode_message(void *obj,
+		const struct pb_protocol_message *message,
+		enum pb_protocol_decode_mode mode)
+{
+	struct pb_protocol_decoder dec = { .mode = mode };
+	int rc;
+
+	if (mode == PB_PROTOCOL_DECODE_ARENA && message->payload_len) {
+		dec.arena = talloc_size(obj, message->payload_len);
+		if (!dec.arena)
+			return -1;
+	}
+
+	switch (message->action) {
+	case PB_PROTOCOL_ACTION_DEVICE_ADD:
+		rc = deserialise_device(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_BOOT_OPTION_ADD:
+		rc = deserialise_boot_option(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_BOOT:
+		rc = deserialise_boot_command(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_STATUS:
+		rc = deserialise_boot_status(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_SYSTEM_INFO:
+		rc = deserialise_system_info(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_CONFIG:
+		rc = deserialise_config(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD:
+		rc = deserialise_plugin_option(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_TEMP_AUTOBOOT:
+		rc = deserialise_temp_autoboot(&dec, obj, message);
+		break;
+	case PB_PROTOCOL_ACTION_AUTHENTICATE:
+		rc = deserialise_authenticate(&dec, obj, message);
+		break;
+	default:
+		pb_log("%s: no decoder for action %d\n", __func__,
+				message->action);
+		return -1;
+	}
+
+	/* string views point into the payload, so keep the message for as
+	 * long as the decoded object */
+	if (!rc && mode == PB_PROTOCOL_DECODE_VIEW)
+		talloc_steal(obj, message);
+
+	return rc;
+}
+
+int pb_protocol_deserialise_capabilities(uint32_t *caps,
+		const struct pb_protocol_message *message)
+{
+	unsigned int len = message->payload_len;
+	const char *pos = message->payload;
+
+	return read_u32(&pos, &len, caps);
+}
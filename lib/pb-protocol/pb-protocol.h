@@ -11,6 +11,18 @@
 
 #define PB_PROTOCOL_MAX_PAYLOAD_SIZE (64 * 1024)
 
+/* Messages with larger payloads than PB_PROTOCOL_MAX_PAYLOAD_SIZE are sent
+ * as a series of PB_PROTOCOL_ACTION_FRAGMENT messages, to peers that have
+ * advertised PB_PROTOCOL_CAP_FRAGMENTS. This is the limit on the size of
+ * the reassembled payload. */
+#define PB_PROTOCOL_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+/* Each fragment is preceded by the message header, then the action and
+ * payload length of the complete message */
+#define PB_PROTOCOL_FRAGMENT_HEADER_SIZE	16
+#define PB_PROTOCOL_FRAGMENT_DATA_SIZE \
+	(PB_PROTOCOL_MAX_PAYLOAD_SIZE - 2 * sizeof(uint32_t))
+
 enum pb_protocol_action {
 	PB_PROTOCOL_ACTION_DEVICE_ADD		= 0x1,
 	PB_PROTOCOL_ACTION_BOOT_OPTION_ADD	= 0x2,
@@ -28,8 +40,22 @@ enum pb_protocol_action {
 	PB_PROTOCOL_ACTION_PLUGIN_INSTALL	= 0xe,
 	PB_PROTOCOL_ACTION_TEMP_AUTOBOOT	= 0xf,
 	PB_PROTOCOL_ACTION_AUTHENTICATE		= 0x10,
+	PB_PROTOCOL_ACTION_CAPABILITIES		= 0x11,
+	PB_PROTOCOL_ACTION_FRAGMENT		= 0x12,
+};
+
+/* Protocol extensions, advertised in capabilities messages. The server
+ * sends its capabilities when the client connects, and the client replies
+ * with its own; older servers treat unknown actions from non-root clients
+ * as privileged, so clients never send one first. Peers that don't send
+ * one (older versions) have none of these, and unknown capabilities are
+ * ignored. */
+enum pb_protocol_capability {
+	PB_PROTOCOL_CAP_FRAGMENTS	= 0x1,
 };
 
+#define PB_PROTOCOL_CAPABILITIES	(PB_PROTOCOL_CAP_FRAGMENTS)
+
 struct pb_protocol_message {
 	uint32_t action;
 	uint32_t payload_len;
@@ -71,6 +97,7 @@ int pb_protocol_url_len(const char *url);
 int pb_protocol_plugin_option_len(const struct plugin_option *opt);
 int pb_protocol_temp_autoboot_len(const struct autoboot_option *opt);
 int pb_protocol_authenticate_len(struct auth_message *msg);
+int pb_protocol_capabilities_len(void);
 int pb_protocol_device_cmp(const struct device *a, const struct device *b);
 
 int pb_protocol_boot_option_cmp(const struct boot_option *a,
@@ -99,14 +126,66 @@ int pb_protocol_serialise_temp_autoboot(const struct autoboot_option *opt,
 		char *buf, int buf_len);
 int pb_protocol_serialise_authenticate(struct auth_message *msg,
 		char *buf, int buf_len);
+int pb_protocol_serialise_capabilities(uint32_t caps, char *buf, int buf_len);
 
 int pb_protocol_write_message(int fd, struct pb_protocol_message *message);
 
+/* Convert a message's header to wire format, for callers doing their own
+ * writes. Returns the total number of bytes to send. */
+int pb_protocol_finalise_message(struct pb_protocol_message *message);
+
+/* Whether message is too large to send other than as fragments, which is
+ * only possible if the peer has PB_PROTOCOL_CAP_FRAGMENTS. */
+bool pb_protocol_needs_fragments(const struct pb_protocol_message *message);
+
+/* The number of bytes needed to send message, including the fragment
+ * headers if it needs to be fragmented */
+unsigned int pb_protocol_wire_len(const struct pb_protocol_message *message);
+
+/* For callers doing their own writes of fragmented messages: fill hdr
+ * (PB_PROTOCOL_FRAGMENT_HEADER_SIZE bytes) with the headers for the fragment
+ * of message starting at payload offset, and return the number of payload
+ * bytes to send after it. The message header must not be finalised. */
+unsigned int pb_protocol_fragment_header(
+		const struct pb_protocol_message *message,
+		unsigned int offset, char *hdr);
+
 struct pb_protocol_message *pb_protocol_create_message(void *ctx,
 		enum pb_protocol_action action, int payload_len);
 
+/* Read one message from fd, blocking until all of it, and all the fragments
+ * of a fragmented message, have arrived. Peers run from a waitset use a
+ * pb_protocol_reader instead. */
 struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd);
 
+/* A buffer of complete, wire-format messages, for sending many messages in
+ * a single write. pb_protocol_batch_add appends a message header, and
+ * returns a pointer to payload_len bytes for the caller to serialise the
+ * payload into. */
+struct pb_protocol_batch {
+	char		*buf;
+	unsigned int	len;
+	unsigned int	size;
+};
+
+struct pb_protocol_batch *pb_protocol_batch_create(void *ctx);
+char *pb_protocol_batch_add(struct pb_protocol_batch *batch,
+		enum pb_protocol_action action, int payload_len);
+
+/* Buffered message reader. pb_protocol_reader_fill performs a single read
+ * from fd, returning -1 on EOF or error. pb_protocol_reader_next then
+ * returns each complete message received, or NULL once none remain.
+ * Messages point into the reader's buffer, so are only valid until the
+ * next call to pb_protocol_reader_fill. Fragmented messages are returned
+ * once reassembled, and are only valid until the next call to either
+ * function. */
+struct pb_protocol_reader;
+
+struct pb_protocol_reader *pb_protocol_reader_create(void *ctx, int fd);
+int pb_protocol_reader_fill(struct pb_protocol_reader *reader);
+const struct pb_protocol_message *pb_protocol_reader_next(
+		struct pb_protocol_reader *reader);
+
 int pb_protocol_deserialise_device(struct device *dev,
 		const struct pb_protocol_message *message);
 
@@ -133,4 +212,31 @@ int pb_protocol_deserialise_temp_autoboot(struct autoboot_option *opt,
 
 int pb_protocol_deserialise_authenticate(struct auth_message *msg,
 		const struct pb_protocol_message *message);
+
+int pb_protocol_deserialise_capabilities(uint32_t *caps,
+		const struct pb_protocol_message *message);
+
+/* Where decoded strings are stored. The pb_protocol_deserialise_*
+ * functions use PB_PROTOCOL_DECODE_COPY, allocating each string separately
+ * as a child of the object that refers to it. */
+enum pb_protocol_decode_mode {
+	PB_PROTOCOL_DECODE_COPY,
+	/* strings are nul-terminated in place in the message payload, and the
+	 * message is reparented under the decoded object. The message must
+	 * be a talloc allocation (not from a pb_protocol_reader), and can
+	 * only be decoded once. */
+	PB_PROTOCOL_DECODE_VIEW,
+	/* strings are packed into a single allocation under the decoded
+	 * object; the message is not modified. */
+	PB_PROTOCOL_DECODE_ARENA,
+};
+
+/* Decode message into obj, which must be the type corresponding to the
+ * message's action (eg. struct device for PB_PROTOCOL_ACTION_DEVICE_ADD).
+ * In the VIEW and ARENA modes, individual strings can't be freed or
+ * reallocated; they live as long as obj does. Only the VIEW mode modifies
+ * the message. */
+int pb_protocol_decode_message(void *obj,
+		const struct pb_protocol_message *message,
+		enum pb_protocol_decode_mode mode);
 #endif /* _PB_PROTOCOL_H */
@@ -15,8 +15,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/wait.h>
 
 #include <process/process.h>
@@ -56,6 +58,8 @@ struct process_info {
 
 static struct procset *procset;
 
+extern char **environ;
+
 static struct process_info *get_info(struct process *process)
 {
 	return container_of(process, struct process_info, process);
@@ -185,6 +189,7 @@ static void process_setup_stdout_child(struct process_info *procinfo)
 static void process_finish_stdout(struct process_info *procinfo)
 {
 	close(procinfo->stdout_pipe[0]);
+	procinfo->stdout_pipe[0] = -1;
 	procinfo->process.stdout_buf[procinfo->process.stdout_len] = '\0';
 }
 
@@ -192,14 +197,21 @@ static int process_read_stdout(struct process_info *procinfo)
 {
 	int rc;
 
-	if (!procinfo->process.keep_stdout)
+	if (!procinfo->process.keep_stdout || procinfo->stdout_pipe[0] < 0)
 		return 0;
 
 	do {
 		rc = process_read_stdout_once(procinfo, NULL);
 	} while (rc > 0);
 
-	process_finish_stdout(procinfo);
+	/* An async process' stdout waiter will see the EOF too, and close
+	 * the pipe itself. Closing it from under the waiter would leave it
+	 * polling a stale fd */
+	if (procinfo->stdout_waiter)
+		procinfo->process.stdout_buf[procinfo->process.stdout_len] =
+			'\0';
+	else
+		process_finish_stdout(procinfo);
 
 	return rc < 0 ? rc : 0;
 }
@@ -212,10 +224,11 @@ int process_process_stdout(struct process_info *procinfo, char **line)
 
 	/* if we're going to signal to the waitset that we're done (ie, non-zero
 	 * return value), then the waiters will remove us, so we drop the
-	 * reference */
-	if (rc < 0) {
-		talloc_unlink(procset, procinfo);
+	 * reference. Once we've seen EOF there's nothing more to wait for. */
+	if (rc <= 0) {
 		procinfo->stdout_waiter = NULL;
+		process_finish_stdout(procinfo);
+		talloc_unlink(procset, procinfo);
 		rc = -1;
 	} else {
 		rc = 0;
@@ -242,7 +255,7 @@ static void sigchld_sigaction(int signo, siginfo_t *info,
 
 static int sigchld_pipe_event(void *arg)
 {
-	struct process_info *procinfo;
+	struct process_info *procinfo, *tmp;
 	struct procset *procset = arg;
 	struct process *process;
 	pid_t pid;
@@ -254,7 +267,8 @@ static int sigchld_pipe_event(void *arg)
 		return 0;
 
 	/* More than 1 async process may have finished. Check them all. */
-	list_for_each_entry(&procset->async_list, procinfo, async_list) {
+	list_for_each_entry_safe(&procset->async_list, procinfo, tmp,
+			async_list) {
 		process = &procinfo->process;
 		pid = waitpid(process->pid, &process->exit_status, WNOHANG);
 		if (pid > 0) {
@@ -349,6 +363,88 @@ void process_release(struct process *process)
 	talloc_unlink(info->orig_ctx, info);
 }
 
+static pid_t process_fork(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		pb_log_fn("fork failed: %s\n", strerror(errno));
+		return pid;
+	}
+
+	if (pid == 0) {
+		process_setup_stdout_child(procinfo);
+		process_setup_stdin_child(procinfo);
+		if (process->child_fn)
+			_exit(process->child_fn(process->child_data));
+		if (procset->dry_run)
+			exit(EXIT_SUCCESS);
+		execvp(process->path, (char * const *)process->argv);
+		exit(EXIT_FAILURE);
+	}
+
+	return pid;
+}
+
+/* Start an executable with posix_spawn, which avoids copying our page
+ * tables as fork() would. The file actions here must match the
+ * process_setup_*_child functions. */
+static pid_t process_spawn(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	posix_spawn_file_actions_t actions;
+	int rc, log, out_fd, err_fd;
+	pid_t pid;
+
+	posix_spawn_file_actions_init(&actions);
+
+	if (!process->raw_stdout) {
+		log = fileno(pb_log_get_stream());
+		out_fd = err_fd = log;
+
+		if (process->keep_stdout) {
+			out_fd = procinfo->stdout_pipe[1];
+			if (process->add_stderr)
+				err_fd = procinfo->stdout_pipe[1];
+		}
+
+		posix_spawn_file_actions_adddup2(&actions, out_fd,
+				STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, err_fd,
+				STDERR_FILENO);
+	}
+
+	if (process->pipe_stdin) {
+		posix_spawn_file_actions_addclose(&actions,
+				procinfo->stdin_pipe[1]);
+		posix_spawn_file_actions_adddup2(&actions,
+				procinfo->stdin_pipe[0], STDIN_FILENO);
+	}
+
+	rc = posix_spawnp(&pid, process->path, &actions, NULL,
+			(char * const *)process->argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (rc) {
+		pb_log_fn("spawn of %s failed: %s\n", process->path,
+				strerror(rc));
+		if (process->keep_stdout && !process->raw_stdout) {
+			close(procinfo->stdout_pipe[0]);
+			close(procinfo->stdout_pipe[1]);
+		}
+		if (process->pipe_stdin) {
+			close(procinfo->stdin_pipe[0]);
+			close(procinfo->stdin_pipe[1]);
+		}
+		return -1;
+	}
+
+	return pid;
+}
+
 static int process_run_common(struct process_info *procinfo)
 {
 	struct process *process = &procinfo->process;
@@ -357,11 +453,17 @@ static int process_run_common(struct process_info *procinfo)
 	pid_t pid;
 	int rc, i;
 
-	logmsg = talloc_asprintf(procinfo, " exe:  %s\n argv:", process->path);
-	for (i = 0, arg = process->argv[i]; arg; i++, arg = process->argv[i])
-		logmsg = talloc_asprintf_append(logmsg, " '%s'", arg);
+	if (process->child_fn) {
+		pb_debug("Running %s in child process\n", process->path);
+	} else {
+		logmsg = talloc_asprintf(procinfo, " exe:  %s\n argv:",
+				process->path);
+		for (i = 0, arg = process->argv[i]; arg;
+				i++, arg = process->argv[i])
+			logmsg = talloc_asprintf_append(logmsg, " '%s'", arg);
 
-	pb_log("Running command:\n%s\n", logmsg);
+		pb_log("Running command:\n%s\n", logmsg);
+	}
 
 	rc = process_setup_stdout_pipe(procinfo);
 	if (rc)
@@ -372,20 +474,15 @@ static int process_run_common(struct process_info *procinfo)
 			return rc;
 	}
 
-	pid = fork();
-	if (pid < 0) {
-		pb_log_fn("fork failed: %s\n", strerror(errno));
-		return pid;
-	}
+	/* child functions need a copy of our address space, and dry-run
+	 * children exit without exec()ing anything */
+	if (process->child_fn || procset->dry_run)
+		pid = process_fork(procinfo);
+	else
+		pid = process_spawn(procinfo);
 
-	if (pid == 0) {
-		process_setup_stdout_child(procinfo);
-		process_setup_stdin_child(procinfo);
-		if (procset->dry_run)
-			exit(EXIT_SUCCESS);
-		execvp(process->path, (char * const *)process->argv);
-		exit(EXIT_FAILURE);
-	}
+	if (pid < 0)
+		return pid;
 
 	process_setup_stdout_parent(procinfo);
 	process_setup_stdin_parent(procinfo);
@@ -551,6 +648,236 @@ int process_get_stdout(void *ctx, struct process_stdout **stdout,
 	return rc;
 }
 
+struct process_step {
+	struct process		*process;
+	process_step_cb		cb;
+	struct list_item	list;
+};
+
+struct process_chain {
+	struct list		steps;
+	struct process_step	*current;
+	/* for steps that couldn't be started */
+	struct waiter		*waiter;
+	process_chain_cb	cb;
+	void			*data;
+	bool			stopped;
+};
+
+static void process_chain_next(struct process_chain *chain);
+
+static int process_chain_destructor(void *arg)
+{
+	struct process_chain *chain = arg;
+
+	if (chain->waiter)
+		waiter_remove(chain->waiter);
+
+	/* the current step may outlive us, so drop its callback */
+	if (chain->current)
+		chain->current->process->exit_cb = NULL;
+
+	return 0;
+}
+
+struct process_chain *process_chain_create(void *ctx, process_chain_cb cb,
+		void *data)
+{
+	struct process_chain *chain;
+
+	chain = talloc_zero(ctx, struct process_chain);
+	list_init(&chain->steps);
+	chain->cb = cb;
+	chain->data = data;
+	talloc_set_destructor(chain, process_chain_destructor);
+
+	return chain;
+}
+
+struct process *process_chain_add_argv(struct process_chain *chain,
+		process_step_cb cb, const char *argv[])
+{
+	struct process_step *step;
+	int i, n_argv;
+
+	for (n_argv = 0; argv[n_argv]; n_argv++)
+		;
+
+	step = talloc_zero(chain, struct process_step);
+	step->cb = cb;
+	step->process = process_create(step);
+	step->process->argv = talloc_array(step, const char *, n_argv + 1);
+	for (i = 0; i < n_argv; i++)
+		step->process->argv[i] = talloc_strdup(step, argv[i]);
+	step->process->argv[n_argv] = NULL;
+	step->process->path = step->process->argv[0];
+
+	list_add_tail(&chain->steps, &step->list);
+
+	return step->process;
+}
+
+struct process *process_chain_add(struct process_chain *chain,
+		process_step_cb cb, const char *path, ...)
+{
+	struct process *process;
+	int i, n_argv = 1;
+	const char **argv;
+	va_list ap;
+
+	va_start(ap, path);
+	while (va_arg(ap, char *))
+		n_argv++;
+	va_end(ap);
+
+	argv = talloc_array(chain, const char *, n_argv + 1);
+	argv[0] = path;
+
+	va_start(ap, path);
+	for (i = 1; i < n_argv; i++)
+		argv[i] = va_arg(ap, const char *);
+	va_end(ap);
+
+	argv[i] = NULL;
+
+	process = process_chain_add_argv(chain, cb, argv);
+
+	talloc_free(argv);
+
+	return process;
+}
+
+static void process_chain_finish(struct process_chain *chain,
+		struct process_step *failed)
+{
+	/* the callback may free our parent context; make sure we're still
+	 * around to clean up afterwards */
+	talloc_steal(NULL, chain);
+
+	chain->cb(chain->data, failed ? failed->process : NULL);
+
+	talloc_free(chain);
+}
+
+static void process_chain_step_done(struct process_chain *chain)
+{
+	struct process_step *step = chain->current;
+	enum process_chain_action action;
+	bool ok;
+
+	chain->current = NULL;
+	list_remove(&step->list);
+
+	ok = process_exit_ok(step->process);
+
+	if (chain->stopped)
+		action = ok ? PROCESS_CHAIN_STOP : PROCESS_CHAIN_FAIL;
+	else if (step->cb)
+		action = step->cb(step->process, chain->data);
+	else
+		action = ok ? PROCESS_CHAIN_CONTINUE : PROCESS_CHAIN_FAIL;
+
+	if (action == PROCESS_CHAIN_CONTINUE && list_empty(&chain->steps))
+		action = ok ? PROCESS_CHAIN_STOP : PROCESS_CHAIN_FAIL;
+
+	switch (action) {
+	case PROCESS_CHAIN_CONTINUE:
+		process_release(step->process);
+		talloc_free(step);
+		process_chain_next(chain);
+		break;
+	case PROCESS_CHAIN_STOP:
+		process_release(step->process);
+		talloc_free(step);
+		process_chain_finish(chain, NULL);
+		break;
+	case PROCESS_CHAIN_FAIL:
+		process_chain_finish(chain, step);
+		break;
+	}
+}
+
+static void process_chain_exit(struct process *process)
+{
+	process_chain_step_done(process->data);
+}
+
+static int process_chain_start_failed(void *arg)
+{
+	struct process_chain *chain = arg;
+
+	chain->waiter = NULL;
+	process_chain_step_done(chain);
+	return 0;
+}
+
+static void process_chain_next(struct process_chain *chain)
+{
+	struct process_step *step;
+
+	step = list_entry(chain->steps.head.next, struct process_step, list,
+			&chain->steps);
+	chain->current = step;
+
+	step->process->exit_cb = process_chain_exit;
+	step->process->data = chain;
+
+	if (!process_run_async(step->process))
+		return;
+
+	/* report the failure from the waitset, so that the chain callback
+	 * is never invoked from within process_chain_run */
+	step->process->exit_status = W_EXITCODE(EXIT_FAILURE, 0);
+	chain->waiter = waiter_register_timeout(procset->waitset, 0,
+			process_chain_start_failed, chain);
+}
+
+static int process_chain_empty(void *arg)
+{
+	struct process_chain *chain = arg;
+
+	chain->waiter = NULL;
+	process_chain_finish(chain, NULL);
+	return 0;
+}
+
+void process_chain_run(struct process_chain *chain)
+{
+	if (chain->current || chain->waiter)
+		return;
+
+	if (!list_empty(&chain->steps)) {
+		process_chain_next(chain);
+		return;
+	}
+
+	/* nothing to run, but the caller still expects to hear back */
+	chain->waiter = waiter_register_timeout(procset->waitset, 0,
+			process_chain_empty, chain);
+}
+
+void process_chain_stop(struct process_chain *chain)
+{
+	struct process_step *step, *tmp;
+
+	if (!chain->current || chain->stopped)
+		return;
+
+	chain->stopped = true;
+
+	list_for_each_entry_safe(&chain->steps, step, tmp, list) {
+		if (step == chain->current)
+			continue;
+		list_remove(&step->list);
+		process_release(step->process);
+		talloc_free(step);
+	}
+
+	/* a step that couldn't be started is already reported as failed */
+	if (!chain->waiter)
+		process_stop_async(chain->current->process);
+}
+
 bool process_exit_ok(struct process *process)
 {
 	return WIFEXITED(process->exit_status) &&
@@ -26,6 +26,7 @@ struct procset;
 struct process_info;
 
 typedef void	(*process_exit_cb)(struct process *);
+typedef int	(*process_child_fn)(void *);
 
 struct process_stdout {
 	size_t len;
@@ -45,6 +46,14 @@ struct process {
 	void			*stdout_data;
 	char			*pipe_stdin;
 
+	/* If set, child_fn is called in the child process instead of
+	 * executing path (which is then only used for logging), and its
+	 * return value is the exit status. This is for blocking system calls
+	 * that shouldn't hold up the main loop, so child_fn is called even
+	 * in dry-run mode. */
+	process_child_fn	child_fn;
+	void			*child_data;
+
 	/* runtime data */
 	pid_t			pid;
 	int			stdout_len;
@@ -98,6 +107,56 @@ int process_run_async(struct process *process);
 void process_stop_async(struct process *process);
 void process_stop_async_all(void);
 
+/* Asynchronous command sequences. The steps of a chain are run in order,
+ * each starting once the previous step has exited, and all from the
+ * waitset; nothing blocks waiting for a child.
+ *
+ * As each step exits, its step callback decides whether to continue with
+ * the next step, stop the chain successfully, or fail it. Without a step
+ * callback, a step that doesn't exit cleanly fails the chain. A step that
+ * can't be started is treated as exiting with EXIT_FAILURE.
+ *
+ * Once the chain is finished, the chain callback is invoked with the
+ * failing step's process, or NULL if the chain succeeded. A chain also
+ * fails if its last step didn't exit cleanly, even if the step callback
+ * returned PROCESS_CHAIN_CONTINUE. A chain with no steps succeeds. The
+ * chain then frees itself.
+ *
+ * Freeing the chain's talloc context cancels the callbacks, but leaves any
+ * running step to exit on its own.
+ */
+struct process_chain;
+
+enum process_chain_action {
+	PROCESS_CHAIN_CONTINUE,
+	PROCESS_CHAIN_STOP,
+	PROCESS_CHAIN_FAIL,
+};
+
+typedef enum process_chain_action (*process_step_cb)(struct process *process,
+		void *data);
+typedef void (*process_chain_cb)(void *data, struct process *failed);
+
+struct process_chain *process_chain_create(void *ctx, process_chain_cb cb,
+		void *data);
+
+/* Add a step to the chain. The returned process may be configured further
+ * (eg, keep_stdout), but its exit_cb and data are used by the chain.
+ * Steps may be added while the chain is running. */
+struct process *process_chain_add_argv(struct process_chain *chain,
+		process_step_cb cb, const char *argv[]);
+struct process *process_chain_add(struct process_chain *chain,
+		process_step_cb cb, const char *path, ...)
+	__attribute__((sentinel(0)));
+
+/* Start running the chain; this has no effect if it is already running */
+void process_chain_run(struct process_chain *chain);
+
+/* Stop a running chain: no further steps are started, and the running step
+ * is sent SIGTERM. The chain callback is still called once that step has
+ * exited, with its process unless it had already exited cleanly. */
+void process_chain_stop(struct process_chain *chain);
+
 /* helper function to determine if a process exited cleanly, with a non-zero
  * exit status */
 bool process_exit_ok(struct process *process);
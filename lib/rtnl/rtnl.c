@@ -0,0 +1,779 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <list/list.h>
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "rtnl.h"
+
+#define RTNL_BUFSIZE		32768
+#define RTNL_MSG_SIZE		128
+#define RTNL_MAX_IOV		64
+#define RTNL_SYNC_TIMEOUT_MS	5000
+
+struct rtnl {
+	int			fd;
+	struct waitset		*waitset;
+	struct waiter		*waiter;
+	struct list		batches;
+	uint32_t		seq;
+	char			*buf;
+	bool			dry_run;
+};
+
+struct rtnl_batch {
+	struct rtnl		*rtnl;
+	struct list		requests;
+	struct list_item	list;
+	bool			queued;
+	bool			started;
+	rtnl_batch_cb		cb;
+	void			*data;
+	struct waiter		*complete_waiter;
+	bool			*sync_complete;
+	int			*sync_rc;
+};
+
+struct rtnl_request {
+	struct rtnl_batch	*batch;
+	struct list_item	list;
+	struct nlmsghdr		*nlmsg;
+	rtnl_request_cb		cb;
+	uint32_t		seq;
+	int			error;
+	bool			sent;
+	bool			done;
+
+	/* address flushes: the dump, and the deletes it generates */
+	int			ifindex;
+	bool			dump;
+	struct rtnl_request	*flush;
+	struct rtnl_request	*last_delete;
+	unsigned int		n_deletes;
+};
+
+static void rtnl_batch_start(struct rtnl_batch *batch);
+
+static struct rtnl_batch *rtnl_current_batch(struct rtnl *rtnl)
+{
+	return list_entry(rtnl->batches.head.next, struct rtnl_batch, list,
+			&rtnl->batches);
+}
+
+static void rtnl_start_next(struct rtnl *rtnl)
+{
+	struct rtnl_batch *batch = rtnl_current_batch(rtnl);
+
+	if (batch)
+		rtnl_batch_start(batch);
+}
+
+static bool rtnl_batch_complete(struct rtnl_batch *batch)
+{
+	struct rtnl_request *req;
+
+	list_for_each_entry(&batch->requests, req, list)
+		if (!req->done)
+			return false;
+
+	return true;
+}
+
+static void rtnl_batch_finish(struct rtnl_batch *batch)
+{
+	struct rtnl_request *req, *failed = NULL;
+	struct rtnl *rtnl = batch->rtnl;
+	bool was_current;
+
+	was_current = batch->queued && batch == rtnl_current_batch(rtnl);
+
+	if (batch->queued) {
+		list_remove(&batch->list);
+		batch->queued = false;
+	}
+
+	list_for_each_entry(&batch->requests, req, list) {
+		int fail;
+
+		/* deletes are reported through their flush */
+		if (req->flush)
+			continue;
+
+		if (req->cb)
+			fail = req->cb(req->error, batch->data);
+		else
+			fail = req->error != 0;
+
+		if (fail && !failed)
+			failed = req;
+	}
+
+	/* the callback may free the batch's context */
+	talloc_steal(NULL, batch);
+
+	if (batch->sync_complete) {
+		*batch->sync_complete = true;
+		*batch->sync_rc = failed ? -1 : 0;
+	}
+
+	if (batch->cb)
+		batch->cb(batch->data, failed);
+
+	talloc_free(batch);
+
+	if (was_current)
+		rtnl_start_next(rtnl);
+}
+
+static int rtnl_batch_complete_cb(void *arg)
+{
+	struct rtnl_batch *batch = arg;
+
+	batch->complete_waiter = NULL;
+	rtnl_batch_finish(batch);
+	return 0;
+}
+
+/* Complete the batch; when we may have been called from rtnl_batch_run(),
+ * defer to the waitset so that callers don't see the callback early */
+static void rtnl_batch_finish_deferred(struct rtnl_batch *batch)
+{
+	struct rtnl *rtnl = batch->rtnl;
+
+	if (batch->sync_complete || !rtnl->waitset) {
+		rtnl_batch_finish(batch);
+		return;
+	}
+
+	if (batch->complete_waiter)
+		return;
+
+	batch->complete_waiter = waiter_register_timeout(rtnl->waitset, 0,
+			rtnl_batch_complete_cb, batch);
+}
+
+static void rtnl_request_done(struct rtnl_request *req, int error)
+{
+	struct rtnl_request *flush = req->flush;
+
+	req->done = true;
+
+	if (!flush) {
+		if (!req->error)
+			req->error = error;
+		return;
+	}
+
+	/* a delete may race with the kernel removing the address itself,
+	 * eg. secondary addresses going with their primary */
+	if (error && error != -EADDRNOTAVAIL && !flush->error)
+		flush->error = error;
+}
+
+static int rtnl_send(struct rtnl *rtnl, struct iovec *iov, unsigned int n)
+{
+	struct sockaddr_nl addr;
+	struct msghdr msg;
+	int rc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	rc = sendmsg(rtnl->fd, &msg, MSG_NOSIGNAL);
+	if (rc < 0) {
+		rc = -errno;
+		pb_log("rtnl: sendmsg failed: %s\n", strerror(errno));
+		return rc;
+	}
+
+	return 0;
+}
+
+/* Send any unsent requests, up to and including the next address dump */
+static void rtnl_batch_send(struct rtnl_batch *batch)
+{
+	struct rtnl_request *reqs[RTNL_MAX_IOV], *req;
+	struct iovec iov[RTNL_MAX_IOV];
+	struct rtnl *rtnl = batch->rtnl;
+	unsigned int i, n;
+	bool more = true;
+	int rc;
+
+	while (more) {
+		n = 0;
+		more = false;
+
+		list_for_each_entry(&batch->requests, req, list) {
+			if (req->sent) {
+				if (req->dump && !req->done)
+					break;
+				continue;
+			}
+
+			if (n == RTNL_MAX_IOV) {
+				more = true;
+				break;
+			}
+
+			req->seq = ++rtnl->seq;
+			req->nlmsg->nlmsg_seq = req->seq;
+			req->sent = true;
+
+			iov[n].iov_base = req->nlmsg;
+			iov[n].iov_len = NLMSG_ALIGN(req->nlmsg->nlmsg_len);
+			reqs[n++] = req;
+
+			if (req->dump)
+				break;
+		}
+
+		if (!n)
+			break;
+
+		rc = rtnl_send(rtnl, iov, n);
+		if (rc) {
+			for (i = 0; i < n; i++)
+				rtnl_request_done(reqs[i], rc);
+			/* keep going; later requests may not depend on
+			 * these */
+			more = true;
+		}
+	}
+
+	if (rtnl_batch_complete(batch))
+		rtnl_batch_finish_deferred(batch);
+}
+
+static void rtnl_batch_start(struct rtnl_batch *batch)
+{
+	if (batch->started)
+		return;
+
+	batch->started = true;
+	rtnl_batch_send(batch);
+}
+
+static struct rtnl_request *rtnl_batch_find_request(struct rtnl_batch *batch,
+		uint32_t seq)
+{
+	struct rtnl_request *req;
+
+	list_for_each_entry(&batch->requests, req, list)
+		if (req->sent && !req->done && req->seq == seq)
+			return req;
+
+	return NULL;
+}
+
+/* Queue a delete for an address reported by a flush's dump, copying the
+ * dumped message as iproute2 does */
+static void rtnl_flush_add_delete(struct rtnl_request *flush,
+		struct nlmsghdr *nlmsg)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlmsg);
+	struct rtnl_request *req;
+
+	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return;
+
+	if (ifa->ifa_index != (unsigned int)flush->ifindex)
+		return;
+
+	req = talloc_zero(flush->batch, struct rtnl_request);
+	req->batch = flush->batch;
+	req->flush = flush;
+	req->nlmsg = talloc_zero_size(req, NLMSG_ALIGN(nlmsg->nlmsg_len));
+	memcpy(req->nlmsg, nlmsg, nlmsg->nlmsg_len);
+	req->nlmsg->nlmsg_type = RTM_DELADDR;
+	req->nlmsg->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req->nlmsg->nlmsg_pid = 0;
+
+	list_insert_after(flush->last_delete ? &flush->last_delete->list :
+			&flush->list, &req->list);
+	flush->last_delete = req;
+	flush->n_deletes++;
+}
+
+static void rtnl_handle_nlmsg(struct rtnl_batch *batch, struct nlmsghdr *nlmsg)
+{
+	struct rtnl_request *req;
+	struct nlmsgerr *err;
+
+	req = rtnl_batch_find_request(batch, nlmsg->nlmsg_seq);
+	if (!req)
+		return;
+
+	switch (nlmsg->nlmsg_type) {
+	case NLMSG_ERROR:
+		err = NLMSG_DATA(nlmsg);
+		rtnl_request_done(req, err->error);
+		break;
+	case NLMSG_DONE:
+		rtnl_request_done(req, 0);
+		if (req->dump)
+			pb_debug("rtnl: flushing %u addresses from "
+					"interface %d\n",
+					req->n_deletes, req->ifindex);
+		break;
+	case RTM_NEWADDR:
+		if (req->dump)
+			rtnl_flush_add_delete(req, nlmsg);
+		break;
+	}
+}
+
+/* Fail every request that hasn't completed, and so the batch; those not yet
+ * sent never will be */
+static void rtnl_batch_fail(struct rtnl_batch *batch, int error)
+{
+	struct rtnl_request *req;
+
+	list_for_each_entry(&batch->requests, req, list) {
+		if (req->done)
+			continue;
+		req->sent = true;
+		rtnl_request_done(req, error);
+	}
+
+	rtnl_batch_finish_deferred(batch);
+}
+
+static void rtnl_recv(struct rtnl *rtnl)
+{
+	struct rtnl_batch *batch;
+	struct nlmsghdr *nlmsg;
+	int len, err;
+
+	len = recv(rtnl->fd, rtnl->buf, RTNL_BUFSIZE, 0);
+	if (len < 0) {
+		err = errno;
+		if (err == EINTR || err == EAGAIN)
+			return;
+		pb_log("rtnl: recv failed: %s\n", strerror(err));
+
+		/* replies may have been lost (eg. ENOBUFS), so the running
+		 * batch would never complete. Drop what is still queued for
+		 * it, so there's room for the next batch's replies; any that
+		 * come later won't match their sequence numbers. */
+		while (recv(rtnl->fd, rtnl->buf, RTNL_BUFSIZE,
+					MSG_DONTWAIT) > 0)
+			;
+
+		batch = rtnl_current_batch(rtnl);
+		if (batch)
+			rtnl_batch_fail(batch, -err);
+		return;
+	}
+
+	/* with no batch running, these are replies for a cancelled batch */
+	batch = rtnl_current_batch(rtnl);
+	if (!batch)
+		return;
+
+	for (nlmsg = (struct nlmsghdr *)rtnl->buf; NLMSG_OK(nlmsg, len);
+			nlmsg = NLMSG_NEXT(nlmsg, len))
+		rtnl_handle_nlmsg(batch, nlmsg);
+
+	/* a completed dump may have released more requests */
+	rtnl_batch_send(batch);
+}
+
+static int rtnl_process(void *arg)
+{
+	struct rtnl *rtnl = arg;
+
+	rtnl_recv(rtnl);
+	return 0;
+}
+
+static int rtnl_destroy(void *arg)
+{
+	struct rtnl *rtnl = arg;
+	struct rtnl_batch *batch, *tmp;
+
+	list_for_each_entry_safe(&rtnl->batches, batch, tmp, list) {
+		list_remove(&batch->list);
+		batch->queued = false;
+	}
+
+	if (rtnl->waiter)
+		waiter_remove(rtnl->waiter);
+	if (rtnl->fd >= 0)
+		close(rtnl->fd);
+
+	return 0;
+}
+
+struct rtnl *rtnl_init(void *ctx, struct waitset *set, bool dry_run)
+{
+	struct sockaddr_nl addr;
+	struct rtnl *rtnl;
+	int rc;
+
+	rtnl = talloc_zero(ctx, struct rtnl);
+	list_init(&rtnl->batches);
+	rtnl->waitset = set;
+	rtnl->dry_run = dry_run;
+	rtnl->buf = talloc_array(rtnl, char, RTNL_BUFSIZE);
+	rtnl->fd = -1;
+	talloc_set_destructor(rtnl, rtnl_destroy);
+
+	rtnl->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (rtnl->fd < 0) {
+		pb_log("rtnl: socket failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	rc = bind(rtnl->fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (rc) {
+		pb_log("rtnl: bind failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (set) {
+		rtnl->waiter = waiter_register_io(set, rtnl->fd, WAIT_IN,
+				rtnl_process, rtnl);
+		if (!rtnl->waiter)
+			goto err;
+	}
+
+	return rtnl;
+
+err:
+	talloc_free(rtnl);
+	return NULL;
+}
+
+static int rtnl_batch_destroy(void *arg)
+{
+	struct rtnl_batch *batch = arg;
+	bool was_current;
+
+	if (batch->complete_waiter)
+		waiter_remove(batch->complete_waiter);
+
+	if (!batch->queued)
+		return 0;
+
+	/* replies to any requests in flight will be ignored, as their
+	 * sequence numbers won't match the next batch */
+	was_current = batch == rtnl_current_batch(batch->rtnl);
+	list_remove(&batch->list);
+	if (was_current)
+		rtnl_start_next(batch->rtnl);
+
+	return 0;
+}
+
+struct rtnl_batch *rtnl_batch_create(void *ctx, struct rtnl *rtnl,
+		rtnl_batch_cb cb, void *data)
+{
+	struct rtnl_batch *batch;
+
+	batch = talloc_zero(ctx, struct rtnl_batch);
+	batch->rtnl = rtnl;
+	batch->cb = cb;
+	batch->data = data;
+	list_init(&batch->requests);
+	talloc_set_destructor(batch, rtnl_batch_destroy);
+
+	return batch;
+}
+
+static struct rtnl_request *rtnl_request_create(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int type, int flags,
+		const void *hdr, unsigned int hdr_len)
+{
+	struct rtnl_request *req;
+
+	req = talloc_zero(batch, struct rtnl_request);
+	req->batch = batch;
+	req->cb = cb;
+	list_add_tail(&batch->requests, &req->list);
+
+	req->nlmsg = talloc_zero_size(req, RTNL_MSG_SIZE);
+	req->nlmsg->nlmsg_len = NLMSG_LENGTH(hdr_len);
+	req->nlmsg->nlmsg_type = type;
+	req->nlmsg->nlmsg_flags = NLM_F_REQUEST | flags;
+	memcpy(NLMSG_DATA(req->nlmsg), hdr, hdr_len);
+
+	return req;
+}
+
+/* A request that we couldn't construct; it is never sent */
+static struct rtnl_request *rtnl_request_create_failed(
+		struct rtnl_batch *batch, rtnl_request_cb cb, int error)
+{
+	struct rtnl_request *req;
+
+	req = talloc_zero(batch, struct rtnl_request);
+	req->batch = batch;
+	req->cb = cb;
+	req->sent = req->done = true;
+	req->error = error;
+	list_add_tail(&batch->requests, &req->list);
+
+	return req;
+}
+
+static void rtnl_request_add_attr(struct rtnl_request *req, int type,
+		const void *data, unsigned int len)
+{
+	struct nlmsghdr *nlmsg = req->nlmsg;
+	struct rtattr *rta;
+
+	assert(NLMSG_ALIGN(nlmsg->nlmsg_len) + RTA_SPACE(len) <= RTNL_MSG_SIZE);
+
+	rta = (struct rtattr *)((char *)nlmsg + NLMSG_ALIGN(nlmsg->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+
+	nlmsg->nlmsg_len = NLMSG_ALIGN(nlmsg->nlmsg_len) + RTA_SPACE(len);
+}
+
+/* Parse "address[/prefixlen]"; a NULL @prefixlen disallows the prefix */
+static int rtnl_parse_addr(const char *str, int *family, void *addr,
+		unsigned int *addr_len, unsigned int *prefixlen)
+{
+	char buf[INET6_ADDRSTRLEN + sizeof("/128")], *sep, *end;
+	unsigned long len;
+
+	if (!str || strlen(str) >= sizeof(buf))
+		return -1;
+
+	strcpy(buf, str);
+
+	*family = strchr(buf, ':') ? AF_INET6 : AF_INET;
+	*addr_len = *family == AF_INET6 ? 16 : 4;
+
+	sep = strchr(buf, '/');
+	if (sep) {
+		if (!prefixlen)
+			return -1;
+		*sep++ = '\0';
+		len = strtoul(sep, &end, 10);
+		if (end == sep || *end || len > *addr_len * 8)
+			return -1;
+		*prefixlen = len;
+	} else if (prefixlen) {
+		*prefixlen = *addr_len * 8;
+	}
+
+	if (inet_pton(*family, buf, addr) != 1)
+		return -1;
+
+	return 0;
+}
+
+struct rtnl_request *rtnl_batch_link_set(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, bool up)
+{
+	struct ifinfomsg ifi;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = ifindex;
+	ifi.ifi_flags = up ? IFF_UP : 0;
+	ifi.ifi_change = IFF_UP;
+
+	return rtnl_request_create(batch, cb, RTM_NEWLINK, NLM_F_ACK,
+			&ifi, sizeof(ifi));
+}
+
+struct rtnl_request *rtnl_batch_addr_flush(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex)
+{
+	struct rtnl_request *req;
+	struct ifaddrmsg ifa;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_UNSPEC;
+
+	req = rtnl_request_create(batch, cb, RTM_GETADDR, NLM_F_DUMP,
+			&ifa, sizeof(ifa));
+	req->dump = true;
+	req->ifindex = ifindex;
+
+	return req;
+}
+
+static struct rtnl_request *rtnl_batch_addr_change(
+		struct rtnl_batch *batch, rtnl_request_cb cb, int ifindex,
+		const char *addr, int type, int flags)
+{
+	unsigned int addr_len, prefixlen;
+	struct rtnl_request *req;
+	struct ifaddrmsg ifa;
+	uint8_t buf[16];
+	int family;
+
+	if (rtnl_parse_addr(addr, &family, buf, &addr_len, &prefixlen)) {
+		pb_log("rtnl: invalid address %s\n", addr);
+		return rtnl_request_create_failed(batch, cb, -EINVAL);
+	}
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = family;
+	ifa.ifa_prefixlen = prefixlen;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = ifindex;
+
+	req = rtnl_request_create(batch, cb, type, NLM_F_ACK | flags,
+			&ifa, sizeof(ifa));
+	rtnl_request_add_attr(req, IFA_LOCAL, buf, addr_len);
+	rtnl_request_add_attr(req, IFA_ADDRESS, buf, addr_len);
+
+	return req;
+}
+
+struct rtnl_request *rtnl_batch_addr_add(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *addr)
+{
+	return rtnl_batch_addr_change(batch, cb, ifindex, addr, RTM_NEWADDR,
+			NLM_F_CREATE | NLM_F_EXCL);
+}
+
+struct rtnl_request *rtnl_batch_addr_del(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *addr)
+{
+	return rtnl_batch_addr_change(batch, cb, ifindex, addr, RTM_DELADDR, 0);
+}
+
+struct rtnl_request *rtnl_batch_route_add_default(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *gateway)
+{
+	unsigned int addr_len;
+	struct rtnl_request *req;
+	uint32_t oif = ifindex;
+	struct rtmsg rtm;
+	uint8_t buf[16];
+	int family;
+
+	if (rtnl_parse_addr(gateway, &family, buf, &addr_len, NULL)) {
+		pb_log("rtnl: invalid gateway %s\n", gateway);
+		return rtnl_request_create_failed(batch, cb, -EINVAL);
+	}
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = family;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	rtm.rtm_protocol = RTPROT_BOOT;
+	rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+	rtm.rtm_type = RTN_UNICAST;
+
+	req = rtnl_request_create(batch, cb, RTM_NEWROUTE,
+			NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+			&rtm, sizeof(rtm));
+	rtnl_request_add_attr(req, RTA_GATEWAY, buf, addr_len);
+	rtnl_request_add_attr(req, RTA_OIF, &oif, sizeof(oif));
+
+	return req;
+}
+
+static void rtnl_batch_dry_run(struct rtnl_batch *batch)
+{
+	struct rtnl_request *req;
+
+	list_for_each_entry(&batch->requests, req, list) {
+		if (req->sent)
+			continue;
+		pb_debug("rtnl: dry run: not sending message type %d\n",
+				req->nlmsg->nlmsg_type);
+		req->sent = req->done = true;
+	}
+
+	rtnl_batch_finish_deferred(batch);
+}
+
+void rtnl_batch_run(struct rtnl_batch *batch)
+{
+	struct rtnl *rtnl = batch->rtnl;
+
+	if (batch->queued || batch->complete_waiter)
+		return;
+
+	if (rtnl->dry_run) {
+		rtnl_batch_dry_run(batch);
+		return;
+	}
+
+	batch->queued = true;
+	list_add_tail(&rtnl->batches, &batch->list);
+
+	if (batch == rtnl_current_batch(rtnl))
+		rtnl_batch_start(batch);
+}
+
+int rtnl_batch_run_sync(struct rtnl_batch *batch)
+{
+	struct rtnl *rtnl = batch->rtnl;
+	bool complete = false;
+	struct pollfd pollfd;
+	int rc, result = 0;
+
+	batch->sync_complete = &complete;
+	batch->sync_rc = &result;
+
+	rtnl_batch_run(batch);
+
+	pollfd.fd = rtnl->fd;
+	pollfd.events = POLLIN;
+
+	while (!complete) {
+		pollfd.revents = 0;
+		rc = poll(&pollfd, 1, RTNL_SYNC_TIMEOUT_MS);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			pb_log("rtnl: no response from kernel\n");
+			talloc_free(batch);
+			return -1;
+		}
+		rtnl_recv(rtnl);
+	}
+
+	return result;
+}
+
+int rtnl_request_error(const struct rtnl_request *req)
+{
+	return req->error;
+}
@@ -0,0 +1,68 @@
+#ifndef _RTNL_H
+#define _RTNL_H
+
+#include <stdbool.h>
+
+/* In-process network configuration over rtnetlink.
+ *
+ * Requests are collected into a batch, which is sent to the kernel in a
+ * single message and completes once every request has been acknowledged.
+ * The kernel applies the requests in order, but a failed request doesn't
+ * prevent later ones from being applied. An address flush has to dump the
+ * interface's addresses first, so requests after a flush are held back
+ * until its deletions have been sent.
+ *
+ * Batches on the same rtnl handle run one at a time, in the order they were
+ * started.
+ */
+
+struct waitset;
+struct rtnl;
+struct rtnl_batch;
+struct rtnl_request;
+
+/* Called when the batch completes, with the request's result: zero or a
+ * negative errno. Returns non-zero if the batch should be reported as
+ * failed. Without a request callback, any error fails the batch. */
+typedef int (*rtnl_request_cb)(int error, void *data);
+
+/* Called with the first failing request, or NULL if the batch succeeded.
+ * If the socket overruns and replies are lost, the requests still
+ * outstanding fail with the receive error (-ENOBUFS). The batch is freed
+ * once this returns. */
+typedef void (*rtnl_batch_cb)(void *data, struct rtnl_request *failed);
+
+/* Open a rtnetlink socket, processing replies from @set. In dry-run mode,
+ * nothing is sent and every request succeeds. */
+struct rtnl *rtnl_init(void *ctx, struct waitset *set, bool dry_run);
+
+/* Freeing the batch's talloc context cancels the callbacks; requests that
+ * have already been sent may still be applied. */
+struct rtnl_batch *rtnl_batch_create(void *ctx, struct rtnl *rtnl,
+		rtnl_batch_cb cb, void *data);
+
+struct rtnl_request *rtnl_batch_link_set(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, bool up);
+struct rtnl_request *rtnl_batch_addr_flush(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex);
+
+/* @addr is an IPv4 or IPv6 address, with an optional "/prefixlen". An
+ * address that can't be parsed gives a request that fails with -EINVAL. */
+struct rtnl_request *rtnl_batch_addr_add(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *addr);
+struct rtnl_request *rtnl_batch_addr_del(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *addr);
+struct rtnl_request *rtnl_batch_route_add_default(struct rtnl_batch *batch,
+		rtnl_request_cb cb, int ifindex, const char *gateway);
+
+/* Start sending the batch. The callback is always invoked from the waitset,
+ * never from this function. */
+void rtnl_batch_run(struct rtnl_batch *batch);
+
+/* Run the batch to completion without the waitset, for use when the main
+ * loop isn't running. Returns zero if the batch succeeded. */
+int rtnl_batch_run_sync(struct rtnl_batch *batch);
+
+int rtnl_request_error(const struct rtnl_request *req);
+
+#endif /* _RTNL_H */
@@ -24,9 +24,16 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <locale.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <log/log.h>
@@ -35,6 +42,7 @@
 #include <url/url.h>
 #include <util/util.h>
 #include <i18n/i18n.h>
+#include <waiter/job.h>
 
 #include "security.h"
 
@@ -55,178 +63,473 @@ struct pb_url * get_signature_url(void *ctx, struct pb_url *base_file)
 	return signature_file;
 }
 
-int validate_boot_files(struct boot_task *boot_task) {
-    int result = 0;
-    char *kernel_filename = NULL;
-    char *initrd_filename = NULL;
-    char *dtb_filename = NULL;
-
-    FILE *authorized_signatures_handle = NULL;
-
-    char cmdline_template[] = "/tmp/petitbootXXXXXX";
-    int cmdline_fd = mkstemp(cmdline_template);
-    FILE *cmdline_handle = NULL;
-
-    const char* local_initrd_signature = (boot_task->verify_signature) ?
-        boot_task->local_initrd_signature : NULL;
-    const char* local_dtb_signature = (boot_task->verify_signature) ?
-        boot_task->local_dtb_signature : NULL;
-    const char* local_image_signature = (boot_task->verify_signature) ?
-        boot_task->local_image_signature : NULL;
-    const char* local_cmdline_signature =
-        (boot_task->verify_signature || boot_task->decrypt_files) ?
-        boot_task->local_cmdline_signature : NULL;
-
-    if ((!boot_task->verify_signature) && (!boot_task->decrypt_files))
-        return result;
-
-    /* Load authorized signatures file */
-    authorized_signatures_handle = fopen(LOCKDOWN_FILE, "r");
-    if (!authorized_signatures_handle) {
-        pb_log_fn("unable to read lockdown file\n");
-        return KEXEC_LOAD_SIG_SETUP_INVALID;
-    }
-
-    /* Copy files to temporary directory for verification / boot */
-    result = copy_file_secure_dest(boot_task,
-        boot_task->local_image,
-        &kernel_filename);
-    if (result) {
-        pb_log("%s: image copy failed: (%d)\n",
-            __func__, result);
-        return result;
-    }
-    if (boot_task->local_initrd) {
-        result = copy_file_secure_dest(boot_task,
-            boot_task->local_initrd,
-            &initrd_filename);
-        if (result) {
-            pb_log("%s: initrd copy failed: (%d)\n",
-                __func__, result);
-            return result;
-        }
-    }
-    if (boot_task->local_dtb) {
-        result = copy_file_secure_dest(boot_task,
-            boot_task->local_dtb,
-            &dtb_filename);
-        if (result) {
-            pb_log("%s: dtb copy failed: (%d)\n",
-                __func__, result);
-            return result;
-        }
-    }
-    boot_task->local_image_override = talloc_strdup(boot_task,
-        kernel_filename);
-    if (boot_task->local_initrd)
-        boot_task->local_initrd_override = talloc_strdup(boot_task,
-            initrd_filename);
-    if (boot_task->local_dtb)
-        boot_task->local_dtb_override = talloc_strdup(boot_task,
-            dtb_filename);
-
-    /* Write command line to temporary file for verification */
-    if (cmdline_fd < 0) {
-        /* mkstemp failed */
-        pb_log("%s: failed: unable to create command line"
-            " temporary file for verification\n",
-            __func__);
-        result = -1;
-    }
-    else {
-        cmdline_handle = fdopen(cmdline_fd, "w");
-    }
-    if (!cmdline_handle) {
-        /* Failed to open file */
-        pb_log("%s: failed: unable to write command line"
-            " temporary file for verification\n",
-            __func__);
-        result = -1;
-    }
-    else {
-        fwrite(boot_task->args, sizeof(char),
-            strlen(boot_task->args), cmdline_handle);
-        fflush(cmdline_handle);
-    }
-
-    if (boot_task->verify_signature) {
-        /* Check signatures */
-        if (verify_file_signature(kernel_filename,
-            local_image_signature,
-            authorized_signatures_handle,
-            KEYRING_PATH))
-            result = KEXEC_LOAD_SIGNATURE_FAILURE;
-        if (verify_file_signature(cmdline_template,
-            local_cmdline_signature,
-            authorized_signatures_handle,
-            KEYRING_PATH))
-            result = KEXEC_LOAD_SIGNATURE_FAILURE;
-
-        if (boot_task->local_initrd_signature)
-            if (verify_file_signature(initrd_filename,
-                local_initrd_signature,
-                authorized_signatures_handle,
-                KEYRING_PATH))
-                result = KEXEC_LOAD_SIGNATURE_FAILURE;
-        if (boot_task->local_dtb_signature)
-            if (verify_file_signature(dtb_filename,
-                local_dtb_signature,
-                authorized_signatures_handle,
-                KEYRING_PATH))
-                result = KEXEC_LOAD_SIGNATURE_FAILURE;
-
-        /* Clean up */
-        if (cmdline_handle) {
-            fclose(cmdline_handle);
-            unlink(cmdline_template);
-        }
-        fclose(authorized_signatures_handle);
-    } else if (boot_task->decrypt_files) {
-        /* Decrypt files */
-        if (decrypt_file(kernel_filename,
-            authorized_signatures_handle,
-            KEYRING_PATH))
-            result = KEXEC_LOAD_DECRYPTION_FALURE;
-        if (verify_file_signature(cmdline_template,
-            local_cmdline_signature,
-            authorized_signatures_handle,
-            KEYRING_PATH))
-            result = KEXEC_LOAD_SIGNATURE_FAILURE;
-        if (boot_task->local_initrd)
-            if (decrypt_file(initrd_filename,
-                authorized_signatures_handle,
-                KEYRING_PATH))
-                result = KEXEC_LOAD_DECRYPTION_FALURE;
-        if (boot_task->local_dtb)
-            if (decrypt_file(dtb_filename,
-                authorized_signatures_handle,
-                KEYRING_PATH))
-                result = KEXEC_LOAD_DECRYPTION_FALURE;
-
-        /* Clean up */
-        if (cmdline_handle) {
-            fclose(cmdline_handle);
-            unlink(cmdline_template);
-        }
-        fclose(authorized_signatures_handle);
-    }
-
-    return result;
-}
-
-void validate_boot_files_cleanup(struct boot_task *boot_task) {
-	if ((boot_task->verify_signature) || (boot_task->decrypt_files)) {
-		unlink(boot_task->local_image_override);
-		if (boot_task->local_initrd_override)
-			unlink(boot_task->local_initrd_override);
-		if (boot_task->local_dtb_override)
-			unlink(boot_task->local_dtb_override);
-
-		talloc_free(boot_task->local_image_override);
-		if (boot_task->local_initrd_override)
-			talloc_free(boot_task->local_initrd_override);
-		if (boot_task->local_dtb_override)
-			talloc_free(boot_task->local_dtb_override);
+struct boot_file {
+	const char		*name;
+	const char		*filename;
+	const char		*signature;
+	bool			signature_required;
+	char			**override;
+	int			*fd;
+
+	/* worker state: the worker doesn't touch the boot task, and leaves
+	 * anything needing talloc to the caller */
+	bool			verify;
+	bool			decrypt;
+	const char		*lockdown_file;
+	pthread_t		thread;
+	bool			threaded;
+	int			copy_fd;
+	char			path[64];
+	struct stat		source_stat;
+	bool			checked;
+	size_t			len;
+	uint64_t		us;
+	int			rc;
+};
+
+struct boot_file_check {
+	struct boot_task	*boot_task;
+	enum boot_file_type	type;
+	struct boot_file	file;
+	struct waiter_job	*job;
+	validate_boot_file_cb	cb;
+	void			*data;
+};
+
+static void boot_file_init(struct boot_file *file, struct boot_task *boot_task,
+		enum boot_file_type type, const char *lockdown_file)
+{
+	memset(file, 0, sizeof(*file));
+
+	switch (type) {
+	case BOOT_FILE_IMAGE:
+		file->name = "kernel";
+		file->filename = boot_task->local_image;
+		file->signature = boot_task->local_image_signature;
+		file->signature_required = true;
+		file->override = &boot_task->local_image_override;
+		file->fd = &boot_task->local_image_fd;
+		break;
+	case BOOT_FILE_INITRD:
+		file->name = "initrd";
+		file->filename = boot_task->local_initrd;
+		file->signature = boot_task->local_initrd_signature;
+		file->override = &boot_task->local_initrd_override;
+		file->fd = &boot_task->local_initrd_fd;
+		break;
+	case BOOT_FILE_DTB:
+		file->name = "dtb";
+		file->filename = boot_task->local_dtb;
+		file->signature = boot_task->local_dtb_signature;
+		file->override = &boot_task->local_dtb_override;
+		file->fd = &boot_task->local_dtb_fd;
+		break;
+	default:
+		assert(0);
+	}
+
+	file->copy_fd = -1;
+	file->verify = boot_task->verify_signature;
+	file->decrypt = boot_task->decrypt_files;
+	file->lockdown_file = lockdown_file;
+}
+
+static uint64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ull +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void report_throughput(struct boot_task *boot_task, const char *name,
+		size_t len, uint64_t us)
+{
+	/* bytes per microsecond is MB/s */
+	uint64_t rate = len / (us ?: 1);
+	struct status status;
+
+	pb_log("%s: %s: %zu bytes in %" PRIu64 " ms (%" PRIu64 " MB/s)\n",
+			__func__, name, len, us / 1000, rate);
+
+	if (!boot_task->status_fn)
+		return;
+
+	status.type = STATUS_INFO;
+	status.message = boot_task->decrypt_files ?
+		talloc_asprintf(boot_task, _("Decrypted %s (%" PRIu64 " MB/s)"),
+			name, rate) :
+		talloc_asprintf(boot_task, _("Verified %s (%" PRIu64 " MB/s)"),
+			name, rate);
+	status.backlog = false;
+	status.boot_active = true;
+
+	boot_task->status_fn(boot_task->status_arg, &status);
+
+	talloc_free(status.message);
+}
+
+static int map_fd(int fd, void **bufp, size_t *lenp)
+{
+	struct stat statbuf;
+	void *buf;
+
+	if (fstat(fd, &statbuf))
+		return -1;
+
+	/* mmap won't map an empty file, and there's nothing to read anyway */
+	if (!statbuf.st_size) {
+		*bufp = NULL;
+		*lenp = 0;
+		return 0;
+	}
+
+	buf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	*bufp = buf;
+	*lenp = statbuf.st_size;
+	return 0;
+}
+
+static void unmap_fd(void *buf, size_t len)
+{
+	if (buf)
+		munmap(buf, len);
+}
+
+int verify_file_signature(const char *plaintext_filename,
+		const char *signature_filename,
+		FILE *authorized_signatures_handle,
+		const char *keyring_path)
+{
+	size_t len;
+	void *buf;
+	int fd, rc;
+
+	fd = open(plaintext_filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pb_log("%s: unable to open '%s': %m\n", __func__,
+				plaintext_filename);
+		return -1;
+	}
+
+	rc = map_fd(fd, &buf, &len);
+	close(fd);
+	if (rc) {
+		pb_log("%s: unable to map '%s': %m\n", __func__,
+				plaintext_filename);
+		return -1;
+	}
+
+	rc = verify_buffer_signature(buf ?: "", len, plaintext_filename,
+			signature_filename, authorized_signatures_handle,
+			keyring_path);
+
+	unmap_fd(buf, len);
+	return rc;
+}
+
+/*
+ * Copy a boot file into a sealed memory file and check it there, so that
+ * kexec loads exactly what was verified. The source is only read once: the
+ * signature check works on a mapping of the sealed copy, and kexec is given
+ * a /proc path to the same fd.
+ *
+ * This runs on a worker thread, so uses its own handle on the lockdown file
+ * and reports back through @file.
+ */
+static void *validate_boot_file(void *arg)
+{
+	struct boot_file *file = arg;
+	FILE *authorized_signatures_handle;
+	struct timespec start;
+	size_t len;
+	void *buf;
+	int rc;
+
+	authorized_signatures_handle = fopen(file->lockdown_file, "r");
+	if (!authorized_signatures_handle) {
+		pb_log_fn("unable to read lockdown file\n");
+		file->rc = KEXEC_LOAD_SIG_SETUP_INVALID;
+		return NULL;
+	}
+
+	/* noted before the copy, so any change made while we read the file
+	 * shows up in validate_boot_file_stale */
+	rc = stat(file->filename, &file->source_stat);
+	if (!rc)
+		rc = copy_file_memfd(file->filename, &file->copy_fd);
+	if (rc) {
+		pb_log("%s: %s copy failed: (%d)\n", __func__, file->name, rc);
+		goto out;
+	}
+
+	snprintf(file->path, sizeof(file->path), "/proc/%d/fd/%d",
+			getpid(), file->copy_fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* decryption rewrites the copy, so has to happen before sealing */
+	if (file->decrypt) {
+		file->checked = true;
+		if (decrypt_file(file->path, authorized_signatures_handle,
+					KEYRING_PATH)) {
+			rc = KEXEC_LOAD_DECRYPTION_FALURE;
+			goto out;
+		}
+	}
+
+	if (seal_file(file->copy_fd) || map_fd(file->copy_fd, &buf, &len)) {
+		pb_log("%s: unable to seal %s\n", __func__, file->name);
+		rc = -1;
+		goto out;
+	}
+
+	if (file->verify && (file->signature || file->signature_required)) {
+		file->checked = true;
+		rc = verify_buffer_signature(buf ?: "", len, file->filename,
+				file->signature, authorized_signatures_handle,
+				KEYRING_PATH);
+		if (rc)
+			rc = KEXEC_LOAD_SIGNATURE_FAILURE;
+	}
+
+	unmap_fd(buf, len);
+
+	file->len = len;
+	file->us = elapsed_us(&start);
+
+out:
+	fclose(authorized_signatures_handle);
+	file->rc = rc;
+	return NULL;
+}
+
+/* Hand a finished check's sealed copy over to the boot task. Called from the
+ * main thread, once the worker is done with @file */
+static int boot_file_finish(struct boot_task *boot_task,
+		struct boot_file *file)
+{
+	if (file->copy_fd >= 0) {
+		if (*file->fd >= 0)
+			close(*file->fd);
+		talloc_free(*file->override);
+		*file->fd = file->copy_fd;
+		*file->override = talloc_strdup(boot_task, file->path);
+		file->copy_fd = -1;
+	}
+
+	if (!file->rc && file->checked)
+		report_throughput(boot_task, file->name, file->len, file->us);
+
+	return file->rc;
+}
+
+static int validate_boot_cmdline_from(struct boot_task *boot_task,
+		FILE *authorized_signatures_handle)
+{
+	const char *args;
+
+	/* the command line is always signed, and is already in memory */
+	args = boot_task->args ?: "";
+	if (verify_buffer_signature(args, strlen(args), "command line",
+			boot_task->local_cmdline_signature,
+			authorized_signatures_handle, KEYRING_PATH))
+		return KEXEC_LOAD_SIGNATURE_FAILURE;
+
+	return 0;
+}
+
+int validate_boot_files_from(struct boot_task *boot_task,
+		const char *lockdown_file, bool parallel)
+{
+	struct boot_file files[BOOT_FILE_COUNT], *file;
+	FILE *authorized_signatures_handle;
+	int result = 0, rc;
+	unsigned int i;
+
+	if ((!boot_task->verify_signature) && (!boot_task->decrypt_files))
+		return result;
+
+	/* Load authorized signatures file */
+	authorized_signatures_handle = fopen(lockdown_file, "r");
+	if (!authorized_signatures_handle) {
+		pb_log_fn("unable to read lockdown file\n");
+		return KEXEC_LOAD_SIG_SETUP_INVALID;
+	}
+
+	/* Check each file on its own thread; if we can't start one, just
+	 * do the work here instead */
+	for (i = 0; i < BOOT_FILE_COUNT; i++) {
+		file = &files[i];
+		boot_file_init(file, boot_task, i, lockdown_file);
+		if (!file->filename)
+			continue;
+
+		if (parallel && !pthread_create(&file->thread, NULL,
+					validate_boot_file, file))
+			file->threaded = true;
+		else
+			validate_boot_file(file);
+	}
+
+	result = validate_boot_cmdline_from(boot_task,
+			authorized_signatures_handle);
+
+	fclose(authorized_signatures_handle);
+
+	for (i = 0; i < BOOT_FILE_COUNT; i++) {
+		file = &files[i];
+		if (!file->filename)
+			continue;
+
+		if (file->threaded)
+			pthread_join(file->thread, NULL);
+
+		rc = boot_file_finish(boot_task, file);
+		if (rc && !result)
+			result = rc;
 	}
+
+	return result;
+}
+
+int validate_boot_files(struct boot_task *boot_task)
+{
+	return validate_boot_files_from(boot_task, LOCKDOWN_FILE, true);
+}
+
+int validate_boot_cmdline(struct boot_task *boot_task)
+{
+	FILE *authorized_signatures_handle;
+	int rc;
+
+	if ((!boot_task->verify_signature) && (!boot_task->decrypt_files))
+		return 0;
+
+	authorized_signatures_handle = fopen(LOCKDOWN_FILE, "r");
+	if (!authorized_signatures_handle) {
+		pb_log_fn("unable to read lockdown file\n");
+		return KEXEC_LOAD_SIG_SETUP_INVALID;
+	}
+
+	rc = validate_boot_cmdline_from(boot_task,
+			authorized_signatures_handle);
+
+	fclose(authorized_signatures_handle);
+	return rc;
+}
+
+static void boot_file_check_thread(void *arg)
+{
+	struct boot_file_check *check = arg;
+
+	validate_boot_file(&check->file);
 }
 
+static void boot_file_check_done(void *arg)
+{
+	struct boot_file_check *check = arg;
+	int rc;
+
+	rc = boot_file_finish(check->boot_task, &check->file);
+
+	/* this may free the check */
+	check->cb(check->data, check->type, rc);
+}
+
+static int boot_file_check_destroy(void *arg)
+{
+	struct boot_file_check *check = arg;
+
+	if (waiter_job_destroy(check->job))
+		return -1;
+
+	/* a cancelled check's copy was never handed over */
+	if (check->file.copy_fd >= 0)
+		close(check->file.copy_fd);
+
+	return 0;
+}
+
+struct boot_file_check *validate_boot_file_start(struct boot_task *boot_task,
+		struct waitset *set, enum boot_file_type type,
+		validate_boot_file_cb cb, void *data)
+{
+	struct boot_file_check *check;
+
+	check = talloc_zero(boot_task, struct boot_file_check);
+	check->boot_task = boot_task;
+	check->type = type;
+	check->cb = cb;
+	check->data = data;
+	talloc_set_destructor(check, boot_file_check_destroy);
+
+	boot_file_init(&check->file, boot_task, type, LOCKDOWN_FILE);
+
+	/* the worker may outlive the boot task, so needs its own copies */
+	check->file.filename = talloc_strdup(check, check->file.filename);
+	check->file.signature = talloc_strdup(check, check->file.signature);
+
+	check->job = waiter_job_start(set, check, boot_file_check_thread,
+			boot_file_check_done, NULL);
+	if (!check->job) {
+		talloc_free(check);
+		return NULL;
+	}
+
+	return check;
+}
+
+bool validate_boot_file_stale(struct boot_file_check *check)
+{
+	const struct stat *prev = &check->file.source_stat;
+	struct boot_file current;
+	struct stat statbuf;
+
+	boot_file_init(&current, check->boot_task, check->type, LOCKDOWN_FILE);
+
+	if (!current.filename || strcmp(current.filename, check->file.filename))
+		return true;
+
+	if (stat(current.filename, &statbuf))
+		return true;
+
+	return statbuf.st_dev != prev->st_dev ||
+		statbuf.st_ino != prev->st_ino ||
+		statbuf.st_size != prev->st_size ||
+		statbuf.st_mtim.tv_sec != prev->st_mtim.tv_sec ||
+		statbuf.st_mtim.tv_nsec != prev->st_mtim.tv_nsec ||
+		statbuf.st_ctim.tv_sec != prev->st_ctim.tv_sec ||
+		statbuf.st_ctim.tv_nsec != prev->st_ctim.tv_nsec;
+}
+
+void validate_boot_files_cleanup(struct boot_task *boot_task)
+{
+	char **overrides[] = {
+		&boot_task->local_image_override,
+		&boot_task->local_initrd_override,
+		&boot_task->local_dtb_override,
+	};
+	int *fds[] = {
+		&boot_task->local_image_fd,
+		&boot_task->local_initrd_fd,
+		&boot_task->local_dtb_fd,
+	};
+	unsigned int i;
+
+	if ((!boot_task->verify_signature) && (!boot_task->decrypt_files))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(fds); i++) {
+		talloc_free(*overrides[i]);
+		*overrides[i] = NULL;
+
+		if (*fds[i] >= 0)
+			close(*fds[i]);
+		*fds[i] = -1;
+	}
+}
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #include <log/log.h>
@@ -48,6 +49,17 @@
  * to guarantee secure boot by itself.
  */
 
+static pthread_once_t gpg_init_once = PTHREAD_ONCE_INIT;
+
+/* boot files may be checked from several threads at once, but gpgme and the
+ * locale need to be set up from just one */
+static void gpg_init(void)
+{
+	setlocale (LC_ALL, "");
+	gpgme_check_version(NULL);
+	gpgme_set_locale(NULL, LC_CTYPE, setlocale (LC_CTYPE, NULL));
+}
+
 int decrypt_file(const char *filename,
 	FILE *authorized_signatures_handle, const char *keyring_path)
 {
@@ -68,9 +80,7 @@ int decrypt_file(const char *filename,
 	gpgme_error_t err;
 
 	/* Initialize gpgme */
-	setlocale (LC_ALL, "");
-	gpgme_check_version(NULL);
-	gpgme_set_locale(NULL, LC_CTYPE, setlocale (LC_CTYPE, NULL));
+	pthread_once(&gpg_init_once, gpg_init);
 	err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
 	if (err != GPG_ERR_NO_ERROR) {
 		pb_log_fn("OpenPGP support not available\n");
@@ -220,7 +230,7 @@ int decrypt_file(const char *filename,
 	return result;
 }
 
-int verify_file_signature(const char *plaintext_filename,
+int verify_buffer_signature(const void *buf, size_t len, const char *name,
 	const char *signature_filename, FILE *authorized_signatures_handle,
 	const char *keyring_path)
 {
@@ -237,9 +247,7 @@ int verify_file_signature(const char *plaintext_filename,
 		return -1;
 
 	/* Initialize gpgme */
-	setlocale (LC_ALL, "");
-	gpgme_check_version(NULL);
-	gpgme_set_locale(NULL, LC_CTYPE, setlocale (LC_CTYPE, NULL));
+	pthread_once(&gpg_init_once, gpg_init);
 	err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
 	if (err != GPG_ERR_NO_ERROR) {
 		pb_log_fn("OpenPGP support not available\n");
@@ -272,10 +280,10 @@ int verify_file_signature(const char *plaintext_filename,
 		pb_log_fn("Could not set GPG engine information\n");
 		return -1;
 	}
-	err = gpgme_data_new_from_file(&plaintext_data, plaintext_filename, 1);
+	err = gpgme_data_new_from_mem(&plaintext_data, buf, len, 0);
 	if (err != GPG_ERR_NO_ERROR) {
 		pb_log("%s: Could not create GPG plaintext data buffer"
-			" from file '%s'\n", __func__, plaintext_filename);
+			" for '%s'\n", __func__, name);
 		return -1;
 	}
 	err = gpgme_data_new_from_file(&signature_data, signature_filename, 1);
@@ -344,8 +352,8 @@ int verify_file_signature(const char *plaintext_filename,
 		return -1;
 	}
 
-	pb_log("%s: GPG signature '%s' for file '%s' verified\n",
-		__func__, signature_filename, plaintext_filename);
+	pb_log("%s: GPG signature '%s' for '%s' verified\n",
+		__func__, signature_filename, name);
 
 	return 0;
 }
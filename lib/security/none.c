@@ -44,6 +44,16 @@ int verify_file_signature(const char *plaintext_filename __attribute__((unused))
 	return -1;
 }
 
+int verify_buffer_signature(const void *buf __attribute__((unused)),
+    size_t len __attribute__((unused)),
+    const char *name __attribute__((unused)),
+    const char *signature_filename __attribute__((unused)),
+    FILE *authorized_signatures_handle __attribute__((unused)),
+    const char *keyring_path __attribute__((unused)))
+{
+	return -1;
+}
+
 int decrypt_file(const char * filename __attribute__((unused)),
     FILE * authorized_signatures_handle __attribute__((unused)),
     const char * keyring_path __attribute__((unused)))
@@ -56,6 +66,35 @@ int validate_boot_files(struct boot_task *boot_task __attribute__((unused)))
 	return 0;
 }
 
+int validate_boot_files_from(
+    struct boot_task *boot_task __attribute__((unused)),
+    const char *lockdown_file __attribute__((unused)),
+    bool parallel __attribute__((unused)))
+{
+	return 0;
+}
+
+struct boot_file_check *validate_boot_file_start(
+    struct boot_task *boot_task __attribute__((unused)),
+    struct waitset *set __attribute__((unused)),
+    enum boot_file_type type __attribute__((unused)),
+    validate_boot_file_cb cb __attribute__((unused)),
+    void *data __attribute__((unused)))
+{
+	return NULL;
+}
+
+bool validate_boot_file_stale(
+    struct boot_file_check *check __attribute__((unused)))
+{
+	return false;
+}
+
+int validate_boot_cmdline(struct boot_task *boot_task __attribute__((unused)))
+{
+	return 0;
+}
+
 void validate_boot_files_cleanup(struct boot_task *boot_task __attribute__((unused)))
 {}
 
@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include <dirent.h>
 #include <string.h>
@@ -314,26 +315,30 @@ out:
 	return nok;
 }
 
-int verify_file_signature(const char *plaintext_filename,
-			  const char *signature_filename,
-			  FILE *authorized_signatures_handle,
-			  const char *keyring_path __attribute__((unused)))
+int verify_buffer_signature(const void *buf, size_t len, const char *name,
+			    const char *signature_filename,
+			    FILE *authorized_signatures_handle,
+			    const char *keyring_path __attribute__((unused)))
 {
 	BIO *signature_bio = NULL, *plaintext_bio = NULL, *content_bio = NULL;
 	STACK_OF(X509) *certs = NULL;
 	CMS_ContentInfo *cms = NULL;
-	ssize_t bytes_read = -1;
 	EVP_MD_CTX *ctx = NULL;
 	EVP_PKEY *pkey = NULL;
 	char *sigbuf = NULL;
-	char rdbuf[8192];
 	int nok = -1;
 	int siglen;
 
-	plaintext_bio = BIO_new_file(plaintext_filename, "r");
+	if (len > INT_MAX) {
+		pb_log("%s: OpenSSL verify plaintext '%s' is too large\n",
+		       __func__, name);
+		goto out;
+	}
+
+	plaintext_bio = BIO_new_mem_buf(buf, len);
 	if (!plaintext_bio) {
-		pb_log("%s: Error opening OpenSSL verify plaintext file '%s'\n",
-		       __func__, plaintext_filename);
+		pb_log("%s: Error allocating OpenSSL verify plaintext buffer "
+		       "for '%s'\n", __func__, name);
 		ERR_print_errors_cb(&pb_log_print_errors_cb, NULL);
 		goto out;
 	}
@@ -390,21 +395,12 @@ int verify_file_signature(const char *plaintext_filename,
 			goto out;
 		}
 
-		while (bytes_read) {
-			bytes_read = BIO_read(plaintext_bio, rdbuf, 8192);
-			if (bytes_read > 0) {
-				if (EVP_DigestVerifyUpdate(ctx, rdbuf, (size_t)(bytes_read)) < 1) {
-					pb_log("%s: OpenSSL digest update failure on file '%s':\n",
-					       __func__, plaintext_filename);
-					ERR_print_errors_cb(&pb_log_print_errors_cb, NULL);
-					goto out;
-				}
-			} else if (bytes_read < 0) {
-				pb_log("%s: OpenSSL read failure on file '%s':\n",
-				       __func__, plaintext_filename);
-				ERR_print_errors_cb(&pb_log_print_errors_cb, NULL);
-				goto out;
-			}
+		/* the plaintext is already in memory, so digest it in one go */
+		if (EVP_DigestVerifyUpdate(ctx, buf, len) < 1) {
+			pb_log("%s: OpenSSL digest update failure on '%s':\n",
+			       __func__, name);
+			ERR_print_errors_cb(&pb_log_print_errors_cb, NULL);
+			goto out;
 		}
 
 		/*
@@ -35,11 +35,40 @@ int verify_file_signature(const char *plaintext_filename,
 	const char *signature_filename, FILE *authorized_signatures_handle,
 	const char *keyring_path);
 
+/* As verify_file_signature, for plaintext that is already in memory. @name
+ * is only used in log messages */
+int verify_buffer_signature(const void *buf, size_t len, const char *name,
+	const char *signature_filename, FILE *authorized_signatures_handle,
+	const char *keyring_path);
+
 int decrypt_file(const char *filename,
 	FILE * authorized_signatures_handle, const char * keyring_path);
 
 int validate_boot_files(struct boot_task *boot_task);
 
+/* As validate_boot_files, against @lockdown_file. The kernel, initrd and dtb
+ * are checked on worker threads unless @parallel is false */
+int validate_boot_files_from(struct boot_task *boot_task,
+	const char *lockdown_file, bool parallel);
+
+typedef void (*validate_boot_file_cb)(void *data, enum boot_file_type type,
+	int rc);
+
+/* Verify or decrypt one of @boot_task's files on a worker thread, as soon as
+ * it has loaded. @cb is called from @set once the check is done, and the
+ * sealed copy has been put in the task's override for that file. Freeing
+ * the check cancels it. Returns NULL if the check can't be started */
+struct boot_file_check *validate_boot_file_start(struct boot_task *boot_task,
+	struct waitset *set, enum boot_file_type type,
+	validate_boot_file_cb cb, void *data);
+
+/* Whether a finished check's file has been replaced or modified since it
+ * was copied, say by a boot hook, and so needs checking again */
+bool validate_boot_file_stale(struct boot_file_check *check);
+
+/* Check the command line signature, for files checked individually */
+int validate_boot_cmdline(struct boot_task *boot_task);
+
 void validate_boot_files_cleanup(struct boot_task *boot_task);
 
 #endif // _PB_SECURITY_H
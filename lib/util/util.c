@@ -64,3 +64,13 @@ char *format_buffer(void *ctx, const uint8_t *buf, unsigned int len)
 
 	return str;
 }
+
+unsigned int str_hash(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+
+	return hash;
+}
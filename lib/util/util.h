@@ -52,5 +52,8 @@
 void mac_str(uint8_t *mac, unsigned int maclen, char *buf, unsigned int buflen);
 char *format_buffer(void *ctx, const uint8_t *buf, unsigned int len);
 
+/* FNV-1a hash of a string, for hash table lookups */
+unsigned int str_hash(const char *str);
+
 #endif /* UTIL_H */
 
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <log/log.h>
+#include <talloc/talloc.h>
+
+#include "waiter.h"
+#include "job.h"
+
+struct waiter_job {
+	void		*data;
+	waiter_job_fn	fn;
+	waiter_job_fn	done;
+	waiter_job_fn	cancelled;
+
+	pthread_t	thread;
+	bool		threaded;
+	int		pipe[2];
+	struct waiter	*waiter;
+	bool		running;
+	/* the data was freed while we were running */
+	bool		dropped;
+};
+
+static void job_close_pipe(struct waiter_job *job)
+{
+	if (job->pipe[0] >= 0)
+		close(job->pipe[0]);
+	if (job->pipe[1] >= 0)
+		close(job->pipe[1]);
+	job->pipe[0] = job->pipe[1] = -1;
+}
+
+static void *job_thread(void *arg)
+{
+	struct waiter_job *job = arg;
+	char c = 0;
+
+	job->fn(job->data);
+
+	/* wake the main loop, which joins us in job_done */
+	while (write(job->pipe[1], &c, 1) < 0 && errno == EINTR)
+		;
+
+	return NULL;
+}
+
+static int job_done(void *arg)
+{
+	struct waiter_job *job = arg;
+	char c;
+
+	if (read(job->pipe[0], &c, 1) < 0 && errno == EINTR)
+		return 0;
+
+	if (job->threaded)
+		pthread_join(job->thread, NULL);
+
+	waiter_remove(job->waiter);
+	job->waiter = NULL;
+	job_close_pipe(job);
+	job->running = false;
+
+	/* the job is a child of the data, so is freed along with it */
+	if (job->dropped) {
+		if (job->cancelled)
+			job->cancelled(job->data);
+		talloc_free(job->data);
+		return 0;
+	}
+
+	/* this may free the data */
+	job->done(job->data);
+
+	return 0;
+}
+
+int waiter_job_destroy(struct waiter_job *job)
+{
+	if (!job || !job->running)
+		return 0;
+
+	/* talloc hands the data on to its parent's parent if the parent is
+	 * being freed, and job_done frees it once the worker finishes */
+	job->dropped = true;
+	return -1;
+}
+
+struct waiter_job *waiter_job_start(struct waitset *set, void *data,
+		waiter_job_fn fn, waiter_job_fn done, waiter_job_fn cancelled)
+{
+	struct waiter_job *job;
+
+	job = talloc_zero(data, struct waiter_job);
+	job->data = data;
+	job->fn = fn;
+	job->done = done;
+	job->cancelled = cancelled;
+	job->pipe[0] = job->pipe[1] = -1;
+
+	if (pipe2(job->pipe, O_CLOEXEC)) {
+		pb_log_fn("unable to create pipe: %m\n");
+		goto err;
+	}
+
+	job->waiter = waiter_register_io(set, job->pipe[0], WAIT_IN,
+			job_done, job);
+	if (!job->waiter)
+		goto err;
+
+	job->running = true;
+
+	/* if we can't start a thread, do the work here; it still completes
+	 * from the waitset */
+	if (!pthread_create(&job->thread, NULL, job_thread, job))
+		job->threaded = true;
+	else
+		job_thread(job);
+
+	return job;
+
+err:
+	job_close_pipe(job);
+	talloc_free(job);
+	return NULL;
+}
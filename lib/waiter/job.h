@@ -0,0 +1,38 @@
+#ifndef _WAITER_JOB_H
+#define _WAITER_JOB_H
+
+/* Runs blocking work, like a syscall or a file check, on a worker thread,
+ * and completes it from a waitset, so the work can take as long as it needs
+ * without holding up the event loop.
+ *
+ * A job works on a talloc'ed state object that belongs to the caller. The
+ * worker may still be using that state when the caller frees it, so the
+ * state's destructor hands over to waiter_job_destroy, which puts the free
+ * off until the worker has finished.
+ */
+
+struct waitset;
+struct waiter_job;
+
+typedef void (*waiter_job_fn)(void *data);
+
+/*
+ * Run @fn(@data) on a worker thread, then call @done(@data) from @set. If a
+ * thread can't be started, @fn runs here instead, but @done is still called
+ * from the waitset. Returns NULL if the job can't be started, in which case
+ * nothing is called.
+ *
+ * @data must be a talloc pointer whose destructor returns
+ * waiter_job_destroy() for this job. If @data is freed before @done is
+ * called, @done is dropped: once @fn returns, @cancelled (if not NULL) is
+ * called instead, from @set, and @data is then freed.
+ */
+struct waiter_job *waiter_job_start(struct waitset *set, void *data,
+		waiter_job_fn fn, waiter_job_fn done, waiter_job_fn cancelled);
+
+/* For the destructor of a job's data: returns -1, so that talloc keeps the
+ * data, while the worker is still running. @job may be NULL, for data
+ * whose job was never started */
+int waiter_job_destroy(struct waiter_job *job);
+
+#endif /* _WAITER_JOB_H */
@@ -1,16 +1,24 @@
 
 #include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <time.h>
 
 #include <talloc/talloc.h>
 #include <list/list.h>
+#include <log/log.h>
 
 #include "waiter.h"
 
+#define EPOLL_BATCH_SIZE	64
+
 struct waiter {
 	struct waitset	*set;
 	enum {
@@ -21,8 +29,20 @@ struct waiter {
 		struct {
 			int	fd;
 			int	events;
+			/* epoll: our private duplicate of fd, so that the
+			 * registration lives exactly as long as the waiter,
+			 * regardless of when the caller closes fd.
+			 * poll: our index into set->pollfds. */
+			int	epoll_fd;
+			int	poll_idx;
 		} io;
-		struct timeval	timeout;
+		struct {
+			/* CLOCK_MONOTONIC, in milliseconds */
+			uint64_t	expiry;
+			/* our index into set->timers, or -1 if not
+			 * currently armed */
+			int		heap_idx;
+		} time;
 	};
 	waiter_cb	callback;
 	void		*arg;
@@ -32,198 +52,475 @@ struct waiter {
 };
 
 struct waitset {
-	struct waiter	**waiters;
-	int		n_waiters;
-	bool		waiters_changed;
-
-	struct timeval	next_timeout;
-
-	/* These are kept consistent over each call to waiter_poll, as
-	 * set->waiters may be updated (by waiters' callbacks calling
-	 * waiter_register or waiter_remove) during iteration. */
-	struct pollfd	*pollfds;
-	int		n_pollfds;
-	struct waiter	**io_waiters;
-	int		n_io_waiters;
-	struct waiter	**time_waiters;
-	int		n_time_waiters;
-
-	struct list	free_list;
+	enum waitset_backend	backend;
+
+	/* epoll backend */
+	int			epoll_fd;
+	struct epoll_event	*epoll_events;
+
+	/* poll backend: pollfds[i] is being waited on by poll_waiters[i].
+	 * Removal swaps the last entry into the freed slot, so neither
+	 * registration nor removal needs to rebuild the set. */
+	struct pollfd		*pollfds;
+	struct waiter		**poll_waiters;
+	int			n_pollfds;
+	int			pollfds_size;
+
+	/* time waiters, as a binary min-heap on expiry time */
+	struct waiter		**timers;
+	int			n_timers;
+	int			timers_size;
+
+	/* Waiters that are ready to be called in the current iteration of
+	 * waiter_poll. Callbacks may register or remove waiters while we're
+	 * iterating, so this is separate from the backend state. */
+	struct waiter		**ready;
+	int			n_ready;
+	int			ready_size;
+
+	struct list		free_list;
+
+	/* log callbacks that take longer than this, if non-zero */
+	unsigned int		watchdog_ms;
 };
 
-struct waitset *waitset_create(void *ctx)
+static int waitset_destructor(void *arg)
+{
+	struct waitset *set = arg;
+
+	if (set->epoll_fd >= 0)
+		close(set->epoll_fd);
+
+	return 0;
+}
+
+static int waiter_destructor(void *arg)
+{
+	struct waiter *waiter = arg;
+
+	if (waiter->type == WAITER_IO && waiter->io.epoll_fd >= 0)
+		close(waiter->io.epoll_fd);
+
+	return 0;
+}
+
+struct waitset *waitset_create_backend(void *ctx,
+		enum waitset_backend backend)
 {
 	struct waitset *set = talloc_zero(ctx, struct waitset);
+
 	list_init(&set->free_list);
+	set->epoll_fd = -1;
+	talloc_set_destructor(set, waitset_destructor);
+
+	if (backend != WAITSET_BACKEND_POLL) {
+		set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (set->epoll_fd < 0) {
+			pb_log("%s: epoll unavailable (%m), using poll\n",
+					__func__);
+			backend = WAITSET_BACKEND_POLL;
+		} else {
+			set->epoll_events = talloc_array(set,
+					struct epoll_event, EPOLL_BATCH_SIZE);
+			backend = WAITSET_BACKEND_EPOLL;
+		}
+	}
+
+	set->backend = backend;
 	return set;
 }
 
+struct waitset *waitset_create(void *ctx)
+{
+	return waitset_create_backend(ctx, WAITSET_BACKEND_DEFAULT);
+}
+
+enum waitset_backend waitset_get_backend(struct waitset *set)
+{
+	return set->backend;
+}
+
 static struct waiter *waiter_new(struct waitset *set)
 {
-	struct waiter **waiters, *waiter;
+	struct waiter *waiter;
 
-	waiter = talloc(set, struct waiter);
+	waiter = talloc_zero(set, struct waiter);
 	if (!waiter)
 		return NULL;
 
-	waiters = talloc_realloc(set, set->waiters,
-			struct waiter *, set->n_waiters + 1);
+	waiter->set = set;
+	waiter->active = true;
+	return waiter;
+}
 
-	if (!waiters) {
-		talloc_free(waiter);
-		return NULL;
+static int epoll_add(struct waitset *set, struct waiter *waiter)
+{
+	struct epoll_event ev;
+
+	waiter->io.epoll_fd = fcntl(waiter->io.fd, F_DUPFD_CLOEXEC, 0);
+	if (waiter->io.epoll_fd < 0)
+		return -1;
+
+	talloc_set_destructor(waiter, waiter_destructor);
+
+	memset(&ev, 0, sizeof(ev));
+	if (waiter->io.events & WAIT_IN)
+		ev.events |= EPOLLIN;
+	if (waiter->io.events & WAIT_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = waiter;
+
+	return epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, waiter->io.epoll_fd,
+			&ev);
+}
+
+static int poll_add(struct waitset *set, struct waiter *waiter)
+{
+	if (set->n_pollfds == set->pollfds_size) {
+		int size = set->pollfds_size ? set->pollfds_size * 2 : 16;
+
+		set->pollfds = talloc_realloc(set, set->pollfds,
+				struct pollfd, size);
+		set->poll_waiters = talloc_realloc(set, set->poll_waiters,
+				struct waiter *, size);
+		if (!set->pollfds || !set->poll_waiters)
+			return -1;
+		set->pollfds_size = size;
 	}
 
-	set->waiters_changed = true;
-	set->waiters = waiters;
-	set->n_waiters++;
+	waiter->io.poll_idx = set->n_pollfds++;
+	set->pollfds[waiter->io.poll_idx].fd = waiter->io.fd;
+	set->pollfds[waiter->io.poll_idx].events = waiter->io.events;
+	set->pollfds[waiter->io.poll_idx].revents = 0;
+	set->poll_waiters[waiter->io.poll_idx] = waiter;
 
-	set->waiters[set->n_waiters - 1] = waiter;
-	waiter->active = true;
-	return waiter;
+	return 0;
+}
+
+static void poll_remove(struct waitset *set, struct waiter *waiter)
+{
+	int i = waiter->io.poll_idx, last = set->n_pollfds - 1;
+
+	assert(set->poll_waiters[i] == waiter);
+
+	if (i != last) {
+		set->pollfds[i] = set->pollfds[last];
+		set->poll_waiters[i] = set->poll_waiters[last];
+		set->poll_waiters[i]->io.poll_idx = i;
+	}
+	set->n_pollfds--;
 }
 
 struct waiter *waiter_register_io(struct waitset *set, int fd, int events,
 		waiter_cb callback, void *arg)
 {
 	struct waiter *waiter = waiter_new(set);
+	int rc;
+
+	if (!waiter)
+		return NULL;
 
 	waiter->type = WAITER_IO;
-	waiter->set = set;
 	waiter->io.fd = fd;
 	waiter->io.events = events;
+	waiter->io.epoll_fd = -1;
 	waiter->callback = callback;
 	waiter->arg = arg;
 
+	if (set->backend == WAITSET_BACKEND_EPOLL)
+		rc = epoll_add(set, waiter);
+	else
+		rc = poll_add(set, waiter);
+
+	if (rc) {
+		pb_log("%s: failed to register fd %d: %m\n", __func__, fd);
+		talloc_free(waiter);
+		return NULL;
+	}
+
 	return waiter;
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_set(struct waitset *set, int idx, struct waiter *waiter)
+{
+	set->timers[idx] = waiter;
+	waiter->time.heap_idx = idx;
+}
+
+static void timer_sift_up(struct waitset *set, int idx)
+{
+	struct waiter *waiter = set->timers[idx];
+
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+
+		if (set->timers[parent]->time.expiry <= waiter->time.expiry)
+			break;
+		timer_set(set, idx, set->timers[parent]);
+		idx = parent;
+	}
+
+	timer_set(set, idx, waiter);
+}
+
+static void timer_sift_down(struct waitset *set, int idx)
+{
+	struct waiter *waiter = set->timers[idx];
+
+	for (;;) {
+		int child = idx * 2 + 1;
+
+		if (child >= set->n_timers)
+			break;
+		if (child + 1 < set->n_timers &&
+				set->timers[child + 1]->time.expiry <
+				set->timers[child]->time.expiry)
+			child++;
+		if (waiter->time.expiry <= set->timers[child]->time.expiry)
+			break;
+		timer_set(set, idx, set->timers[child]);
+		idx = child;
+	}
+
+	timer_set(set, idx, waiter);
+}
+
+static int timer_arm(struct waitset *set, struct waiter *waiter)
+{
+	if (set->n_timers == set->timers_size) {
+		int size = set->timers_size ? set->timers_size * 2 : 16;
+		struct waiter **timers;
+
+		timers = talloc_realloc(set, set->timers,
+				struct waiter *, size);
+		if (!timers)
+			return -1;
+		set->timers = timers;
+		set->timers_size = size;
+	}
+
+	set->timers[set->n_timers] = waiter;
+	timer_sift_up(set, set->n_timers++);
+	return 0;
+}
+
+static void timer_disarm(struct waitset *set, struct waiter *waiter)
+{
+	int idx = waiter->time.heap_idx;
+	struct waiter *moved;
+
+	if (idx < 0)
+		return;
+
+	assert(set->timers[idx] == waiter);
+	waiter->time.heap_idx = -1;
+
+	if (idx == --set->n_timers)
+		return;
+
+	/* move the last timer into the vacated slot, and restore the heap
+	 * property from there */
+	moved = set->timers[set->n_timers];
+	timer_set(set, idx, moved);
+	timer_sift_up(set, idx);
+	timer_sift_down(set, moved->time.heap_idx);
+}
+
 struct waiter *waiter_register_timeout(struct waitset *set, int delay_ms,
 		waiter_cb callback, void *arg)
 {
 	struct waiter *waiter = waiter_new(set);
-	struct timeval now, delay;
-
-	delay.tv_sec = delay_ms / 1000;
-	delay.tv_usec = 1000 * (delay_ms % 1000);
-
-	gettimeofday(&now, NULL);
 
-	timeradd(&now, &delay, &waiter->timeout);
+	if (!waiter)
+		return NULL;
 
 	waiter->type = WAITER_TIME;
-	waiter->set = set;
 	waiter->callback = callback;
 	waiter->arg = arg;
+	waiter->time.expiry = now_ms() + delay_ms;
+	waiter->time.heap_idx = -1;
+
+	if (timer_arm(set, waiter)) {
+		talloc_free(waiter);
+		return NULL;
+	}
 
 	return waiter;
 }
 
-void waiter_remove(struct waiter *waiter)
+void waiter_rearm_timeout(struct waiter *waiter, int delay_ms)
 {
 	struct waitset *set = waiter->set;
-	int i;
+	uint64_t expiry = now_ms() + delay_ms;
+	int idx = waiter->time.heap_idx;
 
-	for (i = 0; i < set->n_waiters; i++)
-		if (set->waiters[i] == waiter)
-			break;
+	assert(waiter->type == WAITER_TIME);
+	assert(waiter->active);
+
+	waiter->time.expiry = expiry;
+
+	/* currently firing: put it back in the heap. This can't fail, as
+	 * the waiter's slot was only just released */
+	if (idx < 0) {
+		timer_arm(set, waiter);
+		return;
+	}
+
+	timer_sift_up(set, idx);
+	timer_sift_down(set, waiter->time.heap_idx);
+}
 
-	assert(i < set->n_waiters);
+void waiter_remove(struct waiter *waiter)
+{
+	struct waitset *set = waiter->set;
 
-	set->n_waiters--;
-	memmove(&set->waiters[i], &set->waiters[i+1],
-		(set->n_waiters - i) * sizeof(set->waiters[0]));
+	assert(waiter->active);
 
-	set->waiters = talloc_realloc(set, set->waiters,
-			struct waiter *, set->n_waiters);
-	set->waiters_changed = true;
+	if (waiter->type == WAITER_IO) {
+		if (set->backend == WAITSET_BACKEND_EPOLL) {
+			epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL,
+					waiter->io.epoll_fd, NULL);
+			close(waiter->io.epoll_fd);
+			waiter->io.epoll_fd = -1;
+		} else {
+			poll_remove(set, waiter);
+		}
+	} else {
+		timer_disarm(set, waiter);
+	}
 
+	/* The waiter may still be referenced from set->ready, so defer the
+	 * free until the end of this waiter_poll iteration */
 	waiter->active = false;
 	list_add(&set->free_list, &waiter->list);
 }
 
-static void update_waiters(struct waitset *set)
+static int ready_add(struct waitset *set, struct waiter *waiter)
 {
-	int n_io, n_time, i_io, i_time, i;
+	if (set->n_ready == set->ready_size) {
+		int size = set->ready_size ? set->ready_size * 2 : 16;
+		struct waiter **ready;
+
+		ready = talloc_realloc(set, set->ready, struct waiter *, size);
+		if (!ready)
+			return -1;
+		set->ready = ready;
+		set->ready_size = size;
+	}
 
-	if (!set->waiters_changed)
-		return;
+	set->ready[set->n_ready++] = waiter;
+	return 0;
+}
 
-	n_io = n_time = 0;
+static int next_timeout_ms(struct waitset *set)
+{
+	uint64_t next, now;
 
-	for (i = 0; i < set->n_waiters; i++) {
-		if (set->waiters[i]->type == WAITER_IO)
-			n_io++;
-		else if (set->waiters[i]->type == WAITER_TIME)
-			n_time++;
-	}
+	if (!set->n_timers)
+		return -1;
 
-	/* realloc if counts have changed */
-	if (set->n_io_waiters != n_io) {
-		set->io_waiters = talloc_realloc(set, set->io_waiters,
-				struct waiter *, n_io);
-		set->pollfds = talloc_realloc(set, set->pollfds,
-				struct pollfd, n_io);
-		set->n_io_waiters = n_io;
-	}
-	if (set->n_time_waiters != n_time) {
-		set->time_waiters = talloc_realloc(set, set->time_waiters,
-				struct waiter *, n_time);
-		set->n_time_waiters = n_time;
-	}
+	next = set->timers[0]->time.expiry;
+	now = now_ms();
+
+	if (next <= now)
+		return 0;
 
-	i_io = 0;
-	i_time = 0;
+	if (next - now > INT_MAX)
+		return INT_MAX;
 
-	timerclear(&set->next_timeout);
+	return next - now;
+}
 
-	for (i = 0; i < set->n_waiters; i++) {
-		struct waiter *waiter = set->waiters[i];
+static int epoll_wait_ready(struct waitset *set, int timeout_ms)
+{
+	int i, rc;
 
-		/* IO waiters: copy to io_waiters, populate pollfds */
-		if (waiter->type == WAITER_IO) {
-			set->pollfds[i_io].fd = waiter->io.fd;
-			set->pollfds[i_io].events = waiter->io.events;
-			set->io_waiters[i_io] = waiter;
-			i_io++;
-		}
+	rc = epoll_wait(set->epoll_fd, set->epoll_events, EPOLL_BATCH_SIZE,
+			timeout_ms);
+	if (rc < 0)
+		return rc;
 
-		/* time waiters: copy to time_waiters, calculate next expiry */
-		if (waiter->type == WAITER_TIME) {
-			if (!timerisset(&set->next_timeout) ||
-					timercmp(&waiter->timeout,
-						&set->next_timeout, <))
-				set->next_timeout = waiter->timeout;
+	for (i = 0; i < rc; i++)
+		if (ready_add(set, set->epoll_events[i].data.ptr))
+			return -1;
 
-			set->time_waiters[i_time] = waiter;
-			i_time++;
-		}
+	return 0;
+}
+
+static int poll_wait_ready(struct waitset *set, int timeout_ms)
+{
+	int i, rc;
+
+	rc = poll(set->pollfds, set->n_pollfds, timeout_ms);
+	if (rc <= 0)
+		return rc;
+
+	for (i = 0; i < set->n_pollfds && rc > 0; i++) {
+		if (!set->pollfds[i].revents)
+			continue;
+		rc--;
+		if (ready_add(set, set->poll_waiters[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+void waitset_set_watchdog(struct waitset *set, unsigned int threshold_ms)
+{
+	set->watchdog_ms = threshold_ms;
+}
+
+static int waiter_call(struct waitset *set, struct waiter *waiter)
+{
+	uint64_t start, elapsed;
+	waiter_cb callback;
+	int rc, fd;
+
+	if (!set->watchdog_ms)
+		return waiter->callback(waiter->arg);
+
+	callback = waiter->callback;
+	fd = waiter->type == WAITER_IO ? waiter->io.fd : -1;
+
+	start = now_ms();
+	rc = callback(waiter->arg);
+	elapsed = now_ms() - start;
+
+	if (elapsed >= set->watchdog_ms) {
+		if (fd >= 0)
+			pb_log("waiter: callback %p for fd %d blocked the "
+					"loop for %llums\n", callback, fd,
+					(unsigned long long)elapsed);
+		else
+			pb_log("waiter: timeout callback %p blocked the "
+					"loop for %llums\n", callback,
+					(unsigned long long)elapsed);
 	}
+
+	return rc;
 }
 
 int waiter_poll(struct waitset *set)
 {
-	struct timeval now, timeout;
 	struct waiter *waiter, *tmp;
-	int timeout_ms;
+	uint64_t now;
 	int i, rc;
 
-	/* If the waiters have been updated, we need to update our
-	 * consistent copy */
-	update_waiters(set);
-
-	if (timerisset(&set->next_timeout)) {
-		gettimeofday(&now, NULL);
-		timersub(&set->next_timeout, &now, &timeout);
-		timeout_ms = timeout.tv_sec * 1000 +
-				timeout.tv_usec / 1000;
-		if (timeout_ms < 0)
-			timeout_ms = 0;
-	} else {
-		timeout_ms = -1;
-	}
+	set->n_ready = 0;
 
-	rc = poll(set->pollfds, set->n_io_waiters, timeout_ms);
+	if (set->backend == WAITSET_BACKEND_EPOLL)
+		rc = epoll_wait_ready(set, next_timeout_ms(set));
+	else
+		rc = poll_wait_ready(set, next_timeout_ms(set));
 
 	if (rc < 0) {
 		if (errno == EINTR)
@@ -231,40 +528,51 @@ int waiter_poll(struct waitset *set)
 		goto out;
 	}
 
-	for (i = 0; i < set->n_io_waiters; i++) {
-		struct waiter *waiter = set->io_waiters[i];
+	for (i = 0; i < set->n_ready; i++) {
+		waiter = set->ready[i];
 
 		if (!waiter->active)
 			continue;
 
-		if (!set->pollfds[i].revents)
-			continue;
-		rc = waiter->callback(waiter->arg);
+		rc = waiter_call(set, waiter);
 
-		if (rc)
+		if (rc && waiter->active)
 			waiter_remove(waiter);
 	}
 
-	if (set->n_time_waiters > 0)
-		gettimeofday(&now, NULL);
+	set->n_ready = 0;
 
-	for (i = 0; i < set->n_time_waiters; i++) {
-		struct waiter *waiter = set->time_waiters[i];
+	/* Pop expired timers in expiry order before calling any of them, so
+	 * that a callback re-arming its own waiter (or registering a new
+	 * zero-delay timeout) doesn't cause it to run again until the next
+	 * iteration. */
+	now = set->n_timers ? now_ms() : 0;
 
-		if (!waiter->active)
-			continue;
+	while (set->n_timers && set->timers[0]->time.expiry <= now) {
+		waiter = set->timers[0];
+		if (ready_add(set, waiter))
+			break;
+		timer_disarm(set, waiter);
+	}
+
+	for (i = 0; i < set->n_ready; i++) {
+		waiter = set->ready[i];
 
-		if (timercmp(&waiter->timeout, &now, >))
+		if (!waiter->active)
 			continue;
 
-		waiter->callback(waiter->arg);
+		waiter_call(set, waiter);
 
-		waiter_remove(waiter);
+		/* keep waiters that have been re-armed from their callback */
+		if (waiter->active && waiter->time.heap_idx < 0)
+			waiter_remove(waiter);
 	}
 
 	rc = 0;
 
 out:
+	set->n_ready = 0;
+
 	/* free any waiters that have been removed */
 	list_for_each_entry_safe(&set->free_list, waiter, tmp, list)
 		talloc_free(waiter);
@@ -11,19 +11,43 @@ enum events {
 	WAIT_OUT = POLLOUT,
 };
 
+/* The mechanism used to wait for io events. WAITSET_BACKEND_DEFAULT uses
+ * epoll where available, and falls back to poll() otherwise. The poll()
+ * backend can be requested explicitly, mainly so that tests can exercise
+ * both implementations.
+ */
+enum waitset_backend {
+	WAITSET_BACKEND_DEFAULT,
+	WAITSET_BACKEND_EPOLL,
+	WAITSET_BACKEND_POLL,
+};
+
 typedef int (*waiter_cb)(void *);
 
 struct waitset *waitset_create(void *ctx);
+struct waitset *waitset_create_backend(void *ctx,
+		enum waitset_backend backend);
+enum waitset_backend waitset_get_backend(struct waitset *set);
 
 struct waiter *waiter_register_io(struct waitset *waitset, int fd, int events,
 		waiter_cb callback, void *arg);
 
+/* Timeouts are measured against CLOCK_MONOTONIC, so are not affected by
+ * changes to the system time. */
 struct waiter *waiter_register_timeout(struct waitset *set, int delay_ms,
 		waiter_cb callback, void *arg);
 
+/* Restart a timeout waiter to expire delay_ms from now, without
+ * reallocating it. This may be called from the waiter's own callback, in
+ * which case the waiter stays registered rather than being removed once the
+ * callback returns. */
+void waiter_rearm_timeout(struct waiter *waiter, int delay_ms);
+
 void waiter_remove(struct waiter *waiter);
 
+/* Log any callback that runs for longer than threshold_ms, and so holds up
+ * every other waiter in the set. A threshold of zero disables the check. */
+void waitset_set_watchdog(struct waitset *set, unsigned int threshold_ms);
+
 int waiter_poll(struct waitset *waitset);
 #endif /* _WAITER_H */
-
-
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Compares the latency of starting a process with posix_spawn against
+ * fork and exec, from a parent with a large heap. Not run by 'make check';
+ * test-process-spawn covers the behaviour. Built without assertions, so
+ * failures abort explicitly */
+
+#define N_ITERATIONS	200
+#define HEAP_SIZE	(64 * 1024 * 1024)
+
+static const char *child_argv[3];
+
+/* the previous fork-based launch: exec from a full copy of the parent */
+static int fork_exec_child(void *arg __attribute__((unused)))
+{
+	execv(child_argv[0], (char * const *)child_argv);
+	return EXIT_FAILURE;
+}
+
+static double elapsed_us(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+		(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void bench(void *ctx, const char *name, bool use_fork)
+{
+	struct timespec start, end;
+	struct process *process;
+	double total_us = 0;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < N_ITERATIONS; i++) {
+		process = process_create(ctx);
+		process->path = child_argv[0];
+		process->argv = child_argv;
+		process->keep_stdout = true;
+		if (use_fork)
+			process->child_fn = fork_exec_child;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = process_run_sync(process);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (rc || !WIFEXITED(process->exit_status) ||
+				WEXITSTATUS(process->exit_status) != 42 ||
+				strcmp(process->stdout_buf, "child\n")) {
+			fprintf(stderr, "%s: process %u failed\n", name, i);
+			abort();
+		}
+
+		total_us += elapsed_us(&start, &end);
+		process_release(process);
+	}
+
+	printf("%-6s %8.1f us/process\n", name, total_us / N_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+	struct waitset *waitset;
+	char *heap;
+	void *ctx;
+
+	if (argc == 2 && !strcmp(argv[1], "child")) {
+		printf("child\n");
+		return 42;
+	}
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+
+	process_init(ctx, waitset, false);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	/* fork() cost scales with the parent's mapped memory */
+	heap = talloc_size(ctx, HEAP_SIZE);
+	memset(heap, 0x5a, HEAP_SIZE);
+
+	bench(ctx, "fork", true);
+	bench(ctx, "spawn", false);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
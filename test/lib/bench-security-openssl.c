@@ -0,0 +1,213 @@
+/*
+ * Benchmark boot file verification, one file at a time and in parallel.
+ *
+ * Synthetic kernel, initrd and dtb payloads are signed with the test key
+ * from the verify fixtures. Pass a size in MiB to scale the initrd (the
+ * kernel is a quarter of that). Not run by 'make check';
+ * test-security-openssl-parallel covers the results. Built without
+ * assertions, so failures abort explicitly.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <log/log.h>
+#include <security/security.h>
+#include <talloc/talloc.h>
+
+#define SECURITY_TEST_DATA_DIR	TEST_LIB_DATA_BASE "/security/"
+
+#define DEFAULT_SIZE_MB		16
+
+static const char *args = "console=hvc0 root=/dev/sda2";
+
+static EVP_PKEY *load_key(void)
+{
+	EVP_PKEY *key;
+	FILE *f;
+
+	f = fopen(SECURITY_TEST_DATA_DIR "key.pem", "r");
+	if (!f)
+		abort();
+	key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (!key)
+		abort();
+
+	return key;
+}
+
+static void sign(EVP_PKEY *key, const char *filename, const void *buf,
+		size_t len)
+{
+	unsigned char *sig;
+	EVP_MD_CTX *ctx;
+	size_t siglen;
+	FILE *f;
+
+	ctx = EVP_MD_CTX_create();
+	if (EVP_DigestSignInit(ctx, NULL, EVP_get_digestbyname(VERIFY_DIGEST),
+				NULL, key) != 1 ||
+			EVP_DigestSignUpdate(ctx, buf, len) != 1 ||
+			EVP_DigestSignFinal(ctx, NULL, &siglen) != 1)
+		abort();
+	sig = talloc_size(NULL, siglen);
+	if (EVP_DigestSignFinal(ctx, sig, &siglen) != 1)
+		abort();
+	EVP_MD_CTX_destroy(ctx);
+
+	f = fopen(filename, "w");
+	if (!f || fwrite(sig, 1, siglen, f) != siglen)
+		abort();
+	fclose(f);
+	talloc_free(sig);
+}
+
+/* write @len bytes of noise to @dir/@name, along with a signature */
+static char *create_payload(void *ctx, EVP_PKEY *key, const char *dir,
+		const char *name, size_t len)
+{
+	unsigned int seed = len;
+	char *filename, *signame;
+	unsigned char *buf;
+	size_t i;
+	FILE *f;
+
+	buf = talloc_size(ctx, len);
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	filename = talloc_asprintf(ctx, "%s/%s", dir, name);
+	f = fopen(filename, "w");
+	if (!f || fwrite(buf, 1, len, f) != len)
+		abort();
+	fclose(f);
+
+	signame = talloc_asprintf(ctx, "%s.sig", filename);
+	sign(key, signame, buf, len);
+
+	talloc_free(buf);
+	return filename;
+}
+
+static struct boot_task *create_task(void *ctx, const char *dir)
+{
+	struct boot_task *task;
+
+	task = talloc_zero(ctx, struct boot_task);
+	task->local_image = talloc_asprintf(task, "%s/vmlinux", dir);
+	task->local_initrd = talloc_asprintf(task, "%s/initrd", dir);
+	task->local_dtb = talloc_asprintf(task, "%s/dtb", dir);
+	task->local_image_signature = talloc_asprintf(task, "%s.sig",
+			task->local_image);
+	task->local_initrd_signature = talloc_asprintf(task, "%s.sig",
+			task->local_initrd);
+	task->local_dtb_signature = talloc_asprintf(task, "%s.sig",
+			task->local_dtb);
+	task->local_cmdline_signature = talloc_asprintf(task, "%s/cmdline.sig",
+			dir);
+	task->args = args;
+	task->verify_signature = true;
+
+	task->local_image_fd = -1;
+	task->local_initrd_fd = -1;
+	task->local_dtb_fd = -1;
+
+	return task;
+}
+
+static int run(struct boot_task *task, bool parallel, double *ms)
+{
+	struct timespec start, end;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = validate_boot_files_from(task, SECURITY_TEST_DATA_DIR "cert.pem",
+			parallel);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+		(end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+	return rc;
+}
+
+static bool task_verified(struct boot_task *task)
+{
+	return task->local_image_override && task->local_initrd_override &&
+		task->local_dtb_override;
+}
+
+int main(int argc, char **argv)
+{
+	double serial_ms, parallel_ms;
+	char dir[] = "/tmp/pb-bench-XXXXXX";
+	struct boot_task *task;
+	size_t size;
+	EVP_PKEY *key;
+	void *ctx;
+
+	size = (argc > 1 ? atoi(argv[1]) : DEFAULT_SIZE_MB) << 20;
+	if (!size) {
+		fprintf(stderr, "usage: %s [size in MiB]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	pb_log_init(stderr);
+
+	ctx = talloc_new(NULL);
+	if (!mkdtemp(dir))
+		abort();
+
+	key = load_key();
+	create_payload(ctx, key, dir, "vmlinux", size / 4);
+	create_payload(ctx, key, dir, "initrd", size);
+	create_payload(ctx, key, dir, "dtb", 128 << 10);
+	sign(key, talloc_asprintf(ctx, "%s/cmdline.sig", dir),
+			args, strlen(args));
+	EVP_PKEY_free(key);
+
+	task = create_task(ctx, dir);
+
+	/* warm the page cache, so neither run pays for the first read */
+	if (run(task, false, &serial_ms))
+		abort();
+	validate_boot_files_cleanup(task);
+
+	if (run(task, false, &serial_ms) || !task_verified(task))
+		abort();
+	validate_boot_files_cleanup(task);
+
+	if (run(task, true, &parallel_ms) || !task_verified(task))
+		abort();
+	validate_boot_files_cleanup(task);
+
+	printf("%zu MiB: serial %.1f ms, parallel %.1f ms (%.2fx)\n",
+			(size + size / 4 + (128 << 10)) >> 20,
+			serial_ms, parallel_ms, serial_ms / parallel_ms);
+
+	unlink(task->local_image);
+	unlink(task->local_initrd);
+	unlink(task->local_dtb);
+	unlink(task->local_image_signature);
+	unlink(task->local_initrd_signature);
+	unlink(task->local_dtb_signature);
+	unlink(task->local_cmdline_signature);
+	rmdir(dir);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <dhcp/dhcp.h>
+#include <rtnl/rtnl.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Runs a DHCP client against a minimal server on the other end of a veth
+ * pair, in a private network namespace. This needs CAP_SYS_ADMIN and veth
+ * support; the test is skipped otherwise. */
+
+#define TEST_SKIP	77
+#define LEASE_TIME	2
+
+#define CLIENT_IF	"pbdhcp0"
+#define SERVER_IF	"pbdhcp1"
+#define SERVER_ADDR	"10.7.0.1"
+#define CLIENT_ADDR	"10.7.0.50"
+
+struct bootp {
+	uint8_t		op, htype, hlen, hops;
+	uint32_t	xid;
+	uint16_t	secs, flags;
+	uint32_t	ciaddr, yiaddr, siaddr, giaddr;
+	uint8_t		chaddr[16];
+	uint8_t		sname[64];
+	uint8_t		file[128];
+	uint32_t	cookie;
+	uint8_t		options[308];
+} __attribute__((packed));
+
+enum {
+	DISCOVER = 1, OFFER, REQUEST, DECLINE, ACK, NAK, RELEASE,
+};
+
+struct server {
+	int		fd;
+	struct in_addr	addr;
+	struct in_addr	client_addr;
+	unsigned int	n_msgs[RELEASE + 1];
+	uint32_t	last_ciaddr;
+	int		arch_id;
+	bool		nak_next;
+};
+
+struct client_result {
+	unsigned int		n_events[DHCP_EVENT_EXPIRED + 1];
+	enum dhcp_event		last_event;
+	struct in_addr		address;
+	unsigned int		prefixlen;
+	char			*bootfile;
+	char			*pxeconffile;
+	uint32_t		reboottime;
+	struct in_addr		router;
+	unsigned int		n_dns_servers;
+};
+
+static const uint8_t *find_option(const struct bootp *msg, int code,
+		unsigned int *len)
+{
+	const uint8_t *opt = msg->options;
+
+	while (opt < msg->options + sizeof(msg->options) && *opt != 255) {
+		if (*opt == 0) {
+			opt++;
+			continue;
+		}
+		if (*opt == code) {
+			*len = opt[1];
+			return opt + 2;
+		}
+		opt += 2 + opt[1];
+	}
+
+	return NULL;
+}
+
+static uint8_t *add_option(uint8_t *opt, int code, const void *data,
+		unsigned int len)
+{
+	*opt++ = code;
+	*opt++ = len;
+	memcpy(opt, data, len);
+	return opt + len;
+}
+
+static uint8_t *add_addr_option(uint8_t *opt, int code, const char *addr)
+{
+	struct in_addr in;
+
+	inet_pton(AF_INET, addr, &in);
+	return add_option(opt, code, &in, sizeof(in));
+}
+
+static uint8_t *add_u32_option(uint8_t *opt, int code, uint32_t val)
+{
+	val = htonl(val);
+	return add_option(opt, code, &val, sizeof(val));
+}
+
+static void server_reply(struct server *server, const struct bootp *req,
+		int type)
+{
+	struct sockaddr_in addr;
+	struct bootp reply;
+	uint8_t *opt, t = type;
+	int rc;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.op = 2;
+	reply.htype = 1;
+	reply.hlen = 6;
+	reply.xid = req->xid;
+	reply.flags = req->flags;
+	memcpy(reply.chaddr, req->chaddr, sizeof(reply.chaddr));
+	reply.cookie = htonl(0x63825363);
+
+	opt = reply.options;
+	opt = add_option(opt, 53, &t, 1);
+	opt = add_option(opt, 54, &server->addr, 4);
+
+	if (type != NAK) {
+		reply.yiaddr = server->client_addr.s_addr;
+		reply.siaddr = server->addr.s_addr;
+		strcpy((char *)reply.file, "pxelinux.0");
+
+		opt = add_addr_option(opt, 1, "255.255.255.0");
+		opt = add_addr_option(opt, 3, SERVER_ADDR);
+		opt = add_option(opt, 6, "\x0a\x07\x00\x01\x0a\x07\x00\x02", 8);
+		opt = add_u32_option(opt, 51, LEASE_TIME);
+		opt = add_option(opt, 209, "pxelinux.cfg/test",
+				strlen("pxelinux.cfg/test"));
+		opt = add_u32_option(opt, 211, 300);
+	}
+	*opt = 255;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(68);
+	addr.sin_addr.s_addr = INADDR_BROADCAST;
+
+	rc = sendto(server->fd, &reply, sizeof(reply), 0,
+			(struct sockaddr *)&addr, sizeof(addr));
+	assert(rc == sizeof(reply));
+}
+
+static int server_process(void *arg)
+{
+	struct server *server = arg;
+	const uint8_t *opt;
+	struct bootp req;
+	unsigned int len;
+	uint32_t addr;
+	int rc, type;
+
+	memset(&req, 0, sizeof(req));
+	rc = recv(server->fd, &req, sizeof(req), 0);
+	assert(rc > 0);
+
+	opt = find_option(&req, 53, &len);
+	assert(opt && len == 1);
+	type = *opt;
+	assert(type >= DISCOVER && type <= RELEASE);
+	server->n_msgs[type]++;
+
+	opt = find_option(&req, 93, &len);
+	if (opt && len == 2)
+		server->arch_id = opt[0] << 8 | opt[1];
+
+	switch (type) {
+	case DISCOVER:
+		server_reply(server, &req, OFFER);
+		break;
+	case REQUEST:
+		server->last_ciaddr = req.ciaddr;
+		opt = find_option(&req, 50, &len);
+		if (opt)
+			memcpy(&addr, opt, 4);
+		else
+			addr = req.ciaddr;
+
+		if (server->nak_next || addr != server->client_addr.s_addr) {
+			server->nak_next = false;
+			server_reply(server, &req, NAK);
+		} else {
+			server_reply(server, &req, ACK);
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void server_init(struct server *server, struct waitset *waitset)
+{
+	struct sockaddr_in addr;
+	int one = 1, rc;
+
+	memset(server, 0, sizeof(*server));
+	inet_pton(AF_INET, SERVER_ADDR, &server->addr);
+	inet_pton(AF_INET, CLIENT_ADDR, &server->client_addr);
+	server->arch_id = -1;
+
+	server->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(server->fd >= 0);
+
+	rc = setsockopt(server->fd, SOL_SOCKET, SO_BROADCAST, &one,
+			sizeof(one));
+	assert(!rc);
+	rc = setsockopt(server->fd, SOL_SOCKET, SO_BINDTODEVICE, SERVER_IF,
+			strlen(SERVER_IF));
+	assert(!rc);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(67);
+	rc = bind(server->fd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(!rc);
+
+	waiter_register_io(waitset, server->fd, WAIT_IN, server_process,
+			server);
+}
+
+static void lease_cb(void *data, enum dhcp_event event,
+		const struct dhcp_lease *lease)
+{
+	struct client_result *result = data;
+
+	result->n_events[event]++;
+	result->last_event = event;
+	result->address = lease->address;
+	result->prefixlen = lease->prefixlen;
+	result->router = lease->router;
+	result->n_dns_servers = lease->n_dns_servers;
+	result->reboottime = lease->reboottime;
+
+	talloc_free(result->bootfile);
+	talloc_free(result->pxeconffile);
+	result->bootfile = talloc_strdup(NULL, lease->bootfile);
+	result->pxeconffile = talloc_strdup(NULL, lease->pxeconffile);
+}
+
+static int timeout_cb(void *arg)
+{
+	fprintf(stderr, "timed out waiting for %s\n", (const char *)arg);
+	abort();
+}
+
+static void wait_event(struct waitset *waitset, struct client_result *result,
+		enum dhcp_event event, const char *desc)
+{
+	unsigned int n = result->n_events[event];
+	struct waiter *timeout;
+
+	timeout = waiter_register_timeout(waitset, 10000, timeout_cb,
+			(void *)desc);
+
+	while (result->n_events[event] == n)
+		waiter_poll(waitset);
+
+	waiter_remove(timeout);
+}
+
+static void link_cb(void *data, struct rtnl_request *failed)
+{
+	bool *done = data;
+
+	assert(!failed);
+	*done = true;
+}
+
+/* create the veth pair, with the server end configured */
+static int setup_links(void *ctx, struct waitset *waitset)
+{
+	struct rtnl_batch *batch;
+	struct rtnl *rtnl;
+	bool done = false;
+
+	if (system("ip link add " CLIENT_IF " type veth peer name " SERVER_IF
+				" 2>/dev/null"))
+		return -1;
+
+	rtnl = rtnl_init(ctx, waitset, false);
+	assert(rtnl);
+
+	batch = rtnl_batch_create(ctx, rtnl, link_cb, &done);
+	rtnl_batch_addr_add(batch, NULL, if_nametoindex(SERVER_IF),
+			SERVER_ADDR "/24");
+	rtnl_batch_link_set(batch, NULL, if_nametoindex(SERVER_IF), true);
+	rtnl_batch_link_set(batch, NULL, if_nametoindex(CLIENT_IF), true);
+	rtnl_batch_run(batch);
+
+	while (!done)
+		waiter_poll(waitset);
+
+	return 0;
+}
+
+int main(void)
+{
+	uint8_t hwaddr[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x50 };
+	struct client_result result;
+	struct dhcp_client *client;
+	struct waitset *waitset;
+	struct server server;
+	void *ctx;
+	int rc;
+
+	if (unshare(CLONE_NEWNET)) {
+		fprintf(stderr, "can't create network namespace: %s\n",
+				strerror(errno));
+		return TEST_SKIP;
+	}
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+
+	if (setup_links(ctx, waitset)) {
+		fprintf(stderr, "can't create veth interfaces\n");
+		return TEST_SKIP;
+	}
+
+	server_init(&server, waitset);
+
+	memset(&result, 0, sizeof(result));
+	client = dhcp_client_create(ctx, waitset, if_nametoindex(CLIENT_IF),
+			hwaddr, 0x000e, lease_cb, &result);
+	assert(client);
+
+	/* full discovery */
+	rc = dhcp_client_start(client);
+	assert(!rc);
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "initial lease");
+
+	assert(server.n_msgs[DISCOVER] == 1);
+	assert(server.n_msgs[REQUEST] == 1);
+	assert(server.arch_id == 0x000e);
+	assert(result.address.s_addr == server.client_addr.s_addr);
+	assert(result.prefixlen == 24);
+	assert(result.router.s_addr == server.addr.s_addr);
+	assert(result.n_dns_servers == 2);
+	assert(result.reboottime == 300);
+	assert(!strcmp(result.bootfile, "pxelinux.0"));
+	assert(!strcmp(result.pxeconffile, "pxelinux.cfg/test"));
+
+	/* the lease is renewed at half its lifetime, from our address */
+	wait_event(waitset, &result, DHCP_EVENT_RENEWED, "renewal");
+	assert(server.n_msgs[REQUEST] == 2);
+	assert(server.last_ciaddr == server.client_addr.s_addr);
+
+	/* stopping releases the lease */
+	dhcp_client_stop(client);
+	assert(server.n_msgs[RELEASE] == 0);
+	while (server.n_msgs[RELEASE] == 0)
+		waiter_poll(waitset);
+
+	/* restarting asks for the cached address, without a discover */
+	rc = dhcp_client_start(client);
+	assert(!rc);
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "cached lease");
+	assert(server.n_msgs[DISCOVER] == 1);
+	assert(server.n_msgs[REQUEST] == 3);
+
+	/* if the server refuses the cached address, we rediscover */
+	server.nak_next = true;
+	rc = dhcp_client_start(client);
+	assert(!rc);
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "refused cached lease");
+	assert(server.n_msgs[DISCOVER] == 2);
+	assert(server.n_msgs[REQUEST] == 5);
+	assert(result.n_events[DHCP_EVENT_EXPIRED] == 0);
+
+	/* a refused renewal loses the lease */
+	server.nak_next = true;
+	wait_event(waitset, &result, DHCP_EVENT_EXPIRED, "refused renewal");
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "new lease");
+	assert(server.n_msgs[DISCOVER] == 3);
+
+	talloc_free(result.bootfile);
+	talloc_free(result.pxeconffile);
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <dhcp/dhcp6.h>
+#include <rtnl/rtnl.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Runs a DHCPv6 client against a minimal server on the other end of a veth
+ * pair, in a private network namespace. This needs CAP_SYS_ADMIN, veth and
+ * IPv6 support; the test is skipped otherwise. */
+
+#define TEST_SKIP	77
+#define T1		1
+#define T2		2
+#define LIFETIME	4
+
+#define CLIENT_IF	"pbdhcp6c"
+#define SERVER_IF	"pbdhcp6s"
+#define CLIENT_ADDR	"2001:db8::50"
+#define BOOTFILE_URL	"tftp://[2001:db8::1]/pxelinux.0"
+
+enum {
+	SOLICIT = 1, ADVERTISE, REQUEST, CONFIRM, RENEW, REBIND, REPLY,
+	RELEASE,
+};
+
+struct server {
+	int		fd;
+	struct in6_addr	client_addr;
+	unsigned int	n_msgs[RELEASE + 1];
+	int		arch_id;
+	/* the address hinted in the last solicit */
+	bool		have_hint;
+	struct in6_addr	hint;
+	bool		refuse_next;
+};
+
+struct client_result {
+	unsigned int		n_events[DHCP_EVENT_EXPIRED + 1];
+	struct in6_addr		address;
+	unsigned int		n_dns_servers;
+	char			*bootfile_url;
+	char			*bootfile_param;
+};
+
+static const uint8_t *find_option(const uint8_t *buf, unsigned int len,
+		int code, unsigned int *optlen)
+{
+	unsigned int i = 0, c, l;
+
+	while (i + 4 <= len) {
+		c = buf[i] << 8 | buf[i + 1];
+		l = buf[i + 2] << 8 | buf[i + 3];
+		i += 4;
+		assert(i + l <= len);
+		if (c == (unsigned int)code) {
+			*optlen = l;
+			return buf + i;
+		}
+		i += l;
+	}
+
+	return NULL;
+}
+
+static uint8_t *add_option(uint8_t *opt, int code, const void *data,
+		unsigned int len)
+{
+	opt[0] = code >> 8;
+	opt[1] = code;
+	opt[2] = len >> 8;
+	opt[3] = len;
+	memcpy(opt + 4, data, len);
+	return opt + 4 + len;
+}
+
+static void put_u32(uint8_t *p, uint32_t val)
+{
+	val = htonl(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+/* reply with the client's IA: with our address, or a status code */
+static uint8_t *add_ia_na(struct server *server, uint8_t *opt,
+		const uint8_t *req_ia, int status)
+{
+	uint8_t ia[12 + 4 + 24], iaaddr[24], code[2];
+	unsigned int len = 12;
+
+	memcpy(ia, req_ia, 4);
+	put_u32(ia + 4, T1);
+	put_u32(ia + 8, T2);
+
+	if (status) {
+		code[0] = 0;
+		code[1] = status;
+		add_option(ia + len, 13, code, sizeof(code));
+		len += 4 + sizeof(code);
+	} else {
+		memcpy(iaaddr, &server->client_addr, 16);
+		put_u32(iaaddr + 16, LIFETIME);
+		put_u32(iaaddr + 20, LIFETIME);
+		add_option(ia + len, 5, iaaddr, sizeof(iaaddr));
+		len += 4 + sizeof(iaaddr);
+	}
+
+	return add_option(opt, 3, ia, len);
+}
+
+static void server_reply(struct server *server, const uint8_t *req,
+		unsigned int len, const struct sockaddr_in6 *to, int type,
+		int status)
+{
+	const uint8_t *client_id, *ia, *opts = req + 4;
+	uint8_t reply[1024], *opt;
+	unsigned int id_len, ia_len;
+	int rc;
+
+	client_id = find_option(opts, len - 4, 1, &id_len);
+	assert(client_id);
+	ia = find_option(opts, len - 4, 3, &ia_len);
+	assert(ia && ia_len >= 12);
+
+	reply[0] = type;
+	memcpy(reply + 1, req + 1, 3);
+	opt = reply + 4;
+
+	opt = add_option(opt, 1, client_id, id_len);
+	opt = add_option(opt, 2, "\x00\x03\x00\x01\x02\x00\x00\x00\x00\x01",
+			10);
+	opt = add_ia_na(server, opt, ia, status);
+	if (!status) {
+		opt = add_option(opt, 23,
+				"\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01"
+				"\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x02",
+				32);
+		opt = add_option(opt, 59, BOOTFILE_URL, strlen(BOOTFILE_URL));
+		opt = add_option(opt, 60,
+				"\x00\x05" "quiet" "\x00\x07" "console", 16);
+	}
+
+	rc = sendto(server->fd, reply, opt - reply, 0,
+			(const struct sockaddr *)to, sizeof(*to));
+	assert(rc == opt - reply);
+}
+
+static int server_process(void *arg)
+{
+	struct server *server = arg;
+	const uint8_t *opt, *ia, *iaaddr;
+	unsigned int len, ia_len, addr_len;
+	struct sockaddr_in6 from;
+	socklen_t from_len;
+	uint8_t req[1024];
+	int rc, type;
+
+	from_len = sizeof(from);
+	rc = recvfrom(server->fd, req, sizeof(req), 0,
+			(struct sockaddr *)&from, &from_len);
+	assert(rc >= 4);
+	len = rc;
+
+	type = req[0];
+	assert(type >= SOLICIT && type <= RELEASE);
+	server->n_msgs[type]++;
+
+	opt = find_option(req + 4, len - 4, 61, &addr_len);
+	if (opt && addr_len == 2)
+		server->arch_id = opt[0] << 8 | opt[1];
+
+	switch (type) {
+	case SOLICIT:
+		ia = find_option(req + 4, len - 4, 3, &ia_len);
+		assert(ia && ia_len >= 12);
+		iaaddr = find_option(ia + 12, ia_len - 12, 5, &addr_len);
+		server->have_hint = !!iaaddr;
+		if (iaaddr)
+			memcpy(&server->hint, iaaddr, sizeof(server->hint));
+		server_reply(server, req, len, &from, ADVERTISE, 0);
+		break;
+	case REQUEST:
+		assert(find_option(req + 4, len - 4, 2, &addr_len));
+		server_reply(server, req, len, &from, REPLY, 0);
+		break;
+	case RENEW:
+		assert(find_option(req + 4, len - 4, 2, &addr_len));
+		if (server->refuse_next) {
+			server->refuse_next = false;
+			/* NoBinding */
+			server_reply(server, req, len, &from, REPLY, 3);
+		} else {
+			server_reply(server, req, len, &from, REPLY, 0);
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void server_init(struct server *server, struct waitset *waitset)
+{
+	struct ipv6_mreq mreq;
+	struct sockaddr_in6 addr;
+	int one = 1, rc;
+
+	memset(server, 0, sizeof(*server));
+	inet_pton(AF_INET6, CLIENT_ADDR, &server->client_addr);
+	server->arch_id = -1;
+
+	server->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	assert(server->fd >= 0);
+
+	rc = setsockopt(server->fd, IPPROTO_IPV6, IPV6_V6ONLY, &one,
+			sizeof(one));
+	assert(!rc);
+	rc = setsockopt(server->fd, SOL_SOCKET, SO_BINDTODEVICE, SERVER_IF,
+			strlen(SERVER_IF));
+	assert(!rc);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(547);
+	rc = bind(server->fd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(!rc);
+
+	inet_pton(AF_INET6, "ff02::1:2", &mreq.ipv6mr_multiaddr);
+	mreq.ipv6mr_interface = if_nametoindex(SERVER_IF);
+	rc = setsockopt(server->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq,
+			sizeof(mreq));
+	assert(!rc);
+
+	waiter_register_io(waitset, server->fd, WAIT_IN, server_process,
+			server);
+}
+
+static void lease_cb(void *data, enum dhcp_event event,
+		const struct dhcp6_lease *lease)
+{
+	struct client_result *result = data;
+
+	result->n_events[event]++;
+	result->address = lease->address;
+	result->n_dns_servers = lease->n_dns_servers;
+
+	talloc_free(result->bootfile_url);
+	talloc_free(result->bootfile_param);
+	result->bootfile_url = talloc_strdup(NULL, lease->bootfile_url);
+	result->bootfile_param = talloc_strdup(NULL, lease->bootfile_param);
+}
+
+static int timeout_cb(void *arg)
+{
+	fprintf(stderr, "timed out waiting for %s\n", (const char *)arg);
+	abort();
+}
+
+static void wait_event(struct waitset *waitset, struct client_result *result,
+		enum dhcp_event event, const char *desc)
+{
+	unsigned int n = result->n_events[event];
+	struct waiter *timeout;
+
+	timeout = waiter_register_timeout(waitset, 15000, timeout_cb,
+			(void *)desc);
+
+	while (result->n_events[event] == n)
+		waiter_poll(waitset);
+
+	waiter_remove(timeout);
+}
+
+static void link_cb(void *data, struct rtnl_request *failed)
+{
+	bool *done = data;
+
+	assert(!failed);
+	*done = true;
+}
+
+/* Turn off duplicate address detection in the namespace, so that the
+ * link-local addresses are usable as soon as the links are up */
+static int disable_dad(void)
+{
+	int fd, rc;
+
+	fd = open("/proc/sys/net/ipv6/conf/default/accept_dad", O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	rc = write(fd, "0", 1) == 1 ? 0 : -1;
+	close(fd);
+	return rc;
+}
+
+/* create the veth pair, and bring it up */
+static int setup_links(void *ctx, struct waitset *waitset)
+{
+	struct rtnl_batch *batch;
+	struct rtnl *rtnl;
+	bool done = false;
+
+	if (system("ip link add " CLIENT_IF " type veth peer name " SERVER_IF
+				" 2>/dev/null"))
+		return -1;
+
+	rtnl = rtnl_init(ctx, waitset, false);
+	assert(rtnl);
+
+	batch = rtnl_batch_create(ctx, rtnl, link_cb, &done);
+	rtnl_batch_link_set(batch, NULL, if_nametoindex(SERVER_IF), true);
+	rtnl_batch_link_set(batch, NULL, if_nametoindex(CLIENT_IF), true);
+	rtnl_batch_run(batch);
+
+	while (!done)
+		waiter_poll(waitset);
+
+	return 0;
+}
+
+int main(void)
+{
+	uint8_t hwaddr[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x51 };
+	struct client_result result;
+	struct dhcp6_client *client;
+	struct waitset *waitset;
+	struct server server;
+	void *ctx;
+	int rc;
+
+	if (unshare(CLONE_NEWNET)) {
+		fprintf(stderr, "can't create network namespace: %s\n",
+				strerror(errno));
+		return TEST_SKIP;
+	}
+
+	if (disable_dad()) {
+		fprintf(stderr, "no IPv6 support\n");
+		return TEST_SKIP;
+	}
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+
+	if (setup_links(ctx, waitset)) {
+		fprintf(stderr, "can't create veth interfaces\n");
+		return TEST_SKIP;
+	}
+
+	server_init(&server, waitset);
+
+	memset(&result, 0, sizeof(result));
+	client = dhcp6_client_create(ctx, waitset, if_nametoindex(CLIENT_IF),
+			hwaddr, 0x0010, lease_cb, &result);
+	assert(client);
+
+	/* solicit, then request the advertised address */
+	rc = dhcp6_client_start(client);
+	assert(!rc);
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "initial lease");
+
+	assert(server.n_msgs[SOLICIT] >= 1);
+	assert(server.n_msgs[REQUEST] == 1);
+	assert(!server.have_hint);
+	assert(server.arch_id == 0x0010);
+	assert(!memcmp(&result.address, &server.client_addr, 16));
+	assert(result.n_dns_servers == 2);
+	assert(!strcmp(result.bootfile_url, BOOTFILE_URL));
+	assert(!strcmp(result.bootfile_param, "quiet console"));
+
+	/* the lease is renewed at T1 */
+	wait_event(waitset, &result, DHCP_EVENT_RENEWED, "renewal");
+	assert(server.n_msgs[RENEW] == 1);
+
+	/* stopping releases the lease */
+	dhcp6_client_stop(client);
+	assert(server.n_msgs[RELEASE] == 0);
+	while (server.n_msgs[RELEASE] == 0)
+		waiter_poll(waitset);
+
+	/* restarting asks for the previous address */
+	rc = dhcp6_client_start(client);
+	assert(!rc);
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "second lease");
+	assert(server.have_hint);
+	assert(!memcmp(&server.hint, &server.client_addr, 16));
+	assert(server.n_msgs[REQUEST] == 2);
+
+	/* a refused renewal loses the lease, and we solicit again without a
+	 * hint */
+	server.refuse_next = true;
+	wait_event(waitset, &result, DHCP_EVENT_EXPIRED, "refused renewal");
+	wait_event(waitset, &result, DHCP_EVENT_BOUND, "new lease");
+	assert(!server.have_hint);
+	assert(server.n_msgs[REQUEST] == 3);
+	assert(result.n_events[DHCP_EVENT_EXPIRED] == 1);
+
+	talloc_free(result.bootfile_url);
+	talloc_free(result.bootfile_param);
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
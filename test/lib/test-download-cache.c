@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <download/cache.h>
+#include <url/url.h>
+#include <talloc/talloc.h>
+
+/* Checks cache hits, replacement, eviction and validation, with files in a
+ * temporary directory standing in for downloads. */
+
+#define MB	(1024 * 1024)
+
+static char dir[] = "/tmp/pb-test-cache-XXXXXX";
+
+static char *create_file(void *ctx, const char *name, size_t len, char c)
+{
+	char *path, *buf;
+	FILE *f;
+
+	path = talloc_asprintf(ctx, "%s/%s", dir, name);
+	buf = talloc_size(ctx, len);
+	memset(buf, c, len);
+
+	f = fopen(path, "w");
+	assert(f);
+	assert(fwrite(buf, 1, len, f) == len);
+	fclose(f);
+
+	talloc_free(buf);
+	return path;
+}
+
+static bool file_is(const char *path, size_t len, char c)
+{
+	struct stat statbuf;
+	bool match = true;
+	FILE *f;
+	int ch;
+
+	if (stat(path, &statbuf) || (size_t)statbuf.st_size != len)
+		return false;
+
+	f = fopen(path, "r");
+	assert(f);
+	while ((ch = fgetc(f)) != EOF)
+		if (ch != c)
+			match = false;
+	fclose(f);
+
+	return match;
+}
+
+int main(void)
+{
+	struct download_info info = { 0 };
+	struct download_cache_stats stats;
+	const struct download_info *cached;
+	struct pb_url *http, *http1, *http2, *http3, *tftp;
+	struct download_cache *cache;
+	char *cache_dir, *path, *stale;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+	assert(mkdtemp(dir));
+
+	http = pb_url_parse(ctx, "http://server/vmlinux");
+	http1 = pb_url_parse(ctx, "http://server/initrd1");
+	http2 = pb_url_parse(ctx, "http://server/initrd2");
+	http3 = pb_url_parse(ctx, "http://server/initrd3");
+	tftp = pb_url_parse(ctx, "tftp://server/initrd");
+
+	/* anything left by an earlier instance is removed */
+	cache_dir = talloc_asprintf(ctx, "%s/cache", dir);
+	assert(!mkdir(cache_dir, 0700));
+	stale = create_file(ctx, "cache/1", 100, 's');
+
+	cache = download_cache_init(ctx, cache_dir, 3 * MB, false);
+	assert(cache);
+	assert(access(stale, F_OK));
+
+	/* a miss keeps the file, with its validators */
+	assert(!download_cache_lookup(cache, http));
+	path = create_file(ctx, "dl-1", 1000, 'a');
+	info.etag = "\"v1\"";
+	download_cache_add(cache, http, path, &info);
+	unlink(path);
+
+	cached = download_cache_lookup(cache, http);
+	assert(cached && !strcmp(cached->etag, "\"v1\""));
+
+	/* a hit replaces the new, empty download */
+	path = create_file(ctx, "dl-2", 0, 0);
+	assert(!download_cache_use(cache, http, path));
+	assert(file_is(path, 1000, 'a'));
+
+	/* changing the file through that link invalidates the entry. Wait
+	 * for the modification time to move on */
+	usleep(20000);
+	create_file(ctx, "dl-2", 1000, 'b');
+	assert(!download_cache_lookup(cache, http));
+
+	/* files we can't validate later aren't kept: HTTP without an ETag
+	 * or Last-Modified time, and TFTP files, unless asked to */
+	path = create_file(ctx, "dl-3", 1000, 'c');
+	info.etag = NULL;
+	info.total = 1000;
+	download_cache_add(cache, http, path, &info);
+	assert(!download_cache_lookup(cache, http));
+	info.total = MB + 1;
+	info.etag = "\"v2\"";
+	download_cache_add(cache, tftp, path, &info);
+	assert(!download_cache_lookup(cache, tftp));
+
+	/* the least recently used file is evicted to stay in budget */
+	download_cache_add(cache, http1,
+			create_file(ctx, "dl-4", info.total, '1'), &info);
+	download_cache_add(cache, http2,
+			create_file(ctx, "dl-5", info.total, '2'), &info);
+
+	path = create_file(ctx, "dl-6", 0, 0);
+	assert(download_cache_lookup(cache, http1));
+	assert(!download_cache_use(cache, http1, path));
+	assert(file_is(path, info.total, '1'));
+
+	download_cache_add(cache, http3,
+			create_file(ctx, "dl-7", info.total, '3'), &info);
+
+	assert(download_cache_lookup(cache, http1));
+	assert(!download_cache_lookup(cache, http2));
+	assert(download_cache_lookup(cache, http3));
+
+	/* a new download replaces the old one */
+	download_cache_add(cache, http3,
+			create_file(ctx, "dl-8", info.total, '4'), &info);
+	path = create_file(ctx, "dl-9", 0, 0);
+	assert(!download_cache_use(cache, http3, path));
+	assert(file_is(path, info.total, '4'));
+
+	download_cache_get_stats(cache, &stats);
+	assert(stats.hits == 3);
+	assert(stats.misses == 7);
+	assert(stats.evictions == 1);
+	assert(stats.saved == 1000 + 2 * info.total);
+	assert(stats.n_entries == 2);
+	assert(stats.size == 2 * info.total);
+
+	/* a cache that trusts TFTP sizes keeps TFTP files that have one */
+	cache_dir = talloc_asprintf(ctx, "%s/cache-tftp", dir);
+	cache = download_cache_init(ctx, cache_dir, 3 * MB, true);
+	assert(cache);
+
+	info.etag = NULL;
+	info.total = 0;
+	download_cache_add(cache, tftp,
+			create_file(ctx, "dl-10", 1000, 'd'), &info);
+	assert(!download_cache_lookup(cache, tftp));
+
+	info.total = 1000;
+	download_cache_add(cache, tftp,
+			create_file(ctx, "dl-11", 1000, 'e'), &info);
+	cached = download_cache_lookup(cache, tftp);
+	assert(cached && cached->total == 1000);
+	path = create_file(ctx, "dl-12", 0, 0);
+	assert(!download_cache_use(cache, tftp, path));
+	assert(file_is(path, 1000, 'e'));
+
+	assert(!system(talloc_asprintf(ctx, "rm -rf %s", dir)));
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,678 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <download/download.h>
+#include <url/url.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Runs concurrent HTTP and TFTP downloads against minimal servers on the
+ * loopback interface. */
+
+#define FILE_SIZE	(300 * 1024 + 123)
+
+enum {
+	TFTP_RRQ = 1, TFTP_WRQ, TFTP_DATA, TFTP_ACK, TFTP_ERROR, TFTP_OACK,
+};
+
+static uint8_t *file_data;
+
+struct server {
+	void		*ctx;
+	struct waitset	*waitset;
+	int		fd;
+	int		port;
+	unsigned int	n_requests;
+};
+
+struct http_conn {
+	struct server	*server;
+	int		fd;
+	struct waiter	*waiter;
+	char		req[4096];
+	size_t		req_len;
+	char		*resp;
+	size_t		resp_len;
+	size_t		sent;
+};
+
+struct tftp_xfer {
+	struct server	*server;
+	int		fd;
+	struct waiter	*waiter;
+	unsigned int	blksize;
+	unsigned int	windowsize;
+	unsigned int	n_blocks;
+	unsigned int	drop_block;
+};
+
+struct result {
+	FILE		*file;
+	bool		done;
+	int		rc;
+	uint64_t	size;
+	uint64_t	total;
+	char		*etag;
+	char		*last_modified;
+	bool		not_modified;
+};
+
+static int server_socket(struct server *server, int type)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd;
+
+	fd = socket(AF_INET, type, 0);
+	assert(fd >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(!bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	assert(!getsockname(fd, (struct sockaddr *)&addr, &len));
+
+	if (server)
+		server->port = ntohs(addr.sin_port);
+
+	return fd;
+}
+
+static void http_append(struct http_conn *conn, const void *buf, size_t len)
+{
+	conn->resp = talloc_realloc(conn, conn->resp, char,
+			conn->resp_len + len);
+	memcpy(conn->resp + conn->resp_len, buf, len);
+	conn->resp_len += len;
+}
+
+static void http_printf(struct http_conn *conn, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	http_append(conn, buf, len);
+}
+
+static void http_response(struct server *server, struct http_conn *conn,
+		const char *path)
+{
+	size_t chunks[] = { 1, 4095, 10000, 65536, 0 };
+	unsigned int i;
+	size_t off;
+
+	if (!strcmp(path, "/file") &&
+			strstr(conn->req, "\r\nIf-None-Match: \"pb-test\"\r\n")) {
+		http_printf(conn, "HTTP/1.1 304 Not Modified\r\n\r\n");
+
+	} else if (!strcmp(path, "/file")) {
+		http_printf(conn, "HTTP/1.1 200 OK\r\n"
+				"Content-Length: %d\r\n"
+				"ETag: \"pb-test\"\r\n"
+				"Last-Modified: Mon, 01 Jan 2024 00:00:00 GMT"
+				"\r\n\r\n", FILE_SIZE);
+		http_append(conn, file_data, FILE_SIZE);
+
+	} else if (!strcmp(path, "/chunked")) {
+		http_printf(conn, "HTTP/1.1 200 OK\r\n"
+				"Transfer-Encoding: chunked\r\n\r\n");
+		for (i = 0, off = 0; off < FILE_SIZE; i++) {
+			size_t len = chunks[i % 5] ?: FILE_SIZE - off;
+			if (len > FILE_SIZE - off)
+				len = FILE_SIZE - off;
+			http_printf(conn, "%zx%s\r\n", len,
+					i == 2 ? ";ext=1" : "");
+			http_append(conn, file_data + off, len);
+			http_printf(conn, "\r\n");
+			off += len;
+		}
+		http_printf(conn, "0\r\nX-Trailer: 1\r\n\r\n");
+
+	} else if (!strcmp(path, "/eof")) {
+		http_printf(conn, "HTTP/1.0 200 OK\r\n\r\n");
+		http_append(conn, file_data, FILE_SIZE);
+
+	} else if (!strcmp(path, "/redirect")) {
+		http_printf(conn, "HTTP/1.1 302 Found\r\n"
+				"Location: http://127.0.0.1:%d/file\r\n"
+				"Content-Length: 0\r\n\r\n", server->port);
+
+	} else if (!strcmp(path, "/redirect-path")) {
+		http_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
+				"Location: /chunked\r\n\r\n");
+
+	} else if (!strcmp(path, "/short")) {
+		http_printf(conn, "HTTP/1.1 200 OK\r\n"
+				"Content-Length: %d\r\n\r\n", FILE_SIZE);
+		http_append(conn, file_data, FILE_SIZE / 2);
+
+	} else if (!strcmp(path, "/stall")) {
+		return;
+
+	} else {
+		http_printf(conn, "HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\n\r\n");
+	}
+}
+
+static void http_conn_close(struct http_conn *conn)
+{
+	waiter_remove(conn->waiter);
+	close(conn->fd);
+	talloc_free(conn);
+}
+
+static int http_conn_process(void *arg);
+
+static int http_conn_send(void *arg)
+{
+	struct http_conn *conn = arg;
+	ssize_t rc;
+
+	rc = send(conn->fd, conn->resp + conn->sent,
+			conn->resp_len - conn->sent, MSG_NOSIGNAL);
+	if (rc < 0) {
+		if (errno != EAGAIN)
+			http_conn_close(conn);
+		return 0;
+	}
+
+	conn->sent += rc;
+	if (conn->sent == conn->resp_len)
+		http_conn_close(conn);
+
+	return 0;
+}
+
+static int http_conn_process(void *arg)
+{
+	struct http_conn *conn = arg;
+	struct server *server = conn->server;
+	char path[256];
+	ssize_t rc;
+
+	rc = recv(conn->fd, conn->req + conn->req_len,
+			sizeof(conn->req) - conn->req_len - 1, 0);
+	if (rc <= 0) {
+		http_conn_close(conn);
+		return 0;
+	}
+
+	conn->req_len += rc;
+	conn->req[conn->req_len] = '\0';
+	if (!strstr(conn->req, "\r\n\r\n"))
+		return 0;
+
+	assert(sscanf(conn->req, "GET %255s HTTP/1.1", path) == 1);
+	assert(strstr(conn->req, "\r\nHost: 127.0.0.1:") ||
+			strstr(conn->req, "\r\nHost: localhost:"));
+	server->n_requests++;
+
+	http_response(server, conn, path);
+	if (!conn->resp_len)
+		return 0;
+
+	waiter_remove(conn->waiter);
+	conn->waiter = waiter_register_io(server->waitset, conn->fd,
+			WAIT_OUT, http_conn_send, conn);
+	return 0;
+}
+
+static int http_accept(void *arg)
+{
+	struct server *server = arg;
+	struct http_conn *conn;
+	int fd;
+
+	fd = accept(server->fd, NULL, NULL);
+	assert(fd >= 0);
+
+	conn = talloc_zero(server->ctx, struct http_conn);
+	conn->server = server;
+	conn->fd = fd;
+	conn->waiter = waiter_register_io(server->waitset, fd, WAIT_IN,
+			http_conn_process, conn);
+	return 0;
+}
+
+static void http_server_init(struct server *server, void *ctx,
+		struct waitset *waitset)
+{
+	memset(server, 0, sizeof(*server));
+	server->ctx = ctx;
+	server->waitset = waitset;
+	server->fd = server_socket(server, SOCK_STREAM);
+	assert(!listen(server->fd, 16));
+	waiter_register_io(waitset, server->fd, WAIT_IN, http_accept, server);
+}
+
+static void tftp_send_data(struct tftp_xfer *xfer, unsigned int block)
+{
+	uint8_t pkt[4 + 65464];
+	size_t off, len;
+
+	off = (block - 1) * xfer->blksize;
+	len = FILE_SIZE - off;
+	if (len > xfer->blksize)
+		len = xfer->blksize;
+
+	pkt[0] = 0;
+	pkt[1] = TFTP_DATA;
+	pkt[2] = block >> 8;
+	pkt[3] = block & 0xff;
+	memcpy(pkt + 4, file_data + off, len);
+	assert(send(xfer->fd, pkt, len + 4, 0) == (ssize_t)len + 4);
+}
+
+static void tftp_send_window(struct tftp_xfer *xfer, unsigned int first)
+{
+	unsigned int block;
+
+	for (block = first; block < first + xfer->windowsize &&
+			block <= xfer->n_blocks; block++) {
+		/* lose one packet, so the client has to recover */
+		if (block == xfer->drop_block) {
+			xfer->drop_block = 0;
+			continue;
+		}
+		tftp_send_data(xfer, block);
+	}
+}
+
+static int tftp_xfer_process(void *arg)
+{
+	struct tftp_xfer *xfer = arg;
+	uint8_t pkt[16];
+	unsigned int block;
+	ssize_t rc;
+
+	rc = recv(xfer->fd, pkt, sizeof(pkt), 0);
+	if (rc < 4 || pkt[1] != TFTP_ACK)
+		goto out_close;
+
+	block = (pkt[2] << 8) | pkt[3];
+	if (block == xfer->n_blocks)
+		goto out_close;
+
+	tftp_send_window(xfer, block + 1);
+	return 0;
+
+out_close:
+	waiter_remove(xfer->waiter);
+	close(xfer->fd);
+	talloc_free(xfer);
+	return 0;
+}
+
+static void tftp_send_error(int fd, struct sockaddr_in *addr, int code,
+		const char *msg)
+{
+	uint8_t pkt[64];
+
+	pkt[0] = 0;
+	pkt[1] = TFTP_ERROR;
+	pkt[2] = 0;
+	pkt[3] = code;
+	strcpy((char *)pkt + 4, msg);
+	sendto(fd, pkt, 5 + strlen(msg), 0, (struct sockaddr *)addr,
+			sizeof(*addr));
+}
+
+static int tftp_server_process(void *arg)
+{
+	struct server *server = arg;
+	const char *file, *mode, *name, *value;
+	unsigned int blksize = 0, windowsize = 0;
+	char pkt[512], oack[128], *p, *end;
+	struct tftp_xfer *xfer;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	bool tsize = false;
+	ssize_t rc;
+
+	addr_len = sizeof(addr);
+	rc = recvfrom(server->fd, pkt, sizeof(pkt) - 1, 0,
+			(struct sockaddr *)&addr, &addr_len);
+	assert(rc > 4 && pkt[1] == TFTP_RRQ);
+	pkt[rc] = '\0';
+	end = pkt + rc;
+
+	file = pkt + 2;
+	mode = file + strlen(file) + 1;
+	assert(!strcmp(mode, "octet"));
+	server->n_requests++;
+
+	for (name = mode + strlen(mode) + 1; name < end;
+			name = value + strlen(value) + 1) {
+		value = name + strlen(name) + 1;
+		if (!strcmp(name, "blksize"))
+			blksize = atoi(value);
+		else if (!strcmp(name, "windowsize"))
+			windowsize = atoi(value);
+		else if (!strcmp(name, "tsize"))
+			tsize = true;
+	}
+
+	if (!strcmp(file, "/missing")) {
+		tftp_send_error(server->fd, &addr, 1, "File not found");
+		return 0;
+	}
+
+	if (!strcmp(file, "/refuse") && (blksize || windowsize || tsize)) {
+		tftp_send_error(server->fd, &addr, 8, "No options");
+		return 0;
+	}
+
+	if (!strcmp(file, "/ignore"))
+		blksize = windowsize = tsize = 0;
+
+	xfer = talloc_zero(server->ctx, struct tftp_xfer);
+	xfer->server = server;
+	xfer->blksize = blksize ?: 512;
+	xfer->windowsize = windowsize ?: 1;
+	xfer->n_blocks = FILE_SIZE / xfer->blksize + 1;
+	if (!strcmp(file, "/drop"))
+		xfer->drop_block = 5;
+
+	xfer->fd = server_socket(NULL, SOCK_DGRAM);
+	assert(!connect(xfer->fd, (struct sockaddr *)&addr, addr_len));
+	xfer->waiter = waiter_register_io(server->waitset, xfer->fd, WAIT_IN,
+			tftp_xfer_process, xfer);
+
+	if (!blksize && !windowsize && !tsize) {
+		tftp_send_window(xfer, 1);
+		return 0;
+	}
+
+	p = oack;
+	*p++ = 0;
+	*p++ = TFTP_OACK;
+	if (blksize)
+		p += sprintf(p, "blksize%c%u%c", 0, blksize, 0);
+	if (windowsize)
+		p += sprintf(p, "windowsize%c%u%c", 0, windowsize, 0);
+	if (tsize)
+		p += sprintf(p, "tsize%c%d%c", 0, FILE_SIZE, 0);
+	assert(send(xfer->fd, oack, p - oack, 0) == p - oack);
+
+	return 0;
+}
+
+static void tftp_server_init(struct server *server, void *ctx,
+		struct waitset *waitset)
+{
+	memset(server, 0, sizeof(*server));
+	server->ctx = ctx;
+	server->waitset = waitset;
+	server->fd = server_socket(server, SOCK_DGRAM);
+	waiter_register_io(waitset, server->fd, WAIT_IN,
+			tftp_server_process, server);
+}
+
+static void complete_cb(void *data, int rc, const struct download_info *info)
+{
+	struct result *result = data;
+
+	assert(!result->done);
+	result->done = true;
+	result->rc = rc;
+	result->size = info->size;
+	result->total = info->total;
+	result->etag = talloc_strdup(NULL, info->etag);
+	result->last_modified = talloc_strdup(NULL, info->last_modified);
+	result->not_modified = info->not_modified;
+}
+
+static void progress_cb(void *data, const struct download_info *info)
+{
+	struct result *result = data;
+
+	assert(!result->done);
+	assert(!info->total || info->size <= info->total);
+}
+
+static struct download *start_cached(void *ctx, struct waitset *waitset,
+		struct result *result, const struct download_info *cached,
+		const char *fmt, int port)
+{
+	struct download *download;
+	struct pb_url *url;
+	char *str;
+
+	memset(result, 0, sizeof(*result));
+	result->file = tmpfile();
+	assert(result->file);
+
+	str = talloc_asprintf(ctx, fmt, port);
+	url = pb_url_parse(ctx, str);
+	assert(url);
+
+	download = download_start_cached(ctx, waitset, url,
+			fileno(result->file), cached, complete_cb,
+			progress_cb, result);
+	assert(download);
+	return download;
+}
+
+static struct download *start(void *ctx, struct waitset *waitset,
+		struct result *result, const char *fmt, int port)
+{
+	return start_cached(ctx, waitset, result, NULL, fmt, port);
+}
+
+static int timeout_cb(void *arg __attribute__((unused)))
+{
+	fprintf(stderr, "timed out waiting for downloads\n");
+	abort();
+}
+
+static void wait_results(struct waitset *waitset, struct result *results,
+		unsigned int n)
+{
+	struct waiter *timeout;
+	unsigned int i;
+
+	timeout = waiter_register_timeout(waitset, 20000, timeout_cb, NULL);
+
+	for (i = 0; i < n; i++)
+		while (!results[i].done)
+			waiter_poll(waitset);
+
+	waiter_remove(timeout);
+}
+
+static void check_file(struct result *result)
+{
+	uint8_t *buf;
+
+	assert(result->rc == 0);
+	assert(result->size == FILE_SIZE);
+
+	buf = malloc(FILE_SIZE + 1);
+	rewind(result->file);
+	assert(fread(buf, 1, FILE_SIZE + 1, result->file) == FILE_SIZE);
+	assert(!memcmp(buf, file_data, FILE_SIZE));
+	free(buf);
+}
+
+static void free_result(struct result *result)
+{
+	fclose(result->file);
+	talloc_free(result->etag);
+	talloc_free(result->last_modified);
+}
+
+enum {
+	HTTP_FILE, HTTP_CHUNKED, HTTP_EOF, HTTP_REDIRECT, HTTP_REDIRECT_PATH,
+	TFTP_FILE, TFTP_DROP, TFTP_REFUSE, TFTP_IGNORE,
+	N_DOWNLOADS,
+};
+
+int main(void)
+{
+	struct server http_server, tftp_server, closed;
+	struct result results[N_DOWNLOADS], result;
+	struct download_info cached = { 0 };
+	struct download *download;
+	struct waitset *waitset;
+	unsigned int i;
+	void *ctx;
+	int fd;
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+
+	file_data = talloc_array(ctx, uint8_t, FILE_SIZE);
+	for (i = 0; i < FILE_SIZE; i++)
+		file_data[i] = (i * 7919) >> 5;
+
+	http_server_init(&http_server, ctx, waitset);
+	tftp_server_init(&tftp_server, ctx, waitset);
+
+	/* every transfer type, all at once */
+	start(ctx, waitset, &results[HTTP_FILE],
+			"http://127.0.0.1:%d/file", http_server.port);
+	start(ctx, waitset, &results[HTTP_CHUNKED],
+			"http://127.0.0.1:%d/chunked", http_server.port);
+	start(ctx, waitset, &results[HTTP_EOF],
+			"http://127.0.0.1:%d/eof", http_server.port);
+	start(ctx, waitset, &results[HTTP_REDIRECT],
+			"http://127.0.0.1:%d/redirect", http_server.port);
+	start(ctx, waitset, &results[HTTP_REDIRECT_PATH],
+			"http://127.0.0.1:%d/redirect-path", http_server.port);
+	start(ctx, waitset, &results[TFTP_FILE],
+			"tftp://127.0.0.1:%d/file", tftp_server.port);
+	start(ctx, waitset, &results[TFTP_DROP],
+			"tftp://127.0.0.1:%d/drop", tftp_server.port);
+	start(ctx, waitset, &results[TFTP_REFUSE],
+			"tftp://127.0.0.1:%d/refuse", tftp_server.port);
+	start(ctx, waitset, &results[TFTP_IGNORE],
+			"tftp://127.0.0.1:%d/ignore", tftp_server.port);
+
+	wait_results(waitset, results, N_DOWNLOADS);
+
+	for (i = 0; i < N_DOWNLOADS; i++)
+		check_file(&results[i]);
+
+	assert(http_server.n_requests == 7);
+	assert(tftp_server.n_requests == 5);
+
+	/* sizes and validators are reported where the server sent them */
+	assert(results[HTTP_FILE].total == FILE_SIZE);
+	assert(!strcmp(results[HTTP_FILE].etag, "\"pb-test\""));
+	assert(!strcmp(results[HTTP_FILE].last_modified,
+				"Mon, 01 Jan 2024 00:00:00 GMT"));
+	assert(results[HTTP_REDIRECT].total == FILE_SIZE);
+	assert(results[HTTP_CHUNKED].total == 0);
+	assert(!results[HTTP_CHUNKED].etag);
+	assert(results[HTTP_EOF].total == 0);
+	assert(results[TFTP_FILE].total == FILE_SIZE);
+	assert(results[TFTP_DROP].total == FILE_SIZE);
+	assert(results[TFTP_IGNORE].total == 0);
+
+	for (i = 0; i < N_DOWNLOADS; i++)
+		free_result(&results[i]);
+
+	/* unchanged files aren't transferred again */
+	cached.etag = "\"pb-test\"";
+	start_cached(ctx, waitset, &result, &cached,
+			"http://127.0.0.1:%d/file", http_server.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == 0 && result.not_modified && result.size == 0);
+	assert(!strcmp(result.etag, "\"pb-test\""));
+	free_result(&result);
+
+	cached.etag = "\"pb-old\"";
+	start_cached(ctx, waitset, &result, &cached,
+			"http://127.0.0.1:%d/file", http_server.port);
+	wait_results(waitset, &result, 1);
+	assert(!result.not_modified);
+	check_file(&result);
+	free_result(&result);
+
+	/* TFTP has no validators, so only the size has to match */
+	cached.etag = NULL;
+	cached.total = FILE_SIZE;
+	start_cached(ctx, waitset, &result, &cached,
+			"tftp://127.0.0.1:%d/file", tftp_server.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == 0 && result.not_modified && result.size == 0);
+	free_result(&result);
+
+	cached.total = FILE_SIZE - 1;
+	start_cached(ctx, waitset, &result, &cached,
+			"tftp://127.0.0.1:%d/file", tftp_server.port);
+	wait_results(waitset, &result, 1);
+	assert(!result.not_modified);
+	check_file(&result);
+	free_result(&result);
+
+	/* errors are reported through the completion callback */
+	start(ctx, waitset, &result, "http://127.0.0.1:%d/missing",
+			http_server.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -ENOENT);
+	free_result(&result);
+
+	start(ctx, waitset, &result, "http://127.0.0.1:%d/short",
+			http_server.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -EIO);
+	free_result(&result);
+
+	start(ctx, waitset, &result, "tftp://127.0.0.1:%d/missing",
+			tftp_server.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -ENOENT);
+	free_result(&result);
+
+	/* nothing listening on a port we have just released */
+	fd = server_socket(&closed, SOCK_STREAM);
+	close(fd);
+	start(ctx, waitset, &result, "http://127.0.0.1:%d/file", closed.port);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -ECONNREFUSED);
+	free_result(&result);
+
+	/* host names are looked up on a worker thread */
+	start(ctx, waitset, &result, "http://localhost:%d/file",
+			http_server.port);
+	wait_results(waitset, &result, 1);
+	check_file(&result);
+	free_result(&result);
+
+	download = start(ctx, waitset, &result, "tftp://localhost:%d/file",
+			tftp_server.port);
+	download_cancel(download);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -ECANCELED);
+	free_result(&result);
+
+	/* cancellation completes from the waitset, not the cancel call */
+	download = start(ctx, waitset, &result, "http://127.0.0.1:%d/stall",
+			http_server.port);
+	while (http_server.n_requests != 13)
+		waiter_poll(waitset);
+	download_cancel(download);
+	assert(!result.done);
+	wait_results(waitset, &result, 1);
+	assert(result.rc == -ECANCELED);
+	free_result(&result);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
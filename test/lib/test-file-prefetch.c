@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <file/file.h>
+#include <talloc/talloc.h>
+
+/* Checks which files are read ahead, in a temporary directory */
+
+static char dir[] = "/tmp/pb-test-prefetch-XXXXXX";
+
+static char *create_file(void *ctx, const char *name, off_t size)
+{
+	char *path;
+	int fd;
+
+	path = talloc_asprintf(ctx, "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	assert(fd >= 0);
+	assert(!ftruncate(fd, size));
+	close(fd);
+
+	return path;
+}
+
+static char *create_dir(void *ctx, const char *name)
+{
+	char *path;
+
+	path = talloc_asprintf(ctx, "%s/%s", dir, name);
+	assert(!mkdir(path, 0700));
+
+	return path;
+}
+
+int main(void)
+{
+	struct file_prefetch *prefetch;
+	char *entries;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+	assert(mkdtemp(dir));
+
+	entries = create_dir(ctx, "entries");
+	create_dir(ctx, "entries/subdir");
+	create_dir(ctx, "empty");
+
+	/* nothing to read */
+	prefetch = file_prefetch_create(ctx);
+	file_prefetch_add(prefetch, talloc_asprintf(ctx, "%s/missing", dir));
+	file_prefetch_add(prefetch, entries);
+	file_prefetch_add_dir(prefetch,
+			talloc_asprintf(ctx, "%s/missing", dir));
+	file_prefetch_add_dir(prefetch,
+			talloc_asprintf(ctx, "%s/empty", dir));
+	assert(file_prefetch_wait(prefetch) == 0);
+
+	/* regular files, up to the size that read_file would read, and only
+	 * the files directly within directories */
+	prefetch = file_prefetch_create(ctx);
+	file_prefetch_add(prefetch, create_file(ctx, "grub.cfg", 100));
+	file_prefetch_add(prefetch, create_file(ctx, "empty.cfg", 0));
+	file_prefetch_add(prefetch, create_file(ctx, "huge.cfg", 2 << 20));
+	create_file(ctx, "entries/1.conf", 10);
+	create_file(ctx, "entries/2.conf", 20000);
+	create_file(ctx, "entries/subdir/3.conf", 10);
+	file_prefetch_add_dir(prefetch, entries);
+	assert(file_prefetch_wait(prefetch) == 4);
+
+	assert(!system(talloc_asprintf(ctx, "rm -rf %s", dir)));
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
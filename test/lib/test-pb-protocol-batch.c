@@ -0,0 +1,99 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <pb-protocol/pb-protocol.h>
+
+#define N_STATUS	1000
+
+int main(void)
+{
+	const struct pb_protocol_message *message;
+	struct pb_protocol_reader *reader;
+	struct pb_protocol_batch *batch;
+	unsigned int i, pos, n;
+	struct status status;
+	char *payload;
+	int fds[2], rc, len;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+
+	/* build a batch of status messages, with a large message in the
+	 * middle to force the reader to grow its buffer */
+	batch = pb_protocol_batch_create(ctx);
+	assert(batch);
+
+	memset(&status, 0, sizeof(status));
+	status.type = STATUS_INFO;
+
+	for (i = 0; i < N_STATUS; i++) {
+		if (i == N_STATUS / 2) {
+			status.message = talloc_zero_array(ctx, char, 40000);
+			memset(status.message, 'x', 39999);
+		} else {
+			status.message = talloc_asprintf(ctx, "status %d", i);
+		}
+
+		len = pb_protocol_boot_status_len(&status);
+		payload = pb_protocol_batch_add(batch,
+				PB_PROTOCOL_ACTION_STATUS, len);
+		assert(payload);
+		pb_protocol_serialise_boot_status(&status, payload, len);
+	}
+
+	reader = pb_protocol_reader_create(ctx, fds[1]);
+	assert(reader);
+
+	/* send in odd-sized chunks, so messages are split across reads */
+	n = 0;
+	for (pos = 0; pos < batch->len;) {
+		unsigned int chunk = batch->len - pos;
+
+		if (chunk > 4093)
+			chunk = 4093;
+
+		rc = write(fds[0], batch->buf + pos, chunk);
+		assert(rc > 0);
+		pos += rc;
+
+		rc = pb_protocol_reader_fill(reader);
+		assert(!rc);
+
+		while ((message = pb_protocol_reader_next(reader))) {
+			struct status *s = talloc_zero(ctx, struct status);
+
+			assert(message->action == PB_PROTOCOL_ACTION_STATUS);
+			rc = pb_protocol_deserialise_boot_status(s, message);
+			assert(!rc);
+
+			if (n == N_STATUS / 2)
+				assert(strlen(s->message) == 39999);
+			else
+				assert(atoi(s->message + strlen("status ")) ==
+						(int)n);
+			n++;
+			talloc_free(s);
+		}
+	}
+
+	assert(n == N_STATUS);
+
+	/* EOF is reported as an error */
+	close(fds[0]);
+	rc = pb_protocol_reader_fill(reader);
+	assert(rc == -1);
+
+	close(fds[1]);
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <pb-protocol/pb-protocol.h>
+
+/* Compares the copying decoder against the view and arena decoders, by
+ * number of allocations and decode time */
+
+#define N_ITERATIONS	10000
+#define N_EXECUTABLES	8
+
+static const char *mode_names[] = {
+	[PB_PROTOCOL_DECODE_COPY]	= "copy",
+	[PB_PROTOCOL_DECODE_VIEW]	= "view",
+	[PB_PROTOCOL_DECODE_ARENA]	= "arena",
+};
+
+static struct pb_protocol_message *create_boot_option(void *ctx)
+{
+	struct pb_protocol_message *message;
+	struct boot_option *opt;
+	int len;
+
+	opt = talloc_zero(ctx, struct boot_option);
+	opt->device_id = "sda1";
+	opt->id = "sda1#linux";
+	opt->name = "Linux";
+	opt->description = "Linux kernel from /dev/sda1";
+	opt->boot_image_file = "/var/petitboot/mnt/dev/sda1/boot/vmlinux";
+	opt->initrd_file = "/var/petitboot/mnt/dev/sda1/boot/initrd.img";
+	opt->dtb_file = "/var/petitboot/mnt/dev/sda1/boot/system.dtb";
+	opt->boot_args = "root=/dev/sda2 console=hvc0 quiet";
+	opt->type = DISCOVER_BOOT_OPTION;
+
+	len = pb_protocol_boot_option_len(opt);
+	message = pb_protocol_create_message(ctx,
+			PB_PROTOCOL_ACTION_BOOT_OPTION_ADD, len);
+	assert(message);
+	pb_protocol_serialise_boot_option(opt, message->payload, len);
+
+	return message;
+}
+
+static struct pb_protocol_message *create_plugin_option(void *ctx)
+{
+	struct pb_protocol_message *message;
+	struct plugin_option *opt;
+	unsigned int i;
+	int len;
+
+	opt = talloc_zero(ctx, struct plugin_option);
+	opt->id = "com.example.plugin";
+	opt->name = "Example plugin";
+	opt->vendor = "Example";
+	opt->vendor_id = "example";
+	opt->version = "1.0";
+	opt->date = "2018-01-01";
+	opt->plugin_file = "/var/petitboot/plugins/example.pb-plugin";
+	opt->n_executables = N_EXECUTABLES;
+	opt->executables = talloc_array(opt, char *, N_EXECUTABLES);
+	for (i = 0; i < N_EXECUTABLES; i++)
+		opt->executables[i] = talloc_asprintf(opt,
+				"/usr/bin/example-tool-%d", i);
+
+	len = pb_protocol_plugin_option_len(opt);
+	message = pb_protocol_create_message(ctx,
+			PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD, len);
+	assert(message);
+	pb_protocol_serialise_plugin_option(opt, message->payload, len);
+
+	return message;
+}
+
+static void check_boot_option(struct boot_option *opt)
+{
+	assert(!strcmp(opt->device_id, "sda1"));
+	assert(!strcmp(opt->id, "sda1#linux"));
+	assert(!strcmp(opt->name, "Linux"));
+	assert(!strcmp(opt->boot_args, "root=/dev/sda2 console=hvc0 quiet"));
+	assert(!strcmp(opt->dtb_file,
+			"/var/petitboot/mnt/dev/sda1/boot/system.dtb"));
+	assert(opt->icon_file == NULL);
+	assert(opt->args_sig_file == NULL);
+	assert(opt->type == DISCOVER_BOOT_OPTION);
+}
+
+static void check_plugin_option(struct plugin_option *opt)
+{
+	char str[64];
+	unsigned int i;
+
+	assert(!strcmp(opt->id, "com.example.plugin"));
+	assert(!strcmp(opt->plugin_file,
+			"/var/petitboot/plugins/example.pb-plugin"));
+	assert(opt->n_executables == N_EXECUTABLES);
+	for (i = 0; i < N_EXECUTABLES; i++) {
+		snprintf(str, sizeof(str), "/usr/bin/example-tool-%d", i);
+		assert(!strcmp(opt->executables[i], str));
+	}
+}
+
+static double elapsed_us(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+		(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void bench(void *ctx, const char *name,
+		struct pb_protocol_message *tmpl, size_t obj_size,
+		void (*check)(void *), enum pb_protocol_decode_mode mode)
+{
+	struct pb_protocol_message *message;
+	struct timespec start, end;
+	size_t message_size;
+	double total_us = 0;
+	size_t blocks = 0;
+	unsigned int i;
+	void *obj;
+	int rc;
+
+	message_size = sizeof(*tmpl) + tmpl->payload_len;
+
+	for (i = 0; i < N_ITERATIONS; i++) {
+		/* a view decode consumes its message, so work on a fresh
+		 * copy each time, outside of the timed section */
+		message = talloc_memdup(ctx, tmpl, message_size);
+		obj = talloc_zero_size(ctx, obj_size);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = pb_protocol_decode_message(obj, message, mode);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		assert(!rc);
+
+		total_us += elapsed_us(&start, &end);
+		/* don't count the object itself, or the retained message */
+		blocks = talloc_total_blocks(obj) - 1;
+		if (mode == PB_PROTOCOL_DECODE_VIEW)
+			blocks--;
+
+		check(obj);
+
+		talloc_free(obj);
+		if (mode != PB_PROTOCOL_DECODE_VIEW)
+			talloc_free(message);
+	}
+
+	printf("%-14s %-6s %4zu allocations, %6.3f us/message\n",
+			name, mode_names[mode], blocks,
+			total_us / N_ITERATIONS);
+}
+
+int main(void)
+{
+	struct pb_protocol_message *boot_option, *plugin_option;
+	enum pb_protocol_decode_mode mode;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	boot_option = create_boot_option(ctx);
+	plugin_option = create_plugin_option(ctx);
+
+	for (mode = PB_PROTOCOL_DECODE_COPY;
+			mode <= PB_PROTOCOL_DECODE_ARENA; mode++) {
+		bench(ctx, "boot option", boot_option,
+				sizeof(struct boot_option),
+				(void (*)(void *))check_boot_option, mode);
+		bench(ctx, "plugin option", plugin_option,
+				sizeof(struct plugin_option),
+				(void (*)(void *))check_plugin_option, mode);
+	}
+
+	/* the template messages must not have been modified */
+	bench(ctx, "boot option", boot_option, sizeof(struct boot_option),
+			(void (*)(void *))check_boot_option,
+			PB_PROTOCOL_DECODE_COPY);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
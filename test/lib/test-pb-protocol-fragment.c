@@ -0,0 +1,190 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <pb-protocol/pb-protocol.h>
+
+/* larger than PB_PROTOCOL_MAX_PAYLOAD_SIZE, and not a multiple of the
+ * fragment size */
+#define LARGE_LEN	(3 * PB_PROTOCOL_MAX_PAYLOAD_SIZE + 1234)
+
+static struct pb_protocol_message *create_status(void *ctx, char c,
+		unsigned int len)
+{
+	struct pb_protocol_message *message;
+	struct status status;
+	int payload_len;
+
+	memset(&status, 0, sizeof(status));
+	status.type = STATUS_INFO;
+	status.message = talloc_zero_array(ctx, char, len + 1);
+	memset(status.message, c, len);
+
+	payload_len = pb_protocol_boot_status_len(&status);
+	message = pb_protocol_create_message(ctx, PB_PROTOCOL_ACTION_STATUS,
+			payload_len);
+	assert(message);
+	pb_protocol_serialise_boot_status(&status, message->payload,
+			payload_len);
+
+	return message;
+}
+
+static void check_status(const struct pb_protocol_message *message, char c,
+		unsigned int len)
+{
+	struct status *status;
+	unsigned int i;
+	int rc;
+
+	assert(message->action == PB_PROTOCOL_ACTION_STATUS);
+
+	status = talloc_zero(NULL, struct status);
+	rc = pb_protocol_deserialise_boot_status(status, message);
+	assert(!rc);
+	assert(strlen(status->message) == len);
+	for (i = 0; i < len; i++)
+		assert(status->message[i] == c);
+	talloc_free(status);
+}
+
+/* send a small message, a fragmented message, then another small message */
+static void write_messages(int fd)
+{
+	struct pb_protocol_message *message;
+	void *ctx = talloc_new(NULL);
+
+	message = create_status(ctx, 'a', 10);
+	assert(!pb_protocol_needs_fragments(message));
+	assert(!pb_protocol_write_message(fd, message));
+
+	message = create_status(ctx, 'b', LARGE_LEN);
+	assert(pb_protocol_needs_fragments(message));
+	assert(!pb_protocol_write_message(fd, message));
+
+	message = create_status(ctx, 'c', 10);
+	assert(!pb_protocol_write_message(fd, message));
+
+	talloc_free(ctx);
+}
+
+static pid_t start_writer(int *fd)
+{
+	int fds[2], rc;
+	pid_t pid;
+
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+
+	pid = fork();
+	assert(pid >= 0);
+
+	if (!pid) {
+		close(fds[1]);
+		write_messages(fds[0]);
+		close(fds[0]);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(fds[0]);
+	*fd = fds[1];
+	return pid;
+}
+
+static void wait_writer(pid_t pid)
+{
+	int status;
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+static void test_read_message(void *ctx)
+{
+	struct pb_protocol_message *message;
+	pid_t pid;
+	int fd;
+
+	pid = start_writer(&fd);
+
+	message = pb_protocol_read_message(ctx, fd);
+	assert(message);
+	check_status(message, 'a', 10);
+
+	message = pb_protocol_read_message(ctx, fd);
+	assert(message);
+	check_status(message, 'b', LARGE_LEN);
+
+	message = pb_protocol_read_message(ctx, fd);
+	assert(message);
+	check_status(message, 'c', 10);
+
+	assert(!pb_protocol_read_message(ctx, fd));
+
+	wait_writer(pid);
+	close(fd);
+}
+
+static void test_reader(void *ctx)
+{
+	const struct pb_protocol_message *message;
+	struct pb_protocol_reader *reader;
+	unsigned int n = 0;
+	pid_t pid;
+	int fd;
+
+	pid = start_writer(&fd);
+
+	reader = pb_protocol_reader_create(ctx, fd);
+	assert(reader);
+
+	while (!pb_protocol_reader_fill(reader)) {
+		while ((message = pb_protocol_reader_next(reader))) {
+			switch (n++) {
+			case 0:
+				check_status(message, 'a', 10);
+				break;
+			case 1:
+				check_status(message, 'b', LARGE_LEN);
+				break;
+			case 2:
+				check_status(message, 'c', 10);
+				break;
+			default:
+				assert(0);
+			}
+		}
+	}
+
+	assert(n == 3);
+
+	wait_writer(pid);
+	close(fd);
+}
+
+int main(void)
+{
+	struct pb_protocol_message *message;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	/* fragment headers are included in the wire length */
+	message = create_status(ctx, 'x', LARGE_LEN);
+	assert(pb_protocol_wire_len(message) ==
+			4 * PB_PROTOCOL_FRAGMENT_HEADER_SIZE +
+			message->payload_len);
+
+	test_read_message(ctx);
+	test_reader(ctx);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+struct chain_result {
+	bool		done;
+	int		failed_status;
+	bool		failed_signalled;
+	unsigned int	n_steps;
+};
+
+static enum process_chain_action count_step_cb(
+		struct process *process __attribute__((unused)), void *data)
+{
+	struct chain_result *result = data;
+
+	result->n_steps++;
+	return PROCESS_CHAIN_CONTINUE;
+}
+
+static enum process_chain_action stop_step_cb(
+		struct process *process __attribute__((unused)), void *data)
+{
+	struct chain_result *result = data;
+
+	result->n_steps++;
+	return PROCESS_CHAIN_STOP;
+}
+
+static void chain_cb(void *data, struct process *failed)
+{
+	struct chain_result *result = data;
+
+	result->done = true;
+	result->failed_status = failed ? WEXITSTATUS(failed->exit_status) : -1;
+	result->failed_signalled = failed && WIFSIGNALED(failed->exit_status);
+}
+
+static void run_chain(struct waitset *waitset, struct chain_result *result)
+{
+	while (!result->done)
+		waiter_poll(waitset);
+}
+
+int main(int argc, char **argv)
+{
+	struct chain_result result;
+	struct process_chain *chain;
+	struct waitset *waitset;
+	struct process *process;
+	void *ctx;
+
+	if (argc == 3 && !strcmp(argv[1], "child"))
+		return atoi(argv[2]);
+
+	if (argc == 2 && !strcmp(argv[1], "sleep")) {
+		sleep(10);
+		return EXIT_SUCCESS;
+	}
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+
+	process_init(ctx, waitset, false);
+
+	/* all steps succeed */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_run(chain);
+	/* callbacks are only ever called from the waitset */
+	assert(!result.done);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 3);
+	assert(result.failed_status == -1);
+
+	/* a failing step without a callback stops the chain */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_add(chain, NULL, argv[0], "child", "3", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_run(chain);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 1);
+	assert(result.failed_status == 3);
+
+	/* callbacks can ignore failures, but the last step's status is the
+	 * chain's status */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "4", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "5", NULL);
+	process_chain_run(chain);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 2);
+	assert(result.failed_status == 5);
+
+	/* ... unless the callback stops the chain */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, stop_step_cb, argv[0], "child", "4", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_run(chain);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 1);
+	assert(result.failed_status == -1);
+
+	/* a step that can't be started fails, with output available */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process = process_chain_add(chain, NULL,
+			"/nonexistent/petitboot-test", NULL);
+	process->keep_stdout = true;
+	process_chain_run(chain);
+	assert(!result.done);
+	run_chain(waitset, &result);
+	assert(result.failed_status == EXIT_FAILURE);
+
+	/* an empty chain succeeds, still from the waitset */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_run(chain);
+	assert(!result.done);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 0);
+	assert(result.failed_status == -1);
+
+	/* stopping a chain kills the running step, and runs no more */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, count_step_cb, argv[0], "sleep", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_run(chain);
+	process_chain_stop(chain);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 0);
+	assert(result.failed_signalled);
+
+	/* including one that couldn't be started */
+	memset(&result, 0, sizeof(result));
+	chain = process_chain_create(ctx, chain_cb, &result);
+	process_chain_add(chain, NULL, "/nonexistent/petitboot-test", NULL);
+	process_chain_add(chain, count_step_cb, argv[0], "child", "0", NULL);
+	process_chain_run(chain);
+	process_chain_stop(chain);
+	run_chain(waitset, &result);
+	assert(result.n_steps == 0);
+	assert(result.failed_status == EXIT_FAILURE);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
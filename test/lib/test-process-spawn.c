@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Checks that spawned executables get the same stdin, stdout and stderr
+ * set up as forked children, and that a missing executable fails to start */
+
+static int do_child(void)
+{
+	char buf[16];
+	ssize_t len;
+
+	len = read(STDIN_FILENO, buf, sizeof(buf));
+	if (len != 5 || memcmp(buf, "input", 5))
+		return EXIT_FAILURE;
+
+	printf("out\n");
+	fflush(stdout);
+	fprintf(stderr, "err\n");
+	return 42;
+}
+
+static int child_fn(void *arg)
+{
+	return *(int *)arg;
+}
+
+int main(int argc, char **argv)
+{
+	struct waitset *waitset;
+	struct process *process;
+	const char *child_argv[3];
+	int status = 7;
+	void *ctx;
+
+	if (argc == 2 && !strcmp(argv[1], "child"))
+		return do_child();
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+
+	process_init(ctx, waitset, false);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	process = process_create(ctx);
+	process->path = child_argv[0];
+	process->argv = child_argv;
+	process->keep_stdout = true;
+	process->add_stderr = true;
+	process->pipe_stdin = "input";
+
+	assert(!process_run_sync(process));
+
+	assert(WIFEXITED(process->exit_status));
+	assert(WEXITSTATUS(process->exit_status) == 42);
+
+	assert(process->stdout_len == strlen("out\nerr\n"));
+	assert(!memcmp(process->stdout_buf, "out\nerr\n",
+				process->stdout_len));
+	process_release(process);
+
+	/* a missing executable fails to start */
+	child_argv[0] = "/nonexistent/pb-test-process-spawn";
+	process = process_create(ctx);
+	process->path = child_argv[0];
+	process->argv = child_argv;
+	process->keep_stdout = true;
+
+	assert(process_run_sync(process));
+	process_release(process);
+
+	/* child functions are still forked */
+	process = process_create(ctx);
+	process->path = "child_fn";
+	process->child_fn = child_fn;
+	process->child_data = &status;
+
+	assert(!process_run_sync(process));
+	assert(WIFEXITED(process->exit_status));
+	assert(WEXITSTATUS(process->exit_status) == 7);
+	process_release(process);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+
+#include <rtnl/rtnl.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+/* Configures a veth pair in a private network namespace, so this needs
+ * CAP_SYS_ADMIN and veth support; the test is skipped otherwise. */
+
+#define TEST_SKIP	77
+
+struct batch_result {
+	bool			done;
+	struct rtnl_request	*failed;
+	int			failed_error;
+	unsigned int		n_flush_errors;
+};
+
+static void batch_cb(void *data, struct rtnl_request *failed)
+{
+	struct batch_result *result = data;
+
+	result->done = true;
+	result->failed = failed;
+	result->failed_error = failed ? rtnl_request_error(failed) : 0;
+}
+
+/* free the batch's context from its callback, as callers do once
+ * they've finished with an interface's configuration */
+static void free_ctx_cb(void *data,
+		struct rtnl_request *failed __attribute__((unused)))
+{
+	struct batch_result *result = talloc_get_type(talloc_parent(data),
+			struct batch_result);
+
+	result->done = true;
+	talloc_free(data);
+}
+
+static int flush_cb(int error, void *data)
+{
+	struct batch_result *result = data;
+
+	if (error)
+		result->n_flush_errors++;
+	return 0;
+}
+
+static void run_batch(struct waitset *waitset, struct rtnl_batch *batch,
+		struct batch_result *result)
+{
+	rtnl_batch_run(batch);
+	/* completion is always deferred to the waitset */
+	assert(!result->done);
+	while (!result->done)
+		waiter_poll(waitset);
+}
+
+static void add_attr(struct nlmsghdr *nlmsg, int type, const void *data,
+		int len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((char *)nlmsg + NLMSG_ALIGN(nlmsg->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len)
+		memcpy(RTA_DATA(rta), data, len);
+	nlmsg->nlmsg_len = NLMSG_ALIGN(nlmsg->nlmsg_len) + RTA_SPACE(len);
+}
+
+/* Create a veth pair; this is test setup, so isn't part of the rtnl API */
+static int create_veth(const char *name, const char *peer)
+{
+	struct rtattr *linkinfo, *data, *info_peer;
+	struct nlmsghdr *nlmsg, *reply;
+	struct ifinfomsg *ifi;
+	char buf[1024], rbuf[1024];
+	int fd, rc;
+
+	memset(buf, 0, sizeof(buf));
+	nlmsg = (struct nlmsghdr *)buf;
+	nlmsg->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+	nlmsg->nlmsg_type = RTM_NEWLINK;
+	nlmsg->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE |
+		NLM_F_EXCL;
+	ifi = NLMSG_DATA(nlmsg);
+	ifi->ifi_family = AF_UNSPEC;
+
+	add_attr(nlmsg, IFLA_IFNAME, name, strlen(name) + 1);
+
+	linkinfo = (struct rtattr *)(buf + NLMSG_ALIGN(nlmsg->nlmsg_len));
+	add_attr(nlmsg, IFLA_LINKINFO, NULL, 0);
+	add_attr(nlmsg, IFLA_INFO_KIND, "veth", strlen("veth"));
+
+	data = (struct rtattr *)(buf + NLMSG_ALIGN(nlmsg->nlmsg_len));
+	add_attr(nlmsg, IFLA_INFO_DATA, NULL, 0);
+
+	info_peer = (struct rtattr *)(buf + NLMSG_ALIGN(nlmsg->nlmsg_len));
+	add_attr(nlmsg, VETH_INFO_PEER, NULL, 0);
+	nlmsg->nlmsg_len += sizeof(*ifi);
+	add_attr(nlmsg, IFLA_IFNAME, peer, strlen(peer) + 1);
+
+	info_peer->rta_len = buf + nlmsg->nlmsg_len - (char *)info_peer;
+	data->rta_len = buf + nlmsg->nlmsg_len - (char *)data;
+	linkinfo->rta_len = buf + nlmsg->nlmsg_len - (char *)linkinfo;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+	assert(fd >= 0);
+
+	rc = send(fd, buf, nlmsg->nlmsg_len, 0);
+	assert(rc == (int)nlmsg->nlmsg_len);
+
+	rc = recv(fd, rbuf, sizeof(rbuf), 0);
+	assert(rc > 0);
+	reply = (struct nlmsghdr *)rbuf;
+	assert(reply->nlmsg_type == NLMSG_ERROR);
+	rc = ((struct nlmsgerr *)NLMSG_DATA(reply))->error;
+
+	close(fd);
+	return rc;
+}
+
+static bool link_is_up(const char *name)
+{
+	struct ifaddrs *ifaddrs, *ifa;
+	bool up = false;
+
+	assert(!getifaddrs(&ifaddrs));
+	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next)
+		if (!strcmp(ifa->ifa_name, name))
+			up = ifa->ifa_flags & IFF_UP;
+	freeifaddrs(ifaddrs);
+
+	return up;
+}
+
+/* count the IP addresses on an interface, checking for @addr if given */
+static unsigned int count_addrs(const char *name, int family,
+		const char *addr, bool *found)
+{
+	struct ifaddrs *ifaddrs, *ifa;
+	char str[INET6_ADDRSTRLEN];
+	unsigned int n = 0;
+	void *sa;
+
+	if (found)
+		*found = false;
+
+	assert(!getifaddrs(&ifaddrs));
+	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (strcmp(ifa->ifa_name, name) || !ifa->ifa_addr ||
+				ifa->ifa_addr->sa_family != family)
+			continue;
+		n++;
+
+		if (family == AF_INET)
+			sa = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+		else
+			sa = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		inet_ntop(family, sa, str, sizeof(str));
+		if (addr && found && !strcmp(str, addr))
+			*found = true;
+	}
+	freeifaddrs(ifaddrs);
+
+	return n;
+}
+
+/* look for a default route through @gateway in /proc/net/route */
+static bool have_default_route(const char *name, const char *gateway)
+{
+	char line[256], iface[IFNAMSIZ + 1];
+	unsigned int dest, gw, mask;
+	struct in_addr gw_addr;
+	bool found = false;
+	FILE *fp;
+
+	assert(inet_pton(AF_INET, gateway, &gw_addr) == 1);
+
+	fp = fopen("/proc/net/route", "r");
+	assert(fp);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%16s %x %x %*x %*d %*d %*d %x",
+				iface, &dest, &gw, &mask) != 4)
+			continue;
+		if (!strcmp(iface, name) && dest == 0 && mask == 0 &&
+				gw == gw_addr.s_addr)
+			found = true;
+	}
+
+	fclose(fp);
+	return found;
+}
+
+int main(void)
+{
+	struct rtnl_request *addr_req, *bad_req;
+	struct batch_result result, *result_ctx;
+	struct rtnl_batch *batch;
+	struct waitset *waitset;
+	int ifindex, peer_index;
+	struct rtnl *rtnl;
+	void *ctx, *batch_ctx;
+	unsigned int i;
+	bool found;
+
+	if (unshare(CLONE_NEWNET)) {
+		fprintf(stderr, "can't create network namespace: %s\n",
+				strerror(errno));
+		return TEST_SKIP;
+	}
+
+	if (create_veth("pbtest0", "pbtest1")) {
+		fprintf(stderr, "can't create veth interfaces\n");
+		return TEST_SKIP;
+	}
+
+	ifindex = if_nametoindex("pbtest0");
+	peer_index = if_nametoindex("pbtest1");
+	assert(ifindex > 0 && peer_index > 0);
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+	rtnl = rtnl_init(ctx, waitset, false);
+	assert(rtnl);
+
+	/* static configuration, as done by the network code */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_link_set(batch, NULL, peer_index, true);
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.2.3/24");
+	rtnl_batch_addr_add(batch, NULL, ifindex, "fd00::3/64");
+	rtnl_batch_link_set(batch, NULL, ifindex, true);
+	rtnl_batch_route_add_default(batch, NULL, ifindex, "10.1.2.1");
+	run_batch(waitset, batch, &result);
+
+	assert(!result.failed);
+	assert(link_is_up("pbtest0"));
+	assert(count_addrs("pbtest0", AF_INET, "10.1.2.3", &found) == 1);
+	assert(found);
+	count_addrs("pbtest0", AF_INET6, "fd00::3", &found);
+	assert(found);
+	assert(have_default_route("pbtest0", "10.1.2.1"));
+
+	/* a request that fails is reported, but the rest of the batch is
+	 * still applied */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	bad_req = rtnl_batch_addr_add(batch, NULL, ifindex, "not-an-address");
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.2.3/24");
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.3.3/24");
+	run_batch(waitset, batch, &result);
+
+	assert(result.failed == bad_req);
+	assert(result.failed_error == -EINVAL);
+	count_addrs("pbtest0", AF_INET, "10.1.3.3", &found);
+	assert(found);
+
+	/* batches are run in order, so the second add is a duplicate */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, NULL, NULL);
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.4.3/24");
+	rtnl_batch_run(batch);
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	addr_req = rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.4.3/24");
+	run_batch(waitset, batch, &result);
+	assert(result.failed == addr_req);
+	assert(result.failed_error == -EEXIST);
+
+	/* flush and down, synchronously, as done on shutdown. The flush
+	 * must complete before the address that follows it is added. */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_addr_flush(batch, flush_cb, ifindex);
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.5.3/24");
+	rtnl_batch_link_set(batch, NULL, ifindex, false);
+	assert(!rtnl_batch_run_sync(batch));
+	assert(result.done && !result.failed);
+	assert(!result.n_flush_errors);
+
+	assert(!link_is_up("pbtest0"));
+	assert(count_addrs("pbtest0", AF_INET, "10.1.5.3", &found) == 1);
+	assert(found);
+	assert(count_addrs("pbtest0", AF_INET6, NULL, NULL) == 0);
+
+	/* freeing a running batch cancels its callback */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_link_set(batch, NULL, ifindex, true);
+	rtnl_batch_run(batch);
+	talloc_free(batch);
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_addr_flush(batch, NULL, ifindex);
+	run_batch(waitset, batch, &result);
+	assert(!result.failed);
+	assert(count_addrs("pbtest0", AF_INET, NULL, NULL) == 0);
+
+	/* the batch callback may free the batch's parent context */
+	result_ctx = talloc_zero(ctx, struct batch_result);
+	batch_ctx = talloc_new(result_ctx);
+	batch = rtnl_batch_create(batch_ctx, rtnl, free_ctx_cb, batch_ctx);
+	rtnl_batch_link_set(batch, NULL, ifindex, true);
+	run_batch(waitset, batch, result_ctx);
+
+	/* more acks than the socket can queue fail the batch with ENOBUFS,
+	 * and the batches after it still run */
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	for (i = 0; i < 10000; i++)
+		rtnl_batch_link_set(batch, NULL, ifindex, true);
+	run_batch(waitset, batch, &result);
+	assert(result.failed);
+	assert(result.failed_error == -ENOBUFS);
+
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_link_set(batch, NULL, ifindex, false);
+	run_batch(waitset, batch, &result);
+	assert(!result.failed);
+	assert(!link_is_up("pbtest0"));
+
+	/* nothing is changed in dry-run mode */
+	rtnl = rtnl_init(ctx, waitset, true);
+	assert(rtnl);
+	memset(&result, 0, sizeof(result));
+	batch = rtnl_batch_create(ctx, rtnl, batch_cb, &result);
+	rtnl_batch_addr_add(batch, NULL, ifindex, "10.1.6.3/24");
+	run_batch(waitset, batch, &result);
+	assert(!result.failed);
+	assert(count_addrs("pbtest0", AF_INET, NULL, NULL) == 0);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/*
+ * Check boot file verification, one file at a time and in parallel, with
+ * small synthetic payloads signed with the test key from the verify
+ * fixtures. test/lib/bench-security-openssl times the two.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <log/log.h>
+#include <security/security.h>
+#include <talloc/talloc.h>
+
+#define SECURITY_TEST_DATA_DIR	TEST_LIB_DATA_BASE "/security/"
+
+#define PAYLOAD_SIZE		(256 << 10)
+
+static const char *args = "console=hvc0 root=/dev/sda2";
+
+static EVP_PKEY *load_key(void)
+{
+	EVP_PKEY *key;
+	FILE *f;
+
+	f = fopen(SECURITY_TEST_DATA_DIR "key.pem", "r");
+	assert(f);
+	key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	assert(key);
+
+	return key;
+}
+
+static void sign(EVP_PKEY *key, const char *filename, const void *buf,
+		size_t len)
+{
+	unsigned char *sig;
+	EVP_MD_CTX *ctx;
+	size_t siglen;
+	FILE *f;
+
+	ctx = EVP_MD_CTX_create();
+	assert(EVP_DigestSignInit(ctx, NULL,
+			EVP_get_digestbyname(VERIFY_DIGEST), NULL, key) == 1);
+	assert(EVP_DigestSignUpdate(ctx, buf, len) == 1);
+	assert(EVP_DigestSignFinal(ctx, NULL, &siglen) == 1);
+	sig = talloc_size(NULL, siglen);
+	assert(EVP_DigestSignFinal(ctx, sig, &siglen) == 1);
+	EVP_MD_CTX_destroy(ctx);
+
+	f = fopen(filename, "w");
+	assert(f);
+	assert(fwrite(sig, 1, siglen, f) == siglen);
+	fclose(f);
+	talloc_free(sig);
+}
+
+/* write @len bytes of noise to @dir/@name, along with a signature */
+static char *create_payload(void *ctx, EVP_PKEY *key, const char *dir,
+		const char *name, size_t len)
+{
+	unsigned int seed = len;
+	char *filename, *signame;
+	unsigned char *buf;
+	size_t i;
+	FILE *f;
+
+	buf = talloc_size(ctx, len);
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	filename = talloc_asprintf(ctx, "%s/%s", dir, name);
+	f = fopen(filename, "w");
+	assert(f);
+	assert(fwrite(buf, 1, len, f) == len);
+	fclose(f);
+
+	signame = talloc_asprintf(ctx, "%s.sig", filename);
+	sign(key, signame, buf, len);
+
+	talloc_free(buf);
+	return filename;
+}
+
+static struct boot_task *create_task(void *ctx, const char *dir)
+{
+	struct boot_task *task;
+
+	task = talloc_zero(ctx, struct boot_task);
+	task->local_image = talloc_asprintf(task, "%s/vmlinux", dir);
+	task->local_initrd = talloc_asprintf(task, "%s/initrd", dir);
+	task->local_dtb = talloc_asprintf(task, "%s/dtb", dir);
+	task->local_image_signature = talloc_asprintf(task, "%s.sig",
+			task->local_image);
+	task->local_initrd_signature = talloc_asprintf(task, "%s.sig",
+			task->local_initrd);
+	task->local_dtb_signature = talloc_asprintf(task, "%s.sig",
+			task->local_dtb);
+	task->local_cmdline_signature = talloc_asprintf(task, "%s/cmdline.sig",
+			dir);
+	task->args = args;
+	task->verify_signature = true;
+
+	task->local_image_fd = -1;
+	task->local_initrd_fd = -1;
+	task->local_dtb_fd = -1;
+
+	return task;
+}
+
+static void check_overrides(struct boot_task *task, bool set)
+{
+	assert(!task->local_image_override == !set);
+	assert(!task->local_initrd_override == !set);
+	assert(!task->local_dtb_override == !set);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/pb-test-verify-XXXXXX";
+	const char *cert = SECURITY_TEST_DATA_DIR "cert.pem";
+	struct boot_task *task;
+	EVP_PKEY *key;
+	char *tmp;
+	void *ctx;
+
+	pb_log_init(stderr);
+
+	ctx = talloc_new(NULL);
+	assert(mkdtemp(dir));
+
+	key = load_key();
+	create_payload(ctx, key, dir, "vmlinux", PAYLOAD_SIZE / 4);
+	create_payload(ctx, key, dir, "initrd", PAYLOAD_SIZE);
+	create_payload(ctx, key, dir, "dtb", PAYLOAD_SIZE / 16);
+	sign(key, talloc_asprintf(ctx, "%s/cmdline.sig", dir),
+			args, strlen(args));
+	EVP_PKEY_free(key);
+
+	task = create_task(ctx, dir);
+
+	/* both ways, each file is replaced by its verified copy */
+	assert(validate_boot_files_from(task, cert, false) == 0);
+	check_overrides(task, true);
+	validate_boot_files_cleanup(task);
+	check_overrides(task, false);
+
+	assert(validate_boot_files_from(task, cert, true) == 0);
+	check_overrides(task, true);
+	validate_boot_files_cleanup(task);
+
+	/* a bad signature on any one file fails the whole set */
+	tmp = talloc_strdup(ctx, task->local_dtb_signature);
+	task->local_dtb_signature = task->local_initrd_signature;
+	assert(validate_boot_files_from(task, cert, false) ==
+			KEXEC_LOAD_SIGNATURE_FAILURE);
+	validate_boot_files_cleanup(task);
+	assert(validate_boot_files_from(task, cert, true) ==
+			KEXEC_LOAD_SIGNATURE_FAILURE);
+	validate_boot_files_cleanup(task);
+	task->local_dtb_signature = tmp;
+
+	/* as does a command line that doesn't match its signature */
+	task->args = "console=hvc1";
+	assert(validate_boot_files_from(task, cert, true) ==
+			KEXEC_LOAD_SIGNATURE_FAILURE);
+	validate_boot_files_cleanup(task);
+
+	unlink(task->local_image);
+	unlink(task->local_initrd);
+	unlink(task->local_dtb);
+	unlink(task->local_image_signature);
+	unlink(task->local_initrd_signature);
+	unlink(task->local_dtb_signature);
+	unlink(task->local_cmdline_signature);
+	rmdir(dir);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -2,17 +2,22 @@
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
+#include <file/file.h>
 #include <log/log.h>
 #include <security/security.h>
+#include <talloc/talloc.h>
 
 #define SECURITY_TEST_DATA_DIR  TEST_LIB_DATA_BASE "/security/"
 #define SECURITY_TEST_DATA_CERT SECURITY_TEST_DATA_DIR "/cert.pem"
 
 int main(void)
 {
+	char path[64], *buf;
 	FILE *keyfile;
+	int fd, len;
 
 	pb_log_init(stdout);
 
@@ -65,6 +70,59 @@ int main(void)
 		return EXIT_FAILURE;
 	}
 
+	/* check a sealed in-memory copy, as used for boot files */
+	if (copy_file_memfd(SECURITY_TEST_DATA_DIR "rootdata.txt", &fd) ||
+	    seal_file(fd))
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	/* sealed copies can't be modified after verification */
+	if (write(fd, "x", 1) >= 0)
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if (verify_file_signature(path,
+				  SECURITY_TEST_DATA_DIR "rootdatasha256.sig",
+				  keyfile,
+				  NULL))
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	close(fd);
+
+	/* and a buffer, with and without the signed contents */
+	if (read_file(NULL, SECURITY_TEST_DATA_DIR "rootdata.txt", &buf, &len))
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	if (verify_buffer_signature(buf, len, "rootdata",
+				    SECURITY_TEST_DATA_DIR "rootdatasha256.sig",
+				    keyfile,
+				    NULL))
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	if (!verify_buffer_signature(buf, len - 1, "rootdata",
+				     SECURITY_TEST_DATA_DIR "rootdatasha256.sig",
+				     keyfile,
+				     NULL))
+	{
+		fclose(keyfile);
+		return EXIT_FAILURE;
+	}
+
+	talloc_free(buf);
 	fclose(keyfile);
 
 	/* now check basic pubkey fallback */
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <waiter/waiter.h>
+#include <waiter/job.h>
+#include <talloc/talloc.h>
+
+/* Checks that jobs complete from the waitset, and that freeing a job's data
+ * while its worker runs is put off until the worker has finished */
+
+struct test_job {
+	struct waiter_job	*job;
+	/* the worker reads a byte from here before returning */
+	int			block_fd;
+	bool			ran;
+};
+
+static int n_done, n_cancelled, n_freed;
+
+static void job_fn(void *arg)
+{
+	struct test_job *tj = arg;
+	char c;
+
+	if (tj->block_fd >= 0)
+		assert(read(tj->block_fd, &c, 1) == 1);
+
+	tj->ran = true;
+}
+
+static void job_done(void *arg)
+{
+	struct test_job *tj = arg;
+
+	assert(tj->ran);
+	n_done++;
+	talloc_free(tj);
+}
+
+static void job_cancelled(void *arg)
+{
+	struct test_job *tj = arg;
+
+	assert(tj->ran);
+	n_cancelled++;
+}
+
+static int test_job_destroy(void *arg)
+{
+	struct test_job *tj = arg;
+
+	if (waiter_job_destroy(tj->job))
+		return -1;
+
+	n_freed++;
+	return 0;
+}
+
+static struct test_job *start_job(void *ctx, struct waitset *waitset,
+		int block_fd)
+{
+	struct test_job *tj;
+
+	tj = talloc_zero(ctx, struct test_job);
+	tj->block_fd = block_fd;
+	talloc_set_destructor(tj, test_job_destroy);
+
+	tj->job = waiter_job_start(waitset, tj, job_fn, job_done,
+			job_cancelled);
+	assert(tj->job);
+
+	return tj;
+}
+
+int main(void)
+{
+	struct waitset *waitset;
+	struct test_job *tj;
+	void *ctx, *parent;
+	int fds[2];
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+
+	/* a finished job only completes from the waitset */
+	tj = start_job(ctx, waitset, -1);
+	assert(!n_done);
+	while (!n_done)
+		waiter_poll(waitset);
+	assert(n_freed == 1 && !n_cancelled);
+
+	/* freeing the data of a running job waits for the worker, and calls
+	 * the cancelled callback rather than done */
+	assert(!pipe(fds));
+	tj = start_job(ctx, waitset, fds[0]);
+	assert(talloc_free(tj) == -1);
+	assert(n_freed == 1);
+	assert(write(fds[1], "", 1) == 1);
+	while (n_freed < 2)
+		waiter_poll(waitset);
+	assert(n_cancelled == 1 && n_done == 1);
+
+	/* as does freeing its parent, which leaves the data to be freed
+	 * later */
+	parent = talloc_new(ctx);
+	tj = start_job(parent, waitset, fds[0]);
+	talloc_free(parent);
+	assert(n_freed == 2);
+	assert(write(fds[1], "", 1) == 1);
+	while (n_freed < 3)
+		waiter_poll(waitset);
+	assert(n_cancelled == 2 && n_done == 1);
+
+	close(fds[0]);
+	close(fds[1]);
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+#define N_PIPES	64
+
+struct test_pipe {
+	int		fds[2];
+	int		n_reads;
+	struct waiter	*waiter;
+};
+
+static struct test_pipe pipes[N_PIPES];
+static int n_timeouts;
+
+static int pipe_cb(void *arg)
+{
+	struct test_pipe *pipe = arg;
+	char c;
+	int rc;
+
+	rc = read(pipe->fds[0], &c, 1);
+	assert(rc == 1);
+	pipe->n_reads++;
+
+	/* remove every second waiter from its own callback */
+	if ((pipe - pipes) % 2) {
+		pipe->waiter = NULL;
+		return 1;
+	}
+
+	/* ... and let the others remove the odd-numbered waiter that follows
+	 * them, which may still be pending in this iteration */
+	if (pipe - pipes + 1 < N_PIPES && pipe[1].waiter) {
+		waiter_remove(pipe[1].waiter);
+		pipe[1].waiter = NULL;
+	}
+
+	return 0;
+}
+
+static int timeout_cb(void *arg)
+{
+	int *order = arg;
+
+	assert(order);
+	assert(*order == n_timeouts);
+	n_timeouts++;
+	return 0;
+}
+
+static struct waiter *rearm_waiter;
+static int n_rearms;
+
+static int rearm_cb(void *arg)
+{
+	assert(arg == &rearm_waiter);
+
+	if (++n_rearms < 3)
+		waiter_rearm_timeout(rearm_waiter, 1);
+	return 0;
+}
+
+static void test_backend(enum waitset_backend backend)
+{
+	struct waitset *waitset;
+	void *ctx;
+	int i, rc;
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create_backend(ctx, backend);
+	assert(waitset_get_backend(waitset) == backend);
+
+	for (i = 0; i < N_PIPES; i++) {
+		rc = pipe(pipes[i].fds);
+		assert(!rc);
+		pipes[i].n_reads = 0;
+		pipes[i].waiter = waiter_register_io(waitset, pipes[i].fds[0],
+				WAIT_IN, pipe_cb, &pipes[i]);
+		assert(pipes[i].waiter);
+	}
+
+	/* all pipes readable at once: each waiter is called at most once, and
+	 * waiters removed earlier in the same iteration are not called */
+	for (i = 0; i < N_PIPES; i++) {
+		rc = write(pipes[i].fds[1], "x", 1);
+		assert(rc == 1);
+	}
+
+	rc = waiter_poll(waitset);
+	assert(!rc);
+
+	for (i = 0; i < N_PIPES; i += 2) {
+		assert(pipes[i].n_reads == 1);
+		assert(pipes[i + 1].n_reads <= 1);
+		assert(!pipes[i + 1].waiter);
+	}
+
+	/* removed waiters stay removed, even though their pipes are still
+	 * readable; remaining waiters keep firing */
+	rc = write(pipes[0].fds[1], "x", 1);
+	assert(rc == 1);
+	rc = waiter_poll(waitset);
+	assert(!rc);
+	assert(pipes[0].n_reads == 2);
+	for (i = 1; i < N_PIPES; i += 2)
+		assert(pipes[i].n_reads <= 1);
+
+	/* timeouts fire in expiry order, not registration order */
+	{
+		static int order[3] = { 0, 1, 2 };
+
+		n_timeouts = 0;
+		waiter_register_timeout(waitset, 30, timeout_cb, &order[2]);
+		waiter_register_timeout(waitset, 0, timeout_cb, &order[0]);
+		waiter_register_timeout(waitset, 15, timeout_cb, &order[1]);
+
+		while (n_timeouts < 3)
+			waiter_poll(waitset);
+	}
+
+	/* re-arming from the callback keeps the waiter registered */
+	n_rearms = 0;
+	rearm_waiter = waiter_register_timeout(waitset, 0, rearm_cb,
+			&rearm_waiter);
+	while (n_rearms < 3)
+		waiter_poll(waitset);
+
+	/* removing armed timers keeps the remaining ones in order */
+	{
+		static int order[2] = { 0, 1 };
+		struct waiter *cancelled[4];
+
+		n_timeouts = 0;
+		cancelled[0] = waiter_register_timeout(waitset, 5,
+				timeout_cb, NULL);
+		waiter_register_timeout(waitset, 20, timeout_cb, &order[1]);
+		cancelled[1] = waiter_register_timeout(waitset, 1,
+				timeout_cb, NULL);
+		cancelled[2] = waiter_register_timeout(waitset, 10,
+				timeout_cb, NULL);
+		waiter_register_timeout(waitset, 10, timeout_cb, &order[0]);
+		cancelled[3] = waiter_register_timeout(waitset, 0,
+				timeout_cb, NULL);
+
+		for (i = 0; i < 4; i++)
+			waiter_remove(cancelled[i]);
+
+		while (n_timeouts < 2)
+			waiter_poll(waitset);
+	}
+
+	for (i = 0; i < N_PIPES; i++) {
+		close(pipes[i].fds[0]);
+		close(pipes[i].fds[1]);
+	}
+
+	talloc_free(ctx);
+}
+
+int main(void)
+{
+	test_backend(WAITSET_BACKEND_EPOLL);
+	test_backend(WAITSET_BACKEND_POLL);
+
+	return EXIT_SUCCESS;
+}
@@ -39,6 +39,14 @@ void discover_server_notify_boot_status(struct discover_server *server,
 	(void)status;
 }
 
+void discover_server_notify_boot_progress(struct discover_server *server,
+		struct status *status, const char *source)
+{
+	(void)server;
+	(void)status;
+	(void)source;
+}
+
 void system_info_set_interface_address(unsigned int hwaddr_size,
 		uint8_t *hwaddr, const char *address)
 {
@@ -80,10 +88,10 @@ void parser_init(void)
 {
 }
 
+/* tests run parsers with test_run_parser; discovery itself finds nothing */
 void iterate_parsers(struct discover_context *ctx)
 {
 	(void)ctx;
-	assert(false);
 }
 
 struct boot_task *boot(void *ctx, struct discover_boot_option *opt,
@@ -33,6 +33,13 @@ int test_run_parser(struct parser_test *test, const char *parser_name);
 void test_hotplug_device(struct parser_test *test, struct discover_device *dev);
 void test_remove_device(struct parser_test *test, struct discover_device *dev);
 
+/* Devices created with mounted cleared are mounted during discovery by a
+ * worker that completes when this is called: for dev, or for a device
+ * removed while mounting if dev is NULL. Returns -1 if there is no such
+ * mount in progress. Implemented in device-handler.c */
+int test_discover_mount_done(struct device_handler *handler,
+		struct discover_device *dev, int err);
+
 /* Note that the testing filesystem will only reflect files and
  * directories that you explicitly add, so it is possible for a test
  * to inconsistently believe that a file exists but that its parent
@@ -71,6 +78,13 @@ extern const size_t __embedded_config_size;
  * for the failure, and exit the test with a non-zero exit status.
  */
 
+/**
+ * Check that an arbitrary condition @cond holds
+ */
+void __check(bool cond, const char *str, const char *file, int line);
+#define check(cond) \
+	__check(cond, #cond, __FILE__, __LINE__)
+
 /**
  * Check that we have an expected number of boot options parsed. If not,
  * print out what we did find, then exit.
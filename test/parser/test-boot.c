@@ -0,0 +1,378 @@
+/* check the boot pipeline: the boot hooks start once the boot files have
+ * loaded, in whatever order, and the kexec load once the hooks are done. A
+ * failed load stops the boot, and a cancelled boot is only freed once its
+ * outstanding loads, kexec load and any kexec unload have finished.
+ *
+ * Loads are completed by hand, and processes run in dry-run mode, so the
+ * hook in PKG_SYSCONF_DIR/boot.d and kexec are never actually executed.
+ * kexec_file_load is answered by test_kexec_file_syscall. */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/kexec.h>
+
+#include <log/log.h>
+#include <process/process.h>
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <waiter/waiter.h>
+
+#include "boot.h"
+#include "kexec.h"
+#include "paths.h"
+#include "platform.h"
+#include "sysinfo.h"
+
+#define MAX_LOADS	4
+
+static struct {
+	struct load_url_result	*result;
+	load_url_complete	cb;
+	void			*data;
+} loads[MAX_LOADS];
+static unsigned int n_loads;
+
+static char *statuses[32];
+static unsigned int n_statuses;
+
+static bool task_freed;
+
+/* kexec_file_load calls, mostly made from the load's worker thread */
+static struct {
+	int		rc;
+	/* if set, read a byte from this before returning */
+	int		block_fd;
+	unsigned int	n_calls;
+	unsigned long	flags[4];
+} kexec_file = { .block_fd = -1 };
+
+int test_kexec_file_syscall(int kernel_fd, int initrd_fd,
+		const char *cmdline, unsigned long flags);
+int test_kexec_file_syscall(int kernel_fd __attribute__((unused)),
+		int initrd_fd __attribute__((unused)),
+		const char *cmdline __attribute__((unused)),
+		unsigned long flags)
+{
+	char c;
+
+	assert(kexec_file.n_calls < 4);
+	kexec_file.flags[kexec_file.n_calls++] = flags;
+
+	if (flags & KEXEC_FILE_UNLOAD)
+		return 0;
+
+	if (kexec_file.block_fd >= 0)
+		assert(read(kexec_file.block_fd, &c, 1) == 1);
+
+	return kexec_file.rc;
+}
+
+struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
+		load_url_complete complete, void *data,
+		waiter_cb stdout_cb __attribute__((unused)),
+		void *stdout_data __attribute__((unused)))
+{
+	struct load_url_result *result;
+
+	assert(n_loads < MAX_LOADS);
+
+	result = talloc_zero(ctx, struct load_url_result);
+	result->url = url;
+	result->local = talloc_asprintf(result, PKG_SYSCONF_DIR "/%s",
+			url->file);
+	result->status = LOAD_ASYNC;
+
+	loads[n_loads].result = result;
+	loads[n_loads].cb = complete;
+	loads[n_loads].data = data;
+	n_loads++;
+
+	return result;
+}
+
+void load_url_async_cancel(struct load_url_result *res)
+{
+	res->status = LOAD_CANCELLED;
+}
+
+char *join_paths(void *alloc_ctx, const char *a, const char *b)
+{
+	return talloc_asprintf(alloc_ctx, "%s/%s", a, b);
+}
+
+bool platform_preboot_check(const char *image __attribute__((unused)),
+		char **err_msg __attribute__((unused)))
+{
+	return true;
+}
+
+const struct config *config_get(void)
+{
+	static struct config config;
+
+	return &config;
+}
+
+const struct system_info *system_info_get(void)
+{
+	static struct system_info info;
+
+	return &info;
+}
+
+static void complete_load(unsigned int i, int status)
+{
+	assert(i < n_loads);
+
+	/* a cancelled load stays cancelled */
+	if (loads[i].result->status == LOAD_ASYNC)
+		loads[i].result->status = status;
+
+	loads[i].cb(loads[i].result, loads[i].data);
+}
+
+static void status_cb(void *arg __attribute__((unused)),
+		struct status *status)
+{
+	assert(n_statuses < sizeof(statuses) / sizeof(statuses[0]));
+	statuses[n_statuses++] = talloc_strdup(NULL, status->message);
+}
+
+/* the index of the first status starting with @prefix, or -1 */
+static int find_status(const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_statuses; i++)
+		if (!strncmp(statuses[i], prefix, strlen(prefix)))
+			return i;
+
+	return -1;
+}
+
+static int task_destructor(void *arg __attribute__((unused)))
+{
+	task_freed = true;
+	return 0;
+}
+
+static void clear_statuses(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_statuses; i++)
+		talloc_free(statuses[i]);
+	n_statuses = 0;
+}
+
+static struct boot_task *start_boot(void *ctx, struct boot_command *cmd,
+		bool dry_run)
+{
+	struct boot_task *task;
+
+	clear_statuses();
+	n_loads = 0;
+	task_freed = false;
+	kexec_file.n_calls = 0;
+
+	/* a dry-run boot doesn't try kexec_file_load */
+	task = boot(ctx, NULL, cmd, dry_run, status_cb, NULL);
+	assert(task);
+	talloc_set_destructor(task, task_destructor);
+
+	return task;
+}
+
+static void wait_for_status(struct waitset *waitset, const char *prefix)
+{
+	while (find_status(prefix) < 0)
+		waiter_poll(waitset);
+}
+
+#ifdef NATIVE_KEXEC
+/* kernels without a device tree are loaded in-process where possible */
+static void test_kexec_file(void *ctx, struct waitset *waitset,
+		struct boot_command *cmd)
+{
+	struct boot_task *task;
+	int fds[2];
+
+	fclose(fopen(PKG_SYSCONF_DIR "/vmlinux", "w"));
+	fclose(fopen(PKG_SYSCONF_DIR "/initrd", "w"));
+
+	task = start_boot(ctx, cmd, false);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	wait_for_status(waitset, "Performing kexec reboot");
+	assert(kexec_file.n_calls == 1 && kexec_file.flags[0] == 0);
+	talloc_free(task);
+
+	/* a load the kernel rejects is tried again with the kexec binary */
+	kexec_file.rc = -EKEYREJECTED;
+	task = start_boot(ctx, cmd, false);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	while (!task->kexec_chain)
+		waiter_poll(waitset);
+	assert(kexec_file.n_calls == 1);
+	wait_for_status(waitset, "Performing kexec reboot");
+	assert(kexec_file_load_available());
+	talloc_free(task);
+
+	/* a load that succeeds after its boot is cancelled is undone */
+	kexec_file.rc = 0;
+	assert(!pipe(fds));
+	kexec_file.block_fd = fds[0];
+	task = start_boot(ctx, cmd, false);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	while (!task->kexec_file)
+		waiter_poll(waitset);
+	boot_cancel(task);
+	assert(task_freed);
+	assert(write(fds[1], "", 1) == 1);
+	while (kexec_file.n_calls < 2)
+		waiter_poll(waitset);
+	assert(kexec_file.flags[1] == KEXEC_FILE_UNLOAD);
+	kexec_file.block_fd = -1;
+	close(fds[0]);
+	close(fds[1]);
+
+	/* a kernel without kexec_file_load isn't asked again */
+	kexec_file.rc = -ENOSYS;
+	task = start_boot(ctx, cmd, false);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	wait_for_status(waitset, "Performing kexec reboot");
+	assert(kexec_file.n_calls == 1);
+	assert(!kexec_file_load_available());
+	talloc_free(task);
+
+	unlink(PKG_SYSCONF_DIR "/vmlinux");
+	unlink(PKG_SYSCONF_DIR "/initrd");
+}
+#endif
+
+int main(void)
+{
+	struct boot_command cmd = { 0 };
+	struct waitset *waitset;
+	struct boot_task *task;
+	siginfo_t info;
+	char *hook;
+	void *ctx;
+
+	/* the waits below would otherwise hang if the boot stalls */
+	alarm(10);
+
+	ctx = talloc_new(NULL);
+	pb_log_init(stdout);
+
+	waitset = waitset_create(ctx);
+	process_init(ctx, waitset, true);
+	boot_init(waitset);
+
+	mkdir(PKG_SYSCONF_DIR, 0700);
+	mkdir(PKG_SYSCONF_DIR "/boot.d", 0700);
+	hook = PKG_SYSCONF_DIR "/boot.d/01-hook";
+	fclose(fopen(hook, "w"));
+	assert(!chmod(hook, 0700));
+
+	cmd.boot_image_file = "http://server/vmlinux";
+	cmd.initrd_file = "http://server/initrd";
+	cmd.dtb_file = "http://server/dtb";
+
+	/* loads complete in any order; the hooks wait for all of them */
+	task = start_boot(ctx, &cmd, true);
+	assert(n_loads == 3);
+	complete_load(2, LOAD_OK);
+	complete_load(0, LOAD_OK);
+	assert(!task->hooks_started);
+	complete_load(1, LOAD_OK);
+	assert(task->hooks_started && !task->hooks_done);
+
+	/* then the kexec load waits for the hooks */
+	assert(find_status("Performing kexec load") < 0);
+	wait_for_status(waitset, "Performing kexec reboot");
+	assert(task->hooks_done && !task->kexec_loading);
+	assert(find_status("Boot files loaded") <
+			find_status("Boot hooks finished"));
+	assert(find_status("Boot hooks finished") <
+			find_status("Performing kexec load"));
+	talloc_free(task);
+
+	/* a failed load stops the boot, once the rest have finished */
+	task = start_boot(ctx, &cmd, true);
+	complete_load(0, LOAD_ERROR);
+	complete_load(1, LOAD_OK);
+	assert(find_status("Couldn't load kernel image") >= 0);
+	assert(!task->files_ready);
+	complete_load(2, LOAD_OK);
+	assert(task->files_ready && !task->hooks_started);
+	assert(find_status("Performing kexec load") < 0);
+	talloc_free(task);
+
+	/* a boot cancelled during its loads waits for the cancellations */
+	cmd.dtb_file = NULL;
+	task = start_boot(ctx, &cmd, true);
+	assert(n_loads == 2);
+	complete_load(0, LOAD_OK);
+	boot_cancel(task);
+	assert(loads[1].result->status == LOAD_CANCELLED);
+	assert(!task_freed);
+	complete_load(1, LOAD_OK);
+	assert(task_freed);
+
+	/* and one cancelled during the kexec load waits for that */
+	task = start_boot(ctx, &cmd, true);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	while (!task->kexec_loading)
+		waiter_poll(waitset);
+	boot_cancel(task);
+	assert(!task_freed);
+	while (!task_freed)
+		waiter_poll(waitset);
+	assert(find_status("Performing kexec reboot") < 0);
+
+	/* a kexec load that finishes anyway is undone, without blocking, and
+	 * the task waits for that too. Wait for the load to exit, but leave
+	 * it for the process code to reap */
+	task = start_boot(ctx, &cmd, true);
+	complete_load(0, LOAD_OK);
+	complete_load(1, LOAD_OK);
+	while (!task->kexec_loading)
+		waiter_poll(waitset);
+	while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) && errno == EINTR)
+		;
+	boot_cancel(task);
+	while (!task->kexec_unload)
+		waiter_poll(waitset);
+	assert(!task_freed);
+	while (!task_freed)
+		waiter_poll(waitset);
+	assert(find_status("Performing kexec reboot") < 0);
+
+#ifdef NATIVE_KEXEC
+	test_kexec_file(ctx, waitset, &cmd);
+#endif
+
+	unlink(hook);
+	rmdir(PKG_SYSCONF_DIR "/boot.d");
+	rmdir(PKG_SYSCONF_DIR);
+
+	clear_statuses();
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
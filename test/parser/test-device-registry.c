@@ -0,0 +1,105 @@
+/* check device lookups by id, uuid, label and serial with many devices */
+
+#include <stdio.h>
+
+#include <talloc/talloc.h>
+
+#include "parser-test.h"
+
+#define N_DEVICES	5000
+
+/* every tenth device is a second path to the previous one, with the same
+ * filesystem UUID, label and serial */
+static bool is_multipath(int i)
+{
+	return i % 10 == 9;
+}
+
+static int key_idx(int i)
+{
+	return is_multipath(i) ? i - 1 : i;
+}
+
+static struct discover_device *create_device(struct parser_test *test, int i)
+{
+	struct discover_device *dev;
+	char name[32], serial[32];
+
+	snprintf(name, sizeof(name), "sd%d", i);
+	dev = test_create_device(test, name);
+
+	dev->uuid = talloc_asprintf(dev, "uuid-%08x", key_idx(i));
+	dev->label = talloc_asprintf(dev, "label-%d", key_idx(i));
+	snprintf(serial, sizeof(serial), "serial-%d", key_idx(i));
+	discover_device_set_param(dev, "ID_SERIAL", serial);
+
+	return dev;
+}
+
+void run_test(struct parser_test *test)
+{
+	struct device_handler *handler = test->handler;
+	struct discover_device **devs, *dev;
+	char str[32];
+	int i;
+
+	devs = talloc_array(test, struct discover_device *, N_DEVICES);
+
+	for (i = 0; i < N_DEVICES; i++) {
+		devs[i] = create_device(test, i);
+		device_handler_add_device(handler, devs[i]);
+	}
+
+	/* lookups by key find the first device added with that key */
+	for (i = 0; i < N_DEVICES; i++) {
+		snprintf(str, sizeof(str), "sd%d", i);
+		check(device_lookup_by_id(handler, str) == devs[i]);
+		check(device_lookup_by_name(handler, str) == devs[i]);
+
+		snprintf(str, sizeof(str), "uuid-%08x", key_idx(i));
+		check(device_lookup_by_uuid(handler, str) == devs[key_idx(i)]);
+
+		snprintf(str, sizeof(str), "label-%d", key_idx(i));
+		check(device_lookup_by_label(handler, str) == devs[key_idx(i)]);
+
+		snprintf(str, sizeof(str), "serial-%d", key_idx(i));
+		check(device_lookup_by_serial(handler, str) ==
+				devs[key_idx(i)]);
+	}
+
+	check(!device_lookup_by_id(handler, "sd-missing"));
+	check(!device_lookup_by_uuid(handler, "uuid-missing"));
+	check(!device_lookup_by_uuid(handler, NULL));
+
+	/* removing the first path makes the second the match for the
+	 * shared keys */
+	for (i = 0; i < N_DEVICES; i++) {
+		if (!is_multipath(i + 1))
+			continue;
+		device_handler_remove(handler, devs[i]);
+		devs[i] = NULL;
+	}
+
+	for (i = 0; i < N_DEVICES; i++) {
+		snprintf(str, sizeof(str), "sd%d", i);
+		dev = device_lookup_by_id(handler, str);
+		check(dev == devs[i]);
+
+		snprintf(str, sizeof(str), "uuid-%08x", key_idx(i));
+		dev = device_lookup_by_uuid(handler, str);
+		check(dev == (devs[key_idx(i)] ?: devs[key_idx(i) + 1]));
+	}
+
+	/* renamed devices are found by their new id only */
+	dev = devs[0];
+	dev->device->id = talloc_strdup(dev->device, "renamed");
+	device_handler_reindex_device(handler, dev);
+	check(device_lookup_by_id(handler, "renamed") == dev);
+	check(!device_lookup_by_id(handler, "sd0"));
+
+	/* removed devices drop out of every index */
+	dev = devs[1];
+	device_handler_remove(handler, dev);
+	check(!device_lookup_by_id(handler, "sd1"));
+	check(!device_lookup_by_label(handler, "label-1"));
+}
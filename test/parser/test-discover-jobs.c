@@ -0,0 +1,85 @@
+/* check the discovery pipeline: devices are mounted at most four at a time,
+ * and devices removed while queued or mounting are cleaned up */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <talloc/talloc.h>
+#include <process/process.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+#define N_DEVICES	8
+
+static struct discover_device *create_device(struct parser_test *test, int i)
+{
+	struct discover_device *dev;
+	char name[32];
+
+	snprintf(name, sizeof(name), "sd%d", i);
+	dev = test_create_device(test, name);
+	dev->mounted = false;
+
+	return dev;
+}
+
+void run_test(struct parser_test *test)
+{
+	struct device_handler *handler = test->handler;
+	struct discover_device *devs[N_DEVICES];
+	int i;
+
+	/* parsed devices are scanned for plugins; don't run anything */
+	process_init(test, waitset_create(test), true);
+
+	for (i = 0; i < 6; i++) {
+		devs[i] = create_device(test, i);
+		device_handler_discover(handler, devs[i]);
+		check(devs[i]->discover_job);
+	}
+
+	/* a device already being discovered isn't queued again */
+	device_handler_discover(handler, devs[0]);
+
+	/* four are mounting, the rest are queued */
+	for (i = 0; i < 6; i++)
+		check(!devs[i]->mounted);
+	check(test_discover_mount_done(handler, devs[4], 0) == -1);
+	check(test_discover_mount_done(handler, devs[5], 0) == -1);
+
+	/* a completed mount is parsed, and the next queued mount starts */
+	check(!test_discover_mount_done(handler, devs[0], 0));
+	check(devs[0]->mounted);
+	check(!devs[0]->discover_job);
+	check(test_discover_mount_done(handler, devs[0], 0) == -1);
+	check(test_discover_mount_done(handler, devs[5], 0) == -1);
+
+	/* as does a failed one */
+	check(!test_discover_mount_done(handler, devs[1], EIO));
+	check(!devs[1]->mounted);
+	check(!devs[1]->discover_job);
+
+	/* 2-5 are mounting; a device removed while queued is dropped */
+	devs[6] = create_device(test, 6);
+	devs[7] = create_device(test, 7);
+	device_handler_discover(handler, devs[6]);
+	device_handler_discover(handler, devs[7]);
+	test_remove_device(test, devs[6]);
+
+	/* one removed while mounting is cleaned up once the mount completes,
+	 * and the slot goes to the next queued device */
+	test_remove_device(test, devs[2]);
+	check(test_discover_mount_done(handler, devs[7], 0) == -1);
+	check(!test_discover_mount_done(handler, NULL, 0));
+	check(test_discover_mount_done(handler, NULL, 0) == -1);
+	check(!test_discover_mount_done(handler, devs[7], 0));
+	check(devs[7]->mounted);
+
+	/* a reinit drops the devices still mounting, and their mounts are
+	 * cleaned up as they complete */
+	device_handler_reinit(handler);
+	for (i = 0; i < 3; i++)
+		check(!test_discover_mount_done(handler, NULL, 0));
+	check(test_discover_mount_done(handler, NULL, 0) == -1);
+}
@@ -0,0 +1,93 @@
+/* check the per-context file cache, against files in a temporary directory:
+ * each path is read and stat()ed once, including failures, until it is
+ * invalidated */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <talloc/talloc.h>
+
+#include "file-cache.h"
+#include "parser-test.h"
+
+static char dir[] = "/tmp/pb-test-file-cache-XXXXXX";
+
+static void write_file(const char *path, const char *str)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	check(f != NULL);
+	fputs(str, f);
+	fclose(f);
+}
+
+static void check_stats(struct discover_context *ctx,
+		unsigned int hits, unsigned int misses, int line)
+{
+	unsigned int h, m;
+
+	file_cache_get_stats(ctx, &h, &m);
+	__check(h == hits && m == misses, "cache stats", __FILE__, line);
+}
+
+void run_test(struct parser_test *test)
+{
+	struct discover_context *ctx = test->ctx;
+	char *path, *missing, *buf;
+	struct stat statbuf;
+	int len;
+
+	check(mkdtemp(dir));
+	path = talloc_asprintf(test, "%s/grub.cfg", dir);
+	missing = talloc_asprintf(test, "%s/yaboot.conf", dir);
+	write_file(path, "one");
+
+	/* a file is read once; callers get their own, terminated, copy */
+	check(!file_cache_read(ctx, path, &buf, &len));
+	check(len == 3 && !strcmp(buf, "one"));
+	buf[0] = 'X';
+	talloc_free(buf);
+	check_stats(ctx, 0, 1, __LINE__);
+
+	write_file(path, "two");
+	check(!file_cache_read(ctx, path, &buf, &len));
+	check(len == 3 && !strcmp(buf, "one"));
+	talloc_free(buf);
+	check_stats(ctx, 1, 1, __LINE__);
+
+	/* stats are cached separately from reads */
+	check(!file_cache_stat(ctx, path, &statbuf));
+	check(statbuf.st_size == 3);
+	check(!file_cache_stat(ctx, path, &statbuf));
+	check_stats(ctx, 2, 2, __LINE__);
+
+	/* failures are cached too, and a path that can't be stat()ed isn't
+	 * read */
+	check(file_cache_stat(ctx, missing, &statbuf));
+	write_file(missing, "three");
+	check(file_cache_stat(ctx, missing, &statbuf));
+	check(file_cache_read(ctx, missing, &buf, &len));
+	check_stats(ctx, 4, 3, __LINE__);
+
+	/* invalidating a path drops its reads and stats */
+	file_cache_invalidate(ctx, path);
+	check(!file_cache_read(ctx, path, &buf, &len));
+	check(len == 3 && !strcmp(buf, "two"));
+	talloc_free(buf);
+	file_cache_invalidate(ctx, missing);
+	check(!file_cache_stat(ctx, missing, &statbuf));
+	check(statbuf.st_size == 5);
+	check_stats(ctx, 4, 5, __LINE__);
+
+	/* including the stat of the file we read back */
+	check(!file_cache_stat(ctx, path, &statbuf));
+	check_stats(ctx, 4, 6, __LINE__);
+	check(!file_cache_stat(ctx, path, &statbuf));
+	check_stats(ctx, 5, 6, __LINE__);
+
+	unlink(path);
+	unlink(missing);
+	rmdir(dir);
+}
@@ -548,6 +548,15 @@ struct discover_boot_option *get_boot_option(struct discover_context *ctx,
 	return NULL;
 }
 
+void __check(bool cond, const char *str, const char *file, int line)
+{
+	if (cond)
+		return;
+
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, str);
+	exit(EXIT_FAILURE);
+}
+
 void __check_boot_option_count(struct discover_context *ctx, int count,
 		const char *file, int line)
 {
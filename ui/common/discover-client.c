@@ -23,10 +23,12 @@
 
 struct discover_client {
 	int fd;
+	struct pb_protocol_reader *reader;
 	struct discover_client_ops ops;
 	int n_devices;
 	struct device **devices;
 	bool authenticated;
+	uint32_t server_caps;
 };
 
 static int discover_client_destructor(void *arg)
@@ -172,10 +174,45 @@ static void update_config(struct discover_client *client,
 		client->ops.update_config(config, client->ops.cb_arg);
 }
 
-static int discover_client_process(void *arg)
+/* Servers that don't support fragments can't receive messages larger than
+ * PB_PROTOCOL_MAX_PAYLOAD_SIZE, so fail those here rather than sending
+ * something the server can't parse */
+static int discover_client_write_message(struct discover_client *client,
+		struct pb_protocol_message *message)
+{
+	if (pb_protocol_needs_fragments(message) &&
+			!(client->server_caps & PB_PROTOCOL_CAP_FRAGMENTS)) {
+		pb_log_fn("%u-byte message (action %d) is too large for "
+				"server\n", message->payload_len,
+				message->action);
+		talloc_free(message);
+		return -1;
+	}
+
+	return pb_protocol_write_message(client->fd, message);
+}
+
+static int discover_client_send_capabilities(struct discover_client *client)
 {
-	struct discover_client *client = arg;
 	struct pb_protocol_message *message;
+	int len;
+
+	len = pb_protocol_capabilities_len();
+
+	message = pb_protocol_create_message(client,
+			PB_PROTOCOL_ACTION_CAPABILITIES, len);
+	if (!message)
+		return -1;
+
+	pb_protocol_serialise_capabilities(PB_PROTOCOL_CAPABILITIES,
+			message->payload, len);
+
+	return pb_protocol_write_message(client->fd, message);
+}
+
+static void discover_client_process_message(struct discover_client *client,
+		const struct pb_protocol_message *message)
+{
 	struct auth_message *auth_msg;
 	struct plugin_option *p_opt;
 	struct system_info *sysinfo;
@@ -188,20 +225,19 @@ static int discover_client_process(void *arg)
 	int rc;
 
 	/* We use a temporary context for processing one message; persistent
-	 * data is re-parented to the client in the callbacks. */
+	 * data is re-parented to the client in the callbacks. Messages belong
+	 * to the reader, so each object's strings are packed into a single
+	 * arena allocation under the object, rather than allocated one by
+	 * one. */
 	ctx = talloc_new(client);
 
-	message = pb_protocol_read_message(ctx, client->fd);
-
-	if (!message)
-		return -1;
-
 	switch (message->action) {
 	case PB_PROTOCOL_ACTION_DEVICE_ADD:
 		dev = talloc_zero(ctx, struct device);
 		list_init(&dev->boot_options);
 
-		rc = pb_protocol_deserialise_device(dev, message);
+		rc = pb_protocol_decode_message(dev, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("no device?\n");
 			goto out;
@@ -212,7 +248,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_BOOT_OPTION_ADD:
 		opt = talloc_zero(ctx, struct boot_option);
 
-		rc = pb_protocol_deserialise_boot_option(opt, message);
+		rc = pb_protocol_decode_message(opt, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("no boot_option?\n");
 			goto out;
@@ -231,7 +268,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_STATUS:
 		status = talloc_zero(ctx, struct status);
 
-		rc = pb_protocol_deserialise_boot_status(status, message);
+		rc = pb_protocol_decode_message(status, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("invalid status message?\n");
 			goto out;
@@ -241,7 +279,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_SYSTEM_INFO:
 		sysinfo = talloc_zero(ctx, struct system_info);
 
-		rc = pb_protocol_deserialise_system_info(sysinfo, message);
+		rc = pb_protocol_decode_message(sysinfo, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("invalid sysinfo message?\n");
 			goto out;
@@ -251,7 +290,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_CONFIG:
 		config = talloc_zero(ctx, struct config);
 
-		rc = pb_protocol_deserialise_config(config, message);
+		rc = pb_protocol_decode_message(config, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("invalid config message?\n");
 			goto out;
@@ -261,7 +301,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD:
 		p_opt = talloc_zero(ctx, struct plugin_option);
 
-		rc = pb_protocol_deserialise_plugin_option(p_opt, message);
+		rc = pb_protocol_decode_message(p_opt, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc) {
 			pb_log_fn("no plugin_option?\n");
 			goto out;
@@ -275,7 +316,8 @@ static int discover_client_process(void *arg)
 	case PB_PROTOCOL_ACTION_AUTHENTICATE:
 		auth_msg = talloc_zero(ctx, struct auth_message);
 
-		rc = pb_protocol_deserialise_authenticate(auth_msg, message);
+		rc = pb_protocol_decode_message(auth_msg, message,
+				PB_PROTOCOL_DECODE_ARENA);
 		if (rc || auth_msg->op != AUTH_MSG_RESPONSE) {
 			pb_log("%s: invalid auth message? (%d)\n",
 					__func__, rc);
@@ -286,12 +328,40 @@ static int discover_client_process(void *arg)
 				client->authenticated ? "" : "un");
 		client->authenticated = auth_msg->authenticated;
 		break;
+	case PB_PROTOCOL_ACTION_CAPABILITIES:
+		rc = pb_protocol_deserialise_capabilities(&client->server_caps,
+				message);
+		if (rc) {
+			pb_log_fn("invalid capabilities message?\n");
+			goto out;
+		}
+		pb_debug("server capabilities 0x%x\n", client->server_caps);
+
+		/* Only reply to servers that sent theirs: older servers
+		 * reject actions they don't know from non-root clients */
+		if (discover_client_send_capabilities(client))
+			pb_log_fn("failed to send capabilities\n");
+		break;
 	default:
 		pb_log_fn("unknown action %d\n", message->action);
 	}
 
 out:
 	talloc_free(ctx);
+}
+
+static int discover_client_process(void *arg)
+{
+	struct discover_client *client = arg;
+	const struct pb_protocol_message *message;
+
+	if (pb_protocol_reader_fill(client->reader))
+		return -1;
+
+	/* The server sends its initial state as one large write, so we may
+	 * have many messages to process from a single read */
+	while ((message = pb_protocol_reader_next(client->reader)))
+		discover_client_process_message(client, message);
 
 	return 0;
 }
@@ -319,6 +389,7 @@ struct discover_client* discover_client_init(struct waitset *waitset,
 
 	client->n_devices = 0;
 	client->devices = NULL;
+	client->server_caps = 0;
 
 	addr.sun_family = AF_UNIX;
 	strcpy(addr.sun_path, PB_SOCKET_PATH);
@@ -328,6 +399,10 @@ struct discover_client* discover_client_init(struct waitset *waitset,
 		goto out_err;
 	}
 
+	client->reader = pb_protocol_reader_create(client, client->fd);
+	if (!client->reader)
+		goto out_err;
+
 	waiter_register_io(waitset, client->fd, WAIT_IN,
 			discover_client_process, client);
 
@@ -401,7 +476,7 @@ int discover_client_boot(struct discover_client *client,
 	pb_protocol_serialise_boot_command(&boot_command,
 			message->payload, len);
 
-	rc = pb_protocol_write_message(client->fd, message);
+	rc = discover_client_write_message(client, message);
 
 	return rc;
 }
@@ -416,7 +491,7 @@ int discover_client_cancel_default(struct discover_client *client)
 	if (!message)
 		return -1;
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_reinit(struct discover_client *client)
@@ -429,7 +504,7 @@ int discover_client_send_reinit(struct discover_client *client)
 	if (!message)
 		return -1;
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_config(struct discover_client *client,
@@ -447,7 +522,7 @@ int discover_client_send_config(struct discover_client *client,
 
 	pb_protocol_serialise_config(config, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_url(struct discover_client *client,
@@ -465,7 +540,7 @@ int discover_client_send_url(struct discover_client *client,
 
 	pb_protocol_serialise_url(url, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_plugin_install(struct discover_client *client,
@@ -483,7 +558,7 @@ int discover_client_send_plugin_install(struct discover_client *client,
 
 	pb_protocol_serialise_url(file, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_temp_autoboot(struct discover_client *client,
@@ -501,7 +576,7 @@ int discover_client_send_temp_autoboot(struct discover_client *client,
 
 	pb_protocol_serialise_temp_autoboot(opt, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_authenticate(struct discover_client *client,
@@ -525,7 +600,7 @@ int discover_client_send_authenticate(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_set_password(struct discover_client *client,
@@ -550,7 +625,7 @@ int discover_client_send_set_password(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_open_luks_device(struct discover_client *client,
@@ -575,5 +650,5 @@ int discover_client_send_open_luks_device(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
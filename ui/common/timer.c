@@ -48,8 +48,9 @@ static int timer_cb(void *arg)
 {
 	struct ui_timer *timer = arg;
 
-	timer->handle_timeout(timer);
+	/* the waiter is released once we return, unless re-armed */
 	timer->waiter = NULL;
+	timer->handle_timeout(timer);
 	return 0;
 }
 
@@ -58,8 +59,10 @@ void ui_timer_kick(struct ui_timer *timer)
 	if (timer->update_display)
 		timer->update_display(timer, timer->timeout);
 
-	if (timer->waiter)
-		waiter_remove(timer->waiter);
+	if (timer->waiter) {
+		waiter_rearm_timeout(timer->waiter, timer->timeout * 1000);
+		return;
+	}
 
 	timer->waiter = waiter_register_timeout(timer->waitset,
 			timer->timeout * 1000, timer_cb, timer);